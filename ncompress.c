@@ -0,0 +1,792 @@
+/*  This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <http://unlicense.org/>
+*/
+
+/*  A compress command built on the library.
+
+    usage: ncompress [-cdfSv] [-b bits] [-j jobs] [file ...]
+           ncompress -T sample file ...
+           ncompress -K container ...
+
+    The options are those of compress(1):
+
+        -c          write to the standard output and keep the files
+        -d          decompress, as uncompress(1)
+        -b bits     the maximum code size, 9 to 16
+        -f          overwrite existing files and replace a file even
+                    if it doesn't get smaller
+        -v          report the compression of each file
+
+    and -S leaves runs of zeros out of decompressed files as holes, and
+    -j jobs processes that many files at once, or one per CPU for
+    -j 0.  Each worker takes files from its own queue and steals from
+    the others when it runs dry, so a few large files don't hold up the
+    rest.  With -c the files are done one at a time so that their
+    output stays in order.  A single file, or the files with -c, are
+    decompressed with the jobs working on the parts of each between its
+    CLEARs instead.
+
+    -T sample trains a preset table for nSetPreset() instead.  Each file
+    is taken as one example message, and up to 64 KB of them are written
+    to the sample file.
+
+    -K compacts each container made with nOpenContainer() instead, with
+    nCompactContainer(), so that the space of replaced and removed
+    objects is given back.  A container open for writing is left alone
+    with an error.
+
+    When run as uncompress, or any name ending in it, -d is the default.
+    Without files it filters the standard input to the standard output.
+
+    The files go through nCompressFile() and nDecompressFileParallel(),
+    which map the input and write the output in large aligned blocks.  A
+    replaced file keeps the mode, owner and times of the original.
+
+    The exit status is 1 on an error, else 2 if some file was left
+    unchanged because it didn't get smaller, else 0.
+*/
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <pthread.h>
+#include    <stdarg.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <sys/stat.h>
+
+#include    "ncompress42.h"
+
+#define ST_OK           0
+#define ST_ERROR        1
+#define ST_UNCHANGED    2
+
+#define SAMPLE_CAP      (64 * 1024)
+
+
+typedef struct options
+{
+    int     decompress;
+    int     toStdout;
+    int     force;
+    int     verbose;
+    int     sparse;
+    int     bits;
+    int     jobs;
+    int     memberJobs;     // for the members of one file
+    char*   train;
+    int     compact;
+} Options;
+
+
+static Options          opts;
+static const char*      progName = "ncompress";
+static pthread_mutex_t  msgLock = PTHREAD_MUTEX_INITIALIZER;
+
+//======================================================================
+
+static void
+message(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void
+message(const char* fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    pthread_mutex_lock(&msgLock);
+
+    fprintf(stderr, "%s: ", progName);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+
+    pthread_mutex_unlock(&msgLock);
+    va_end(ap);
+}
+
+
+//======================================================================
+
+static NCompressError
+runFile(int fdIn, int fdOut)
+{
+    if (opts.decompress && opts.sparse)
+        return nDecompressFileSparse(fdIn, fdOut);
+    else
+    if (opts.decompress)
+        return nDecompressFileParallel(fdIn, fdOut, opts.memberJobs);
+    else
+        return nCompressFile(fdIn, fdOut, opts.bits);
+}
+
+
+
+/*  Call this straight after the error so that errno is still set.
+*/
+static const char*
+errorText(NCompressError err)
+{
+    switch (err)
+    {
+    case NCMP_READ_ERROR:
+    case NCMP_WRITE_ERROR:
+        return strerror(errno);
+
+    case NCMP_DATA_ERROR:
+        return "corrupt input";
+
+    case NCMP_BITS_ERROR:
+        return "compressed with too many bits";
+
+    case NCMP_PRESET_ERROR:
+        return "needs a preset table";
+
+    case NCMP_LIMIT_ERROR:
+        return "passed a decompression limit";
+
+    case NCMP_NOT_FOUND:
+        return "no such object";
+
+    default:
+        return "internal error";
+    }
+}
+
+
+//======================================================================
+
+/*  Compress or decompress one named file.  This returns one of the ST_
+    values.
+*/
+static int
+processFile(const char* name)
+{
+    char*           inName;
+    char*           outName;
+    size_t          len = strlen(name);
+    int             hasZ = len > 2 && strcmp(name + len - 2, ".Z") == 0;
+    int             status = ST_OK;
+    int             outFlags;
+    int             inFd = -1;
+    int             outFd = -1;
+    struct stat     st;
+    struct stat     outSt;
+    struct timespec times[2];
+    NCompressError  err;
+
+    inName  = malloc(len + 3);
+    outName = malloc(len + 3);
+
+    if (!inName || !outName)
+    {
+        message("%s: out of memory", name);
+        free(inName);
+        free(outName);
+        return ST_ERROR;
+    }
+
+    if (opts.decompress)
+    {
+        // Accept the name with or without the .Z suffix.
+        if (hasZ)
+        {
+            strcpy(inName, name);
+            memcpy(outName, name, len - 2);
+            outName[len - 2] = '\0';
+        }
+        else
+        {
+            strcpy(outName, name);
+            strcpy(inName, name);
+            strcat(inName, ".Z");
+        }
+    }
+    else
+    {
+        if (hasZ)
+        {
+            message("%s: already has .Z suffix -- no change", name);
+            goto done;
+        }
+
+        strcpy(inName, name);
+        strcpy(outName, name);
+        strcat(outName, ".Z");
+    }
+
+    if ((inFd = open(inName, O_RDONLY)) < 0 || fstat(inFd, &st) < 0)
+    {
+        message("%s: %s", inName, strerror(errno));
+        status = ST_ERROR;
+        goto done;
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        message("%s: not a regular file: unchanged", inName);
+        status = ST_ERROR;
+        goto done;
+    }
+
+    if (opts.toStdout)
+    {
+        outFd = STDOUT_FILENO;
+    }
+    else
+    {
+        outFlags = O_WRONLY | O_CREAT | O_TRUNC | (opts.force ? 0 : O_EXCL);
+
+        if ((outFd = open(outName, outFlags, 0600)) < 0)
+        {
+            if (errno == EEXIST)
+                message("%s already exists; not overwritten", outName);
+            else
+                message("%s: %s", outName, strerror(errno));
+
+            status = ST_ERROR;
+            goto done;
+        }
+    }
+
+    if ((err = runFile(inFd, outFd)) != NCMP_OK)
+    {
+        message("%s: %s", inName, errorText(err));
+        status = ST_ERROR;
+    }
+
+    if (opts.toStdout)
+    {
+        goto done;
+    }
+
+    if (status == ST_OK && fstat(outFd, &outSt) < 0)
+    {
+        message("%s: %s", outName, strerror(errno));
+        status = ST_ERROR;
+    }
+
+    if (status == ST_OK && !opts.decompress && !opts.force && outSt.st_size >= st.st_size)
+    {
+        if (opts.verbose)
+        {
+            message("%s: No compression -- unchanged", inName);
+        }
+
+        status = ST_UNCHANGED;
+    }
+
+    if (status != ST_OK)
+    {
+        close(outFd);
+        outFd = -1;
+        unlink(outName);
+        goto done;
+    }
+
+    // The replacement keeps the mode, owner and times of the original.
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+
+    if (fchown(outFd, st.st_uid, st.st_gid) < 0)
+    {
+        st.st_mode &= ~(S_ISUID | S_ISGID);
+    }
+
+    fchmod(outFd, st.st_mode & 07777);
+    futimens(outFd, times);
+
+    if (close(outFd) < 0)
+    {
+        message("%s: %s", outName, strerror(errno));
+        outFd = -1;
+        unlink(outName);
+        status = ST_ERROR;
+        goto done;
+    }
+
+    outFd = -1;
+
+    if (unlink(inName) < 0)
+    {
+        message("%s: %s", inName, strerror(errno));
+    }
+
+    if (opts.verbose)
+    {
+        long    before = opts.decompress ? (long)outSt.st_size : (long)st.st_size;
+        long    after  = opts.decompress ? (long)st.st_size : (long)outSt.st_size;
+
+        message("%s: %s%.2f%% -- replaced with %s", inName,
+                opts.decompress ? "" : "Compression: ",
+                before ? 100.0 * (before - after) / before : 0.0, outName);
+    }
+
+done:
+    if (inFd >= 0)
+    {
+        close(inFd);
+    }
+
+    if (outFd >= 0 && outFd != STDOUT_FILENO)
+    {
+        close(outFd);
+    }
+
+    free(inName);
+    free(outName);
+    return status;
+}
+
+
+
+/*  Filter the standard input to the standard output.
+*/
+static int
+processStdin()
+{
+    NCompressError  err;
+
+    if (!opts.decompress && !opts.force && isatty(STDOUT_FILENO))
+    {
+        message("compressed data not written to a terminal");
+        return ST_ERROR;
+    }
+
+    if ((err = runFile(STDIN_FILENO, STDOUT_FILENO)) != NCMP_OK)
+    {
+        message("stdin: %s", errorText(err));
+        return ST_ERROR;
+    }
+
+    return ST_OK;
+}
+
+
+//======================================================================
+//  A pool of workers with a queue each.  A worker takes files from the
+//  front of its own queue and steals from the back of the others.
+
+typedef struct queue
+{
+    pthread_mutex_t lock;
+    int*            items;
+    int             head;
+    int             tail;
+} Queue;
+
+
+typedef struct pool
+{
+    char**          files;
+    int             numWorkers;
+    Queue*          queues;
+    pthread_mutex_t lock;
+    int             status;
+} Pool;
+
+
+typedef struct worker
+{
+    Pool*       pool;
+    int         id;
+    pthread_t   thread;
+} Worker;
+
+
+
+static int
+takeFile(Pool* pool, int id)
+{
+    int item = -1;
+    int i;
+
+    for (i = 0; i < pool->numWorkers && item < 0; ++i)
+    {
+        Queue*  q = &pool->queues[(id + i) % pool->numWorkers];
+
+        pthread_mutex_lock(&q->lock);
+
+        if (q->head < q->tail)
+        {
+            item = (i == 0) ? q->items[q->head++] : q->items[--q->tail];
+        }
+
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return item;
+}
+
+
+
+static int
+mergeStatus(int a, int b)
+{
+    if (a == ST_ERROR || b == ST_ERROR)
+        return ST_ERROR;
+
+    return (a == ST_UNCHANGED || b == ST_UNCHANGED) ? ST_UNCHANGED : ST_OK;
+}
+
+
+
+static void*
+runWorker(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    Pool*   pool = w->pool;
+    int     status = ST_OK;
+    int     item;
+
+    while ((item = takeFile(pool, w->id)) >= 0)
+    {
+        status = mergeStatus(status, processFile(pool->files[item]));
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->status = mergeStatus(pool->status, status);
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+
+static int
+processFiles(char** files, int numFiles, int jobs)
+{
+    Pool        pool;
+    Worker*     workers;
+    int         i;
+
+    if (jobs > numFiles)
+    {
+        jobs = numFiles;
+    }
+
+    pool.files      = files;
+    pool.numWorkers = jobs;
+    pool.status     = ST_OK;
+    pool.queues     = calloc(jobs, sizeof(Queue));
+    workers         = calloc(jobs, sizeof(Worker));
+
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if (!pool.queues || !workers)
+    {
+        message("out of memory");
+        return ST_ERROR;
+    }
+
+    // Deal the files out in turn.
+    for (i = 0; i < jobs; ++i)
+    {
+        Queue*  q = &pool.queues[i];
+
+        pthread_mutex_init(&q->lock, NULL);
+        q->items = malloc(((numFiles + jobs - 1) / jobs) * sizeof(int));
+        q->head  = 0;
+        q->tail  = 0;
+
+        if (!q->items)
+        {
+            message("out of memory");
+            return ST_ERROR;
+        }
+    }
+
+    for (i = 0; i < numFiles; ++i)
+    {
+        Queue*  q = &pool.queues[i % jobs];
+
+        q->items[q->tail++] = i;
+    }
+
+    for (i = 0; i < jobs; ++i)
+    {
+        workers[i].pool = &pool;
+        workers[i].id   = i;
+    }
+
+    // The calling thread is the first worker.
+    for (i = 1; i < jobs; ++i)
+    {
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0)
+        {
+            message("cannot start a thread: %s", strerror(errno));
+            pool.status = ST_ERROR;
+            jobs = i;
+            break;
+        }
+    }
+
+    runWorker(&workers[0]);
+
+    for (i = 1; i < jobs; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < pool.numWorkers; ++i)
+    {
+        free(pool.queues[i].items);
+    }
+
+    free(pool.queues);
+    free(workers);
+    return pool.status;
+}
+
+
+//======================================================================
+
+/*  Read a whole file into memory.  This returns 0 on an error.
+*/
+static int
+readAll(const char* name, Byte** bytes, size_t* len)
+{
+    int     fd = open(name, O_RDONLY);
+    size_t  cap = 4096;
+    ssize_t got = 0;
+    Byte*   more;
+
+    *len   = 0;
+    *bytes = malloc(cap);
+
+    if (fd < 0 || !*bytes)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            errno = ENOMEM;
+        }
+
+        return 0;
+    }
+
+    while ((got = read(fd, *bytes + *len, cap - *len)) > 0)
+    {
+        *len += got;
+
+        if (*len == cap)
+        {
+            if (!(more = realloc(*bytes, cap * 2)))
+            {
+                errno = ENOMEM;
+                got   = -1;
+                break;
+            }
+
+            *bytes = more;
+            cap   *= 2;
+        }
+    }
+
+    close(fd);
+    return got == 0;
+}
+
+
+
+/*  Train a preset table from example messages in files and write the
+    sample.  This returns one of the ST_ values.
+*/
+static int
+trainFiles(char** files, int numFiles)
+{
+    Byte**          msgs = calloc(numFiles, sizeof(Byte*));
+    size_t*         lens = calloc(numFiles, sizeof(size_t));
+    Byte*           sample = malloc(SAMPLE_CAP);
+    size_t          sampleLen = 0;
+    int             status = ST_OK;
+    int             fd = -1;
+    int             i;
+    NCompressError  err;
+
+    if (!msgs || !lens || !sample)
+    {
+        message("out of memory");
+        status = ST_ERROR;
+        goto done;
+    }
+
+    for (i = 0; i < numFiles; ++i)
+    {
+        if (!readAll(files[i], &msgs[i], &lens[i]))
+        {
+            message("%s: %s", files[i], strerror(errno));
+            status = ST_ERROR;
+            goto done;
+        }
+    }
+
+    err = nTrainPreset((const Byte* const*)msgs, lens, numFiles, sample, SAMPLE_CAP, &sampleLen);
+
+    if (err != NCMP_OK)
+    {
+        message("%s", errorText(err));
+        status = ST_ERROR;
+        goto done;
+    }
+
+    if ((fd = open(opts.train, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        write(fd, sample, sampleLen) != (ssize_t)sampleLen || close(fd) < 0)
+    {
+        message("%s: %s", opts.train, strerror(errno));
+        status = ST_ERROR;
+        goto done;
+    }
+
+    if (opts.verbose)
+    {
+        message("%s: %zu bytes from %d files", opts.train, sampleLen, numFiles);
+    }
+
+done:
+    for (i = 0; msgs && i < numFiles; ++i)
+    {
+        free(msgs[i]);
+    }
+
+    free(msgs);
+    free(lens);
+    free(sample);
+    return status;
+}
+
+
+/*  Compact containers.  This returns one of the ST_ values.
+*/
+static int
+compactContainers(char** paths, int numPaths)
+{
+    int             status = ST_OK;
+    int             i;
+    NCompressError  err;
+
+    for (i = 0; i < numPaths; ++i)
+    {
+        if ((err = nCompactContainer(paths[i])) != NCMP_OK)
+        {
+            message("%s: %s", paths[i], errorText(err));
+            status = ST_ERROR;
+        }
+        else
+        if (opts.verbose)
+        {
+            message("%s: compacted", paths[i]);
+        }
+    }
+
+    return status;
+}
+
+
+//======================================================================
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: %s [-cdfSv] [-b bits] [-j jobs] [file ...]\n", progName);
+    fprintf(stderr, "       %s -T sample file ...\n", progName);
+    fprintf(stderr, "       %s -K container ...\n", progName);
+    exit(ST_ERROR);
+}
+
+
+
+int
+main(int argc, char** argv)
+{
+    const char* base = strrchr(argv[0], '/');
+    size_t      len;
+    int         opt;
+
+    progName = base ? base + 1 : argv[0];
+    len      = strlen(progName);
+
+    opts.bits = 16;
+    opts.jobs = 1;
+
+    if (len >= 10 && strcmp(progName + len - 10, "uncompress") == 0)
+    {
+        opts.decompress = 1;
+    }
+
+    while ((opt = getopt(argc, argv, "cdfKSvb:j:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': opts.toStdout   = 1;              break;
+        case 'd': opts.decompress = 1;              break;
+        case 'f': opts.force      = 1;              break;
+        case 'K': opts.compact    = 1;              break;
+        case 'S': opts.sparse     = 1;              break;
+        case 'v': opts.verbose    = 1;              break;
+        case 'b': opts.bits       = atoi(optarg);   break;
+        case 'j': opts.jobs       = atoi(optarg);   break;
+        case 'T': opts.train      = optarg;         break;
+        default:  usage();
+        }
+    }
+
+    if (opts.bits < 9 || opts.bits > 16)
+    {
+        message("-b bits must be from 9 to 16");
+        return ST_ERROR;
+    }
+
+    if (opts.train)
+    {
+        if (optind == argc)
+        {
+            usage();
+        }
+
+        return trainFiles(argv + optind, argc - optind);
+    }
+
+    if (opts.compact)
+    {
+        if (optind == argc)
+        {
+            usage();
+        }
+
+        return compactContainers(argv + optind, argc - optind);
+    }
+
+    if (opts.jobs <= 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        opts.jobs = (n > 0) ? (int)n : 1;
+    }
+
+    opts.memberJobs = 1;
+
+    if (opts.toStdout || argc - optind <= 1)
+    {
+        opts.memberJobs = opts.jobs;
+    }
+
+    if (opts.toStdout)
+    {
+        opts.jobs = 1;
+    }
+
+    if (optind == argc)
+    {
+        return processStdin();
+    }
+
+    if (opts.toStdout && !opts.decompress && !opts.force && isatty(STDOUT_FILENO))
+    {
+        message("compressed data not written to a terminal");
+        return ST_ERROR;
+    }
+
+    return processFiles(argv + optind, argc - optind, opts.jobs);
+}
@@ -17,14 +17,29 @@
 
     ... and many more revisions have been elided
  */
+#ifdef __linux__
+#define     _GNU_SOURCE             // for O_DIRECT and fallocate()
+#endif
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <pthread.h>
 #include    <stdint.h>
 #include    <stdio.h>
 #include    <stdlib.h>
 #include    <string.h>
 #include    <unistd.h>
 #include    <ctype.h>
+#include    <time.h>
+#include    <sys/mman.h>
+#include    <sys/stat.h>
 #include    <sys/types.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NCMP_NO_SIMD)
+#define     NCMP_X86_SIMD 1
+#include    <immintrin.h>
+#endif
+
 #include    "ncompress42.h"
 
 #define IBUFSIZ 8192
@@ -38,9 +53,11 @@
 #define MAGIC_1     (Byte)'\037'/* First byte of compressed file               */
 #define MAGIC_2     (Byte)'\235'/* Second byte of compressed file              */
 #define BIT_MASK    0x1f            /* Mask for 'number of compresssion bits'       */
-                                    /* Masks 0x20 and 0x40 are free.                */
+                                    /* Mask 0x20 is free.                           */
                                     /* I think 0x20 should mean that there is       */
                                     /* a fourth header byte (for expansion).        */
+#define PRESET      0x40            /* The table starts with a preset, which isn't  */
+                                    /* part of the format.  See nSetPreset().       */
 #define BLOCK_MODE  0x80            /* Block compresssion if table is full and      */
                                     /* compression rate is dropping flush tables    */
 
@@ -51,6 +68,14 @@
 
 #define INIT_BITS 9         /* initial number of bits/code */
 
+/*  A preset table takes at most three quarters of the codes, leaving the
+    rest for the message.
+*/
+#define PRESETEND(mb)   (MAXCODE(mb) - MAXCODE((mb)-2))
+
+//  The slot of a code which got no entry.  See clear_used().
+#define NOSLOT      0xFFFFFFFFu
+
 
 /*  The original code had a FAST variant. This is the only
     variant left here. A modern processor can do the fast thing.
@@ -64,6 +89,24 @@
 
 #define CHECK_GAP 10000
 
+/*  The tagged dictionary keeps 8 slots to a 64 byte bucket so that it
+    fits in the same space as htab.
+*/
+#define  TAGSLOTS       8
+#define  TAGBITS        (HBITS-3)
+#define  TAGBUCKETS     (1<<TAGBITS)
+#define  TAGMASK        (TAGBUCKETS-1)
+
+#ifndef NCMP_DEFAULT_DICT
+#define NCMP_DEFAULT_DICT   NCMP_DICT_CLASSIC
+#endif
+
+//  The most codes unpacked in one pass by the decompressor.
+#define CODEBATCH   1024
+
+//  The most bytes compressed or decompressed before their CRC is taken.
+#define CRCPIECE    (1 << 16)
+
 typedef long int        code_int;
 typedef long int        count_int;
 typedef long int        cmp_code_int;
@@ -71,6 +114,16 @@ typedef long int        cmp_code_int;
 
 #define MAXCODE(n)  (1L << (n))
 
+/*  The compressor widens when free_ent reaches extcode.  At maxbits the
+    table ends one code earlier.
+*/
+#define EXTCODE(n,mb)   (((n) < (mb)) ? MAXCODE(n)+1 : MAXCODE(n))
+
+/*  Once the table is full extcode is set past any code, so that only
+    the ratio check limits the chunks.
+*/
+#define FULLCODE(mb)    (MAXCODE(((mb) > BITS) ? (mb) : BITS)+OBUFSIZ)
+
 #define output(b,o,c,n) {   Byte  *p = &(b)[(o)>>3];              \
                             long        i = ((long)(c))<<((o)&0x7);    \
                             p[0] |= (Byte)(i);                         \
@@ -79,17 +132,92 @@ typedef long int        cmp_code_int;
                             (o) += (n);                                     \
                         }
 
-#define input(b,o,c,n,m){   Byte      *p = &(b)[(o)>>3];          \
+#define input(b,o,c,n,m){   const Byte *p = &(b)[(o)>>3];          \
                             (c) = ((((long)(p[0]))|((long)(p[1])<<8)|       \
                                      ((long)(p[2])<<16))>>((o)&0x7))&(m);   \
                             (o) += (n);                                     \
                         }
 
+//  As output() and input() for codes of more than 16 bits.
+#define outputWide(b,o,c,n) {   Byte  *p = &(b)[(o)>>3];          \
+                            long        i = ((long)(c))<<((o)&0x7);    \
+                            p[0] |= (Byte)(i);                         \
+                            p[1] |= (Byte)(i>>8);                      \
+                            p[2] |= (Byte)(i>>16);                     \
+                            p[3] |= (Byte)(i>>24);                     \
+                            (o) += (n);                                     \
+                        }
+
+#define inputWide(b,o,c,n,m){   const Byte *p = &(b)[(o)>>3];      \
+                            (c) = ((((long)(p[0]))|((long)(p[1])<<8)|       \
+                                    ((long)(p[2])<<16)|((long)(p[3])<<24))  \
+                                    >>((o)&0x7))&(m);                       \
+                            (o) += (n);                                     \
+                        }
+
+/*
+    The tagged dictionary is an alternative to the double hashing on htab.
+    The key of (prefix code, char) picks a bucket and each slot of a bucket
+    has an 8 bit tag taken from the hash.  All of the tags in a bucket are
+    compared at once and only a matching tag needs the key to be checked.
+    A full bucket overflows into the next one.  A tag of 0 marks an empty
+    slot.  Since the slots fill from the front and are never deleted, a
+    lookup can stop at the first bucket with an empty slot.
+*/
+
+typedef struct tagBucket
+{
+    Byte            tag[TAGSLOTS];
+    unsigned short  code[TAGSLOTS];
+    uint32_t        key[TAGSLOTS];
+} __attribute__((aligned(64))) TagBucket;
+
+
+/*  The compressor packs the prefix code and the next character into
+    one word to use as the key in htab.
+*/
+typedef union fcode
+{
+    long            code;
+    struct
+    {
+        Byte       c;
+        unsigned short  ent;
+    } e;
+} FCode;
+
+
+/*  The tables for codes of more than BITS bits, which don't fit in
+    codetab and the tables overlaid on htab.  The compressor's slots
+    hash (prefix, char) as htab does, with twice as many slots as codes.
+    A slot with a code of 0 is empty.  The decompressor builds each
+    string backwards from the end of stack, which holds the longest.
+*/
+typedef struct wideSlot
+{
+    uint32_t    key;            // prefix << 8 | char
+    uint32_t    code;
+} WideSlot;
+
+typedef struct wideTables
+{
+    int         bits;           // the widest codes the tables hold
+    code_int    ent;            // the compressor's current prefix
+    WideSlot*   slots;
+    uint32_t*   prefix;
+    Byte*       suffix;
+    Byte*       stack;
+} WideTables;
+
+#define  WIDESLOTS(b)   (MAXCODE(b)*2)
+
+
 /*
     To save much memory, we overlay the table used by compress() with those
     used by decompress().  The tab_prefix table is the same size and type
     as the codetab.  The tab_suffix table needs 2**BITS characters.  We
-    get this from the beginning of htab.  The output stack uses the rest
+    get this from the beginning of htab, followed by the length of each
+    string as 2**BITS shorts.  The output stack uses the rest
     of htab, and contains characters.  There is plenty of room for any
     possible stack (stack used to be 8000 characters).
 */
@@ -98,16 +226,123 @@ typedef struct privState
 {
     int     block_mode;     // Block compress mode -C compatible with 2.0
     int     maxbits;        // user settable max # bits/code
+    int     dict;           // an NCompressDict for compression
+
+    union
+    {
+        count_int   htab[HSIZE];
+        TagBucket   tagtab[TAGBUCKETS];
+    };
 
-    count_int       htab[HSIZE];
     unsigned short  codetab[HSIZE];
 
     Byte    inbuf[IBUFSIZ_ALL];  
     Byte    outbuf[OBUFSIZ_ALL];
 
+    /*  For each byte value b, the longest run b^runlen[b] known to be in
+        the table and its code.  A runlen of 0 means that only the byte
+        itself is known.  See compressRun().
+    */
+    long            runlen[256];
+    unsigned short  runcode[256];
+    long            runpend;        // a run prefix waiting for more input
+
+    unsigned int    slotof[MAXCODE(INIT_BITS)];     // see clear_used()
+
+    /*  The compressor's position in the stream, kept between calls to
+        nCompressWrite().
+    */
+    int         started;        // the header is in outbuf
+    int         hasent;         // fcode.e.ent holds the current prefix
+    int         flushed;        // the prefix was output by a flush
+    int         outbits;
+    int         boff;
+    int         n_bits;
+    int         ratio;
+    int         stcode;
+    int64_t     checkpoint;
+    code_int    free_ent;
+    code_int    extcode;
+    FCode       fcode;
+
+    /*  The decompressor's position in the stream, kept between calls to
+        nDecompressRead().  It shares n_bits and free_ent with the
+        compressor.
+    */
+    int             dstate;         // one of the DS_ states below
+    NCompressError  derror;         // the error which ended the stream
+    int             insize;
+    int             inbits;
+    int             posbits;
+    int             rsize;
+    int             finchar;
+    code_int        oldcode;
+    code_int        maxcode;
+    code_int        maxmaxcode;
+    long            pending;        // the end of a string still on de_stack
+
+    /*  Input passed to nDecompressPush() instead of being read.
+    */
+    int             feeding;        // the input comes from feed
+    int             feedEnd;        // there is no more input after feed
+    const Byte*     feed;
+    size_t          feedLen;
+
     // REVISIT this could be local rather than preserved in the state
-    long    bytes_in;               // Total number of byte from input
-    long    bytes_out;              // Total number of byte to output
+    int64_t bytes_in;               // Total number of byte from input
+    int64_t bytes_out;              // Total number of byte to output
+
+    /*  Statistics and events.  See nGetStats().  bytesIn and bytesOut
+        in stats are filled in from bytes_in and bytes_out.
+    */
+    NCompressStats      stats;
+    int                 statFlags;
+    int                 expanding;      // decompressing, for the offsets
+    int64_t             fullAt;         // where the table filled or -1
+    double              apiSeconds;     // the time in the library calls
+    NCmpEventHandler    handler;
+    void*               eventCtxt;
+
+    int                 pipeBlocks;     // see nSetPipeline()
+
+    // From nSetStreams64(), used in place of the reader and writer.
+    NCmpStreamReader64  reader64;
+    NCmpStreamWriter64  writer64;
+    struct searchState* search;         // during nSearch()
+
+    /*  The preset table from nSetPreset(), as the prefix and byte of
+        each code from FIRST.  presetEnd is where it ends in the current
+        stream, which is FIRST for a stream without one.  The table
+        holds the preset up to primed, or primed is 0.
+    */
+    unsigned short*     presetPrefix;
+    Byte*               presetChar;
+    long                presetLen;
+    code_int            presetEnd;
+    code_int            primed;
+
+    /*  The tables for codes of more than BITS bits.  A compressor has
+        them once nSetExtendedBits() has raised maxbits past BITS.  A
+        decompressor accepts codes up to wideBits and makes them for
+        each stream which needs them.
+    */
+    WideTables*         wide;
+    int                 wideBits;
+
+    /*  The decompressor's limits from nSetDecompressLimits().  callWork
+        counts the bytes decompressed by the current call.
+    */
+    NCompressLimits     limits;
+    int                 limited;        // any of the limits is set
+    int64_t             callWork;
+
+    //  The CRC32C of the uncompressed bytes.  See nSetCrc32c().
+    int                 crcOn;
+    uint32_t            crc;
+
+    //  The compressor's members.  See nSetMemberSize().
+    int64_t             memberSize;
+    int64_t             memberIn;       // bytes in the current member
 
 } PrivState;
 
@@ -116,8 +351,33 @@ typedef struct privState
 #define  codetabof(ps, i)           ps->codetab[i]
 #define  tab_prefixof(ps, i)        codetabof(ps, i)
 #define  tab_suffixof(ps, i)        ((Byte *)(ps->htab))[i]
+#define  tab_lenof(ps, i)           ((unsigned short *)(ps->htab))[(1<<BITS)/2+(i)]
 #define  de_stack(ps)               ((Byte *)&(ps->htab[HSIZE-1]))
 
+//  States of the decompressor between calls.
+#define  DS_HEADER      0           // the header is still to be read
+#define  DS_RESET       1           // the input buffer needs refilling
+#define  DS_CODES       2           // part way through the input buffer
+#define  DS_END         3           // the end of the stream or an error
+#define  DS_MEMBER      4           // the header of another member is next
+#define  DS_WAIT        5           // pushed input ran out part way into a group
+
+//  From readInput() when the pushed input has run out.
+#define  READ_WAIT      (-2)
+
+
+static void chooseUnpacker();
+static NCompressError compressPipelined(NCompressCtxt* ctxt);
+static NCompressError decompressPipelined(NCompressCtxt* ctxt);
+static int allocWide(PrivState* ps, int bits);
+static void freeWide(PrivState* ps);
+static NCompressError compressWide(NCompressCtxt* ctxt, const Byte* inbuf, int rsize);
+static NCompressError expandWide(NCompressCtxt* ctxt, Byte* dst, int cap, int* got);
+static void updateCrc(PrivState* ps, const Byte* bytes, size_t len);
+struct fileIO;
+static int decompressMembers(NCompressCtxt* ctxt, struct fileIO* fio, int numThreads, NCompressError* err);
+
+
 
 static inline void
 clear_htab(PrivState* ps)
@@ -127,6 +387,19 @@ clear_htab(PrivState* ps)
 
 
 
+static inline void
+clear_tagtab(PrivState* ps)
+{
+    long    b;
+
+    for (b = 0; b < TAGBUCKETS; ++b)
+    {
+        memset(ps->tagtab[b].tag, 0, TAGSLOTS);
+    }
+}
+
+
+
 static inline void
 clear_tab_prefixof(PrivState* ps)
 {
@@ -140,14 +413,23 @@ createPrivState(NCompressCtxt* ctxt, int bits)
 {
     if (!ctxt->priv)
     {
-        PrivState* priv = (PrivState*)malloc(sizeof(PrivState));
+        PrivState* priv = NULL;
+
+        // The tagged dictionary wants its buckets on cache lines.
+        if (posix_memalign((void**)&priv, 64, sizeof(PrivState)) != 0)
+        {
+            return;
+        }
 
         memset(priv, 0, sizeof(PrivState));
 
         priv->block_mode = BLOCK_MODE;
         priv->maxbits    = bits;
+        priv->dict       = NCMP_DEFAULT_DICT;
         priv->bytes_in   = 0;
         priv->bytes_out  = 0;
+        priv->fullAt     = -1;
+        priv->presetEnd  = FIRST;
 
         ctxt->priv = priv;
     }
@@ -179,11 +461,31 @@ nInitCompress(NCompressCtxt* ctxt, int bits)
 
 
 
+void
+nSetCompressDict(NCompressCtxt* ctxt, NCompressDict dict)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    if (ps)
+    {
+        ps->dict   = dict;
+        ps->primed = 0;
+    }
+}
+
+
+
 void
 nInitDecompress(NCompressCtxt* ctxt)
 {
+    chooseUnpacker();
     ctxt->priv = NULL;
     createPrivState(ctxt, 0);
+
+    if (ctxt->priv)
+    {
+        ((PrivState*)ctxt->priv)->expanding = 1;
+    }
 }
 
 
@@ -193,558 +495,7336 @@ nFreeCompress(NCompressCtxt* ctxt)
 {
     if (ctxt->priv)
     {
+        free(((PrivState*)ctxt->priv)->presetPrefix);
+        freeWide((PrivState*)ctxt->priv);
         free(ctxt->priv);
         ctxt->priv = NULL;
     }
 }
 
 
+void
+nSetPipeline(NCompressCtxt* ctxt, int numBlocks)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    if (ps)
+    {
+        ps->pipeBlocks = (numBlocks > 0) ? numBlocks : 0;
+    }
+}
+
 
-static int
-primetab[256] =     /* Special secondary hash table.     */
+
+void
+nSetStreams64(NCompressCtxt* ctxt, NCmpStreamReader64 reader, NCmpStreamWriter64 writer)
 {
-     1013, -1061, 1109, -1181, 1231, -1291, 1361, -1429,
-     1481, -1531, 1583, -1627, 1699, -1759, 1831, -1889,
-     1973, -2017, 2083, -2137, 2213, -2273, 2339, -2383,
-     2441, -2531, 2593, -2663, 2707, -2753, 2819, -2887,
-     2957, -3023, 3089, -3181, 3251, -3313, 3361, -3449,
-     3511, -3557, 3617, -3677, 3739, -3821, 3881, -3931,
-     4013, -4079, 4139, -4219, 4271, -4349, 4423, -4493,
-     4561, -4639, 4691, -4783, 4831, -4931, 4973, -5023,
-     5101, -5179, 5261, -5333, 5413, -5471, 5521, -5591,
-     5659, -5737, 5807, -5857, 5923, -6029, 6089, -6151,
-     6221, -6287, 6343, -6397, 6491, -6571, 6659, -6709,
-     6791, -6857, 6917, -6983, 7043, -7129, 7213, -7297,
-     7369, -7477, 7529, -7577, 7643, -7703, 7789, -7873,
-     7933, -8017, 8093, -8171, 8237, -8297, 8387, -8461,
-     8543, -8627, 8689, -8741, 8819, -8867, 8963, -9029,
-     9109, -9181, 9241, -9323, 9397, -9439, 9511, -9613,
-     9677, -9743, 9811, -9871, 9941,-10061,10111,-10177,
-    10259,-10321,10399,-10477,10567,-10639,10711,-10789,
-    10867,-10949,11047,-11113,11173,-11261,11329,-11423,
-    11491,-11587,11681,-11777,11827,-11903,11959,-12041,
-    12109,-12197,12263,-12343,12413,-12487,12541,-12611,
-    12671,-12757,12829,-12917,12979,-13043,13127,-13187,
-    13291,-13367,13451,-13523,13619,-13691,13751,-13829,
-    13901,-13967,14057,-14153,14249,-14341,14419,-14489,
-    14557,-14633,14717,-14767,14831,-14897,14983,-15083,
-    15149,-15233,15289,-15359,15427,-15497,15583,-15649,
-    15733,-15791,15881,-15937,16057,-16097,16189,-16267,
-    16363,-16447,16529,-16619,16691,-16763,16879,-16937,
-    17021,-17093,17183,-17257,17341,-17401,17477,-17551,
-    17623,-17713,17791,-17891,17957,-18041,18097,-18169,
-    18233,-18307,18379,-18451,18523,-18637,18731,-18803,
-    18919,-19031,19121,-19211,19273,-19381,19429,-19477
-} ;
+    PrivState* ps = (PrivState*)ctxt->priv;
 
+    if (ps)
+    {
+        ps->reader64 = reader;
+        ps->writer64 = writer;
+    }
+}
 
-/*****************************************************************
-    Algorithm from "A Technique for High Performance Data Compression",
-    Terry A. Welch, IEEE Computer Vol 17, No 6 (June 1984), pp 8-19.
 
-    Algorithm:
-    Modified Lempel-Ziv method (LZW).  Basically finds common substrings
-    and replaces them with a variable size code.  This is deterministic,
-    and can be done on the fly.  Thus, the decompression procedure needs
-    no input table, but tracks the way the table was built.
-*/
 
+void
+nSetDecompressLimits(NCompressCtxt* ctxt, const NCompressLimits* limits)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
 
-/*
-    compress from an input stream to an output
+    if (ps)
+    {
+        memset(&ps->limits, 0, sizeof(ps->limits));
 
-    Algorithm:  use open addressing double hashing (no chaining) on the
-    prefix code / next character combination.
+        if (limits)
+        {
+            ps->limits = *limits;
+        }
 
-    We do a variant of Knuth's algorithm D (vol. 3, sec. 6.4) along
-    with G. Knott's relatively-prime secondary probe.  Here, the
-    modular division first probe is gives way to a faster exclusive-or
-    manipulation.
+        ps->limited = ps->limits.maxOutput > 0 || ps->limits.maxRatio > 0 ||
+                      ps->limits.maxWork > 0;
+    }
+}
 
-    Also do block compression with an adaptive reset, whereby the code
-    table is cleared when the compression ratio decreases, but after
-    the table fills.
 
-    The variable-length output codes are re-sized at this point, and a
-    special CLEAR code is generated for the decompressor.
+//======================================================================
+//  Statistics and events
 
-    Late addition:  construct the table according to file size for
-    noticeable speed improvement on small files.  Please direct questions
-    about this implementation to ames!jaw.
+void
+nSetStatsFlags(NCompressCtxt* ctxt, int flags)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
 
-*/
+    if (ps)
+    {
+        ps->statFlags = flags;
+    }
+}
 
-NCompressError
-nCompress(NCompressCtxt* ctxt)
+
+
+void
+nSetEventHandler(NCompressCtxt* ctxt, NCmpEventHandler handler, void* eventCtxt)
 {
-    long        hp;
-    int         rpos;
-    long        fc;
-    int         outbits;
-    int         rlop;
-    int         rsize;
-    int         stcode;
-    code_int    free_ent;
-    int         boff;
-    int         n_bits;
-    int         ratio;
-    long        checkpoint;
-    code_int    extcode;
-    PrivState*  ps = (PrivState*)ctxt->priv;
+    PrivState* ps = (PrivState*)ctxt->priv;
 
-    union
+    if (ps)
     {
-        long            code;
-        struct
-        {
-            Byte       c;
-            unsigned short  ent;
-        } e;
-    } fcode;
+        ps->handler   = handler;
+        ps->eventCtxt = eventCtxt;
+    }
+}
 
 
-    ratio = 0;
-    checkpoint = CHECK_GAP;
-    extcode = MAXCODE(n_bits = INIT_BITS)+1;
-    stcode = 1;
-    free_ent = FIRST;
 
-    ps->outbuf[0] = MAGIC_1;
-    ps->outbuf[1] = MAGIC_2;
-    ps->outbuf[2] = (char)(ps->maxbits | ps->block_mode);
-    boff = outbits = (3<<3);
-    fcode.code = 0;
+void
+nGetStats(NCompressCtxt* ctxt, NCompressStats* stats)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    long        n;
+    long        i;
 
-    clear_htab(ps);
+    memset(stats, 0, sizeof(*stats));
 
-    while ((rsize = (ctxt->reader)(ps->inbuf, IBUFSIZ, ctxt->rwCtxt)) > 0)
+    if (!ps)
     {
-        if (ps->bytes_in == 0)
-        {
-            fcode.e.ent = ps->inbuf[0];
-            rpos = 1;
-        }
-        else
-            rpos = 0;
+        return;
+    }
 
-        rlop = 0;
+    *stats = ps->stats;
 
-        do
-        {
-            if (free_ent >= extcode && fcode.e.ent < FIRST)
-            {
-                if (n_bits < ps->maxbits)
-                {
-                    boff = outbits = (outbits-1)+((n_bits<<3)-
-                                ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
-                    if (++n_bits < ps->maxbits)
-                        extcode = MAXCODE(n_bits)+1;
-                    else
-                        extcode = MAXCODE(n_bits);
-                }
-                else
-                {
-                    extcode = MAXCODE(16)+OBUFSIZ;
-                    stcode = 0;
-                }
-            }
+    stats->bytesIn  = ps->bytes_in;
+    stats->bytesOut = ps->bytes_out;
 
-            if (!stcode && ps->bytes_in >= checkpoint && fcode.e.ent < FIRST)
-            {
-                long int rat;
+    if (ps->fullAt >= 0)
+    {
+        stats->fullBytes += (ps->expanding ? ps->bytes_out : ps->bytes_in) - ps->fullAt;
+    }
 
-                checkpoint = ps->bytes_in + CHECK_GAP;
+    // The clear offsets are kept in a ring.  Put the oldest first.
+    n = (ps->stats.clears < NCMP_STATS_CLEARS) ? ps->stats.clears : NCMP_STATS_CLEARS;
 
-                if (ps->bytes_in > 0x007fffff)
-                {                           /* shift will overflow */
-                    rat = (ps->bytes_out + (outbits>>3)) >> 8;
+    for (i = 0; i < n; ++i)
+    {
+        stats->clearOffsets[i] = ps->stats.clearOffsets[(ps->stats.clears - n + i) % NCMP_STATS_CLEARS];
+    }
 
-                    if (rat == 0)               /* Don't divide by zero */
-                        rat = 0x7fffffff;
-                    else
-                        rat = ps->bytes_in / rat;
-                }
-                else
-                {
-                    rat = (ps->bytes_in << 8) / (ps->bytes_out+(outbits>>3));   /* 8 fractional bits */
-                }
+    stats->kernelSeconds = ps->apiSeconds - ps->stats.callbackSeconds;
+}
 
-                if (rat >= ratio)
-                {
-                    ratio = (int)rat;
-                }
-                else
-                {
-                    ratio = 0;
 
-                    clear_htab(ps);
-                    output(ps->outbuf, outbits, CLEAR, n_bits);
 
-                    boff = outbits = (outbits-1)+((n_bits<<3)-
-                                ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+void
+nGetTotals(NCompressCtxt* ctxt, uint64_t* bytesIn, uint64_t* bytesOut)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
 
-                    extcode = MAXCODE(n_bits = INIT_BITS)+1;
-                    free_ent = FIRST;
-                    stcode = 1;
-                }
-            }
+    *bytesIn  = ps ? (uint64_t)ps->bytes_in : 0;
+    *bytesOut = ps ? (uint64_t)ps->bytes_out : 0;
+}
 
-            if (outbits >= (OBUFSIZ<<3))
-            {
-                if ((ctxt->writer)(ps->outbuf, OBUFSIZ, ctxt->rwCtxt) != OBUFSIZ)
-                {
-                    return NCMP_WRITE_ERROR;
-                }
 
-                outbits -= (OBUFSIZ<<3);
-                boff = -(((OBUFSIZ<<3)-boff)%(n_bits<<3));
-                ps->bytes_out += OBUFSIZ;
 
-                memcpy(ps->outbuf, ps->outbuf+OBUFSIZ, (outbits>>3)+1);
-                memset(ps->outbuf+(outbits>>3)+1, '\0', OBUFSIZ);
+static double
+statsClock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+
+static void
+resetStats(PrivState* ps)
+{
+    memset(&ps->stats, 0, sizeof(ps->stats));
+
+    ps->fullAt     = -1;
+    ps->apiSeconds = 0;
+}
+
+
+
+/*  Every public call which does work is timed from here to
+    leaveCall().
+*/
+static inline double
+enterCall(PrivState* ps)
+{
+    return (ps->statFlags & NCMP_STATS_TIMES) ? statsClock() : 0;
+}
+
+
+
+static inline void
+leaveCall(PrivState* ps, double start)
+{
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        ps->apiSeconds += statsClock() - start;
+    }
+}
+
+
+
+static void __attribute__((noinline))
+notifyEvent(PrivState* ps, NCompressEventType type, int bits, int64_t offset)
+{
+    NCompressEvent  ev;
+    double          start = 0;
+
+    ev.type     = type;
+    ev.bits     = bits;
+    ev.offset   = offset;
+    ev.bytesIn  = ps->bytes_in;
+    ev.bytesOut = ps->bytes_out;
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        start = statsClock();
+    }
+
+    (ps->handler)(&ev, ps->eventCtxt);
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        ps->stats.callbackSeconds += statsClock() - start;
+    }
+}
+
+
+
+/*  Record the events which the compressor and decompressor share.  The
+    offset is in the uncompressed data, at the end of the codes before
+    the event.  The compressor leaves out the byte it holds as the next
+    prefix so that the two agree.
+*/
+static void __attribute__((noinline))
+recordClear(PrivState* ps, int64_t offset)
+{
+    if (ps->fullAt >= 0)
+    {
+        ps->stats.fullBytes += offset - ps->fullAt;
+        ps->fullAt = -1;
+    }
+
+    ps->stats.clearOffsets[ps->stats.clears % NCMP_STATS_CLEARS] = offset;
+    ++ps->stats.clears;
+
+    if (ps->handler)
+    {
+        notifyEvent(ps, NCMP_EVENT_CLEAR, INIT_BITS, offset);
+    }
+}
+
+
+
+static void __attribute__((noinline))
+recordWiden(PrivState* ps, int bits, int64_t offset)
+{
+    ++ps->stats.widenings;
+
+    if (ps->handler)
+    {
+        notifyEvent(ps, NCMP_EVENT_WIDEN, bits, offset);
+    }
+}
+
+
+
+static void __attribute__((noinline))
+recordFull(PrivState* ps, int bits, int64_t offset)
+{
+    ps->fullAt = offset;
+
+    if (ps->handler)
+    {
+        notifyEvent(ps, NCMP_EVENT_FULL, bits, offset);
+    }
+}
+
+
+
+/*  All calls to the reader and writer go through these so that they
+    can be counted and timed.
+*/
+static ssize_t
+callReader(NCompressCtxt* ctxt, Byte* bytes, size_t numBytes)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    double      start = 0;
+    ssize_t     n;
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        start = statsClock();
+    }
+
+    if (ps->reader64)
+        n = (ps->reader64)(bytes, numBytes, ctxt->rwCtxt);
+    else
+        n = (ctxt->reader)(bytes, numBytes, ctxt->rwCtxt);
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        ps->stats.callbackSeconds += statsClock() - start;
+    }
+
+    ++ps->stats.readerCalls;
+
+    if (ps->handler)
+    {
+        notifyEvent(ps, NCMP_EVENT_PROGRESS, ps->n_bits,
+                    ps->expanding ? ps->bytes_out : ps->bytes_in);
+    }
+
+    return n;
+}
+
+
+
+static ssize_t
+callWriter(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    double      start = 0;
+    ssize_t     n;
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        start = statsClock();
+    }
+
+    if (ps->writer64)
+        n = (ps->writer64)(bytes, numBytes, ctxt->rwCtxt);
+    else
+        n = (ctxt->writer)(bytes, numBytes, ctxt->rwCtxt);
+
+    if (ps->statFlags & NCMP_STATS_TIMES)
+    {
+        ps->stats.callbackSeconds += statsClock() - start;
+    }
+
+    ++ps->stats.writerCalls;
+
+    if (ps->handler)
+    {
+        notifyEvent(ps, NCMP_EVENT_PROGRESS, ps->n_bits,
+                    ps->expanding ? ps->bytes_out : ps->bytes_in);
+    }
+
+    return n;
+}
+
+
+
+static int
+primetab[256] =     /* Special secondary hash table.     */
+{
+     1013, -1061, 1109, -1181, 1231, -1291, 1361, -1429,
+     1481, -1531, 1583, -1627, 1699, -1759, 1831, -1889,
+     1973, -2017, 2083, -2137, 2213, -2273, 2339, -2383,
+     2441, -2531, 2593, -2663, 2707, -2753, 2819, -2887,
+     2957, -3023, 3089, -3181, 3251, -3313, 3361, -3449,
+     3511, -3557, 3617, -3677, 3739, -3821, 3881, -3931,
+     4013, -4079, 4139, -4219, 4271, -4349, 4423, -4493,
+     4561, -4639, 4691, -4783, 4831, -4931, 4973, -5023,
+     5101, -5179, 5261, -5333, 5413, -5471, 5521, -5591,
+     5659, -5737, 5807, -5857, 5923, -6029, 6089, -6151,
+     6221, -6287, 6343, -6397, 6491, -6571, 6659, -6709,
+     6791, -6857, 6917, -6983, 7043, -7129, 7213, -7297,
+     7369, -7477, 7529, -7577, 7643, -7703, 7789, -7873,
+     7933, -8017, 8093, -8171, 8237, -8297, 8387, -8461,
+     8543, -8627, 8689, -8741, 8819, -8867, 8963, -9029,
+     9109, -9181, 9241, -9323, 9397, -9439, 9511, -9613,
+     9677, -9743, 9811, -9871, 9941,-10061,10111,-10177,
+    10259,-10321,10399,-10477,10567,-10639,10711,-10789,
+    10867,-10949,11047,-11113,11173,-11261,11329,-11423,
+    11491,-11587,11681,-11777,11827,-11903,11959,-12041,
+    12109,-12197,12263,-12343,12413,-12487,12541,-12611,
+    12671,-12757,12829,-12917,12979,-13043,13127,-13187,
+    13291,-13367,13451,-13523,13619,-13691,13751,-13829,
+    13901,-13967,14057,-14153,14249,-14341,14419,-14489,
+    14557,-14633,14717,-14767,14831,-14897,14983,-15083,
+    15149,-15233,15289,-15359,15427,-15497,15583,-15649,
+    15733,-15791,15881,-15937,16057,-16097,16189,-16267,
+    16363,-16447,16529,-16619,16691,-16763,16879,-16937,
+    17021,-17093,17183,-17257,17341,-17401,17477,-17551,
+    17623,-17713,17791,-17891,17957,-18041,18097,-18169,
+    18233,-18307,18379,-18451,18523,-18637,18731,-18803,
+    18919,-19031,19121,-19211,19273,-19381,19429,-19477
+} ;
+
+
+/*  Return a bit mask of the slots in the bucket whose tag equals t.
+*/
+static inline unsigned
+tagMatch(const TagBucket* bk, Byte t)
+{
+#if defined(NCMP_X86_SIMD) && defined(__SSE2__)
+    __m128i tags = _mm_loadl_epi64((const __m128i*)bk->tag);
+
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)t))) & 0xff;
+#else
+    uint64_t    x;
+    uint64_t    y;
+    unsigned    m = 0;
+    int         i;
+
+    memcpy(&x, bk->tag, sizeof(x));
+    x ^= 0x0101010101010101ULL * t;
+    y  = ~(((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x | 0x7f7f7f7f7f7f7f7fULL);
+
+    for (i = 0; i < TAGSLOTS; ++i)
+    {
+        m |= (unsigned)((y >> (i * 8 + 7)) & 1) << i;
+    }
+
+    return m;
+#endif
+}
+
+
+
+/*  Look up the (prefix code, char) key.  This returns the code or -1 if
+    the key is not present, in which case slot is set to where it can be
+    inserted.  If nprobe isn't NULL the buckets examined are added to it.
+*/
+static inline long
+tagFind(PrivState* ps, uint32_t key, long* slot, long* nprobe)
+{
+    uint32_t    h = key * 0x9E3779B1u;
+    long        b = (long)(((key >> 8) ^ (key << (TAGBITS - 8)) ^ (key >> (TAGBITS + 8))) & TAGMASK);
+    Byte        t = (Byte)((h >> 25) | 0x80);
+
+    for (;;)
+    {
+        TagBucket*  bk = &ps->tagtab[b];
+        unsigned    m  = tagMatch(bk, t);
+
+        if (nprobe)
+        {
+            ++*nprobe;
+        }
+
+        while (m)
+        {
+            int i = __builtin_ctz(m);
+
+            if (bk->key[i] == key)
+            {
+                return bk->code[i];
             }
 
+            m &= m - 1;
+        }
+
+        if ((m = tagMatch(bk, 0)) != 0)
+        {
+            *slot = b * TAGSLOTS + __builtin_ctz(m);
+            return -1;
+        }
+
+        b = (b + 1) & TAGMASK;
+    }
+}
+
+
+
+static inline void
+tagInsert(PrivState* ps, long slot, uint32_t key, code_int code)
+{
+    TagBucket*  bk = &ps->tagtab[slot / TAGSLOTS];
+    int         i  = (int)(slot % TAGSLOTS);
+    uint32_t    h  = key * 0x9E3779B1u;
+
+    bk->tag[i]  = (Byte)((h >> 25) | 0x80);
+    bk->key[i]  = key;
+    bk->code[i] = (unsigned short)code;
+
+    ps->slotof[code & (MAXCODE(INIT_BITS)-1)] = (unsigned int)slot;
+}
+
+
+
+#define TAGKEY(e)   (((uint32_t)(e).ent << 8) | (e).c)
+
+
+
+static inline void
+clear_dict(PrivState* ps, const int tagged)
+{
+    if (tagged)
+        clear_tagtab(ps);
+    else
+        clear_htab(ps);
+
+    memset(ps->runlen, 0, sizeof(ps->runlen));
+    ps->runpend = 0;
+}
+
+
+
+/*  Look up a (prefix code, char) pair in the htab with the same probe
+    sequence as the loop in compressStream().  This returns the code or
+    -1 with slot set to the first empty entry.
+*/
+static inline long
+classicFind(PrivState* ps, FCode f, long* slot)
+{
+    long    hp = ((((long)(f.e.c)) << (HBITS-8)) ^ (long)(f.e.ent));
+    long    i;
+    long    p;
+
+    if ((i = htabof(ps, hp)) == f.code)
+    {
+        return codetabof(ps, hp);
+    }
+
+    if (i != -1)
+    {
+        p = primetab[f.e.c];
+
+        do
+        {
+            hp = (hp+p)&HMASK;
+
+            if ((i = htabof(ps, hp)) == f.code)
             {
-                int i = rsize-rlop;
+                return codetabof(ps, hp);
+            }
+        }
+        while (i != -1);
+    }
 
-                if ((code_int)i > extcode-free_ent)
-                {
-                    i = (int)(extcode-free_ent);
-                }
+    *slot = hp;
+    return -1;
+}
 
-                if (i > ((OBUFSIZ_ALL - 32)*8 - outbits) / n_bits)
-                {
-                    i = ((OBUFSIZ_ALL - 32)*8 - outbits) / n_bits;
-                }
 
-                if (!stcode && (long)i > checkpoint - ps->bytes_in)
-                {
-                    i = (int)(checkpoint - ps->bytes_in);
-                }
 
-                rlop += i;
-                ps->bytes_in += i;
-            }
+static inline long
+dictFind(PrivState* ps, const int tagged, FCode f, long* slot)
+{
+    if (tagged)
+        return tagFind(ps, TAGKEY(f.e), slot, NULL);
+    else
+        return classicFind(ps, f, slot);
+}
+
+
+
+static inline void
+dictInsert(PrivState* ps, const int tagged, long slot, FCode f, code_int code)
+{
+    if (tagged)
+    {
+        tagInsert(ps, slot, TAGKEY(f.e), code);
+    }
+    else
+    {
+        codetabof(ps, slot) = (unsigned short)code;
+        htabof(ps, slot) = f.code;
+        ps->slotof[code & (MAXCODE(INIT_BITS)-1)] = (unsigned int)slot;
+    }
+}
+
+
+
+/*  Empty the dictionary and insert the preset of the current stream, if
+    it has one.
+*/
+static void
+primeDict(PrivState* ps, const int tagged)
+{
+    code_int    code;
+
+    clear_dict(ps, tagged);
+
+    for (code = FIRST; code < ps->presetEnd; ++code)
+    {
+        FCode   f;
+        long    slot;
+
+        f.code  = 0;
+        f.e.ent = ps->presetPrefix[code - FIRST];
+        f.e.c   = ps->presetChar[code - FIRST];
+
+        // A pair which is already there leaves its code without an entry.
+        if (dictFind(ps, tagged, f, &slot) < 0)
+            dictInsert(ps, tagged, slot, f, code);
+        else
+            ps->slotof[code & (MAXCODE(INIT_BITS)-1)] = NOSLOT;
+    }
+
+    ps->primed = ps->presetEnd;
+}
+
+
+
+/*  Clear the dictionary back to the start of the table, for a CLEAR code
+    or a new stream.  A 9 bit table is cleared every 255 codes, and one
+    for a short message after a few, so when there are few codes since
+    the preset only the slots that they used are emptied.  A code which
+    got no entry has NOSLOT.
+*/
+static inline void
+clear_used(PrivState* ps, const int tagged, code_int free_ent)
+{
+    code_int    code;
+
+    if (ps->primed != ps->presetEnd || free_ent - ps->presetEnd > MAXCODE(INIT_BITS))
+    {
+        primeDict(ps, tagged);
+        return;
+    }
+
+    for (code = ps->presetEnd; code < free_ent; ++code)
+    {
+        unsigned int    slot = ps->slotof[code & (MAXCODE(INIT_BITS)-1)];
+
+        if (slot == NOSLOT)
+            continue;
+
+        if (tagged)
+            ps->tagtab[slot / TAGSLOTS].tag[slot % TAGSLOTS] = 0;
+        else
+            htabof(ps, slot) = -1;
+    }
+
+    memset(ps->runlen, 0, sizeof(ps->runlen));
+    ps->runpend = 0;
+}
+
+
+
+/*  The width of the first codes in a table which starts at presetEnd.
+*/
+static int
+presetBits(PrivState* ps)
+{
+    int n_bits = INIT_BITS;
+
+    while (n_bits < ps->maxbits && ps->presetEnd >= MAXCODE(n_bits))
+    {
+        ++n_bits;
+    }
+
+    return n_bits;
+}
+
+
+
+/*  The decompressor's maxcode for the first codes of a table.  As for
+    the widths after, the largest has maxmaxcode, except for 9 bits.
+*/
+static code_int
+presetMaxcode(PrivState* ps, int n_bits)
+{
+    return (n_bits > INIT_BITS && n_bits == ps->maxbits) ? ps->maxmaxcode : MAXCODE(n_bits)-1;
+}
+
+
+
+/*  Where the preset ends in a stream of maxbits.
+*/
+static code_int
+presetEndOf(PrivState* ps)
+{
+    code_int    end = FIRST + ps->presetLen;
+
+    return (end < PRESETEND(ps->maxbits)) ? end : PRESETEND(ps->maxbits);
+}
+
+
+
+/*  Return the code for the run b^j, which must be in the table.
+*/
+static inline long
+runWalk(PrivState* ps, const int tagged, Byte b, long j)
+{
+    FCode   f;
+    long    slot;
+
+    f.code  = 0;
+    f.e.c   = b;
+    f.e.ent = b;
+
+    while (--j > 0)
+    {
+        f.e.ent = (unsigned short)dictFind(ps, tagged, f, &slot);
+    }
+
+    return f.e.ent;
+}
+
+
+
+/*
+    Compress a run of the byte b when the current prefix is b^j.  Within
+    a run LZW is predictable.  If b^m is the longest run of b in the
+    table then the next m-j bytes make the string b^m, the byte after
+    that misses, b^m is output and b^(m+1) is added as the next code.
+    Then the prefix is b again with m one larger.  So we can skip
+    straight from one output to the next with a single lookup for each
+    code, rather than one for each byte.
+
+    The longest run for each byte is remembered in runlen and runcode.
+    The main loop may have extended a run since then, so each step first
+    checks that (b^m, b) is not in the table.
+
+    The steps must match the main loop.  It only starts a new string
+    before rlop, which keeps the output and code space within the limits
+    the caller set for this chunk, but it will complete a string up to
+    rsize.  If the run reaches rsize before it completes a string then
+    we only record the length of the prefix in runpend, to be picked up
+    with the next input.  Otherwise, when the run stops short, we walk
+    the table to find the code of the prefix.  That costs no more than
+    the main loop would.
+
+    This returns the new rpos and leaves the prefix code in fcode.
+*/
+static inline __attribute__((always_inline)) int
+compressRun(
+    PrivState*  ps,
+    const int   tagged,
+    const Byte* inbuf,
+    FCode*      fcode,
+    long        j,
+    int         rpos,
+    int         rlop,
+    int         rsize,
+    int*        outbits,
+    int         n_bits,
+    code_int*   free_ent,
+    int         stcode
+    )
+{
+    Byte    b  = (Byte)fcode->e.ent;
+    long    m  = ps->runlen[b];
+    int     first = 1;
+    FCode   rc;
+    int     r  = rpos;
+    uint64_t pat = 0x0101010101010101ULL * b;
+
+    // Find the end of the run a word at a time.
+    while (r + 8 <= rsize)
+    {
+        uint64_t w;
+
+        memcpy(&w, inbuf + r, sizeof(w));
+
+        if (w != pat)
+        {
+            break;
+        }
+
+        r += 8;
+    }
+
+    while (r < rsize && inbuf[r] == b)
+    {
+        ++r;
+    }
+
+    r -= rpos;
+
+    rc.code  = 0;
+    rc.e.c   = b;
+    rc.e.ent = (m == 0) ? b : ps->runcode[b];
+
+    if (m == 0)
+    {
+        m = 1;
+    }
+
+    ps->runpend = 0;
+
+    for (;;)
+    {
+        long    slot;
+        long    code;
+        long    need;
+
+        while ((code = dictFind(ps, tagged, rc, &slot)) >= 0)
+        {
+            rc.e.ent = (unsigned short)code;
+            ++m;
+        }
+
+        if (!first && rpos >= rlop)
+        {
+            break;
+        }
+
+        need = m - j + 1;
+
+        if (r < need)
+        {
+            rpos += r;
+            j    += r;
+
+            if (rpos == rsize && j > 1)
+            {
+                ps->runpend = j;
+                j = 1;
+            }
+
+            break;
+        }
+
+        if (!stcode && j == 1)
+        {
+            // The table is full so the same code repeats.
+            long n = (rlop - rpos + m - 1) / m;
+
+            if (n > r / m)
+            {
+                n = r / m;
+            }
+
+            rpos += (int)(n * m);
+            r    -= (int)(n * m);
+
+            ps->stats.codes += n;
+
+            while (n-- > 0)
+            {
+                output(ps->outbuf, *outbits, rc.e.ent, n_bits);
+            }
+        }
+        else
+        {
+            rpos += (int)need;
+            r    -= (int)need;
+
+            output(ps->outbuf, *outbits, rc.e.ent, n_bits);
+            ++ps->stats.codes;
+
+            if (stcode)
+            {
+                dictInsert(ps, tagged, slot, rc, *free_ent);
+                rc.e.ent = (unsigned short)(*free_ent)++;
+                ++m;
+            }
+        }
+
+        j = 1;
+        first = 0;
+    }
+
+    ps->runlen[b]  = m;
+    ps->runcode[b] = rc.e.ent;
+
+    fcode->e.ent = (j == 1) ? b : (unsigned short)runWalk(ps, tagged, b, j);
+
+    return rpos;
+}
+
+
+/*****************************************************************
+    Algorithm from "A Technique for High Performance Data Compression",
+    Terry A. Welch, IEEE Computer Vol 17, No 6 (June 1984), pp 8-19.
+
+    Algorithm:
+    Modified Lempel-Ziv method (LZW).  Basically finds common substrings
+    and replaces them with a variable size code.  This is deterministic,
+    and can be done on the fly.  Thus, the decompression procedure needs
+    no input table, but tracks the way the table was built.
+*/
+
+
+/*
+    compress from an input stream to an output
+
+    Algorithm:  use open addressing double hashing (no chaining) on the
+    prefix code / next character combination.
+
+    We do a variant of Knuth's algorithm D (vol. 3, sec. 6.4) along
+    with G. Knott's relatively-prime secondary probe.  Here, the
+    modular division first probe is gives way to a faster exclusive-or
+    manipulation.
+
+    Also do block compression with an adaptive reset, whereby the code
+    table is cleared when the compression ratio decreases, but after
+    the table fills.
+
+    The variable-length output codes are re-sized at this point, and a
+    special CLEAR code is generated for the decompressor.
+
+    Late addition:  construct the table according to file size for
+    noticeable speed improvement on small files.  Please direct questions
+    about this implementation to ames!jaw.
+
+    This compresses one buffer of input.  The state between buffers is
+    kept in the PrivState so that the input can be pushed in by
+    nCompressWrite() as well as pulled by nCompress().
+
+    The tagged argument selects the tagged dictionary in place of the
+    double hashing, and probes counts the dictionary probes for the
+    statistics.  They are always constants so the compiler generates a
+    separate loop for each case.
+*/
+
+static inline __attribute__((always_inline)) NCompressError
+compressBlock(NCompressCtxt* ctxt, const int tagged, const int probes, const Byte* inbuf, int rsize)
+{
+    long        hp;
+    int         rpos;
+    long        fc;
+    int         outbits;
+    int         rlop;
+    int         stcode;
+    code_int    free_ent;
+    int         boff;
+    int         n_bits;
+    int         ratio;
+    int64_t     checkpoint;
+    code_int    extcode;
+    long        ncodes = 0;
+    long        nlook = 0;
+    long        nprobe = 0;
+    long        np = 0;
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    long        maxprobe = ps->stats.maxProbes;
+
+    FCode       fcode;
+
+    ratio      = ps->ratio;
+    checkpoint = ps->checkpoint;
+    extcode    = ps->extcode;
+    n_bits     = ps->n_bits;
+    stcode     = ps->stcode;
+    free_ent   = ps->free_ent;
+    outbits    = ps->outbits;
+    boff       = ps->boff;
+    fcode      = ps->fcode;
+
+    if (!ps->hasent)
+    {
+        fcode.e.ent = inbuf[0];
+        rpos = 1;
+        ps->hasent = 1;
+    }
+    else
+    if (ps->flushed)
+    {
+        /*  The prefix has already been output so the first byte
+            only completes its table entry, as at out: below.
+        */
+        long    slot;
+
+        fcode.e.c = inbuf[0];
+
+        if (stcode)
+        {
+            if (dictFind(ps, tagged, fcode, &slot) < 0)
+                dictInsert(ps, tagged, slot, fcode, free_ent);
+            else
+                ps->slotof[free_ent & (MAXCODE(INIT_BITS)-1)] = NOSLOT;
+
+            ++free_ent;
+        }
+
+        fcode.e.ent = fcode.e.c;
+        rpos = 1;
+        ps->flushed = 0;
+    }
+    else
+        rpos = 0;
+
+    rlop = 0;
+
+    do
+    {
+        if (free_ent >= extcode && fcode.e.ent < FIRST && !ps->runpend)
+        {
+            if (n_bits < ps->maxbits)
+            {
+                boff = outbits = (outbits-1)+((n_bits<<3)-
+                            ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+                if (++n_bits < ps->maxbits)
+                    extcode = MAXCODE(n_bits)+1;
+                else
+                    extcode = MAXCODE(n_bits);
+
+                recordWiden(ps, n_bits, ps->bytes_in + rpos - rlop - 1);
+            }
+            else
+            if (ps->maxbits == INIT_BITS)
+            {
+                /*  A decompressor widens the codes once its table
+                    passes 511 entries, even when maxbits is 9.  So a
+                    full 9 bit table is always cleared.
+                */
+                checkpoint = ps->bytes_in + CHECK_GAP;
+                goto cleartab;
+            }
+            else
+            {
+                extcode = FULLCODE(ps->maxbits);
+                stcode = 0;
+
+                recordFull(ps, n_bits, ps->bytes_in + rpos - rlop - 1);
+            }
+        }
+
+        if (!stcode && ps->bytes_in >= checkpoint && fcode.e.ent < FIRST && !ps->runpend)
+        {
+            long int rat;
+
+            checkpoint = ps->bytes_in + CHECK_GAP;
+
+            if (ps->bytes_in > 0x007fffff)
+            {                           /* shift will overflow */
+                rat = (ps->bytes_out + (outbits>>3)) >> 8;
+
+                if (rat == 0)               /* Don't divide by zero */
+                    rat = 0x7fffffff;
+                else
+                    rat = ps->bytes_in / rat;
+            }
+            else
+            {
+                rat = (ps->bytes_in << 8) / (ps->bytes_out+(outbits>>3));   /* 8 fractional bits */
+            }
+
+            if (rat >= ratio)
+            {
+                ratio = (int)rat;
+            }
+            else
+            {
+cleartab:       ratio = 0;
+
+                clear_used(ps, tagged, free_ent);
+                output(ps->outbuf, outbits, CLEAR, n_bits);
+                ++ncodes;
+                recordClear(ps, ps->bytes_in + rpos - rlop - 1);
+
+                boff = outbits = (outbits-1)+((n_bits<<3)-
+                            ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+
+                n_bits = presetBits(ps);
+                extcode = EXTCODE(n_bits, ps->maxbits);
+                free_ent = ps->presetEnd;
+                stcode = 1;
+            }
+        }
+
+        if (outbits >= (OBUFSIZ<<3))
+        {
+            ps->bytes_out += OBUFSIZ;
+
+            if (callWriter(ctxt, ps->outbuf, OBUFSIZ) != OBUFSIZ)
+            {
+                return NCMP_WRITE_ERROR;
+            }
+
+            outbits -= (OBUFSIZ<<3);
+            boff = -(((OBUFSIZ<<3)-boff)%(n_bits<<3));
+
+            memcpy(ps->outbuf, ps->outbuf+OBUFSIZ, (outbits>>3)+1);
+            memset(ps->outbuf+(outbits>>3)+1, '\0', OBUFSIZ);
+        }
+
+        {
+            int i = rsize-rlop;
+
+            if ((code_int)i > extcode-free_ent)
+            {
+                i = (int)(extcode-free_ent);
+            }
+
+            if (i > ((OBUFSIZ_ALL - 32)*8 - outbits) / n_bits)
+            {
+                i = ((OBUFSIZ_ALL - 32)*8 - outbits) / n_bits;
+            }
+
+            if (!stcode && (long)i > checkpoint - ps->bytes_in)
+            {
+                i = (int)(checkpoint - ps->bytes_in);
+            }
+
+            rlop += i;
+            ps->bytes_in += i;
+        }
+
+        if (ps->runpend)
+        {
+            rpos = compressRun(ps, tagged, inbuf, &fcode, ps->runpend, rpos, rlop, rsize,
+                               &outbits, n_bits, &free_ent, stcode);
+        }
+        else
+        if (fcode.e.ent < FIRST && rpos < rlop && inbuf[rpos] == fcode.e.ent)
+        {
+            rpos = compressRun(ps, tagged, inbuf, &fcode, 1, rpos, rlop, rsize,
+                               &outbits, n_bits, &free_ent, stcode);
+        }
+
+        goto next;
+
+hfound: fcode.e.ent = codetabof(ps, hp);
+
+next:   if (rpos >= rlop)
+        {
+            goto endlop;
+        }
+
+next2:  fcode.e.c = inbuf[rpos++];
+
+        if (tagged)
+        {
+            long   code = tagFind(ps, TAGKEY(fcode.e), &hp, probes ? &np : NULL);
+
+            if (probes)
+            {
+                ++nlook;
+                nprobe += np;
+                if (np > maxprobe) maxprobe = np;
+                np = 0;
+            }
+
+            if (code < 0) goto out;
+
+            fcode.e.ent = (unsigned short)code;
+            goto next;
+        }
+
+        {
+            long   i;
+            long   p;
+            fc = fcode.code;
+            hp = ((((long)(fcode.e.c)) << (HBITS-8)) ^ (long)(fcode.e.ent));
+
+            if (probes) np = 1;
+            if ((i = htabof(ps, hp)) == fc) goto hprobed;
+            if (i == -1)                goto miss;
+
+            p = primetab[fcode.e.c];
+lookup:         hp = (hp+p)&HMASK;
+            if (probes) ++np;
+            if ((i = htabof(ps, hp)) == fc) goto hprobed;
+            if (i == -1)                goto miss;
+            hp = (hp+p)&HMASK;
+            if (probes) ++np;
+            if ((i = htabof(ps, hp)) == fc) goto hprobed;
+            if (i == -1)                goto miss;
+            hp = (hp+p)&HMASK;
+            if (probes) ++np;
+            if ((i = htabof(ps, hp)) == fc) goto hprobed;
+            if (i == -1)                goto miss;
+            goto lookup;
+
+hprobed:    if (probes)
+            {
+                ++nlook;
+                nprobe += np;
+                if (np > maxprobe) maxprobe = np;
+            }
+            goto hfound;
+
+miss:       if (probes)
+            {
+                ++nlook;
+                nprobe += np;
+                if (np > maxprobe) maxprobe = np;
+            }
+        }
+out:    ;
+        output(ps->outbuf, outbits, fcode.e.ent, n_bits);
+        ++ncodes;
+
+        {
+            long        fc;
+            uint32_t    key;
+            fc = fcode.code;
+            key = TAGKEY(fcode.e);
+            fcode.e.ent = fcode.e.c;
+
+
+            if (stcode)
+            {
+                if (tagged)
+                {
+                    tagInsert(ps, hp, key, free_ent++);
+                }
+                else
+                {
+                    ps->slotof[free_ent & (MAXCODE(INIT_BITS)-1)] = (unsigned int)hp;
+                    codetabof(ps, hp) = (unsigned short)free_ent++;
+                    htabof(ps, hp) = fc;
+                }
+            }
+        }
+
+        if (rpos < rlop && inbuf[rpos] == fcode.e.ent)
+        {
+            rpos = compressRun(ps, tagged, inbuf, &fcode, 1, rpos, rlop, rsize,
+                               &outbits, n_bits, &free_ent, stcode);
+        }
+
+        goto next;
+
+endlop: if (fcode.e.ent >= FIRST && rpos < rsize)
+        {
+            goto next2;
+        }
+
+        if (rpos > rlop)
+        {
+            ps->bytes_in += rpos-rlop;
+            rlop = rpos;
+        }
+    }
+    while (rlop < rsize);
+
+    ps->ratio      = ratio;
+    ps->checkpoint = checkpoint;
+    ps->extcode    = extcode;
+    ps->n_bits     = n_bits;
+    ps->stcode     = stcode;
+    ps->free_ent   = free_ent;
+    ps->outbits    = outbits;
+    ps->boff       = boff;
+    ps->fcode      = fcode;
+
+    ps->stats.codes    += ncodes;
+    ps->stats.lookups  += nlook;
+    ps->stats.probes   += nprobe;
+    ps->stats.maxProbes = maxprobe;
+
+    return NCMP_OK;
+}
+
+
+
+/*  Start a member.  The first has the header, in an output buffer
+    which must hold no other bytes.  The others go on from the CLEAR
+    which ended the last, once its bytes have been written.
+*/
+static void
+beginMember(PrivState* ps, const int header)
+{
+    if (ps->maxbits > BITS)
+    {
+        // Extended codes have their own table and no preset.
+        ps->presetEnd = FIRST;
+        memset(ps->wide->slots, 0, WIDESLOTS(ps->wide->bits) * sizeof(WideSlot));
+    }
+    else
+    {
+        /*  The table of the last stream is cleared back to the preset.
+            Members have none so that each can be decoded by itself.
+        */
+        ps->presetEnd = ps->memberSize ? FIRST : presetEndOf(ps);
+        clear_used(ps, ps->dict == NCMP_DICT_TAGGED, ps->free_ent);
+    }
+
+    ps->ratio      = 0;
+    ps->checkpoint = ps->bytes_in + CHECK_GAP;
+    ps->n_bits     = presetBits(ps);
+    ps->extcode    = EXTCODE(ps->n_bits, ps->maxbits);
+    ps->stcode     = 1;
+    ps->free_ent   = ps->presetEnd;
+    ps->hasent     = 0;
+    ps->flushed    = 0;
+    ps->fcode.code = 0;
+    ps->memberIn   = 0;
+
+    if (!header)
+    {
+        return;
+    }
+
+    memset(ps->outbuf, 0, OBUFSIZ_ALL);
+    ps->outbuf[0] = MAGIC_1;
+    ps->outbuf[1] = MAGIC_2;
+    ps->outbuf[2] = (char)(ps->maxbits | ps->block_mode | ((ps->presetEnd > FIRST) ? PRESET : 0));
+    ps->boff = ps->outbits = (3<<3);
+}
+
+
+
+/*  Start a new stream.
+*/
+static void
+beginCompress(NCompressCtxt* ctxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+
+    ps->bytes_in  = 0;
+    ps->bytes_out = 0;
+    ps->crc       = 0;
+
+    resetStats(ps);
+    beginMember(ps, 1);
+
+    ps->started = 1;
+}
+
+
+
+/*  Widen the codes if the last output filled the code space, as the top
+    of the loop in compressBlock() would.  The events here are at the
+    end of the input so far, which from outputPrefix() includes the
+    prefix still to be output.
+*/
+static void
+widenCodes(PrivState* ps)
+{
+    if (ps->free_ent >= ps->extcode)
+    {
+        int n_bits = ps->n_bits;
+
+        if (n_bits < ps->maxbits)
+        {
+            ps->boff = ps->outbits = (ps->outbits-1)+((n_bits<<3)-
+                            ((ps->outbits-ps->boff-1+(n_bits<<3))%(n_bits<<3)));
+
+            if (++ps->n_bits < ps->maxbits)
+                ps->extcode = MAXCODE(ps->n_bits)+1;
+            else
+                ps->extcode = MAXCODE(ps->n_bits);
+
+            recordWiden(ps, ps->n_bits, ps->bytes_in);
+        }
+        else
+        if (ps->maxbits == INIT_BITS)
+        {
+            // As in compressBlock(), a full 9 bit table is cleared.
+            clear_used(ps, ps->dict == NCMP_DICT_TAGGED, ps->free_ent);
+            output(ps->outbuf, ps->outbits, CLEAR, n_bits);
+            ++ps->stats.codes;
+            recordClear(ps, ps->bytes_in);
+
+            ps->boff = ps->outbits = (ps->outbits-1)+((n_bits<<3)-
+                            ((ps->outbits-ps->boff-1+(n_bits<<3))%(n_bits<<3)));
+
+            ps->n_bits     = presetBits(ps);
+            ps->extcode    = EXTCODE(ps->n_bits, ps->maxbits);
+            ps->free_ent   = ps->presetEnd;
+            ps->ratio      = 0;
+            ps->checkpoint = ps->bytes_in + CHECK_GAP;
+        }
+        else
+        {
+            ps->extcode = FULLCODE(ps->maxbits);
+            ps->stcode = 0;
+
+            recordFull(ps, ps->n_bits, ps->bytes_in);
+        }
+    }
+}
+
+
+
+/*  Output the current prefix, as at the end of the input.  This will
+    first widen the codes if the last output filled the code space, as
+    the top of the loop in compressBlock() would.
+
+    The original compress doesn't widen for the last code.  That is
+    harmless since the code falls on a group boundary and the padding
+    after it is zero, and widening there gives the same bytes.  But after
+    a flush more codes follow so the width must be right.
+*/
+static void
+outputPrefix(PrivState* ps)
+{
+    if (ps->runpend)
+    {
+        ps->fcode.e.ent = (unsigned short)runWalk(ps, ps->dict == NCMP_DICT_TAGGED,
+                                                  (Byte)ps->fcode.e.ent, ps->runpend);
+        ps->runpend = 0;
+    }
+
+    widenCodes(ps);
+
+    if (ps->maxbits > BITS)
+    {
+        outputWide(ps->outbuf, ps->outbits, ps->wide->ent, ps->n_bits);
+    }
+    else
+    {
+        output(ps->outbuf, ps->outbits, ps->fcode.e.ent, ps->n_bits);
+    }
+
+    ++ps->stats.codes;
+}
+
+
+
+/*  End a member with a CLEAR padded to the end of its group, where a
+    decoder can start with a new table.  A member with no codes needs
+    none.
+*/
+static void
+endMember(PrivState* ps)
+{
+    int n_bits;
+
+    if (!ps->hasent)
+    {
+        return;
+    }
+
+    if (!ps->flushed)
+    {
+        outputPrefix(ps);
+    }
+
+    // The decoder adds an entry for the last code before it reads the CLEAR.
+    if (ps->stcode)
+    {
+        ++ps->free_ent;
+    }
+
+    widenCodes(ps);
+    n_bits = ps->n_bits;
+
+    if (ps->maxbits > BITS)
+    {
+        outputWide(ps->outbuf, ps->outbits, CLEAR, n_bits);
+    }
+    else
+    {
+        output(ps->outbuf, ps->outbits, CLEAR, n_bits);
+    }
+
+    ++ps->stats.codes;
+    recordClear(ps, ps->bytes_in);
+
+    ps->boff = ps->outbits = (ps->outbits-1)+((n_bits<<3)-
+                    ((ps->outbits-ps->boff-1+(n_bits<<3))%(n_bits<<3)));
+    ps->hasent = 0;
+}
+
+
+
+/*  Write all complete bytes in outbuf and move the partial byte, if any,
+    down to the start.
+*/
+static NCompressError
+writeCompleteBytes(NCompressCtxt* ctxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    int         num = ps->outbits >> 3;
+
+    if (num == 0)
+    {
+        return NCMP_OK;
+    }
+
+    ps->bytes_out += num;
+
+    if (callWriter(ctxt, ps->outbuf, num) != num)
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    ps->outbits -= num << 3;
+    ps->boff     = -(((num<<3)-ps->boff)%(ps->n_bits<<3));
+
+    ps->outbuf[0] = ps->outbuf[num];
+    memset(ps->outbuf+1, '\0', num + 2);
+    return NCMP_OK;
+}
+
+
+
+static NCompressError
+compressWrite(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    int         probes = (ps->statFlags & NCMP_STATS_PROBES) != 0;
+    size_t      piece = ps->crcOn ? CRCPIECE : (1 << 30);
+
+    if (!ps->started)
+    {
+        beginCompress(ctxt);
+    }
+
+    while (numBytes > 0)
+    {
+        int             n = (numBytes > piece) ? (int)piece : (int)numBytes;
+        NCompressError  err;
+
+        if (ps->memberSize > 0)
+        {
+            if (ps->memberIn >= ps->memberSize)
+            {
+                endMember(ps);
+
+                if ((err = writeCompleteBytes(ctxt)) != NCMP_OK)
+                {
+                    return err;
+                }
+
+                beginMember(ps, 0);
+            }
+
+            if (n > ps->memberSize - ps->memberIn)
+            {
+                n = (int)(ps->memberSize - ps->memberIn);
+            }
+
+            ps->memberIn += n;
+        }
+
+        if (ps->crcOn)
+        {
+            updateCrc(ps, bytes, n);
+        }
+
+        if (ps->maxbits > BITS)
+            err = compressWide(ctxt, bytes, n);
+        else
+        if (ps->dict == NCMP_DICT_TAGGED)
+            err = probes ? compressBlock(ctxt, 1, 1, bytes, n) :
+                           compressBlock(ctxt, 1, 0, bytes, n);
+        else
+            err = probes ? compressBlock(ctxt, 0, 1, bytes, n) :
+                           compressBlock(ctxt, 0, 0, bytes, n);
+
+        if (err != NCMP_OK)
+        {
+            return err;
+        }
+
+        bytes    += n;
+        numBytes -= n;
+    }
+
+    return NCMP_OK;
+}
+
+
+
+static NCompressError
+compressFlush(NCompressCtxt* ctxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+
+    if (!ps->started)
+    {
+        beginCompress(ctxt);
+    }
+
+    if (ps->hasent && !ps->flushed)
+    {
+        outputPrefix(ps);
+        ps->flushed = 1;
+    }
+
+    return writeCompleteBytes(ctxt);
+}
+
+
+
+static NCompressError
+compressEnd(NCompressCtxt* ctxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    int         num;
+
+    if (!ps->started)
+    {
+        beginCompress(ctxt);
+    }
+
+    if (ps->memberSize > 0)
+    {
+        endMember(ps);
+    }
+    else
+    if (ps->hasent && !ps->flushed)
+    {
+        outputPrefix(ps);
+    }
+
+    ps->started = 0;
+    num = (ps->outbits+7)>>3;
+
+    ps->bytes_out += num;
+
+    if (callWriter(ctxt, ps->outbuf, num) != num)
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    return NCMP_OK;
+}
+
+
+
+static NCompressError
+compressStream(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err;
+    int             rsize;
+
+    beginCompress(ctxt);
+
+    while ((rsize = callReader(ctxt, ps->inbuf, IBUFSIZ)) > 0)
+    {
+        if ((err = compressWrite(ctxt, ps->inbuf, rsize)) != NCMP_OK)
+        {
+            return err;
+        }
+    }
+
+    if (rsize < 0)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    return compressEnd(ctxt);
+}
+
+
+
+/*  The public entry points time the calls for the statistics.
+*/
+NCompressError
+nCompressWrite(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err = compressWrite(ctxt, bytes, numBytes);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nCompressFlush(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err = compressFlush(ctxt);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nCompressEnd(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err = compressEnd(ctxt);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nCompress(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err = ps->pipeBlocks ? compressPipelined(ctxt) : compressStream(ctxt);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+/*
+    The decompressor unpacks the codes in a separate pass before it walks
+    the string table. Between width changes and CLEARs all of the codes
+    have n_bits bits and they are laid out in groups of 8 codes which
+    fill exactly n_bits bytes, since the compressor pads to the group
+    boundary whenever it changes the width.  So the position of each code
+    within a group is fixed and a group can be unpacked with a single
+    shuffle and a variable shift on x86.
+
+    The unpackers take the bit position of the first code and the number
+    of codes to unpack.  They may read up to 16 bytes past a group but
+    never past the end of inbuf.
+*/
+
+typedef void (*CodeUnpacker)(const Byte* inbuf, int posbits, int n_bits,
+                             int num, uint16_t* codes);
+
+
+static void
+unpackCodesScalar(const Byte* inbuf, int posbits, int n_bits, int num, uint16_t* codes)
+{
+    int     bitmask = (1<<n_bits)-1;
+    int     k;
+
+    for (k = 0; k < num; ++k)
+    {
+        long    code;
+
+        input(inbuf, posbits, code, n_bits, bitmask);
+        codes[k] = (uint16_t)code;
+    }
+}
+
+
+#ifdef NCMP_X86_SIMD
+
+/*  For each width, the byte shuffle that moves the three bytes under
+    each code of a group into a 32 bit lane and the shift that then
+    brings the code down to bit 0.  Both 128 bit halves of the AVX2
+    shuffle are filled the same way since the shuffle works per half.
+*/
+static Byte     unpackShuf[BITS+1][32];
+static uint32_t unpackShift[BITS+1][8];
+
+
+static void
+initUnpackTables()
+{
+    int     n;
+    int     i;
+    int     j;
+
+    for (n = INIT_BITS; n <= BITS; ++n)
+    {
+        for (i = 0; i < 8; ++i)
+        {
+            int b = (i * n) >> 3;
+
+            for (j = 0; j < 4; ++j)
+            {
+                int x = (j < 3 && b + j < 16) ? b + j : 0x80;
+
+                unpackShuf[n][(i & 3) * 4 + j + (i & 4) * 4] = (Byte)x;
+            }
+
+            unpackShift[n][i] = (uint32_t)((i * n) & 0x7);
+        }
+    }
+}
+
+
+
+__attribute__((target("avx2")))
+static void
+unpackCodesAVX2(const Byte* inbuf, int posbits, int n_bits, int num, uint16_t* codes)
+{
+    int     k = 0;
+
+    // Reach a group boundary first.
+    while (k < num && (posbits % (n_bits<<3)) != 0)
+    {
+        unpackCodesScalar(inbuf, posbits, n_bits, 1, codes + k);
+        posbits += n_bits;
+        ++k;
+    }
+
+    {
+        const Byte*  end   = inbuf + IBUFSIZ_ALL - 16;
+        const Byte*  g     = inbuf + (posbits >> 3);
+        __m256i      shuf  = _mm256_loadu_si256((const __m256i*)unpackShuf[n_bits]);
+        __m256i      shift = _mm256_loadu_si256((const __m256i*)unpackShift[n_bits]);
+        __m256i      mask  = _mm256_set1_epi32((1<<n_bits)-1);
+
+        while (k + 8 <= num && g <= end)
+        {
+            __m128i  in = _mm_loadu_si128((const __m128i*)g);
+            __m256i  v  = _mm256_broadcastsi128_si256(in);
+
+            v = _mm256_shuffle_epi8(v, shuf);
+            v = _mm256_srlv_epi32(v, shift);
+            v = _mm256_and_si256(v, mask);
+            v = _mm256_packus_epi32(v, v);
+            v = _mm256_permute4x64_epi64(v, 0x08);
+
+            _mm_storeu_si128((__m128i*)(codes + k), _mm256_castsi256_si128(v));
+
+            g += n_bits;
+            k += 8;
+            posbits += n_bits<<3;
+        }
+    }
+
+    unpackCodesScalar(inbuf, posbits, n_bits, num - k, codes + k);
+}
+
+
+
+/*  Without AVX2 there is no variable shift.  Multiplying by 2^(8-shift)
+    and then shifting down by 8 does the same job on 24 bit values.
+*/
+__attribute__((target("sse4.1")))
+static void
+unpackCodesSSE4(const Byte* inbuf, int posbits, int n_bits, int num, uint16_t* codes)
+{
+    int     k = 0;
+
+    while (k < num && (posbits % (n_bits<<3)) != 0)
+    {
+        unpackCodesScalar(inbuf, posbits, n_bits, 1, codes + k);
+        posbits += n_bits;
+        ++k;
+    }
+
+    {
+        const Byte*  end   = inbuf + IBUFSIZ_ALL - 16;
+        const Byte*  g     = inbuf + (posbits >> 3);
+        __m128i      shufLo = _mm_loadu_si128((const __m128i*)unpackShuf[n_bits]);
+        __m128i      shufHi = _mm_loadu_si128((const __m128i*)(unpackShuf[n_bits] + 16));
+        __m128i      mulLo;
+        __m128i      mulHi;
+        __m128i      mask  = _mm_set1_epi32((1<<n_bits)-1);
+        const uint32_t* sh = unpackShift[n_bits];
+
+        mulLo = _mm_setr_epi32(1 << (8 - sh[0]), 1 << (8 - sh[1]),
+                               1 << (8 - sh[2]), 1 << (8 - sh[3]));
+        mulHi = _mm_setr_epi32(1 << (8 - sh[4]), 1 << (8 - sh[5]),
+                               1 << (8 - sh[6]), 1 << (8 - sh[7]));
+
+        while (k + 8 <= num && g <= end)
+        {
+            __m128i  in = _mm_loadu_si128((const __m128i*)g);
+            __m128i  lo = _mm_shuffle_epi8(in, shufLo);
+            __m128i  hi = _mm_shuffle_epi8(in, shufHi);
+
+            lo = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(lo, mulLo), 8), mask);
+            hi = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(hi, mulHi), 8), mask);
+
+            _mm_storeu_si128((__m128i*)(codes + k), _mm_packus_epi32(lo, hi));
+
+            g += n_bits;
+            k += 8;
+            posbits += n_bits<<3;
+        }
+    }
+
+    unpackCodesScalar(inbuf, posbits, n_bits, num - k, codes + k);
+}
+
+#endif // NCMP_X86_SIMD
+
+
+
+static CodeUnpacker unpackCodes = NULL;
+static pthread_once_t unpackOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+pickUnpacker()
+{
+#ifdef NCMP_X86_SIMD
+    initUnpackTables();
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        unpackCodes = unpackCodesAVX2;
+        return;
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        unpackCodes = unpackCodesSSE4;
+        return;
+    }
+#endif
+
+    unpackCodes = unpackCodesScalar;
+}
+
+
+
+//  Contexts may be set up on several threads at once.
+static void
+chooseUnpacker()
+{
+    pthread_once(&unpackOnce, pickUnpacker);
+}
+
+
+
+/*  Start a new stream.  The header is read by the first call to
+    decompressBlock().
+*/
+static void
+beginDecompress(PrivState* ps)
+{
+    ps->dstate    = DS_HEADER;
+    ps->derror    = NCMP_OK;
+    ps->maxbits   = 0;              // until the header gives it
+    ps->pending   = 0;
+    ps->insize    = 0;
+    ps->feeding   = 0;
+    ps->feedEnd   = 0;
+    ps->bytes_in  = 0;
+    ps->bytes_out = 0;
+    ps->crc       = 0;
+
+    resetStats(ps);
+}
+
+
+
+/*  Read from the reader or else from the pushed input.  Without
+    pushed input this returns READ_WAIT until the end is pushed.
+*/
+static int
+readInput(NCompressCtxt* ctxt, Byte* bytes, size_t numBytes)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+
+    if (!ps->feeding)
+    {
+        return (int)callReader(ctxt, bytes, numBytes);
+    }
+
+    if (ps->feedLen == 0)
+    {
+        return ps->feedEnd ? 0 : READ_WAIT;
+    }
+
+    if (numBytes > ps->feedLen)
+    {
+        numBytes = ps->feedLen;
+    }
+
+    memcpy(bytes, ps->feed, numBytes);
+    ps->feed    += numBytes;
+    ps->feedLen -= numBytes;
+    return (int)numBytes;
+}
+
+
+
+static NCompressError
+readHeader(NCompressCtxt* ctxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    code_int    code;
+    int         insize;
+    int         rsize = 0;
+
+    if (ps->dstate == DS_MEMBER)
+    {
+        // The header of the next member is at posbits.
+        int o = ((ps->posbits>>3) < ps->insize) ? ps->posbits>>3 : ps->insize;
+
+        memmove(ps->inbuf, ps->inbuf + o, ps->insize - o);
+        ps->insize -= o;
+        ps->dstate  = DS_HEADER;
+        rsize       = ps->rsize;
+    }
+
+    insize = ps->insize;
+
+    while (insize < 3 && (rsize = readInput(ctxt, ps->inbuf + insize, IBUFSIZ)) > 0)
+    {
+        insize += rsize;
+    }
+
+    if (rsize == READ_WAIT)
+    {
+        // The header is read again when more input is pushed.
+        ps->bytes_in += insize - ps->insize;
+        ps->insize    = insize;
+        return NCMP_OK;
+    }
+
+    if (insize < 3 || ps->inbuf[0] != MAGIC_1 || ps->inbuf[1] != MAGIC_2)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    ps->maxbits    = ps->inbuf[2] & BIT_MASK;
+    ps->block_mode = ps->inbuf[2] & BLOCK_MODE;
+
+    ps->maxmaxcode = MAXCODE(ps->maxbits);
+
+    // No compressor writes these, and their table can't hold a code.
+    if (ps->maxbits < INIT_BITS)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (ps->maxbits > BITS)
+    {
+        if (ps->maxbits > ps->wideBits)
+        {
+            return NCMP_BITS_ERROR;
+        }
+
+        if (ps->inbuf[2] & PRESET)
+        {
+            return NCMP_DATA_ERROR;
+        }
+
+        if (!allocWide(ps, ps->maxbits))
+        {
+            return NCMP_OTHER_ERROR;
+        }
+    }
+
+    ps->presetEnd = FIRST;
+
+    if (ps->inbuf[2] & PRESET)
+    {
+        if (!ps->block_mode)
+        {
+            return NCMP_DATA_ERROR;
+        }
+
+        if (!ps->presetLen)
+        {
+            return NCMP_PRESET_ERROR;
+        }
+
+        ps->presetEnd = presetEndOf(ps);
+    }
+
+    ps->bytes_in += insize - ps->insize;
+    ps->insize    = insize;
+    ps->rsize     = rsize;
+    ps->n_bits    = presetBits(ps);
+    ps->maxcode  = presetMaxcode(ps, ps->n_bits);
+    ps->oldcode  = -1;
+    ps->finchar  = 0;
+    ps->posbits  = 3<<3;
+
+    ps->free_ent = ((ps->block_mode) ? ps->presetEnd : 256);
+
+    clear_tab_prefixof(ps);   // As above, initialize the first 256 entries in the table.
+
+    for (code = 255 ; code >= 0 ; --code) 
+    {
+        tab_suffixof(ps, code) = (Byte)code;
+        tab_lenof(ps, code) = 1;
+    }
+
+    /*  Nothing but the preset itself writes below presetEnd, so one
+        already in the table from an earlier stream is kept.
+    */
+    if (ps->primed < ps->presetEnd)
+    {
+        for (code = FIRST; code < ps->presetEnd; ++code)
+        {
+            tab_prefixof(ps, code) = ps->presetPrefix[code - FIRST];
+            tab_suffixof(ps, code) = ps->presetChar[code - FIRST];
+            tab_lenof(ps, code) = (unsigned short)(tab_lenof(ps, tab_prefixof(ps, code)) + 1);
+        }
+    }
+
+    ps->primed = ps->presetEnd;
+    return NCMP_OK;
+}
+
+
+
+//======================================================================
+//  Searching
+//
+//  nSearch() runs the decoder without expanding the strings.  Along
+//  with the prefix, suffix and length of each code it keeps what a
+//  KMP matcher needs to know about the code's string S, after Amir,
+//  Benson and Farach:
+//
+//      node    the node of S in a trie of the substrings of the
+//              pattern P, or NOTFOUND if S isn't a substring of P
+//      suf     the KMP state after S, starting from state 0
+//      hit     the longest prefix of S, as a code, which ends with P
+//      psl     the length of the longest prefix of S which is a proper
+//              suffix of P
+//      first   the first byte of S
+//
+//  Each of these is found from the prefix code and the new byte in
+//  constant time.  When a code arrives in KMP state q, the matches
+//  which start before S end within its first psl bytes, which are the
+//  last psl bytes of P, so the matcher only steps through those.  The
+//  matches inside S are found through hit.  The new state is suf
+//  unless S is a substring of P, in which case the matcher steps
+//  through S, which is at most m bytes.
+
+#define SEARCHNODES     (1 + NCMP_SEARCH_MAX * (NCMP_SEARCH_MAX + 1) / 2)
+#define NOTFOUND        0xFFFF
+#define NOHIT           (-1)
+
+
+typedef struct searchState
+{
+    int             mode;
+    int             m;
+    Byte            pat[NCMP_SEARCH_MAX];
+    int             failm;          // the state after a whole match
+    Byte            dfa[NCMP_SEARCH_MAX][256];
+
+    // The trie of substrings of the pattern.
+    int             numNodes;
+    uint16_t        child[SEARCHNODES];
+    uint16_t        sibling[SEARCHNODES];
+    Byte            nodeCh[SEARCHNODES];
+    Byte            nodeEnd[SEARCHNODES];   // where the string ends in pat
+    Byte            nodeSuffix[SEARCHNODES];
+
+    // For each code.
+    uint16_t        node[1 << BITS];
+    Byte            suf[1 << BITS];
+    Byte            psl[1 << BITS];
+    Byte            first[1 << BITS];
+    int32_t         hit[1 << BITS];
+    int32_t         nl[1 << BITS];          // newlines, for NCMP_SEARCH_LINES
+    int32_t         lastNl[1 << BITS];      // offset of the last one or -1
+
+    int             q;              // the KMP state
+    int64_t         line;           // newlines before the current code
+    int64_t         lineStart;
+    int64_t         lastLine;       // the last line reported
+    int64_t         found;
+    int             stop;
+
+    NCmpMatchHandler    handler;
+    void*               matchCtxt;
+
+    int32_t         hits[1 << BITS];    // for reporting in order
+
+} SearchState;
+
+
+
+static unsigned
+trieChild(const SearchState* sr, unsigned node, Byte ch)
+{
+    unsigned    n;
+
+    for (n = sr->child[node]; n != NOTFOUND; n = sr->sibling[n])
+    {
+        if (sr->nodeCh[n] == ch)
+        {
+            return n;
+        }
+    }
+
+    return NOTFOUND;
+}
+
+
+
+static void
+initSearch(SearchState* sr, const Byte* pattern, int m, int mode,
+           NCmpMatchHandler handler, void* matchCtxt)
+{
+    int     i;
+    int     j;
+    int     x;
+    int     c;
+
+    memcpy(sr->pat, pattern, m);
+    sr->m         = m;
+    sr->mode      = mode;
+    sr->handler   = handler;
+    sr->matchCtxt = matchCtxt;
+    sr->q         = 0;
+    sr->line      = 0;
+    sr->lineStart = 0;
+    sr->lastLine  = -1;
+    sr->found     = 0;
+    sr->stop      = 0;
+
+    // The KMP automaton.  A transition to m is a match.
+    memset(sr->dfa[0], 0, 256);
+    sr->dfa[0][pattern[0]] = 1;
+
+    for (x = 0, j = 1; j < m; ++j)
+    {
+        memcpy(sr->dfa[j], sr->dfa[x], 256);
+        sr->dfa[j][pattern[j]] = (Byte)(j + 1);
+        x = sr->dfa[x][pattern[j]];
+    }
+
+    sr->failm = x;
+
+    // Insert each suffix of the pattern into the trie.
+    sr->numNodes = 1;
+    sr->child[0] = NOTFOUND;
+
+    for (i = 0; i < m; ++i)
+    {
+        unsigned node = 0;
+
+        for (j = i; j < m; ++j)
+        {
+            unsigned n = trieChild(sr, node, pattern[j]);
+
+            if (n == NOTFOUND)
+            {
+                n = sr->numNodes++;
+                sr->child[n]      = NOTFOUND;
+                sr->sibling[n]    = sr->child[node];
+                sr->nodeCh[n]     = pattern[j];
+                sr->nodeEnd[n]    = (Byte)(j + 1);
+                sr->nodeSuffix[n] = 0;
+                sr->child[node]   = n;
+            }
+
+            node = n;
+        }
+
+        sr->nodeSuffix[node] = 1;
+    }
+
+    // The single byte codes.
+    for (c = 0; c < 256; ++c)
+    {
+        int t = sr->dfa[0][c];
+
+        sr->node[c]   = (uint16_t)trieChild(sr, 0, (Byte)c);
+        sr->suf[c]    = (Byte)(t == m ? sr->failm : t);
+        sr->hit[c]    = (t == m) ? c : NOHIT;
+        sr->psl[c]    = (m > 1 && c == pattern[m - 1]);
+        sr->first[c]  = (Byte)c;
+        sr->nl[c]     = (c == '\n');
+        sr->lastNl[c] = (c == '\n') ? 0 : -1;
+    }
+}
+
+
+
+/*  Add the code for the string of prefix followed by ch.  Its length
+    must already be in the table.
+*/
+static inline void
+searchAdd(PrivState* ps, SearchState* sr, code_int code, code_int prefix, Byte ch)
+{
+    int         t = sr->dfa[sr->suf[prefix]][ch];
+    unsigned    node = sr->node[prefix];
+    int         len = tab_lenof(ps, code);
+
+    if (node != NOTFOUND)
+    {
+        node = trieChild(sr, node, ch);
+    }
+
+    sr->node[code]  = (uint16_t)node;
+    sr->suf[code]   = (Byte)(t == sr->m ? sr->failm : t);
+    sr->hit[code]   = (t == sr->m) ? (int32_t)code : sr->hit[prefix];
+    sr->psl[code]   = (node != NOTFOUND && sr->nodeSuffix[node] && len < sr->m) ? (Byte)len : sr->psl[prefix];
+    sr->first[code] = sr->first[prefix];
+
+    if (sr->mode == NCMP_SEARCH_LINES)
+    {
+        sr->nl[code]     = sr->nl[prefix] + (ch == '\n');
+        sr->lastNl[code] = (ch == '\n') ? len - 1 : sr->lastNl[prefix];
+    }
+}
+
+
+
+/*  Add the codes of the preset, which are in the table before the first
+    code.
+*/
+static void
+searchPreset(PrivState* ps, SearchState* sr)
+{
+    code_int    code;
+
+    for (code = FIRST; code < ps->presetEnd; ++code)
+    {
+        searchAdd(ps, sr, code, tab_prefixof(ps, code), tab_suffixof(ps, code));
+    }
+}
+
+
+
+/*  Report a match which ends at end.  Lines holds the newlines before
+    it and lineStart the offset of its line.
+*/
+static void __attribute__((noinline))
+searchReport(SearchState* sr, int64_t end, int64_t lines, int64_t lineStart)
+{
+    NCompressMatch  match;
+
+    if (sr->mode == NCMP_SEARCH_LINES)
+    {
+        if (lines == sr->lastLine)
+        {
+            return;
+        }
+
+        sr->lastLine = lines;
+        match.offset = lineStart;
+        match.line   = lines + 1;
+    }
+    else
+    {
+        match.offset = end - sr->m;
+        match.line   = 0;
+    }
+
+    ++sr->found;
+
+    if ((sr->handler && sr->handler(&match, sr->matchCtxt) != 0) || sr->mode == NCMP_SEARCH_FIRST)
+    {
+        sr->stop = 1;
+    }
+}
+
+
+
+/*  Step the matcher through len bytes from pattern-like text s which
+    start at offset pos.  The bytes hold no newlines when counting lines.
+*/
+static void __attribute__((noinline))
+searchStep(SearchState* sr, const Byte* s, int len, int64_t pos, int crossing)
+{
+    int     q = sr->q;
+    int     i;
+
+    for (i = 0; i < len && !sr->stop && (q || !crossing); ++i)
+    {
+        int t = sr->dfa[q][s[i]];
+
+        if (t == sr->m)
+        {
+            searchReport(sr, pos + i + 1, sr->line, sr->lineStart);
+            t = sr->failm;
+        }
+
+        q = t;
+    }
+
+    sr->q = q;
+}
+
+
+
+/*  Report the matches inside the string of code, in order.
+*/
+static void __attribute__((noinline))
+searchHits(PrivState* ps, SearchState* sr, code_int code, int64_t pos)
+{
+    int     n = 0;
+    int32_t h;
+
+    for (h = sr->hit[code]; h != NOHIT; h = (h < 256) ? NOHIT : sr->hit[tab_prefixof(ps, h)])
+    {
+        sr->hits[n++] = h;
+    }
+
+    while (n > 0 && !sr->stop)
+    {
+        int64_t lines = sr->line;
+        int64_t start = sr->lineStart;
+
+        h = sr->hits[--n];
+
+        if (sr->mode == NCMP_SEARCH_LINES)
+        {
+            lines += sr->nl[h];
+            start  = (sr->lastNl[h] >= 0) ? pos + sr->lastNl[h] + 1 : start;
+        }
+
+        searchReport(sr, pos + tab_lenof(ps, h), lines, start);
+    }
+}
+
+
+
+/*  Match the string of code, which starts at offset pos.
+*/
+static inline void
+searchCode(PrivState* ps, SearchState* sr, code_int code, int64_t pos)
+{
+    unsigned    node = sr->node[code];
+
+    if (node != NOTFOUND)
+    {
+        int len = tab_lenof(ps, code);
+
+        searchStep(sr, sr->pat + sr->nodeEnd[node] - len, len, pos, 0);
+    }
+    else
+    {
+        if (sr->q && sr->psl[code])
+        {
+            searchStep(sr, sr->pat + sr->m - sr->psl[code], sr->psl[code], pos, 1);
+        }
+
+        if (sr->hit[code] != NOHIT)
+        {
+            searchHits(ps, sr, code, pos);
+        }
+
+        sr->q = sr->suf[code];
+    }
+
+    if (sr->mode == NCMP_SEARCH_LINES && sr->nl[code])
+    {
+        sr->line     += sr->nl[code];
+        sr->lineStart = pos + sr->lastNl[code] + 1;
+    }
+}
+
+
+
+/*
+    Decompress into dst until it holds cap bytes or the input ends.  This
+    routine adapts to the codes in the file building the "string" table
+    on-the-fly; requiring no table to be stored in the compressed file.
+    The tables used herein are shared with those of the compress()
+    routine.  See the definitions above.
+
+    The length of each string is kept in the table so that a string can
+    be expanded backwards straight into dst.  Only a string which would
+    run past cap goes through de_stack, and the part of it that doesn't
+    fit waits there for the next call.  Fewer than cap bytes are returned
+    only at the end of the stream.
+
+    With search set the strings are matched by searchCode() instead of
+    expanded, and this runs to the end of the stream or the last match
+    wanted.  It is expanded for each case like compressBlock().
+*/
+
+static inline __attribute__((always_inline)) NCompressError
+expandBlock(NCompressCtxt* ctxt, const int search, Byte* dst, int cap, int* got)
+{
+    Byte        *stackp;
+    code_int    code;
+    int         finchar;
+    code_int    oldcode;
+    code_int    incode;
+    int         inbits;
+    int         posbits;
+    int         outpos;
+    int         insize;
+    code_int    free_ent;
+    code_int    maxcode;
+    code_int    maxmaxcode;
+    int         n_bits;
+    int         rsize;
+    long        ncodes = 0;
+    uint16_t    codes[CODEBATCH];
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    SearchState* sr = search ? ps->search : NULL;
+    NCompressError err = NCMP_OK;
+
+    outpos = 0;
+    *got = 0;
+
+    if (ps->dstate == DS_HEADER || ps->dstate == DS_MEMBER)
+    {
+        if ((err = readHeader(ctxt)) != NCMP_OK)
+        {
+            ps->dstate = DS_END;
+            ps->derror = err;
+            return err;
+        }
+
+        if (ps->insize < 3)
+        {
+            return NCMP_OK;
+        }
+
+        ps->dstate = DS_RESET;
+
+        if (search)
+        {
+            searchPreset(ps, sr);
+        }
+    }
+
+    if (ps->maxbits > BITS)
+    {
+        if (search)
+        {
+            // The search tables are sized for 16 bit codes.
+            ps->dstate = DS_END;
+            ps->derror = NCMP_BITS_ERROR;
+            return NCMP_BITS_ERROR;
+        }
+
+        return expandWide(ctxt, dst, cap, got);
+    }
+
+    if (ps->pending > 0)
+    {
+        // The rest of a string which didn't fit last time.
+        outpos = (ps->pending < cap) ? (int)ps->pending : cap;
+        memcpy(dst, de_stack(ps) - ps->pending, outpos);
+        ps->pending -= outpos;
+    }
+
+    if (ps->dstate == DS_END || outpos >= cap)
+    {
+        ps->bytes_out += outpos;
+
+        *got = outpos;
+        return ps->derror;
+    }
+
+    finchar    = ps->finchar;
+    oldcode    = ps->oldcode;
+    inbits     = ps->inbits;
+    posbits    = ps->posbits;
+    insize     = ps->insize;
+    free_ent   = ps->free_ent;
+    maxcode    = ps->maxcode;
+    maxmaxcode = ps->maxmaxcode;
+    n_bits     = ps->n_bits;
+    rsize      = ps->rsize;
+
+    if (ps->dstate == DS_CODES)
+    {
+        goto codes;
+    }
+
+    if (ps->dstate == DS_WAIT)
+    {
+        goto refill;
+    }
+
+    do
+    {
+resetbuf:   ;
+        {
+            int    i;
+            int    e;
+            int    o;
+
+            o = posbits >> 3;
+            e = (o <= insize) ? insize - o : 0;
+
+            for (i = 0 ; i < e ; ++i)
+            {
+                ps->inbuf[i] = ps->inbuf[i+o];
+            }
+
+            insize = e;
+            posbits = 0;
+        }
+
+refill:
+        if (insize < IBUFSIZ_ALL - IBUFSIZ)
+        {
+            rsize = readInput(ctxt, ps->inbuf + insize, IBUFSIZ);
+
+            if (rsize < 0 && rsize != READ_WAIT)
+            {
+                err = NCMP_READ_ERROR;
+                goto fail;
+            }
+
+            if (rsize > 0)
+            {
+                insize += rsize;
+                ps->bytes_in += rsize;
+            }
+        }
+
+        /*  While more input follows only whole groups are decoded.  At
+            the end, or when the pushed input has run out, every whole
+            code is, since nothing after it can change it.
+        */
+        inbits = ((rsize > 0) ? (insize - insize%n_bits)<<3 :
+                                (insize<<3)-(n_bits-1));
+
+codes:  while (inbits > posbits)
+        {
+            int     num;
+            int     k;
+
+            if (free_ent > maxcode)
+            {
+                int     next = ((posbits-1) + ((n_bits<<3) -
+                                     (posbits-1+(n_bits<<3))%(n_bits<<3)));
+
+                // The end of the group hasn't been pushed yet.
+                if (rsize == READ_WAIT && next > insize<<3)
+                {
+                    goto partial;
+                }
+
+                posbits = next;
+
+                ++n_bits;
+                if (n_bits == ps->maxbits)
+                    maxcode = maxmaxcode;
+                else
+                    maxcode = MAXCODE(n_bits)-1;
+
+                recordWiden(ps, n_bits, ps->bytes_out + outpos);
+                goto resetbuf;
+            }
+
+            /*  Another member may start after a CLEAR, or in place of the
+                first code.  Its magic would be the code 287 there, which
+                is past free_ent, so it can't be taken for a code.
+            */
+            if ((oldcode == -1 || (free_ent == FIRST - 1 && ps->block_mode)) &&
+                ps->presetEnd == FIRST && outpos < cap &&
+                ps->inbuf[posbits>>3] == MAGIC_1 && ps->inbuf[(posbits>>3)+1] == MAGIC_2)
+            {
+                ps->dstate = DS_MEMBER;
+                goto full;
+            }
+
+            /*  Unpack the codes up to the next width change, or to
+                where the table fills, in one go.  Every code but the
+                first adds a table entry so we can tell in advance where
+                free_ent will pass maxcode.
+            */
+            num = (inbits - posbits + n_bits - 1) / n_bits;
+
+            if (free_ent < maxmaxcode)
+            {
+                if (num > maxcode - free_ent + 1 + (oldcode == -1))
+                {
+                    num = (int)(maxcode - free_ent + 1 + (oldcode == -1));
+                }
+            }
+            else
+            if (ps->fullAt < 0)
+            {
+                recordFull(ps, n_bits, ps->bytes_out + outpos);
+            }
+
+            if (num > CODEBATCH)
+            {
+                num = CODEBATCH;
+            }
+
+            unpackCodes(ps->inbuf, posbits, n_bits, num, codes);
+
+            for (k = 0; k < num; ++k)
+            {
+                long    len;
+
+                if (outpos >= cap)
+                {
+                    // The rest of the batch is unpacked again next time.
+                    ps->dstate = DS_CODES;
+                    goto full;
+                }
+
+                code = codes[k];
+                posbits += n_bits;
+                ++ncodes;
+
+                // Only a preset has strings to start with.
+                if (oldcode == -1 && (code < FIRST || code >= free_ent))
+                {
+                    if (code >= 256) {
+#if 0
+                        fprintf(stderr, "oldcode:-1 code:%i\n", (int)(code));
+                        fprintf(stderr, "uncompress: corrupt input\n");
+#endif
+                        err = NCMP_DATA_ERROR;
+                        goto fail;
+                    }
+
+                    if (search)
+                    {
+                        searchCode(ps, sr, code, ps->bytes_out++);
+                        finchar = (int)(oldcode = code);
+
+                        if (sr->stop)
+                        {
+                            ps->dstate = DS_END;
+                            goto full;
+                        }
+
+                        continue;
+                    }
+
+                    dst[outpos++] = (Byte)(finchar = (int)(oldcode = code));
+                    continue;
+                }
+
+                if (code == CLEAR && ps->block_mode)
+                {
+                    int     next = ((posbits-1) + ((n_bits<<3) -
+                                         (posbits-1+(n_bits<<3))%(n_bits<<3)));
+
+                    // As above.  The CLEAR is read again with the rest.
+                    if (rsize == READ_WAIT && next > insize<<3)
+                    {
+                        posbits -= n_bits;
+                        --ncodes;
+                        goto partial;
+                    }
+
+                    clear_tab_prefixof(ps);
+                    free_ent = FIRST - 1;
+                    posbits = next;
+                    maxcode = MAXCODE(n_bits = INIT_BITS)-1;
+
+                    if (ps->presetEnd > FIRST)
+                    {
+                        // Back to the preset, with no string to extend.
+                        free_ent = ps->presetEnd;
+                        oldcode  = -1;
+                        n_bits   = presetBits(ps);
+                        maxcode  = presetMaxcode(ps, n_bits);
+                    }
+
+                    recordClear(ps, ps->bytes_out + outpos);
+                    goto resetbuf;
+                }
+
+                incode = code;
+
+                if (code >= free_ent)   /* Special case for KwKwK string.   */
+                {
+                    if (code > free_ent)
+                    {
+#if 0
+                        Byte *p;
+
+                        posbits -= n_bits;
+                        p = &ps->inbuf[posbits>>3];
+
+                        fprintf(stderr, "insize:%d posbits:%d inbuf:%02X %02X %02X %02X %02X (%d)\n", insize, posbits,
+                                p[-1],p[0],p[1],p[2],p[3], (posbits&07));
+                        fprintf(stderr, "uncompress: corrupt input\n");
+#endif
+                        err = NCMP_DATA_ERROR;
+                        goto fail;
+                    }
+
+                    len = tab_lenof(ps, oldcode) + 1;
+                }
+                else
+                {
+                    len = tab_lenof(ps, code);
+                }
+
+                if (search)
+                {
+                    int fc = sr->first[(code >= free_ent) ? oldcode : code];
+
+                    if ((code = free_ent) < maxmaxcode && oldcode != -1)
+                    {
+                        tab_prefixof(ps, code) = (unsigned short)oldcode;
+                        tab_suffixof(ps, code) = (Byte)fc;
+                        tab_lenof(ps, code) = (unsigned short)(tab_lenof(ps, oldcode) + 1);
+                        searchAdd(ps, sr, code, oldcode, (Byte)fc);
+                        free_ent = code+1;
+                    }
+
+                    // A code of the full table which it never added.
+                    if (incode >= free_ent)
+                    {
+                        err = NCMP_DATA_ERROR;
+                        goto fail;
+                    }
+
+                    searchCode(ps, sr, incode, ps->bytes_out);
+                    ps->bytes_out += len;
+                    finchar = fc;
+                    oldcode = incode;
+
+                    if (sr->stop)
+                    {
+                        ps->dstate = DS_END;
+                        goto full;
+                    }
+
+                    continue;
+                }
+
+                // Generate the string in reverse order where it will end.
+                stackp = (len <= cap - outpos) ? dst + outpos + len : de_stack(ps);
+
+                if (code >= free_ent)
+                {
+                    *--stackp = (Byte)finchar;
+                    code = oldcode;
+                }
+
+                while ((cmp_code_int)code >= (cmp_code_int)256)
+                {
+                    *--stackp = tab_suffixof(ps, code);
+                    code = tab_prefixof(ps, code);
+                }
+
+                *--stackp = (Byte)(finchar = tab_suffixof(ps, code));
+
+                if (len <= cap - outpos)
+                {
+                    outpos += len;
+                }
+                else
+                {
+                    int    i = cap - outpos;
+
+                    memcpy(dst + outpos, stackp, i);
+                    outpos = cap;
+                    ps->pending = len - i;
+                }
+
+                if ((code = free_ent) < maxmaxcode && oldcode != -1) /* Generate the new entry. */
+                {
+                    tab_prefixof(ps, code) = (unsigned short)oldcode;
+                    tab_suffixof(ps, code) = (Byte)finchar;
+                    tab_lenof(ps, code) = (unsigned short)(tab_lenof(ps, oldcode) + 1);
+                    free_ent = code+1;
+                }
+
+                oldcode = incode;   /* Remember previous code.  */
+            }
+        }
+
+partial:
+        if (rsize == READ_WAIT || (rsize > 0 && posbits > inbits))
+        {
+            /*  Part of the last group is decoded.  Keep the group and
+                add the rest of the input to it, since the buffer has to
+                start on a group boundary.
+            */
+            int    o = posbits / (n_bits<<3) * n_bits;
+
+            memmove(ps->inbuf, ps->inbuf + o, insize - o);
+            insize  -= o;
+            posbits -= o<<3;
+
+            if (rsize == READ_WAIT)
+            {
+                ps->dstate = DS_WAIT;
+                goto full;
+            }
+
+            goto refill;
+        }
+    }
+    while (rsize > 0);
+
+    ps->dstate = DS_END;
+
+full:
+    ps->finchar    = finchar;
+    ps->oldcode    = oldcode;
+    ps->inbits     = inbits;
+    ps->posbits    = posbits;
+    ps->insize     = insize;
+    ps->free_ent   = free_ent;
+    ps->maxcode    = maxcode;
+    ps->n_bits     = n_bits;
+    ps->rsize      = rsize;
+    ps->bytes_out += outpos;
+    ps->stats.codes += ncodes;
+
+    *got = outpos;
+    return NCMP_OK;
+
+fail:
+    ps->dstate = DS_END;
+    ps->derror = err;
+    ps->bytes_out += outpos;
+    ps->stats.codes += ncodes;
+
+    *got = outpos;
+    return err;
+}
+
+
+
+static NCompressError
+expandOutput(NCompressCtxt* ctxt, Byte* dst, int cap, int* got)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err;
+    int             n;
+
+    err = expandBlock(ctxt, 0, dst, cap, got);
+
+    // Go on into the next member, which may have other bits.
+    while (err == NCMP_OK && ps->dstate == DS_MEMBER && *got < cap)
+    {
+        err = expandBlock(ctxt, 0, dst + *got, cap - *got, &n);
+        *got += n;
+    }
+
+    return err;
+}
+
+
+
+/*  How many more bytes the limits let through, which is negative once
+    one has been passed.
+*/
+static int64_t
+limitRoom(PrivState* ps)
+{
+    const NCompressLimits*  lim = &ps->limits;
+    int64_t                 room = INT64_MAX;
+
+    if (lim->maxOutput > 0 && lim->maxOutput - ps->bytes_out < room)
+    {
+        room = lim->maxOutput - ps->bytes_out;
+    }
+
+    if (lim->maxWork > 0 && lim->maxWork - ps->callWork < room)
+    {
+        room = lim->maxWork - ps->callWork;
+    }
+
+    if (lim->maxRatio > 0 && ps->bytes_in < INT64_MAX / lim->maxRatio &&
+        lim->maxRatio * ps->bytes_in - ps->bytes_out < room)
+    {
+        room = lim->maxRatio * ps->bytes_in - ps->bytes_out;
+    }
+
+    return room;
+}
+
+
+
+/*  Expand with limits.  The output is asked for in pieces of at most
+    one byte more than the room left, so a piece passes a limit by one
+    byte at most.  That byte is dropped and the stream ends.  Input read
+    during a piece gives the ratio more room for the next one.
+*/
+static NCompressError
+limitBlock(NCompressCtxt* ctxt, Byte* dst, int cap, int* got)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err = NCMP_OK;
+    int             n;
+
+    *got = 0;
+
+    while (*got < cap)
+    {
+        int64_t room = limitRoom(ps);
+        int     piece = cap - *got;
+
+        if (room < 0)
+        {
+            // Limits lowered part way through a stream.
+            goto over;
+        }
+
+        if (room < piece)
+        {
+            piece = (int)room + 1;
+        }
+
+        err = expandOutput(ctxt, dst + *got, piece, &n);
+        ps->callWork += n;
+        *got += n;
+
+        if ((room = limitRoom(ps)) < 0)
+        {
+            *got          += (int)room;
+            ps->bytes_out += room;
+            goto over;
+        }
+
+        if (err != NCMP_OK || n < piece)
+        {
+            break;
+        }
+    }
+
+    return err;
+
+over:
+    ps->pending = 0;
+    ps->dstate  = DS_END;
+    ps->derror  = NCMP_LIMIT_ERROR;
+    return NCMP_LIMIT_ERROR;
+}
+
+
+
+static NCompressError
+decompressBlock(NCompressCtxt* ctxt, Byte* dst, int cap, int* got)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err;
+
+    if (ps->limited)
+        err = limitBlock(ctxt, dst, cap, got);
+    else
+        err = expandOutput(ctxt, dst, cap, got);
+
+    if (ps->crcOn && *got > 0)
+    {
+        updateCrc(ps, dst, *got);
+    }
+
+    return err;
+}
+
+
+
+static NCompressError
+searchBlock(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err;
+    int             got;
+
+    do
+    {
+        err = expandBlock(ctxt, 1, NULL, 1, &got);
+    }
+    while (err == NCMP_OK && ps->dstate == DS_MEMBER);
+
+    return err;
+}
+
+
+
+//  Only for a new context, since ctxt->priv can't be trusted before this.
+void
+nDecompressOpen(NCompressCtxt* ctxt)
+{
+    nInitDecompress(ctxt);
+}
+
+
+
+void
+nResetCompress(NCompressCtxt* ctxt)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    if (!ps)
+    {
+        return;
+    }
+
+    if (ps->expanding)
+    {
+        beginDecompress(ps);
+    }
+    else
+    {
+        ps->started = 0;
+    }
+}
+
+
+
+static NCompressError
+decompressRead(NCompressCtxt* ctxt, Byte* bytes, size_t numBytes, size_t* numRead)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    size_t      piece = ps->crcOn ? CRCPIECE : (1 << 30);
+
+    *numRead = 0;
+
+    while (numBytes > 0)
+    {
+        int             n = (numBytes > piece) ? (int)piece : (int)numBytes;
+        int             got;
+        NCompressError  err;
+
+        err = decompressBlock(ctxt, bytes, n, &got);
+
+        *numRead += got;
+        bytes    += got;
+        numBytes -= got;
+
+        if (err != NCMP_OK || got < n)
+        {
+            return err;
+        }
+    }
+
+    return NCMP_OK;
+}
+
+
+
+/*
+    Decompress stdin to stdout.  The output goes to the writer a buffer
+    at a time.
+*/
+
+static NCompressError
+decompressStream(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    NCompressError  err;
+    int             got;
+
+    beginDecompress(ps);
+
+    do
+    {
+        // The output up to an error is written, as with a pipeline.
+        err = decompressBlock(ctxt, ps->outbuf, OBUFSIZ, &got);
+
+        if (got > 0 && callWriter(ctxt, ps->outbuf, got) != got)
+        {
+            return NCMP_WRITE_ERROR;
+        }
+
+        if (err != NCMP_OK)
+        {
+            return err;
+        }
+    }
+    while (got == OBUFSIZ);
+
+    return NCMP_OK;
+}
+
+
+
+NCompressError
+nDecompressRead(NCompressCtxt* ctxt, Byte* bytes, size_t numBytes, size_t* numRead)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err;
+
+    ps->callWork = 0;
+    err = decompressRead(ctxt, bytes, numBytes, numRead);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nDecompressPush(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes, size_t* numUsed,
+                Byte* out, size_t outSize, size_t* numOut)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err;
+
+    ps->callWork = 0;
+
+    ps->feeding = 1;
+    ps->feedEnd = (bytes == NULL);
+    ps->feed    = bytes;
+    ps->feedLen = bytes ? numBytes : 0;
+
+    err = decompressRead(ctxt, out, outSize, numOut);
+
+    *numUsed    = bytes ? numBytes - ps->feedLen : 0;
+    ps->feed    = NULL;
+    ps->feedLen = 0;
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nDecompressBuffer(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes,
+                  Byte* out, size_t outSize, size_t* numOut)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err;
+    Byte            more;
+    size_t          got;
+
+    ps->callWork = 0;
+    beginDecompress(ps);
+
+    // All of the input is pushed at once.
+    ps->feeding = 1;
+    ps->feedEnd = 1;
+    ps->feed    = bytes;
+    ps->feedLen = numBytes;
+
+    err = decompressRead(ctxt, out, outSize, numOut);
+
+    if (err == NCMP_OK && *numOut == outSize)
+    {
+        // The stream may end just there.
+        err = decompressRead(ctxt, &more, 1, &got);
+
+        if (err == NCMP_OK && got > 0)
+        {
+            err = NCMP_LIMIT_ERROR;
+        }
+    }
+
+    ps->feed    = NULL;
+    ps->feedLen = 0;
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nDecompress(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start = enterCall(ps);
+    NCompressError  err;
+
+    ps->callWork = 0;
+    err = ps->pipeBlocks ? decompressPipelined(ctxt) : decompressStream(ctxt);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+/*  Search the stream from the reader.  See "Searching" above.
+*/
+NCompressError
+nSearch(NCompressCtxt* ctxt, const Byte* pattern, size_t patternLen, NCompressSearchMode mode,
+        NCmpMatchHandler handler, void* matchCtxt, int64_t* numFound)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start;
+    SearchState*    sr;
+    NCompressError  err;
+
+    *numFound = 0;
+
+    if (!ps || patternLen == 0 || patternLen > NCMP_SEARCH_MAX ||
+        (mode == NCMP_SEARCH_LINES && memchr(pattern, '\n', patternLen)))
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if ((sr = (SearchState*)malloc(sizeof(SearchState))) == NULL)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    start = enterCall(ps);
+    initSearch(sr, pattern, (int)patternLen, mode, handler, matchCtxt);
+    beginDecompress(ps);
+
+    ps->search = sr;
+    err = searchBlock(ctxt);
+    ps->search = NULL;
+
+    *numFound = sr->found;
+    free(sr);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+//======================================================================
+//  Extended codes
+//
+//  Codes of 17 to 24 bits follow the format of 16 bit codes with the
+//  widths going on up to maxbits, so only the bits in the header mark
+//  such a stream and other decompressors reject it as having too many
+//  bits.  They have simpler loops of their own, which keeps the tuned
+//  loops above to 16 bits and their tables in shorts.  The tables are
+//  allocated for the widest stream so far and kept.
+
+static int
+allocWide(PrivState* ps, int bits)
+{
+    WideTables* wt = ps->wide;
+    long        n = MAXCODE(bits);
+    long        code;
+
+    if (wt && wt->bits >= bits)
+    {
+        return 1;
+    }
+
+    freeWide(ps);
+
+    if ((wt = (WideTables*)calloc(1, sizeof(WideTables))) == NULL)
+    {
+        return 0;
+    }
+
+    ps->wide = wt;
+    wt->bits = bits;
+
+    if (!ps->expanding)
+    {
+        wt->slots = (WideSlot*)malloc(WIDESLOTS(bits) * sizeof(WideSlot));
+        return wt->slots != NULL;
+    }
+
+    wt->prefix = (uint32_t*)malloc(n * sizeof(uint32_t));
+    wt->suffix = (Byte*)malloc(n);
+    wt->stack  = (Byte*)malloc(n);
+
+    if (!wt->prefix || !wt->suffix || !wt->stack)
+    {
+        return 0;
+    }
+
+    for (code = 0; code < 256; ++code)
+    {
+        wt->suffix[code] = (Byte)code;
+    }
+
+    return 1;
+}
+
+
+
+static void
+freeWide(PrivState* ps)
+{
+    WideTables* wt = ps->wide;
+
+    if (wt)
+    {
+        free(wt->slots);
+        free(wt->prefix);
+        free(wt->suffix);
+        free(wt->stack);
+        free(wt);
+        ps->wide = NULL;
+    }
+}
+
+
+
+NCompressError
+nSetExtendedBits(NCompressCtxt* ctxt, int bits)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+
+    if (!ps)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (bits != 0 && (bits <= BITS || bits > NCMP_EXTENDED_BITS))
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    if (ps->expanding)
+    {
+        // The tables are made when a stream needs them.
+        ps->wideBits = bits;
+        return NCMP_OK;
+    }
+
+    nResetCompress(ctxt);
+
+    if (bits == 0)
+    {
+        freeWide(ps);
+        ps->maxbits = BITS;
+        return NCMP_OK;
+    }
+
+    if (!allocWide(ps, bits))
+    {
+        freeWide(ps);
+        ps->maxbits = BITS;
+        return NCMP_OTHER_ERROR;
+    }
+
+    ps->maxbits = bits;
+    return NCMP_OK;
+}
+
+
+
+/*  Find the slot of (ent, c), or the empty slot where it goes.  The
+    probe steps through the slots as in classicFind().
+*/
+static inline long
+wideFind(const WideTables* wt, uint32_t key)
+{
+    long    mask = WIDESLOTS(wt->bits) - 1;
+    long    hp = ((long)(key & 0xFF) << (wt->bits + 1 - 8)) ^ (long)(key >> 8);
+    long    p = primetab[key & 0xFF];
+
+    while (wt->slots[hp].code != 0 && wt->slots[hp].key != key)
+    {
+        hp = (hp + p) & mask;
+    }
+
+    return hp;
+}
+
+
+
+/*  As compressBlock() but a byte at a time.  The checks at the top of
+    its loop are made after each code output.
+*/
+static NCompressError
+compressWide(NCompressCtxt* ctxt, const Byte* inbuf, int rsize)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    WideTables* wt = ps->wide;
+    WideSlot*   slots = wt->slots;
+    code_int    ent = wt->ent;
+    code_int    free_ent = ps->free_ent;
+    code_int    extcode = ps->extcode;
+    int64_t     checkpoint = ps->checkpoint;
+    int64_t     base = ps->bytes_in;
+    int         outbits = ps->outbits;
+    int         boff = ps->boff;
+    int         n_bits = ps->n_bits;
+    int         ratio = ps->ratio;
+    int         stcode = ps->stcode;
+    long        ncodes = 0;
+    int         coded = 0;
+    int         rpos = 0;
+
+    if (!ps->hasent)
+    {
+        ent = inbuf[rpos++];
+        ps->hasent = 1;
+    }
+    else
+    if (ps->flushed)
+    {
+        // The prefix has already been output, as in compressBlock().
+        uint32_t    key = (uint32_t)ent << 8 | inbuf[0];
+
+        if (stcode)
+        {
+            long    hp = wideFind(wt, key);
+
+            if (slots[hp].code == 0)
+            {
+                slots[hp].key  = key;
+                slots[hp].code = (uint32_t)free_ent;
+            }
+
+            ++free_ent;
+        }
+
+        ent = inbuf[rpos++];
+        ps->flushed = 0;
+        coded = 1;
+    }
+
+    for (;;)
+    {
+        uint32_t    key;
+        long        hp;
+
+        if (coded)
+        {
+            int64_t bytes_in = base + rpos;
+
+            coded = 0;
+
+            if (free_ent >= extcode)
+            {
+                if (n_bits < ps->maxbits)
+                {
+                    boff = outbits = (outbits-1)+((n_bits<<3)-
+                                ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+                    ++n_bits;
+                    extcode = EXTCODE(n_bits, ps->maxbits);
+
+                    recordWiden(ps, n_bits, bytes_in - 1);
+                }
+                else
+                {
+                    extcode = FULLCODE(ps->maxbits);
+                    stcode = 0;
+
+                    recordFull(ps, n_bits, bytes_in - 1);
+                }
+            }
+
+            if (!stcode && bytes_in >= checkpoint)
+            {
+                long int rat;
+
+                checkpoint = bytes_in + CHECK_GAP;
+
+                if (bytes_in > 0x007fffff)
+                {
+                    rat = (ps->bytes_out + (outbits>>3)) >> 8;
+                    rat = (rat == 0) ? 0x7fffffff : bytes_in / rat;
+                }
+                else
+                {
+                    rat = (bytes_in << 8) / (ps->bytes_out+(outbits>>3));
+                }
+
+                if (rat >= ratio)
+                {
+                    ratio = (int)rat;
+                }
+                else
+                {
+                    ratio = 0;
+
+                    memset(slots, 0, WIDESLOTS(wt->bits) * sizeof(WideSlot));
+                    outputWide(ps->outbuf, outbits, CLEAR, n_bits);
+                    ++ncodes;
+                    recordClear(ps, bytes_in - 1);
+
+                    boff = outbits = (outbits-1)+((n_bits<<3)-
+                                ((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+
+                    n_bits = INIT_BITS;
+                    extcode = EXTCODE(n_bits, ps->maxbits);
+                    free_ent = FIRST;
+                    stcode = 1;
+                }
+            }
+
+            if (outbits >= (OBUFSIZ<<3))
+            {
+                ps->bytes_out += OBUFSIZ;
+
+                if (callWriter(ctxt, ps->outbuf, OBUFSIZ) != OBUFSIZ)
+                {
+                    return NCMP_WRITE_ERROR;
+                }
+
+                outbits -= (OBUFSIZ<<3);
+                boff = -(((OBUFSIZ<<3)-boff)%(n_bits<<3));
+
+                memcpy(ps->outbuf, ps->outbuf+OBUFSIZ, (outbits>>3)+1);
+                memset(ps->outbuf+(outbits>>3)+1, '\0', OBUFSIZ);
+            }
+        }
+
+        if (rpos >= rsize)
+        {
+            break;
+        }
+
+        key = (uint32_t)ent << 8 | inbuf[rpos];
+        hp  = wideFind(wt, key);
+
+        if (slots[hp].code != 0)
+        {
+            ent = slots[hp].code;
+            ++rpos;
+            continue;
+        }
+
+        outputWide(ps->outbuf, outbits, ent, n_bits);
+        ++ncodes;
+
+        if (stcode)
+        {
+            slots[hp].key  = key;
+            slots[hp].code = (uint32_t)free_ent++;
+        }
+
+        ent = inbuf[rpos++];
+        coded = 1;
+    }
+
+    ps->ratio      = ratio;
+    ps->checkpoint = checkpoint;
+    ps->extcode    = extcode;
+    ps->n_bits     = n_bits;
+    ps->stcode     = stcode;
+    ps->free_ent   = free_ent;
+    ps->outbits    = outbits;
+    ps->boff       = boff;
+    ps->bytes_in   = base + rsize;
+    wt->ent        = ent;
+
+    ps->stats.codes += ncodes;
+
+    return NCMP_OK;
+}
+
+
+
+/*  As expandBlock() once the header has been read, but a code at a
+    time.  The rest of a string which doesn't fit is left at the end of
+    the stack.
+*/
+static NCompressError
+expandWide(NCompressCtxt* ctxt, Byte* dst, int cap, int* got)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    WideTables* wt = ps->wide;
+    uint32_t*   prefix = wt->prefix;
+    Byte*       suffix = wt->suffix;
+    Byte*       stackEnd = wt->stack + MAXCODE(wt->bits);
+    Byte*       stackp;
+    code_int    code;
+    code_int    incode;
+    int         finchar;
+    code_int    oldcode;
+    int         inbits;
+    int         posbits;
+    int         outpos = 0;
+    int         insize;
+    code_int    free_ent;
+    code_int    maxcode;
+    code_int    maxmaxcode;
+    int         n_bits;
+    int         rsize;
+    long        ncodes = 0;
+    NCompressError err = NCMP_OK;
+
+    if (ps->pending > 0)
+    {
+        outpos = (ps->pending < cap) ? (int)ps->pending : cap;
+        memcpy(dst, stackEnd - ps->pending, outpos);
+        ps->pending -= outpos;
+    }
+
+    if (ps->dstate == DS_END || outpos >= cap)
+    {
+        ps->bytes_out += outpos;
+
+        *got = outpos;
+        return ps->derror;
+    }
+
+    finchar    = ps->finchar;
+    oldcode    = ps->oldcode;
+    inbits     = ps->inbits;
+    posbits    = ps->posbits;
+    insize     = ps->insize;
+    free_ent   = ps->free_ent;
+    maxcode    = ps->maxcode;
+    maxmaxcode = ps->maxmaxcode;
+    n_bits     = ps->n_bits;
+    rsize      = ps->rsize;
+
+    if (ps->dstate == DS_CODES)
+    {
+        goto codes;
+    }
+
+    if (ps->dstate == DS_WAIT)
+    {
+        goto refill;
+    }
+
+    do
+    {
+resetbuf:   ;
+        {
+            int    i;
+            int    e;
+            int    o;
+
+            o = posbits >> 3;
+            e = (o <= insize) ? insize - o : 0;
+
+            for (i = 0 ; i < e ; ++i)
+            {
+                ps->inbuf[i] = ps->inbuf[i+o];
+            }
+
+            insize = e;
+            posbits = 0;
+        }
+
+refill:
+        if (insize < IBUFSIZ_ALL - IBUFSIZ)
+        {
+            rsize = readInput(ctxt, ps->inbuf + insize, IBUFSIZ);
+
+            if (rsize < 0 && rsize != READ_WAIT)
+            {
+                err = NCMP_READ_ERROR;
+                goto fail;
+            }
+
+            if (rsize > 0)
+            {
+                insize += rsize;
+                ps->bytes_in += rsize;
+            }
+        }
+
+        inbits = ((rsize > 0) ? (insize - insize%n_bits)<<3 :
+                                (insize<<3)-(n_bits-1));
+
+codes:  while (inbits > posbits)
+        {
+            long    len;
+
+            if (free_ent > maxcode)
+            {
+                int     next = ((posbits-1) + ((n_bits<<3) -
+                                     (posbits-1+(n_bits<<3))%(n_bits<<3)));
+
+                if (rsize == READ_WAIT && next > insize<<3)
+                {
+                    goto partial;
+                }
+
+                posbits = next;
+
+                ++n_bits;
+                if (n_bits == ps->maxbits)
+                    maxcode = maxmaxcode;
+                else
+                    maxcode = MAXCODE(n_bits)-1;
+
+                recordWiden(ps, n_bits, ps->bytes_out + outpos);
+                goto resetbuf;
+            }
+
+            if (outpos >= cap)
+            {
+                ps->dstate = DS_CODES;
+                goto full;
+            }
+
+            // Another member, as in expandBlock().
+            if ((oldcode == -1 || (free_ent == FIRST - 1 && ps->block_mode)) &&
+                ps->inbuf[posbits>>3] == MAGIC_1 && ps->inbuf[(posbits>>3)+1] == MAGIC_2)
+            {
+                ps->dstate = DS_MEMBER;
+                goto full;
+            }
+
+            inputWide(ps->inbuf, posbits, code, n_bits, MAXCODE(n_bits)-1);
+            ++ncodes;
+
+            if (oldcode == -1)
+            {
+                if (code >= 256)
+                {
+                    err = NCMP_DATA_ERROR;
+                    goto fail;
+                }
+
+                dst[outpos++] = (Byte)(finchar = (int)(oldcode = code));
+                continue;
+            }
+
+            if (code == CLEAR && ps->block_mode)
+            {
+                int     next = ((posbits-1) + ((n_bits<<3) -
+                                     (posbits-1+(n_bits<<3))%(n_bits<<3)));
+
+                if (rsize == READ_WAIT && next > insize<<3)
+                {
+                    posbits -= n_bits;
+                    --ncodes;
+                    goto partial;
+                }
+
+                free_ent = FIRST - 1;
+                posbits = next;
+                maxcode = MAXCODE(n_bits = INIT_BITS)-1;
+
+                recordClear(ps, ps->bytes_out + outpos);
+                goto resetbuf;
+            }
+
+            incode = code;
+            stackp = stackEnd;
+
+            if (code >= free_ent)   /* Special case for KwKwK string.   */
+            {
+                if (code > free_ent)
+                {
+                    err = NCMP_DATA_ERROR;
+                    goto fail;
+                }
+
+                *--stackp = (Byte)finchar;
+                code = oldcode;
+            }
+
+            while (code >= 256)
+            {
+                // Bad input can make a loop through the dummy entry at CLEAR.
+                if (stackp == wt->stack)
+                {
+                    err = NCMP_DATA_ERROR;
+                    goto fail;
+                }
+
+                *--stackp = suffix[code];
+                code = prefix[code];
+            }
+
+            *--stackp = (Byte)(finchar = (int)code);
+            len = stackEnd - stackp;
+
+            if (len <= cap - outpos)
+            {
+                memcpy(dst + outpos, stackp, len);
+                outpos += len;
+            }
+            else
+            {
+                int    i = cap - outpos;
+
+                memcpy(dst + outpos, stackp, i);
+                outpos = cap;
+                ps->pending = len - i;
+            }
+
+            if ((code = free_ent) < maxmaxcode) /* Generate the new entry. */
+            {
+                prefix[code] = (uint32_t)oldcode;
+                suffix[code] = (Byte)finchar;
+                free_ent = code+1;
+            }
+            else
+            if (ps->fullAt < 0)
+            {
+                recordFull(ps, n_bits, ps->bytes_out + outpos);
+            }
+
+            oldcode = incode;   /* Remember previous code.  */
+        }
+
+partial:
+        if (rsize == READ_WAIT || (rsize > 0 && posbits > inbits))
+        {
+            int    o = posbits / (n_bits<<3) * n_bits;
+
+            memmove(ps->inbuf, ps->inbuf + o, insize - o);
+            insize  -= o;
+            posbits -= o<<3;
+
+            if (rsize == READ_WAIT)
+            {
+                ps->dstate = DS_WAIT;
+                goto full;
+            }
+
+            goto refill;
+        }
+    }
+    while (rsize > 0);
+
+    ps->dstate = DS_END;
+
+full:
+    ps->finchar    = finchar;
+    ps->oldcode    = oldcode;
+    ps->inbits     = inbits;
+    ps->posbits    = posbits;
+    ps->insize     = insize;
+    ps->free_ent   = free_ent;
+    ps->maxcode    = maxcode;
+    ps->n_bits     = n_bits;
+    ps->rsize      = rsize;
+    ps->bytes_out += outpos;
+    ps->stats.codes += ncodes;
+
+    *got = outpos;
+    return NCMP_OK;
+
+fail:
+    ps->dstate = DS_END;
+    ps->derror = err;
+    ps->bytes_out += outpos;
+    ps->stats.codes += ncodes;
+
+    *got = outpos;
+    return err;
+}
+
+
+
+//======================================================================
+//  Checksums
+//
+//  The CRC32C of the uncompressed bytes is taken as the compressor is
+//  given them and as the decompressor hands them out, CRCPIECE bytes
+//  at a time so that they are still in the cache.  SSE4.2 has an
+//  instruction for it.  Otherwise a table takes 8 bytes at a time.
+
+#define CRC32C_POLY     0x82F63B78u     // Castagnoli, reversed
+
+//  The sidecar is CRCMAGIC, the CRC and the length, least significant
+//  byte first.
+#define CRCMAGIC        "nCmC"
+#define CRCSIDECAR      16
+
+
+typedef uint32_t (*CrcUpdater)(uint32_t crc, const Byte* bytes, size_t len);
+
+static uint32_t crcTable[8][256];
+
+
+static void
+initCrcTable()
+{
+    uint32_t    i;
+    int         k;
+
+    for (i = 0; i < 256; ++i)
+    {
+        uint32_t    c = i;
+
+        for (k = 0; k < 8; ++k)
+        {
+            c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+        }
+
+        crcTable[0][i] = c;
+    }
+
+    for (i = 0; i < 256; ++i)
+    {
+        for (k = 1; k < 8; ++k)
+        {
+            crcTable[k][i] = (crcTable[k-1][i] >> 8) ^ crcTable[0][crcTable[k-1][i] & 0xFF];
+        }
+    }
+}
+
+
+
+static uint32_t
+crc32cTable(uint32_t crc, const Byte* bytes, size_t len)
+{
+    crc = ~crc;
+
+    for (; len >= 8; bytes += 8, len -= 8)
+    {
+        uint32_t    lo = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+                                (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+        uint32_t    hi = (uint32_t)bytes[4] | (uint32_t)bytes[5] << 8 |
+                         (uint32_t)bytes[6] << 16 | (uint32_t)bytes[7] << 24;
+
+        crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+              crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+              crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+    }
+
+    for (; len > 0; ++bytes, --len)
+    {
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *bytes) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+
+#ifdef NCMP_X86_SIMD
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cSSE42(uint32_t crc, const Byte* bytes, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t    c = ~crc;
+
+    for (; len >= 8; bytes += 8, len -= 8)
+    {
+        uint64_t    v;
+
+        memcpy(&v, bytes, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+
+    crc = (uint32_t)c;
+#else
+    crc = ~crc;
+
+    for (; len >= 4; bytes += 4, len -= 4)
+    {
+        uint32_t    v;
+
+        memcpy(&v, bytes, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+#endif
+
+    for (; len > 0; ++bytes, --len)
+    {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+
+    return ~crc;
+}
+
+#endif
+
+
+static CrcUpdater crcUpdate = NULL;
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+pickCrc()
+{
+#ifdef NCMP_X86_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crcUpdate = crc32cSSE42;
+        return;
+    }
+#endif
+
+    initCrcTable();
+    crcUpdate = crc32cTable;
+}
+
+
+
+static void
+chooseCrc()
+{
+    pthread_once(&crcOnce, pickCrc);
+}
+
+
+
+static void
+updateCrc(PrivState* ps, const Byte* bytes, size_t len)
+{
+    ps->crc = crcUpdate(ps->crc, bytes, len);
+}
+
+
+
+void
+nSetCrc32c(NCompressCtxt* ctxt, int on)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    if (ps)
+    {
+        chooseCrc();
+        ps->crcOn = (on != 0);
+        ps->crc   = 0;
+    }
+}
+
+
+
+uint32_t
+nGetCrc32c(NCompressCtxt* ctxt)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    return ps ? ps->crc : 0;
+}
+
+
+
+static void
+makeSidecar(PrivState* ps, Byte* side)
+{
+    uint64_t    len = (uint64_t)(ps->expanding ? ps->bytes_out : ps->bytes_in);
+    int         i;
+
+    memcpy(side, CRCMAGIC, 4);
+
+    for (i = 0; i < 4; ++i)
+    {
+        side[4 + i] = (Byte)(ps->crc >> (i * 8));
+    }
+
+    for (i = 0; i < 8; ++i)
+    {
+        side[8 + i] = (Byte)(len >> (i * 8));
+    }
+}
+
+
+
+NCompressError
+nWriteCrc32c(NCompressCtxt* ctxt, NCmpStreamWriter writer, void* wCtxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    Byte        side[CRCSIDECAR];
+
+    if (!ps || !ps->crcOn)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    makeSidecar(ps, side);
+    return (writer(side, CRCSIDECAR, wCtxt) == CRCSIDECAR) ? NCMP_OK : NCMP_WRITE_ERROR;
+}
+
+
+
+NCompressError
+nCheckCrc32c(NCompressCtxt* ctxt, NCmpStreamReader reader, void* rCtxt)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    Byte        side[CRCSIDECAR];
+    Byte        want[CRCSIDECAR];
+    int         n = 0;
+    int         r = 1;
+
+    if (!ps || !ps->crcOn)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    while (n < CRCSIDECAR && (r = reader(side + n, CRCSIDECAR - n, rCtxt)) > 0)
+    {
+        n += r;
+    }
+
+    if (r < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    makeSidecar(ps, want);
+    return (n == CRCSIDECAR && memcmp(side, want, CRCSIDECAR) == 0) ? NCMP_OK : NCMP_DATA_ERROR;
+}
+
+
+
+//======================================================================
+//  The pipelined mode
+//
+//  The reader and the writer each run on their own thread while the
+//  calling thread runs the LZW kernel.  The stages pass blocks of
+//  PIPEBLOCKSIZ bytes through two rings, each with one producer and one
+//  consumer.  The ring indexes are atomic so a stage only takes a lock
+//  when it has to sleep because its ring is empty or full.
+
+#define PIPEBLOCKSIZ    (1 << 18)
+#define PIPESPINS       200
+
+
+typedef struct pipeBlock
+{
+    Byte*   data;
+    long    len;                // 0 for the end, -1 for a reader error
+} PipeBlock;
+
+
+typedef struct ring
+{
+    PipeBlock*      blocks;
+    unsigned        mask;       // the number of blocks less 1
+    unsigned        head;       // the next to consume, set by the consumer
+    unsigned        tail;       // the next to fill, set by the producer
+    int             sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} Ring;
+
+
+typedef struct pipeline
+{
+    Ring                in;     // from the reader to the kernel
+    Ring                out;    // from the kernel to the writer
+    int                 stop;   // set on an error to end all stages
+    int                 werror; // the writer failed
+    long                inPos;  // the kernel's position in its input block
+    PipeBlock*          cur;    // the kernel's output block
+    NCmpStreamReader    reader;
+    NCmpStreamWriter    writer;
+    NCmpStreamReader64  reader64;
+    NCmpStreamWriter64  writer64;
+    void*               rwCtxt;
+} Pipeline;
+
+
+
+static int
+initRing(Ring* r, unsigned size)
+{
+    unsigned    i;
+
+    r->blocks = calloc(size, sizeof(PipeBlock));
+    r->mask   = size - 1;
+    r->head   = 0;
+    r->tail   = 0;
+    r->sleepers = 0;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (!r->blocks)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < size; ++i)
+    {
+        if ((r->blocks[i].data = malloc(PIPEBLOCKSIZ)) == NULL)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+static void
+freeRing(Ring* r)
+{
+    unsigned    i;
+
+    if (r->blocks)
+    {
+        for (i = 0; i <= r->mask; ++i)
+        {
+            free(r->blocks[i].data);
+        }
+
+        free(r->blocks);
+    }
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+}
+
+
+
+static inline int
+ringHasData(Ring* r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+}
+
+
+
+static inline int
+ringHasRoom(Ring* r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) <= r->mask;
+}
+
+
+
+/*  Wait until the ring has data, or room if room is set.  This spins
+    for a while before it sleeps.  A sleeper is counted before the last
+    check so that wakeRing() can't miss it.  This returns 0 once the
+    pipeline has been stopped.
+*/
+static int
+waitRing(Pipeline* pl, Ring* r, int room)
+{
+    int     spins;
+
+    for (spins = 0; spins < PIPESPINS; ++spins)
+    {
+        if (__atomic_load_n(&pl->stop, __ATOMIC_SEQ_CST))
+        {
+            return 0;
+        }
+
+        if (room ? ringHasRoom(r) : ringHasData(r))
+        {
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    while (!(room ? ringHasRoom(r) : ringHasData(r)) && !__atomic_load_n(&pl->stop, __ATOMIC_SEQ_CST))
+    {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+
+    __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+
+    return !__atomic_load_n(&pl->stop, __ATOMIC_SEQ_CST);
+}
+
+
+
+static void
+wakeRing(Ring* r)
+{
+    if (__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+
+
+//  The producer fills the block at tail and then pushes it.
+static inline PipeBlock*
+ringFree(Pipeline* pl, Ring* r)
+{
+    return waitRing(pl, r, 1) ? &r->blocks[r->tail & r->mask] : NULL;
+}
+
+
+
+static inline void
+ringPush(Ring* r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    wakeRing(r);
+}
+
+
+
+//  The consumer uses the block at head and then pops it.
+static inline PipeBlock*
+ringNext(Pipeline* pl, Ring* r)
+{
+    return waitRing(pl, r, 0) ? &r->blocks[r->head & r->mask] : NULL;
+}
+
+
+
+static inline void
+ringPop(Ring* r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+    wakeRing(r);
+}
+
+
+
+static void
+stopPipeline(Pipeline* pl)
+{
+    __atomic_store_n(&pl->stop, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&pl->in.lock);
+    pthread_cond_broadcast(&pl->in.cond);
+    pthread_mutex_unlock(&pl->in.lock);
+
+    pthread_mutex_lock(&pl->out.lock);
+    pthread_cond_broadcast(&pl->out.cond);
+    pthread_mutex_unlock(&pl->out.lock);
+}
+
+
+
+static void*
+readStage(void* arg)
+{
+    Pipeline*   pl = (Pipeline*)arg;
+    PipeBlock*  b;
+
+    while ((b = ringFree(pl, &pl->in)) != NULL)
+    {
+        ssize_t n = pl->reader64 ? (pl->reader64)(b->data, PIPEBLOCKSIZ, pl->rwCtxt) :
+                                   (pl->reader)(b->data, PIPEBLOCKSIZ, pl->rwCtxt);
+
+        b->len = (n < 0) ? -1 : n;
+        ringPush(&pl->in);
+
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+static void*
+writeStage(void* arg)
+{
+    Pipeline*   pl = (Pipeline*)arg;
+    PipeBlock*  b;
+
+    while ((b = ringNext(pl, &pl->out)) != NULL && b->len > 0)
+    {
+        ssize_t n = pl->writer64 ? (pl->writer64)(b->data, b->len, pl->rwCtxt) :
+                                   (pl->writer)(b->data, b->len, pl->rwCtxt);
+
+        if (n != b->len)
+        {
+            __atomic_store_n(&pl->werror, 1, __ATOMIC_SEQ_CST);
+            stopPipeline(pl);
+            break;
+        }
+
+        ringPop(&pl->out);
+    }
+
+    return NULL;
+}
+
+
+
+/*  These take the place of the caller's reader and writer on the
+    kernel's side of the pipeline.
+*/
+static int
+pipeReader(Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    Pipeline*   pl = (Pipeline*)rwCtxt;
+    PipeBlock*  b;
+
+    for (;;)
+    {
+        if ((b = ringNext(pl, &pl->in)) == NULL)
+        {
+            return -1;
+        }
+
+        if (b->len <= 0)
+        {
+            // The end block stays in the ring for any later call.
+            return (int)b->len;
+        }
+
+        if (pl->inPos < b->len)
+        {
+            break;
+        }
+
+        pl->inPos = 0;
+        ringPop(&pl->in);
+    }
+
+    if ((long)numBytes > b->len - pl->inPos)
+    {
+        numBytes = b->len - pl->inPos;
+    }
+
+    memcpy(bytes, b->data + pl->inPos, numBytes);
+    pl->inPos += numBytes;
+    return (int)numBytes;
+}
+
+
+
+static int
+pushOutput(Pipeline* pl)
+{
+    if (pl->cur && pl->cur->len > 0)
+    {
+        ringPush(&pl->out);
+        pl->cur = NULL;
+    }
+
+    if (!pl->cur)
+    {
+        if ((pl->cur = ringFree(pl, &pl->out)) == NULL)
+        {
+            return -1;
+        }
+
+        pl->cur->len = 0;
+    }
+
+    return 0;
+}
+
+
+
+static int
+pipeWriter(const Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    Pipeline*   pl = (Pipeline*)rwCtxt;
+    size_t      left = numBytes;
+
+    while (left > 0)
+    {
+        size_t  n;
+
+        if (pl->cur->len == PIPEBLOCKSIZ && pushOutput(pl) < 0)
+        {
+            return -1;
+        }
+
+        n = PIPEBLOCKSIZ - pl->cur->len;
+
+        if (n > left)
+        {
+            n = left;
+        }
+
+        memcpy(pl->cur->data + pl->cur->len, bytes, n);
+        pl->cur->len += n;
+        bytes        += n;
+        left         -= n;
+    }
+
+    return (int)numBytes;
+}
+
+
+
+/*  Set up the pipeline and start the stages.  The kernel then uses the
+    context with pipeReader() and pipeWriter() in place of the caller's
+    functions.  This returns NULL if the threads can't be started, so
+    that the caller can run without them.
+*/
+static Pipeline*
+startPipeline(NCompressCtxt* ctxt, pthread_t* readThread, pthread_t* writeThread)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    Pipeline*   pl = calloc(1, sizeof(Pipeline));
+    unsigned    size = 2;
+
+    if (!pl)
+    {
+        return NULL;
+    }
+
+    while (size < (unsigned)ps->pipeBlocks && size < (1U << 16))
+    {
+        size <<= 1;
+    }
+
+    pl->reader   = ctxt->reader;
+    pl->writer   = ctxt->writer;
+    pl->reader64 = ps->reader64;
+    pl->writer64 = ps->writer64;
+    pl->rwCtxt   = ctxt->rwCtxt;
+
+    if (initRing(&pl->in, size) < 0 || initRing(&pl->out, size) < 0)
+    {
+        freeRing(&pl->in);
+        freeRing(&pl->out);
+        free(pl);
+        return NULL;
+    }
+
+    if (pthread_create(readThread, NULL, readStage, pl) != 0)
+    {
+        freeRing(&pl->in);
+        freeRing(&pl->out);
+        free(pl);
+        return NULL;
+    }
+
+    if (pthread_create(writeThread, NULL, writeStage, pl) != 0)
+    {
+        stopPipeline(pl);
+        pthread_join(*readThread, NULL);
+        freeRing(&pl->in);
+        freeRing(&pl->out);
+        free(pl);
+        return NULL;
+    }
+
+    ctxt->reader = pipeReader;
+    ctxt->writer = pipeWriter;
+    ctxt->rwCtxt = pl;
+    ps->reader64 = NULL;
+    ps->writer64 = NULL;
+
+    return pl;
+}
+
+
+
+/*  Pass the end to the writer, wait for the stages and put back the
+    caller's functions.  On an error the stages are stopped instead.
+*/
+static NCompressError
+endPipeline(NCompressCtxt* ctxt, Pipeline* pl, pthread_t readThread, pthread_t writeThread,
+            NCompressError err)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+
+    if (err == NCMP_OK && pushOutput(pl) == 0)
+    {
+        pl->cur->len = 0;
+        ringPush(&pl->out);
+    }
+    else
+    {
+        stopPipeline(pl);
+    }
+
+    pthread_join(writeThread, NULL);
+
+    // The reader may still be waiting for room after an early end.
+    stopPipeline(pl);
+    pthread_join(readThread, NULL);
+
+    if (pl->werror)
+    {
+        err = NCMP_WRITE_ERROR;
+    }
+
+    ctxt->reader = pl->reader;
+    ctxt->writer = pl->writer;
+    ctxt->rwCtxt = pl->rwCtxt;
+    ps->reader64 = pl->reader64;
+    ps->writer64 = pl->writer64;
+
+    freeRing(&pl->in);
+    freeRing(&pl->out);
+    free(pl);
+
+    return err;
+}
+
+
+
+static NCompressError
+compressPipelined(NCompressCtxt* ctxt)
+{
+    Pipeline*       pl;
+    pthread_t       readThread;
+    pthread_t       writeThread;
+    PipeBlock*      b = NULL;
+    NCompressError  err = NCMP_OK;
+
+    if ((pl = startPipeline(ctxt, &readThread, &writeThread)) == NULL)
+    {
+        return compressStream(ctxt);
+    }
+
+    beginCompress(ctxt);
+
+    if (pushOutput(pl) < 0)
+    {
+        err = NCMP_WRITE_ERROR;
+    }
+
+    // Compress each input block in place in the ring.
+    while (err == NCMP_OK && (b = ringNext(pl, &pl->in)) != NULL && b->len > 0)
+    {
+        err = compressWrite(ctxt, b->data, b->len);
+        ringPop(&pl->in);
+    }
+
+    if (err == NCMP_OK)
+    {
+        if (!b)
+            err = NCMP_WRITE_ERROR;
+        else
+        if (b->len < 0)
+            err = NCMP_OTHER_ERROR;     // as for compressStream()
+        else
+            err = compressEnd(ctxt);
+    }
+
+    return endPipeline(ctxt, pl, readThread, writeThread, err);
+}
+
+
+
+static NCompressError
+decompressPipelined(NCompressCtxt* ctxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    Pipeline*       pl;
+    pthread_t       readThread;
+    pthread_t       writeThread;
+    size_t          got = PIPEBLOCKSIZ;
+    NCompressError  err = NCMP_OK;
+
+    if ((pl = startPipeline(ctxt, &readThread, &writeThread)) == NULL)
+    {
+        return decompressStream(ctxt);
+    }
+
+    beginDecompress(ps);
+
+    // Decompress straight into the output blocks.
+    while (err == NCMP_OK && got == PIPEBLOCKSIZ)
+    {
+        if ((pl->cur = ringFree(pl, &pl->out)) == NULL)
+        {
+            err = NCMP_WRITE_ERROR;
+            break;
+        }
+
+        err = decompressRead(ctxt, pl->cur->data, PIPEBLOCKSIZ, &got);
+        pl->cur->len = (long)got;
+
+        if (got > 0)
+        {
+            ringPush(&pl->out);
+        }
+
+        pl->cur = NULL;
+    }
+
+    return endPipeline(ctxt, pl, readThread, writeThread, err);
+}
+
+
+//======================================================================
+//  File descriptors
+//
+//  A regular input file is mapped and a pipe is read FILEBUFSIZ bytes
+//  at a time.  The output goes out in writes of FILEBUFSIZ bytes from a
+//  page aligned buffer, so an fdOut opened with O_DIRECT works too.
+//
+//  For a sparse output each FILEALIGN block of the output is checked
+//  for zeros.  A run of zero blocks is skipped with lseek() instead of
+//  written if it is at least SPARSEMIN bytes or reaches the end of the
+//  buffer, where it may go on in the next one.  Zeros over data already
+//  in the file are punched out, or written if that isn't supported.
+
+#define FILEBUFSIZ      (1 << 20)
+#define FILEALIGN       4096
+#define SPARSEMIN       (1 << 16)
+
+
+typedef struct fileIO
+{
+    int         fdIn;
+    int         fdOut;
+    const Byte* map;            // the mapped input or NULL
+    size_t      mapSize;
+    size_t      pos;            // the next input byte in map or inBuf
+    Byte*       inBuf;          // for an input which can't be mapped
+    size_t      inLen;
+    Byte*       outBuf;
+    size_t      outLen;
+    int         direct;         // fdOut has O_DIRECT
+    off_t       outStart;
+    off_t       outTotal;
+    int         sparse;         // skip runs of zeros in the output
+    off_t       outSize;        // the size of fdOut when opened
+    off_t       holeAt;         // the start of the zeros not yet skipped
+    off_t       holeLen;
+    int         error;          // errno from the first failure
+} FileIO;
+
+
+
+static NCompressError
+openFileIO(FileIO* fio, int fdIn, int fdOut)
+{
+    struct stat st;
+    int         flags;
+
+    memset(fio, 0, sizeof(*fio));
+    fio->fdIn  = fdIn;
+    fio->fdOut = fdOut;
+
+    if (fstat(fdIn, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdIn, 0);
+
+        if (p != MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            fio->map     = p;
+            fio->mapSize = st.st_size;
+        }
+    }
+
+    if (!fio->map && posix_memalign((void**)&fio->inBuf, FILEALIGN, FILEBUFSIZ) != 0)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (posix_memalign((void**)&fio->outBuf, FILEALIGN, FILEBUFSIZ) != 0)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+#ifdef O_DIRECT
+    /*  Direct writes must start on an aligned offset.  The last write is
+        padded and the file truncated after it.
+    */
+    if ((flags = fcntl(fdOut, F_GETFL)) >= 0 && (flags & O_DIRECT))
+    {
+        fio->outStart = lseek(fdOut, 0, SEEK_CUR);
+        fio->direct   = fio->outStart >= 0 && fio->outStart % FILEALIGN == 0;
+
+        if (!fio->direct)
+        {
+            fcntl(fdOut, F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+#else
+    (void)flags;
+#endif
+
+    return NCMP_OK;
+}
+
+
+
+/*  Holes need a regular file written at a known offset.  Otherwise the
+    zeros are written as usual.
+*/
+static void
+setSparse(FileIO* fio)
+{
+    struct stat st;
+    int         flags = fcntl(fio->fdOut, F_GETFL);
+    off_t       at    = lseek(fio->fdOut, 0, SEEK_CUR);
+
+    if (flags >= 0 && !(flags & O_APPEND) && at >= 0 &&
+        fstat(fio->fdOut, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        fio->sparse   = 1;
+        fio->outStart = at;
+        fio->outSize  = st.st_size;
+    }
+}
+
+
+
+static void
+closeFileIO(FileIO* fio)
+{
+    if (fio->map)
+    {
+        munmap((void*)fio->map, fio->mapSize);
+    }
+
+    free(fio->inBuf);
+    free(fio->outBuf);
+}
+
+
+
+/*  Read up to FILEBUFSIZ bytes into inBuf, stopping early only at the
+    end of the input.
+*/
+static int
+fillFileIO(FileIO* fio)
+{
+    fio->inLen = 0;
+    fio->pos   = 0;
+
+    while (fio->inLen < FILEBUFSIZ)
+    {
+        ssize_t n = read(fio->fdIn, fio->inBuf + fio->inLen, FILEBUFSIZ - fio->inLen);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            fio->error = errno;
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+
+        fio->inLen += n;
+    }
+
+    return 0;
+}
+
+
+
+static int
+writeFileIO(FileIO* fio, const Byte* bytes, size_t numBytes)
+{
+    while (numBytes > 0)
+    {
+        ssize_t n = write(fio->fdOut, bytes, numBytes);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            fio->error = errno;
+            return -1;
+        }
+
+        bytes    += n;
+        numBytes -= n;
+    }
+
+    return 0;
+}
+
+
+
+/*  Write numBytes which end at the file offset end.  With O_DIRECT a
+    partial last block is padded and the file cut back.
+*/
+static int
+writeOutput(FileIO* fio, Byte* bytes, size_t numBytes, off_t end)
+{
+    if (fio->direct && numBytes % FILEALIGN != 0)
+    {
+        size_t  padded = (numBytes + FILEALIGN - 1) & ~(size_t)(FILEALIGN - 1);
+
+        memset(bytes + numBytes, 0, padded - numBytes);
+
+        if (writeFileIO(fio, bytes, padded) < 0 ||
+            ftruncate(fio->fdOut, end) < 0 ||
+            lseek(fio->fdOut, end, SEEK_SET) < 0)
+        {
+            fio->error = errno;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return writeFileIO(fio, bytes, numBytes);
+}
+
+
+
+/*  Write zeros over existing data when holes can't be punched.
+*/
+static int
+writeZeros(FileIO* fio, off_t start, off_t len)
+{
+    Byte*   zeros;
+    int     ok;
+
+    if (posix_memalign((void**)&zeros, FILEALIGN, SPARSEMIN) != 0)
+    {
+        fio->error = ENOMEM;
+        return -1;
+    }
+
+    memset(zeros, 0, SPARSEMIN);
+    ok = lseek(fio->fdOut, start, SEEK_SET) >= 0;
+
+    if (!ok)
+    {
+        fio->error = errno;
+    }
+
+    while (ok && len > 0)
+    {
+        size_t  n = len < SPARSEMIN ? (size_t)len : SPARSEMIN;
+
+        ok   = writeFileIO(fio, zeros, n) == 0;
+        len -= n;
+    }
+
+    free(zeros);
+    return ok ? 0 : -1;
+}
+
+
+
+/*  Skip the pending zeros, leaving the file offset after them.
+*/
+static int
+makeHole(FileIO* fio)
+{
+    off_t   start = fio->holeAt;
+    off_t   end   = fio->holeAt + fio->holeLen;
+
+    if (fio->holeLen == 0)
+    {
+        return 0;
+    }
+
+    fio->holeLen = 0;
+
+    if (start < fio->outSize)
+    {
+        off_t   stop = end < fio->outSize ? end : fio->outSize;
+        int     punched = 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+        punched = fallocate(fio->fdOut, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            start, stop - start) == 0;
+#endif
+
+        if (!punched && writeZeros(fio, start, stop - start) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (lseek(fio->fdOut, end, SEEK_SET) < 0)
+    {
+        fio->error = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*  Skip a hole at the end of the output and make sure that the file
+    covers it.
+*/
+static int
+endHole(FileIO* fio)
+{
+    off_t       end = fio->holeAt + fio->holeLen;
+    struct stat st;
+
+    if (fio->holeLen == 0)
+    {
+        return 0;
+    }
+
+    if (makeHole(fio) < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fio->fdOut, &st) < 0 || (st.st_size < end && ftruncate(fio->fdOut, end) < 0))
+    {
+        fio->error = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*  Find the end of the whole zero blocks from pos.
+*/
+static size_t
+zeroRun(const Byte* bytes, size_t pos, size_t len)
+{
+    for (; pos + FILEALIGN <= len; pos += FILEALIGN)
+    {
+        const uint64_t* w = (const uint64_t*)(bytes + pos);
+        uint64_t        any = 0;
+        int             i;
+
+        for (i = 0; i < FILEALIGN / 8; i += 8)
+        {
+            any |= w[i] | w[i + 1] | w[i + 2] | w[i + 3] |
+                   w[i + 4] | w[i + 5] | w[i + 6] | w[i + 7];
+
+            if (any)
+            {
+                return pos;
+            }
+        }
+    }
+
+    return pos;
+}
+
+
+
+/*  Write the len bytes of outBuf, leaving out the runs of zeros.
+*/
+static int
+flushSparse(FileIO* fio, size_t len)
+{
+    Byte*   bytes = fio->outBuf;
+    off_t   base  = fio->outStart + fio->outTotal;
+    size_t  pos   = 0;
+
+    while (pos < len)
+    {
+        size_t  end = zeroRun(bytes, pos, len);
+
+        if (end > pos && (end - pos >= SPARSEMIN || end == len || (pos == 0 && fio->holeLen > 0)))
+        {
+            if (fio->holeLen == 0)
+            {
+                fio->holeAt = base + pos;
+            }
+
+            fio->holeLen += end - pos;
+            pos = end;
+            continue;
+        }
+
+        // The data runs up to the next zeros long enough to skip.
+        while (end < len)
+        {
+            size_t  zeros = zeroRun(bytes, end, len);
+
+            if (zeros > end && (zeros - end >= SPARSEMIN || zeros == len))
+            {
+                break;
+            }
+
+            end = zeros > end ? zeros : (end + FILEALIGN < len ? end + FILEALIGN : len);
+        }
+
+        if (makeHole(fio) < 0 || writeOutput(fio, bytes + pos, end - pos, base + end) < 0)
+        {
+            return -1;
+        }
+
+        pos = end;
+    }
+
+    return 0;
+}
+
+
+
+/*  Write out the rest of outBuf.
+*/
+static int
+flushFileIO(FileIO* fio)
+{
+    size_t  len = fio->outLen;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    if (fio->sparse)
+    {
+        if (flushSparse(fio, len) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    if (writeOutput(fio, fio->outBuf, len, fio->outStart + fio->outTotal + len) < 0)
+    {
+        return -1;
+    }
+
+    fio->outTotal += len;
+    fio->outLen    = 0;
+    return 0;
+}
+
+
+
+static int
+fileReader(Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    FileIO* fio = (FileIO*)rwCtxt;
+    size_t  avail;
+
+    if (fio->map)
+    {
+        avail = fio->mapSize - fio->pos;
+    }
+    else
+    {
+        if (fio->pos == fio->inLen && fillFileIO(fio) < 0)
+        {
+            return -1;
+        }
+
+        avail = fio->inLen - fio->pos;
+    }
+
+    if (numBytes > avail)
+    {
+        numBytes = avail;
+    }
+
+    memcpy(bytes, (fio->map ? fio->map : fio->inBuf) + fio->pos, numBytes);
+    fio->pos += numBytes;
+    return (int)numBytes;
+}
+
+
+
+static int
+fileWriter(const Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    FileIO* fio = (FileIO*)rwCtxt;
+    size_t  left = numBytes;
+
+    while (left > 0)
+    {
+        size_t  n = FILEBUFSIZ - fio->outLen;
+
+        if (n > left)
+        {
+            n = left;
+        }
+
+        memcpy(fio->outBuf + fio->outLen, bytes, n);
+        fio->outLen += n;
+        bytes       += n;
+        left        -= n;
+
+        if (fio->outLen == FILEBUFSIZ && flushFileIO(fio) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return (int)numBytes;
+}
+
+
+
+/*  The read and write errors leave errno as the failed call set it.
+*/
+static NCompressError
+endFileIO(FileIO* fio, NCompressCtxt* ctxt, NCompressError err)
+{
+    if (err == NCMP_OK && (flushFileIO(fio) < 0 || endHole(fio) < 0))
+    {
+        err = NCMP_WRITE_ERROR;
+    }
+
+    nFreeCompress(ctxt);
+    closeFileIO(fio);
+
+    if (fio->error)
+    {
+        errno = fio->error;
+    }
+
+    return err;
+}
+
+
+
+NCompressError
+nCompressFile(int fdIn, int fdOut, int bits)
+{
+    NCompressCtxt   ctxt;
+    FileIO          fio;
+    NCompressError  err;
+
+    ctxt.reader = fileReader;
+    ctxt.writer = fileWriter;
+    ctxt.rwCtxt = &fio;
+
+    err = openFileIO(&fio, fdIn, fdOut);
+    nInitCompress(&ctxt, bits);
+
+    if (err != NCMP_OK || !ctxt.priv)
+    {
+        return endFileIO(&fio, &ctxt, NCMP_OTHER_ERROR);
+    }
+
+    if (fio.map)
+    {
+        // Straight from the mapping, with no copy.
+        err = compressWrite(&ctxt, fio.map, fio.mapSize);
+    }
+    else
+    {
+        for (;;)
+        {
+            if (fillFileIO(&fio) < 0)
+            {
+                err = NCMP_READ_ERROR;
+                break;
+            }
+
+            if (fio.inLen == 0 || (err = compressWrite(&ctxt, fio.inBuf, fio.inLen)) != NCMP_OK)
+            {
+                break;
+            }
+        }
+    }
+
+    if (err == NCMP_OK)
+    {
+        err = compressEnd(&ctxt);
+    }
+
+    return endFileIO(&fio, &ctxt, err);
+}
+
+
+
+static NCompressError
+decompressFile(int fdIn, int fdOut, int sparse, int numThreads)
+{
+    NCompressCtxt   ctxt;
+    FileIO          fio;
+    NCompressError  err;
+    size_t          got;
+
+    ctxt.reader = fileReader;
+    ctxt.writer = NULL;
+    ctxt.rwCtxt = &fio;
+
+    err = openFileIO(&fio, fdIn, fdOut);
+    nInitDecompress(&ctxt);
+
+    if (err != NCMP_OK || !ctxt.priv)
+    {
+        return endFileIO(&fio, &ctxt, NCMP_OTHER_ERROR);
+    }
+
+    if (sparse)
+    {
+        setSparse(&fio);
+    }
+
+    if (numThreads > 1 && fio.map && decompressMembers(&ctxt, &fio, numThreads, &err))
+    {
+        return endFileIO(&fio, &ctxt, err);
+    }
+
+    // Decompress straight into the output buffer.
+    do
+    {
+        err = decompressRead(&ctxt, fio.outBuf, FILEBUFSIZ, &got);
+
+        if (got > 0)
+        {
+            fio.outLen = got;
+
+            if (flushFileIO(&fio) < 0)
+            {
+                err = NCMP_WRITE_ERROR;
+            }
+        }
+    }
+    while (err == NCMP_OK && got == FILEBUFSIZ);
+
+    return endFileIO(&fio, &ctxt, err);
+}
+
+
+
+NCompressError
+nDecompressFile(int fdIn, int fdOut)
+{
+    return decompressFile(fdIn, fdOut, 0, 1);
+}
+
+
+
+NCompressError
+nDecompressFileSparse(int fdIn, int fdOut)
+{
+    return decompressFile(fdIn, fdOut, 1, 1);
+}
+
+
+
+//======================================================================
+//  Splicing and appending
+//
+//  Two block mode streams with the same bits are joined by ending the
+//  first with a CLEAR.  The decoder pads to the group boundary after a
+//  CLEAR and then starts again at INIT_BITS with free_ent at FIRST-1.
+//  The first code after it adds a dummy entry at CLEAR, which leaves
+//  the table just as the first code of a new stream does.  So the body
+//  of the second stream is used as it is.  The boundary is a whole
+//  number of bytes since each group is n_bits bytes, so the body is
+//  copied rather than shifted.
+//
+//  Only the end of the first stream needs to be found.  It is scanned
+//  without the string table, just following the widths and CLEARs as
+//  the decoder does.
+
+/*  Where the next code of a stream would go, in its last member.
+*/
+typedef struct streamEnd
+{
+    int         maxbits;
+    int         block_mode;
+    int         hasCodes;
+    int         n_bits;
+    long        posBits;        // of the next code from the start of the stream
+    long        baseBits;       // the start of its group
+    long        length;         // of the stream in bytes
+    Byte        last;           // the bits before posBits in its byte
+} StreamEnd;
+
+
+/*  The places a stream can be decoded from, at least MEMBERGAP bytes
+    apart, and the header byte of the stream at each.
+*/
+typedef struct memberList
+{
+    long*       offsets;
+    Byte*       flags;
+    long        num;
+} MemberList;
+
+#define MEMBERGAP       (1 << 16)
+
+
+
+static int
+readFd(Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    ssize_t n;
+
+    while ((n = read(*(int*)rwCtxt, bytes, numBytes)) < 0 && errno == EINTR)
+    {
+    }
+
+    return (int)n;
+}
+
+
+
+//  The reader of a context, which may have been set by nSetStreams64().
+static int
+readCtxt(Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    return (int)callReader((NCompressCtxt*)rwCtxt, bytes, numBytes);
+}
+
+
+
+/*  Add a member at off to the list, which doubles at each power of two,
+    unless it is too close to the last.
+*/
+static int
+addMember(MemberList* ml, long off, int flags)
+{
+    if (ml->num > 0 && off - ml->offsets[ml->num - 1] < MEMBERGAP)
+    {
+        return 1;
+    }
+
+    if ((ml->num & (ml->num - 1)) == 0)
+    {
+        long* m = (long*)realloc(ml->offsets, 2 * (ml->num + 1) * sizeof(long));
+        Byte* f = m ? (Byte*)realloc(ml->flags, 2 * (ml->num + 1)) : NULL;
+
+        if (!m || !f)
+        {
+            if (m)
+            {
+                ml->offsets = m;
+            }
+
+            return 0;
+        }
+
+        ml->offsets = m;
+        ml->flags   = f;
+    }
+
+    ml->offsets[ml->num] = off;
+    ml->flags[ml->num++] = (Byte)flags;
+    return 1;
+}
+
+
+
+/*  Read a stream and find its end, using buf of IBUFSIZ_ALL bytes.  The
+    third byte of the header of the last member must be header unless
+    that is -1.  If passOn is set the bytes before the byte at posBits
+    are passed to its writer and numLeft is set to the rest, which are
+    left in buf.  If ml is set the members are added to it.
+*/
+static NCompressError
+scanStream(NCmpStreamReader reader, void* rwCtxt, Byte* buf, int header, StreamEnd* se,
+           NCompressCtxt* passOn, int* numLeft, MemberList* ml)
+{
+    int         insize = 0;
+    int         rsize = 1;
+    long        off = 0;            // of buf[0] in the stream
+    int         posbits;
+    int         base;
+    int         n_bits = INIT_BITS;
+    int         first = 1;
+    int         flags;
+    int         o;
+    code_int    free_ent;
+    code_int    maxcode;
+    code_int    maxmaxcode;
+    uint16_t    codes[CODEBATCH];
+
+    chooseUnpacker();
+
+    while (insize < 3 && (rsize = reader(buf + insize, IBUFSIZ - insize, rwCtxt)) > 0)
+    {
+        insize += rsize;
+    }
+
+    if (rsize < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if (insize < 3 || buf[0] != MAGIC_1 || buf[1] != MAGIC_2)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    // The first header is read as that of a member.
+    posbits    = base = 0;
+    flags      = 0;
+    maxmaxcode = maxcode = free_ent = 0;
+
+    for (;;)
+    {
+        int avail;
+
+        if (rsize > 0)
+        {
+            // Drop the whole groups before posbits and refill.
+            o = (posbits - (posbits - base) % (n_bits<<3)) >> 3;
+
+            if (o > insize)
+            {
+                o = insize;
+            }
+
+            if (passOn && o > 0 && callWriter(passOn, buf, o) != o)
+            {
+                return NCMP_WRITE_ERROR;
+            }
+
+            memmove(buf, buf + o, insize - o);
+            insize  -= o;
+            off     += o;
+            posbits -= o<<3;
+            base     = posbits - (posbits - base + (o<<3)) % (n_bits<<3);
+
+            // Before the first header is read the buffer may be full.
+            if (insize < IBUFSIZ)
+            {
+                if ((rsize = reader(buf + insize, IBUFSIZ - insize, rwCtxt)) < 0)
+                {
+                    return NCMP_READ_ERROR;
+                }
+
+                insize += rsize;
+            }
+        }
+
+        avail = insize<<3;
+
+        for (;;)
+        {
+            int num;
+            int k;
+
+            // A member starts where expandBlock() looks for one.
+            if (posbits == base && (first || (free_ent == FIRST - 1 && se->block_mode)))
+            {
+                o = posbits>>3;
+
+                if (o + 3 > insize && rsize > 0)
+                {
+                    break;
+                }
+
+                if (o + 3 <= insize && buf[o] == MAGIC_1 && buf[o+1] == MAGIC_2)
+                {
+                    flags = buf[o+2];
+
+                    // Streams with a preset table aren't followed here.
+                    if ((flags & BIT_MASK) > BITS || (flags & PRESET))
+                    {
+                        return NCMP_BITS_ERROR;
+                    }
+
+                    if ((flags & BIT_MASK) < INIT_BITS)
+                    {
+                        return NCMP_DATA_ERROR;
+                    }
+
+                    if (ml && !addMember(ml, off + o, flags))
+                    {
+                        return NCMP_OTHER_ERROR;
+                    }
+
+                    se->maxbits    = flags & BIT_MASK;
+                    se->block_mode = flags & BLOCK_MODE;
+
+                    maxmaxcode = MAXCODE(se->maxbits);
+                    maxcode    = MAXCODE(INIT_BITS)-1;
+                    free_ent   = se->block_mode ? FIRST : 256;
+                    n_bits     = INIT_BITS;
+                    first      = 1;
+                    posbits    = base = posbits + (3<<3);
+                    continue;
+                }
+            }
+
+            if (free_ent > maxcode)
+            {
+                posbits = (posbits-1) + ((n_bits<<3) -
+                                ((posbits-base-1+(n_bits<<3))%(n_bits<<3)));
+                base = posbits;
+
+                ++n_bits;
+                if (n_bits == se->maxbits)
+                    maxcode = maxmaxcode;
+                else
+                    maxcode = MAXCODE(n_bits)-1;
+            }
+
+            if (posbits + n_bits > avail)
+            {
+                break;
+            }
+
+            num = (avail - posbits) / n_bits;
+
+            if (free_ent < maxmaxcode && num > maxcode - free_ent + 1 + first)
+            {
+                num = (int)(maxcode - free_ent + 1 + first);
+            }
+
+            if (num > CODEBATCH)
+            {
+                num = CODEBATCH;
+            }
+
+            unpackCodes(buf, posbits, n_bits, num, codes);
+
+            for (k = 0; k < num; ++k)
+            {
+                code_int code = codes[k];
+
+                posbits += n_bits;
+
+                if (first)
+                {
+                    if (code >= 256)
+                    {
+                        return NCMP_DATA_ERROR;
+                    }
+
+                    first = 0;
+                    continue;
+                }
+
+                if (code == CLEAR && se->block_mode)
+                {
+                    posbits = (posbits-1) + ((n_bits<<3) -
+                                    ((posbits-base-1+(n_bits<<3))%(n_bits<<3)));
+                    base     = posbits;
+
+                    // A member without a header may start after any of them.
+                    if (ml && !addMember(ml, off + (posbits>>3), flags))
+                    {
+                        return NCMP_OTHER_ERROR;
+                    }
+
+                    n_bits   = INIT_BITS;
+                    maxcode  = MAXCODE(INIT_BITS)-1;
+                    free_ent = FIRST - 1;
+                    break;
+                }
+
+                if (code > free_ent)
+                {
+                    return NCMP_DATA_ERROR;
+                }
+
+                if (free_ent < maxmaxcode)
+                {
+                    ++free_ent;
+                }
+            }
+        }
+
+        if (rsize == 0)
+        {
+            break;
+        }
+    }
+
+    if (header >= 0 && flags != header)
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    // After a widening posbits may be past the end.
+    o = ((posbits>>3) < insize) ? posbits>>3 : insize;
+
+    se->hasCodes = !first;
+    se->n_bits   = n_bits;
+    se->posBits  = (off<<3) + posbits;
+    se->baseBits = (off<<3) + base;
+    se->length   = off + insize;
+    se->last     = (o < insize) ? buf[o] & ((1 << (posbits & 7)) - 1) : 0;
+
+    if (passOn)
+    {
+        if (callWriter(passOn, buf, o) != o)
+        {
+            return NCMP_WRITE_ERROR;
+        }
+
+        memmove(buf, buf + o, insize - o);
+        *numLeft = insize - o;
+    }
+
+    return NCMP_OK;
+}
+
+
+
+/*  Put the bytes from the one at posBits to the start of the next stream
+    in bytes, which holds 32.  They are the bits already in the byte at
+    posBits, a CLEAR and the padding to the end of the group.  There is
+    no CLEAR before the first code of a stream.  Returns the count.
+*/
+static int
+spliceJunction(const StreamEnd* se, Byte* bytes)
+{
+    int     n_bits = se->n_bits;
+    int     outbits = (int)(se->posBits & 7);
+    int     boff = (int)(se->baseBits - (se->posBits & ~7L));
+
+    memset(bytes, 0, 32);
+
+    if (!se->hasCodes)
+    {
+        return 0;
+    }
+
+    bytes[0] = se->last;
+    output(bytes, outbits, CLEAR, n_bits);
+
+    outbits = (outbits-1)+((n_bits<<3)-((outbits-boff-1+(n_bits<<3))%(n_bits<<3)));
+    return outbits >> 3;
+}
+
+
+
+static NCompressError
+spliceStreams(NCompressCtxt* ctxt, NCmpStreamReader reader2, void* rwCtxt2)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    StreamEnd       se;
+    Byte            junction[32];
+    Byte            zeros[32] = {0};
+    int             numLeft;
+    int             n = 0;
+    int             rsize = 1;
+    long            gap;
+    NCompressError  err;
+
+    // The header of the second stream, and its first block in outbuf.
+    while (n < 3 && (rsize = reader2(ps->outbuf + n, 3 - n, rwCtxt2)) > 0)
+    {
+        n += rsize;
+    }
+
+    if (rsize < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if (n < 3 || ps->outbuf[0] != MAGIC_1 || ps->outbuf[1] != MAGIC_2)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    err = scanStream(readCtxt, ctxt, ps->inbuf, ps->outbuf[2], &se, ctxt, &numLeft, NULL);
+
+    if (err != NCMP_OK)
+    {
+        return err;
+    }
+
+    if (se.hasCodes && !se.block_mode)
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    if ((rsize = reader2(ps->outbuf, OBUFSIZ, rwCtxt2)) < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if (rsize == 0)
+    {
+        // Nothing to add, so keep the first stream as it was.
+        return (numLeft == 0 || callWriter(ctxt, ps->inbuf, numLeft) == numLeft) ? NCMP_OK : NCMP_WRITE_ERROR;
+    }
+
+    gap = (se.posBits>>3) - se.length;
+    n   = spliceJunction(&se, junction);
+
+    if ((gap > 0 && callWriter(ctxt, zeros, gap) != gap) || (n > 0 && callWriter(ctxt, junction, n) != n))
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    do
+    {
+        if (callWriter(ctxt, ps->outbuf, rsize) != rsize)
+        {
+            return NCMP_WRITE_ERROR;
+        }
+    }
+    while ((rsize = reader2(ps->outbuf, OBUFSIZ, rwCtxt2)) > 0);
+
+    return (rsize < 0) ? NCMP_READ_ERROR : NCMP_OK;
+}
+
+
+
+/*  Join the stream from the reader and the one from reader2 for the
+    writer.  See "Splicing and appending" above.
+*/
+NCompressError
+nSplice(NCompressCtxt* ctxt, NCmpStreamReader reader2, void* rwCtxt2)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    double          start;
+    NCompressError  err;
+
+    if (!ps)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    start = enterCall(ps);
+    err   = spliceStreams(ctxt, reader2, rwCtxt2);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+/*  Set up the compressor to go on from the end of the stream in fd, as
+    splice() would join a new stream onto it.
+*/
+NCompressError
+nCompressAppend(NCompressCtxt* ctxt, int fd)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    StreamEnd       se;
+    NCompressError  err;
+    int             n;
+
+    if (!ps)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (ps->presetLen)
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if ((err = scanStream(readFd, &fd, ps->inbuf, -1, &se, NULL, NULL, NULL)) != NCMP_OK)
+    {
+        return err;
+    }
+
+    if (!se.block_mode || se.maxbits < INIT_BITS)
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    ps->maxbits = se.maxbits;
+    beginCompress(ctxt);
+
+    // The junction replaces the header.
+    memset(ps->outbuf, 0, OBUFSIZ_ALL);
+    n = spliceJunction(&se, ps->outbuf);
+    ps->boff = ps->outbits = n<<3;
+
+    if (lseek(fd, se.posBits>>3, SEEK_SET) < 0)
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    return NCMP_OK;
+}
+
+
+
+//======================================================================
+//  Members
+//
+//  A compressor with a member size ends each member with a CLEAR padded
+//  to its group and goes on with a new table, as a splice joins two
+//  streams.  So the stream is a valid .Z stream for any decompressor,
+//  and it can be decoded from the end of any CLEAR with a header of the
+//  same bits in front.  Members have no preset table, which would have
+//  to be known.
+//
+//  The decoders also go on through whole streams one after the other,
+//  where each but the last ends so.  .Z has no end marker, so they only
+//  look for a header where its magic can't be a code: in place of the
+//  first code, and after a CLEAR, where it would be the code 287 and
+//  past free_ent.
+//
+//  A mapped input is scanned as for a splice, and split at the CLEARs
+//  and headers at least MEMBERGAP bytes apart.  The parts are decoded
+//  into memory on separate threads, the caller's included, and written
+//  in order.  The threads run at most MEMBERAHEAD parts each ahead of
+//  the one being written.
+
+#define MEMBERAHEAD     2
+
+
+/*  One member to decode, and its output.
+*/
+typedef struct memberJob
+{
+    Byte            head[3];        // read first, unless headLen is 0
+    size_t          headLen;
+    const Byte*     in;
+    size_t          inLen;
+    size_t          inPos;
+    Byte*           out;
+    size_t          outLen;
+    NCompressError  err;
+    int             done;
+} MemberJob;
+
+
+typedef struct memberPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    MemberJob*      jobs;
+    long            numJobs;
+    long            next;           // the next member to be taken
+    long            limit;          // members from here wait for the writer
+    int             stop;
+} MemberPool;
+
+
+
+void
+nSetMemberSize(NCompressCtxt* ctxt, int64_t memberSize)
+{
+    PrivState* ps = (PrivState*)ctxt->priv;
+
+    if (ps)
+    {
+        ps->memberSize = (memberSize > 0) ? memberSize : 0;
+    }
+}
+
+
+
+static int
+memberReader(Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    MemberJob*  job = (MemberJob*)rwCtxt;
+    size_t      h = (job->headLen < numBytes) ? job->headLen : numBytes;
+    size_t      n = job->inLen - job->inPos;
+
+    memcpy(bytes, job->head + sizeof(job->head) - job->headLen, h);
+    job->headLen -= h;
+
+    if (n > numBytes - h)
+    {
+        n = numBytes - h;
+    }
+
+    memcpy(bytes + h, job->in + job->inPos, n);
+    job->inPos += n;
+    return (int)(h + n);
+}
+
+
+
+/*  Decompress a member into job->out, which doubles as it fills.
+*/
+static void
+decodeMember(NCompressCtxt* ctxt, MemberJob* job)
+{
+    NCompressError  err;
+    size_t          cap = 0;
+    size_t          got;
+
+    ctxt->reader = memberReader;
+    ctxt->rwCtxt = job;
+    beginDecompress((PrivState*)ctxt->priv);
+
+    do
+    {
+        if (job->outLen == cap)
+        {
+            size_t  size = cap ? 2 * cap : 4 * job->inLen;
+            Byte*   p = (Byte*)realloc(job->out, size);
+
+            if (!p)
+            {
+                err = NCMP_OTHER_ERROR;
+                break;
+            }
+
+            job->out = p;
+            cap      = size;
+        }
+
+        err = decompressRead(ctxt, job->out + job->outLen, cap - job->outLen, &got);
+        job->outLen += got;
+    }
+    while (err == NCMP_OK && job->outLen == cap);
+
+    job->err = err;
+}
+
+
+
+static void*
+memberWorker(void* arg)
+{
+    MemberPool*     pool = (MemberPool*)arg;
+    NCompressCtxt   ctxt;
+    MemberJob*      job;
+
+    ctxt.reader = NULL;
+    ctxt.writer = NULL;
+    nInitDecompress(&ctxt);
+
+    if (!ctxt.priv)
+    {
+        // The other threads take its share.
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;)
+    {
+        while (!pool->stop && pool->next < pool->numJobs && pool->next >= pool->limit)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        if (pool->stop || pool->next >= pool->numJobs)
+        {
+            break;
+        }
+
+        job = &pool->jobs[pool->next++];
+
+        pthread_mutex_unlock(&pool->lock);
+        decodeMember(&ctxt, job);
+        pthread_mutex_lock(&pool->lock);
+
+        job->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    nFreeCompress(&ctxt);
+    return NULL;
+}
+
+
+
+/*  Write the output of a member, up to its error if any.
+*/
+static NCompressError
+writeMember(FileIO* fio, const MemberJob* job)
+{
+    size_t  pos = 0;
+
+    while (pos < job->outLen)
+    {
+        int n = (job->outLen - pos > (1 << 30)) ? (1 << 30) : (int)(job->outLen - pos);
+
+        if (fileWriter(job->out + pos, n, fio) != n)
+        {
+            return NCMP_WRITE_ERROR;
+        }
+
+        pos += n;
+    }
+
+    return job->err;
+}
+
+
+
+/*  Decompress the mapped input of fio on numThreads threads, using
+    ctxt on this one.  Returns 0 if it has fewer than two members which
+    can be found, for it to be decompressed as usual.
+*/
+static int
+decompressMembers(NCompressCtxt* ctxt, FileIO* fio, int numThreads, NCompressError* err)
+{
+    PrivState*  ps = (PrivState*)ctxt->priv;
+    MemberList  ml = {NULL, NULL, 0};
+    MemberPool  pool;
+    MemberJob   scan;
+    StreamEnd   se;
+    pthread_t*  threads;
+    int         numStarted = 0;
+    int         t;
+    long        i;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.in    = fio->map;
+    scan.inLen = fio->mapSize;
+
+    if (scanStream(memberReader, &scan, ps->inbuf, -1, &se, NULL, NULL, &ml) != NCMP_OK)
+    {
+        ml.num = 0;
+    }
+
+    // The CLEAR which ends the last member ends the input too.
+    while (ml.num > 0 && (size_t)ml.offsets[ml.num - 1] >= fio->mapSize)
+    {
+        --ml.num;
+    }
+
+    if (ml.num < 2)
+    {
+        free(ml.offsets);
+        free(ml.flags);
+        return 0;
+    }
+
+    pool.jobs = (MemberJob*)calloc(ml.num, sizeof(MemberJob));
+    threads   = (pthread_t*)malloc((numThreads - 1) * sizeof(pthread_t));
+
+    if (!pool.jobs || !threads)
+    {
+        free(pool.jobs);
+        free(threads);
+        free(ml.offsets);
+        free(ml.flags);
+        *err = NCMP_OTHER_ERROR;
+        return 1;
+    }
+
+    for (i = 0; i < ml.num; ++i)
+    {
+        MemberJob*  job = &pool.jobs[i];
+
+        job->in    = fio->map + ml.offsets[i];
+        job->inLen = ((i + 1 < ml.num) ? (size_t)ml.offsets[i+1] : fio->mapSize) - ml.offsets[i];
+
+        // A part from a CLEAR gets the header of its stream.
+        if (job->inLen < 2 || job->in[0] != MAGIC_1 || job->in[1] != MAGIC_2)
+        {
+            job->head[0] = MAGIC_1;
+            job->head[1] = MAGIC_2;
+            job->head[2] = ml.flags[i];
+            job->headLen = sizeof(job->head);
+        }
+    }
+
+    free(ml.offsets);
+    free(ml.flags);
+
+    pool.numJobs = ml.num;
+    pool.next    = 0;
+    pool.limit   = (long)numThreads * MEMBERAHEAD;
+    pool.stop    = 0;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    for (t = 1; t < numThreads; ++t)
+    {
+        if (pthread_create(&threads[numStarted], NULL, memberWorker, &pool) == 0)
+        {
+            ++numStarted;
+        }
+    }
+
+    *err = NCMP_OK;
+
+    for (i = 0; i < pool.numJobs && *err == NCMP_OK; ++i)
+    {
+        MemberJob*  job = &pool.jobs[i];
+
+        pthread_mutex_lock(&pool.lock);
+
+        if (pool.next == i)
+        {
+            // No thread has taken it, so decode it here.
+            ++pool.next;
+
+            pthread_mutex_unlock(&pool.lock);
+            decodeMember(ctxt, job);
+            pthread_mutex_lock(&pool.lock);
+
+            job->done = 1;
+        }
+
+        while (!job->done)
+        {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+
+        pthread_mutex_unlock(&pool.lock);
+
+        *err = writeMember(fio, job);
+        free(job->out);
+        job->out = NULL;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.limit = i + 1 + (long)numThreads * MEMBERAHEAD;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (t = 0; t < numStarted; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    for (i = 0; i < pool.numJobs; ++i)
+    {
+        free(pool.jobs[i].out);
+    }
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.jobs);
+    free(threads);
+    return 1;
+}
+
+
+
+NCompressError
+nDecompressFileParallel(int fdIn, int fdOut, int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        numThreads = (n > 0) ? (int)n : 1;
+    }
+
+    return decompressFile(fdIn, fdOut, 0, numThreads);
+}
+
+
+
+//======================================================================
+//  Saving and loading state
+//
+//  A snapshot holds the position in the stream and the string table as
+//  the prefix and byte of each code in use, three bytes for each.  The
+//  compressor's dictionary is rebuilt by inserting the codes in order,
+//  which puts each key in the slot it had before since nothing is ever
+//  deleted from the dictionary but by a clear.  So the dictionary of
+//  either kind can be loaded from a snapshot of the other.  A code after
+//  a flush may have no entry, which is saved with the prefix NOPREFIX.
+//
+//  The header is STATEMAGIC, STATEVERSION, the kind and the length of
+//  the whole snapshot.  Numbers are 8 bytes, least significant first.
+
+#define STATEMAGIC      "nCmS"
+#define STATEVERSION    1
+#define STATEHEADER     14
+#define STATEBUFSIZ     4096
+#define STATENUMS       32          // room for the numbers of either kind
+#define NOPREFIX        0xFFFF
+
+
+typedef struct stateIO
+{
+    NCmpStreamReader    reader;
+    NCmpStreamWriter    writer;
+    void*               rwCtxt;
+    long                left;       // still to read
+    int                 len;
+    int                 pos;
+    int                 failed;
+    Byte                buf[STATEBUFSIZ];
+} StateIO;
+
+
+
+static void
+flushState(StateIO* st)
+{
+    if (st->len > 0 && !st->failed && st->writer(st->buf, st->len, st->rwCtxt) != st->len)
+    {
+        st->failed = 1;
+    }
+
+    st->len = 0;
+}
+
+
+
+static void
+putBytes(StateIO* st, const Byte* bytes, size_t numBytes)
+{
+    while (numBytes > 0 && !st->failed)
+    {
+        size_t n = STATEBUFSIZ - st->len;
+
+        if (n > numBytes)
+        {
+            n = numBytes;
+        }
+
+        memcpy(st->buf + st->len, bytes, n);
+        st->len  += (int)n;
+        bytes    += n;
+        numBytes -= n;
+
+        if (st->len == STATEBUFSIZ)
+        {
+            flushState(st);
+        }
+    }
+}
+
+
+
+static void
+putNum(StateIO* st, int64_t v)
+{
+    Byte    b[8];
+    int     i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        b[i] = (Byte)((uint64_t)v >> (i * 8));
+    }
+
+    putBytes(st, b, 8);
+}
+
+
+
+/*  Read from the snapshot, never past its end.  After a failure this
+    gives zeros.
+*/
+static void
+getBytes(StateIO* st, Byte* bytes, size_t numBytes)
+{
+    while (numBytes > 0)
+    {
+        size_t n;
+
+        if (st->pos == st->len)
+        {
+            int r = 0;
+
+            if (!st->failed && st->left > 0)
+            {
+                r = st->reader(st->buf, (st->left < STATEBUFSIZ) ? st->left : STATEBUFSIZ, st->rwCtxt);
+            }
+
+            if (r <= 0)
+            {
+                st->failed = 1;
+                memset(bytes, 0, numBytes);
+                return;
+            }
+
+            st->left -= r;
+            st->len   = r;
+            st->pos   = 0;
+        }
+
+        n = st->len - st->pos;
+
+        if (n > numBytes)
+        {
+            n = numBytes;
+        }
+
+        memcpy(bytes, st->buf + st->pos, n);
+        st->pos  += (int)n;
+        bytes    += n;
+        numBytes -= n;
+    }
+}
+
+
+
+static int64_t
+getNum(StateIO* st)
+{
+    Byte            b[8];
+    uint64_t        v = 0;
+    int             i;
+
+    getBytes(st, b, 8);
+
+    for (i = 7; i >= 0; --i)
+    {
+        v = (v << 8) | b[i];
+    }
+
+    return (int64_t)v;
+}
+
+
+
+/*  Collect the prefix and byte of each code in the compressor's
+    dictionary.
+*/
+static void
+dictEntries(PrivState* ps, unsigned short* prefix, Byte* ch)
+{
+    long    slot;
+
+    memset(prefix, 0xFF, MAXCODE(BITS) * sizeof(*prefix));
+
+    if (ps->dict == NCMP_DICT_TAGGED)
+    {
+        for (slot = 0; slot < TAGBUCKETS * TAGSLOTS; ++slot)
+        {
+            TagBucket*  bk = &ps->tagtab[slot / TAGSLOTS];
+            int         i  = (int)(slot % TAGSLOTS);
+
+            if (bk->tag[i] != 0)
+            {
+                prefix[bk->code[i]] = (unsigned short)(bk->key[i] >> 8);
+                ch[bk->code[i]]     = (Byte)bk->key[i];
+            }
+        }
+    }
+    else
+    {
+        for (slot = 0; slot < HSIZE; ++slot)
+        {
+            if (htabof(ps, slot) != -1)
+            {
+                FCode f;
+
+                f.code = htabof(ps, slot);
+                prefix[codetabof(ps, slot)] = f.e.ent;
+                ch[codetabof(ps, slot)]     = f.e.c;
+            }
+        }
+    }
+}
+
+
+
+static NCompressError
+saveState(NCompressCtxt* ctxt, StateIO* st)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    unsigned short* prefix = NULL;
+    Byte*           ch = NULL;
+    code_int        first;
+    code_int        end = ps->free_ent;
+    int             n_bits = ps->n_bits;
+    code_int        preset = ps->presetEnd;
+    code_int        code;
+    long            length;
+    Byte            head[6] = STATEMAGIC;
+    int             i;
+
+    // A snapshot has no room for extended codes.
+    if (ps->maxbits > BITS)
+    {
+        return NCMP_BITS_ERROR;
+    }
+
+    if (ps->expanding)
+    {
+        first = ps->block_mode ? FIRST : 256;
+
+        if (ps->dstate == DS_HEADER)
+        {
+            // The table is set up with the header.
+            first  = end = 256;
+            n_bits = INIT_BITS;
+            preset = FIRST;
+        }
+    }
+    else
+    {
+        if (ps->started && writeCompleteBytes(ctxt) != NCMP_OK)
+        {
+            return NCMP_WRITE_ERROR;
+        }
+
+        first = FIRST;
+
+        if (!ps->started)
+        {
+            // Nothing else matters until the next stream starts.
+            end    = FIRST;
+            n_bits = INIT_BITS;
+            preset = FIRST;
+        }
+        else
+        if ((prefix = (unsigned short*)malloc(MAXCODE(BITS) * sizeof(*prefix))) == NULL ||
+            (ch = (Byte*)malloc(MAXCODE(BITS))) == NULL)
+        {
+            free(prefix);
+            return NCMP_OTHER_ERROR;
+        }
+        else
+        {
+            dictEntries(ps, prefix, ch);
+        }
+    }
+
+    length = STATEHEADER + STATENUMS * 8 + ((end > first) ? (end - first) * 3 : 0);
+
+    if (ps->expanding)
+    {
+        length += ps->insize + ps->pending;
+    }
+    else
+    {
+        length += 1 + 256 * 8 * 2;
+    }
+
+    head[4] = STATEVERSION;
+    head[5] = (Byte)ps->expanding;
+    putBytes(st, head, 6);
+    putNum(st, length);
+
+    // The numbers, padded to STATENUMS.
+    putNum(st, ps->maxbits);
+    putNum(st, ps->block_mode);
+    putNum(st, n_bits);
+    putNum(st, end);
+    putNum(st, ps->bytes_in);
+    putNum(st, ps->bytes_out);
+    putNum(st, ps->fullAt);
+
+    if (ps->expanding)
+    {
+        putNum(st, ps->dstate);
+        putNum(st, ps->derror);
+        putNum(st, ps->insize);
+        putNum(st, ps->inbits);
+        putNum(st, ps->posbits);
+        putNum(st, ps->rsize);
+        putNum(st, ps->finchar);
+        putNum(st, ps->oldcode);
+        putNum(st, ps->maxcode);
+        putNum(st, ps->pending);
+        putNum(st, ps->feeding);
+        putNum(st, ps->feedEnd);
+        putNum(st, preset);
+        putNum(st, ps->crcOn);
+        putNum(st, ps->crc);
+
+        for (i = 22; i < STATENUMS; ++i)
+        {
+            putNum(st, 0);
+        }
+
+        putBytes(st, ps->inbuf, ps->insize);
+        putBytes(st, de_stack(ps) - ps->pending, ps->pending);
+
+        for (code = first; code < end; ++code)
+        {
+            Byte e[3];
+
+            e[0] = (Byte)tab_prefixof(ps, code);
+            e[1] = (Byte)(tab_prefixof(ps, code) >> 8);
+            e[2] = tab_suffixof(ps, code);
+            putBytes(st, e, 3);
+        }
+    }
+    else
+    {
+        putNum(st, ps->started);
+        putNum(st, ps->hasent);
+        putNum(st, ps->flushed);
+        putNum(st, ps->outbits);
+        putNum(st, ps->boff);
+        putNum(st, ps->ratio);
+        putNum(st, ps->stcode);
+        putNum(st, ps->checkpoint);
+        putNum(st, ps->extcode);
+        putNum(st, ps->fcode.e.ent);
+        putNum(st, ps->fcode.e.c);
+        putNum(st, ps->runpend);
+        putNum(st, preset);
+        putNum(st, ps->crcOn);
+        putNum(st, ps->crc);
+        putNum(st, ps->memberSize);
+        putNum(st, ps->memberIn);
+
+        for (i = 24; i < STATENUMS; ++i)
+        {
+            putNum(st, 0);
+        }
+
+        putBytes(st, ps->outbuf, 1);
+
+        for (i = 0; i < 256; ++i)
+        {
+            putNum(st, ps->runlen[i]);
+            putNum(st, ps->runcode[i]);
+        }
+
+        for (code = first; code < end; ++code)
+        {
+            Byte e[3];
+
+            e[0] = (Byte)prefix[code];
+            e[1] = (Byte)(prefix[code] >> 8);
+            e[2] = ch[code];
+            putBytes(st, e, 3);
+        }
+
+        free(prefix);
+        free(ch);
+    }
+
+    flushState(st);
+    return st->failed ? NCMP_WRITE_ERROR : NCMP_OK;
+}
+
+
+
+/*  Read the entries of the table from first up to free_ent.  Returns 0
+    if a prefix isn't an earlier code, or NOPREFIX when holes are allowed.
+*/
+static int
+loadEntries(StateIO* st, code_int first, code_int free_ent, int holes, unsigned short* prefix, Byte* ch)
+{
+    code_int    code;
+
+    for (code = first; code < free_ent; ++code)
+    {
+        Byte e[3];
+
+        getBytes(st, e, 3);
+        prefix[code] = (unsigned short)(e[0] | (e[1] << 8));
+        ch[code]     = e[2];
+
+        if (prefix[code] >= code && !(holes && prefix[code] == NOPREFIX))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*  Check that the entries before presetEnd are those of the preset.
+*/
+static int
+presetMatches(PrivState* ps, const unsigned short* prefix, const Byte* ch)
+{
+    code_int    code;
+
+    for (code = FIRST; code < ps->presetEnd; ++code)
+    {
+        if (prefix[code] != ps->presetPrefix[code - FIRST] || ch[code] != ps->presetChar[code - FIRST])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+static NCompressError
+loadExpander(PrivState* ps, StateIO* st, int64_t* num)
+{
+    code_int    first;
+    code_int    code;
+
+    ps->dstate   = (int)num[7];
+    ps->derror   = (NCompressError)num[8];
+    ps->insize   = (int)num[9];
+    ps->inbits   = (int)num[10];
+    ps->posbits  = (int)num[11];
+    ps->rsize    = (int)num[12];
+    ps->finchar  = (int)num[13];
+    ps->oldcode  = num[14];
+    ps->maxcode  = num[15];
+    ps->pending  = num[16];
+    ps->feeding  = (num[17] != 0);
+    ps->feedEnd  = (num[18] != 0);
+    ps->feed     = NULL;
+    ps->feedLen  = 0;
+
+    ps->maxmaxcode = MAXCODE(ps->maxbits);
+    first = ps->block_mode ? FIRST : 256;
+
+    if (num[7] < DS_HEADER || num[7] > DS_WAIT || num[8] < NCMP_OK || num[8] > NCMP_LIMIT_ERROR ||
+        num[9] < 0 || num[9] > IBUFSIZ_ALL - 16)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (ps->dstate == DS_HEADER)
+    {
+        getBytes(st, ps->inbuf, ps->insize);
+        ps->pending = 0;
+        return NCMP_OK;
+    }
+
+    if ((ps->dstate == DS_CODES && num[10] > (num[9] << 3)) || num[11] < 0 || num[11] > ((num[9] + BITS) << 3) ||
+        num[13] < 0 || num[13] > 255 || num[14] < -1 || num[14] >= ps->maxmaxcode ||
+        num[15] < 0 || num[15] > ps->maxmaxcode || num[16] < 0 || num[16] > 0xFFFF ||
+        ps->free_ent < 256 || (ps->presetEnd > FIRST && ps->free_ent < ps->presetEnd))
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    // Just after a CLEAR the previous code only makes the unused entry
+    // for CLEAR, so one which is stale by then isn't kept.
+    if (ps->oldcode >= ps->free_ent)
+    {
+        if (ps->free_ent >= first)
+        {
+            return NCMP_DATA_ERROR;
+        }
+
+        ps->oldcode = 0;
+    }
+
+    getBytes(st, ps->inbuf, ps->insize);
+    getBytes(st, de_stack(ps) - ps->pending, ps->pending);
+
+    for (code = 255; code >= 0; --code)
+    {
+        tab_suffixof(ps, code) = (Byte)code;
+        tab_lenof(ps, code) = 1;
+    }
+
+    if (!loadEntries(st, first, ps->free_ent, 0, ps->codetab, (Byte*)ps->htab))
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (!presetMatches(ps, ps->codetab, (Byte*)ps->htab))
+    {
+        return NCMP_PRESET_ERROR;
+    }
+
+    for (code = first; code < ps->free_ent; ++code)
+    {
+        tab_lenof(ps, code) = (unsigned short)(tab_lenof(ps, tab_prefixof(ps, code)) + 1);
+    }
+
+    ps->primed = ps->presetEnd;
+    return NCMP_OK;
+}
+
+
+
+/*  Find the code of b^j in the dictionary, or -1 if it isn't there.
+*/
+static long
+loadRunCode(PrivState* ps, const int tagged, Byte b, long j)
+{
+    FCode   f;
+    long    slot;
+    long    code = b;
+
+    f.code = 0;
+    f.e.c  = b;
+
+    while (--j > 0 && code >= 0)
+    {
+        f.e.ent = (unsigned short)code;
+        code    = dictFind(ps, tagged, f, &slot);
+    }
+
+    return code;
+}
+
+
+
+static NCompressError
+loadCompressor(PrivState* ps, StateIO* st, int64_t* num)
+{
+    const int       tagged = (ps->dict == NCMP_DICT_TAGGED);
+    unsigned short* prefix;
+    Byte*           ch;
+    code_int        code;
+    int             i;
+    int             ok;
+
+    ps->started    = (num[7] != 0);
+    ps->hasent     = (num[8] != 0);
+    ps->flushed    = (num[9] != 0);
+    ps->outbits    = (int)num[10];
+    ps->boff       = (int)num[11];
+    ps->ratio      = (int)num[12];
+    ps->stcode     = (int)num[13];
+    ps->checkpoint = num[14];
+    ps->extcode    = num[15];
+    ps->fcode.code = 0;
+    ps->fcode.e.ent = (unsigned short)num[16];
+    ps->fcode.e.c  = (Byte)num[17];
+    ps->memberSize = num[22];
+    ps->memberIn   = num[23];
+
+    if (num[22] < 0 || num[23] < 0)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (!ps->started)
+    {
+        return NCMP_OK;
+    }
+
+    // The width and the point of widening must agree, else the table
+    // can grow past its end.
+    if (ps->maxbits < INIT_BITS || ps->n_bits > ps->maxbits || (ps->stcode != 0 && ps->stcode != 1) ||
+        ps->extcode != (ps->stcode ? EXTCODE(ps->n_bits, ps->maxbits) : FULLCODE(ps->maxbits)) ||
+        (!ps->stcode && ps->n_bits != ps->maxbits))
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (ps->free_ent < FIRST || num[10] < 0 || num[10] > 7 ||
+        num[11] <= -(ps->n_bits << 3) || num[11] > num[10] || num[18] < 0 || num[18] > MAXCODE(BITS) ||
+        (ps->hasent && (num[16] < 0 || num[16] >= ps->free_ent)))
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    memset(ps->outbuf, 0, OBUFSIZ_ALL);
+    getBytes(st, ps->outbuf, 1);
+
+    clear_dict(ps, tagged);
+
+    for (i = 0; i < 256; ++i)
+    {
+        ps->runlen[i]  = getNum(st);
+        ps->runcode[i] = (unsigned short)getNum(st);
+
+        if (ps->runlen[i] < 0 || ps->runlen[i] > ps->free_ent - FIRST + 1 ||
+            (ps->runlen[i] > 0 && ps->runcode[i] >= ps->free_ent))
+        {
+            return NCMP_DATA_ERROR;
+        }
+    }
+
+    ps->runpend = num[18];
+
+    if ((prefix = (unsigned short*)malloc(MAXCODE(BITS) * sizeof(*prefix))) == NULL ||
+        (ch = (Byte*)malloc(MAXCODE(BITS))) == NULL)
+    {
+        free(prefix);
+        return NCMP_OTHER_ERROR;
+    }
+
+    ok = loadEntries(st, FIRST, ps->free_ent, 1, prefix, ch);
+
+    if (ok && (ps->free_ent < ps->presetEnd || !presetMatches(ps, prefix, ch)))
+    {
+        free(prefix);
+        free(ch);
+        return NCMP_PRESET_ERROR;
+    }
+
+    for (code = FIRST; ok && code < ps->free_ent; ++code)
+    {
+        FCode   f;
+        long    slot;
+
+        if (prefix[code] == NOPREFIX)
+        {
+            ps->slotof[code & (MAXCODE(INIT_BITS)-1)] = NOSLOT;
+            continue;
+        }
+
+        f.code  = 0;
+        f.e.ent = prefix[code];
+        f.e.c   = ch[code];
+
+        if (dictFind(ps, tagged, f, &slot) >= 0)
+        {
+            ok = 0;
+        }
+        else
+        {
+            dictInsert(ps, tagged, slot, f, code);
+        }
+    }
+
+    free(prefix);
+    free(ch);
+
+    // compressRun() trusts the runs, and a pending run, to be there.
+    for (i = 0; ok && i < 256; ++i)
+    {
+        if (ps->runlen[i] > 0 && loadRunCode(ps, tagged, (Byte)i, ps->runlen[i]) != ps->runcode[i])
+        {
+            ok = 0;
+        }
+    }
+
+    if (ok && ps->runpend > 0 &&
+        (!ps->hasent || ps->fcode.e.ent >= 256 || loadRunCode(ps, tagged, (Byte)ps->fcode.e.ent, ps->runpend) < 0))
+    {
+        ok = 0;
+    }
+
+    ps->primed = ps->presetEnd;
+    return ok ? NCMP_OK : NCMP_DATA_ERROR;
+}
+
+
+
+static NCompressError
+loadState(NCompressCtxt* ctxt, StateIO* st)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    Byte            head[6];
+    int64_t         num[STATENUMS];
+    long            length;
+    NCompressError  err;
+    int             i;
+
+    st->left = STATEHEADER;
+    getBytes(st, head, 6);
+    length = getNum(st);
+
+    if (st->failed || memcmp(head, STATEMAGIC, 4) != 0 || head[4] != STATEVERSION ||
+        head[5] != ps->expanding || length < STATEHEADER + STATENUMS * 8)
+    {
+        return st->failed ? NCMP_READ_ERROR : NCMP_DATA_ERROR;
+    }
+
+    st->left = length - STATEHEADER;
+
+    for (i = 0; i < STATENUMS; ++i)
+    {
+        num[i] = getNum(st);
+    }
+
+    if (st->failed)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    // Before its header a stream has no bits, and no table to check.
+    if (num[0] < 0 || num[0] > BITS || num[2] < INIT_BITS || num[2] > BITS ||
+        num[3] < 0 || (num[3] > MAXCODE(num[0]) && !(ps->expanding && num[7] == DS_HEADER)) ||
+        num[20] < 0 || num[20] > 1 || num[21] < 0 || num[21] > 0xFFFFFFFFL)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    ps->maxbits    = (int)num[0];
+    ps->block_mode = num[1] ? BLOCK_MODE : 0;
+    ps->n_bits     = (int)num[2];
+    ps->free_ent   = num[3];
+    ps->presetEnd  = FIRST;
+    ps->primed     = 0;
 
-            goto next;
+    resetStats(ps);
 
-hfound:     fcode.e.ent = codetabof(ps, hp);
+    // A stream with a preset needs the same one here.
+    if (num[19] > FIRST && (!ps->presetLen || num[0] < INIT_BITS || num[19] != presetEndOf(ps)))
+    {
+        err = NCMP_PRESET_ERROR;
+    }
+    else
+    {
+        if (num[19] > FIRST)
+        {
+            ps->presetEnd = num[19];
+        }
 
-next:       if (rpos >= rlop)
-            {
-                goto endlop;
-            }
+        err = ps->expanding ? loadExpander(ps, st, num) : loadCompressor(ps, st, num);
+    }
 
-next2:      fcode.e.c = ps->inbuf[rpos++];
-            {
-                long   i;
-                long   p;
-                fc = fcode.code;
-                hp = ((((long)(fcode.e.c)) << (HBITS-8)) ^ (long)(fcode.e.ent));
+    ps->bytes_in  = num[4];
+    ps->bytes_out = num[5];
+    ps->fullAt    = num[6];
+    ps->crcOn     = (int)num[20];
+    ps->crc       = (uint32_t)num[21];
 
-                if ((i = htabof(ps, hp)) == fc) goto hfound;
-                if (i == -1)                goto out;
+    if (ps->crcOn)
+    {
+        chooseCrc();
+    }
 
-                p = primetab[fcode.e.c];
-lookup:             hp = (hp+p)&HMASK;
-                if ((i = htabof(ps, hp)) == fc) goto hfound;
-                if (i == -1)                goto out;
-                hp = (hp+p)&HMASK;
-                if ((i = htabof(ps, hp)) == fc) goto hfound;
-                if (i == -1)                goto out;
-                hp = (hp+p)&HMASK;
-                if ((i = htabof(ps, hp)) == fc) goto hfound;
-                if (i == -1)                goto out;
-                goto lookup;
-            }
-out:        ;
-            output(ps->outbuf, outbits, fcode.e.ent, n_bits);
+    if (err == NCMP_OK && st->failed)
+    {
+        err = NCMP_READ_ERROR;
+    }
 
-            {
-                long   fc;
-                fc = fcode.code;
-                fcode.e.ent = fcode.e.c;
+    if (err != NCMP_OK)
+    {
+        // Leave the context as though it were new.
+        ps->primed = 0;
 
+        if (ps->expanding)
+            beginDecompress(ps);
+        else
+            ps->started = 0;
+    }
 
-                if (stcode)
-                {
-                    codetabof(ps, hp) = (unsigned short)free_ent++;
-                    htabof(ps, hp) = fc;
-                }
-            }
+    return err;
+}
 
-            goto next;
 
-endlop:     if (fcode.e.ent >= FIRST && rpos < rsize)
-            {
-                goto next2;
-            }
 
-            if (rpos > rlop)
-            {
-                ps->bytes_in += rpos-rlop;
-                rlop = rpos;
-            }
-        }
-        while (rlop < rsize);
-    }
+NCompressError
+nSaveState(NCompressCtxt* ctxt, NCmpStreamWriter writer, void* wCtxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    StateIO         st;
+    double          start;
+    NCompressError  err;
 
-    if (rsize < 0)
+    if (!ps)
     {
         return NCMP_OTHER_ERROR;
     }
 
-    if (ps->bytes_in > 0)
-    {
-        output(ps->outbuf, outbits, fcode.e.ent, n_bits);
-    }
+    memset(&st, 0, sizeof(st));
+    st.writer = writer;
+    st.rwCtxt = wCtxt;
+
+    start = enterCall(ps);
+    err   = saveState(ctxt, &st);
+
+    leaveCall(ps, start);
+    return err;
+}
+
+
+
+NCompressError
+nLoadState(NCompressCtxt* ctxt, NCmpStreamReader reader, void* rCtxt)
+{
+    PrivState*      ps = (PrivState*)ctxt->priv;
+    StateIO         st;
+    double          start;
+    NCompressError  err;
 
-    if ((ctxt->writer)(ps->outbuf, (outbits+7)>>3, ctxt->rwCtxt) != (outbits+7)>>3)
+    if (!ps)
     {
-        return NCMP_WRITE_ERROR;
+        return NCMP_OTHER_ERROR;
     }
 
-    ps->bytes_out += (outbits+7)>>3;
+    memset(&st, 0, sizeof(st));
+    st.reader = reader;
+    st.rwCtxt = rCtxt;
 
-    return NCMP_OK;
+    start = enterCall(ps);
+    err   = loadState(ctxt, &st);
+
+    leaveCall(ps, start);
+    return err;
 }
 
 
 
-/*
-    Decompress stdin to stdout.  This routine adapts to the codes in the
-    file building the "string" table on-the-fly; requiring no table to
-    be stored in the compressed file.  The tables used herein are shared
-    with those of the compress() routine.  See the definitions above.
-*/
+//======================================================================
+//  Preset tables
+//
+//  The sample is compressed into the classic dictionary as a stream
+//  would be, keeping the entries which it adds.  That is the preset.
+//  The compressor's dictionary and the decompressor's table are primed
+//  with it at the start of the first stream that uses it and keep it
+//  from then on.  See clear_used() and readHeader().
+//
+//  The trainer scores a message by how common its strings are, as the
+//  mean over its substrings of GRAMLEN bytes of the number of messages
+//  which have each one.  It takes the best message which fits, takes a
+//  quarter off the counts of its substrings and goes on.  LZW learns a
+//  string a byte at a time, so a few copies of it are worth having but
+//  each is worth less than the last.  The scores never rise, so the
+//  heap only rescores the message at the top.
+
+#define GRAMLEN     6
+#define GRAMBITS    20
+
+
+typedef struct trainItem
+{
+    double      score;
+    size_t      msg;
+    size_t      round;      // when the score was worked out
+} TrainItem;
+
+
+typedef struct trainer
+{
+    const Byte* const*  msgs;
+    const size_t*       msgLens;
+    uint32_t*           count;
+    uint32_t*           mark;
+    uint32_t            marker;
+    TrainItem*          heap;
+    size_t              heapLen;
+} Trainer;
+
+
 
 NCompressError
-nDecompress(NCompressCtxt* ctxt)
+nSetPreset(NCompressCtxt* ctxt, const Byte* sample, size_t sampleLen)
 {
-    Byte        *stackp;
-    code_int    code;
-    int         finchar;
-    code_int    oldcode;
-    code_int    incode;
-    int         inbits;
-    int         posbits;
-    int         outpos;
-    int         insize;
-    int         bitmask;
-    code_int    free_ent;
-    code_int    maxcode;
-    code_int    maxmaxcode;
-    int         n_bits;
-    int         rsize;
     PrivState*  ps = (PrivState*)ctxt->priv;
+    long        size = PRESETEND(BITS) - FIRST;
+    code_int    code = FIRST;
+    FCode       f;
+    size_t      i;
 
-    ps->bytes_in = 0;
-    ps->bytes_out = 0;
-    insize = 0;
+    if (!ps)
+    {
+        return NCMP_OTHER_ERROR;
+    }
 
-    while (insize < 3 && (rsize = (ctxt->reader)(ps->inbuf + insize, IBUFSIZ, ctxt->rwCtxt)) > 0)
+    nResetCompress(ctxt);
+
+    free(ps->presetPrefix);
+    ps->presetPrefix = NULL;
+    ps->presetChar   = NULL;
+    ps->presetLen    = 0;
+    ps->primed       = 0;
+
+    if (sampleLen == 0)
     {
-        insize += rsize;
+        return NCMP_OK;
     }
 
-    if (insize < 3 || ps->inbuf[0] != MAGIC_1 || ps->inbuf[1] != MAGIC_2)
+    if ((ps->presetPrefix = (unsigned short*)malloc(size * 3)) == NULL)
     {
-        return NCMP_DATA_ERROR;
+        return NCMP_OTHER_ERROR;
     }
 
-    ps->maxbits    = ps->inbuf[2] & BIT_MASK;
-    ps->block_mode = ps->inbuf[2] & BLOCK_MODE;
+    ps->presetChar = (Byte*)(ps->presetPrefix + size);
 
-    maxmaxcode = MAXCODE(ps->maxbits);
+    clear_htab(ps);
 
-    if (ps->maxbits > BITS)
+    f.code  = 0;
+    f.e.ent = sample[0];
+
+    for (i = 1; i < sampleLen && code < PRESETEND(BITS); ++i)
     {
-        return NCMP_BITS_ERROR;
+        long    slot;
+        long    found;
+
+        f.e.c = sample[i];
+
+        if ((found = classicFind(ps, f, &slot)) >= 0)
+        {
+            f.e.ent = (unsigned short)found;
+            continue;
+        }
+
+        dictInsert(ps, 0, slot, f, code);
+        ps->presetPrefix[code - FIRST] = f.e.ent;
+        ps->presetChar[code - FIRST]   = f.e.c;
+
+        ++code;
+        f.e.ent = f.e.c;
     }
 
-    ps->bytes_in = insize;
-    maxcode = MAXCODE(n_bits = INIT_BITS)-1;
-    bitmask = (1<<n_bits)-1;
-    oldcode = -1;
-    finchar = 0;
-    outpos  = 0;
-    posbits = 3<<3;
+    ps->presetLen = code - FIRST;
+    return NCMP_OK;
+}
+
 
-    free_ent = ((ps->block_mode) ? FIRST : 256);
 
-    clear_tab_prefixof(ps);   // As above, initialize the first 256 entries in the table.
+static inline uint32_t
+gramHash(const Byte* p)
+{
+    uint64_t    v = 0;
 
-    for (code = 255 ; code >= 0 ; --code) 
+    memcpy(&v, p, GRAMLEN);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - GRAMBITS));
+}
+
+
+
+/*  Add step to the count of each substring of the message, once however
+    often it appears.  This returns the mean count of its substrings
+    before the change.
+*/
+static double
+scoreMessage(Trainer* tr, size_t msg, int step)
+{
+    const Byte* p = tr->msgs[msg];
+    size_t      len = tr->msgLens[msg];
+    double      sum = 0;
+    size_t      i;
+
+    if (len < GRAMLEN)
     {
-        tab_suffixof(ps, code) = (Byte)code;
+        return 0;
     }
 
-    do
+    ++tr->marker;
+
+    for (i = 0; i + GRAMLEN <= len; ++i)
     {
-resetbuf:   ;
+        uint32_t    h = gramHash(p + i);
+
+        sum += tr->count[h];
+
+        if (step != 0 && tr->mark[h] != tr->marker)
         {
-            int    i;
-            int    e;
-            int    o;
+            tr->mark[h]   = tr->marker;
+            tr->count[h] += step;
+        }
+    }
 
-            o = posbits >> 3;
-            e = (o <= insize) ? insize - o : 0;
+    return sum / (len - GRAMLEN + 1);
+}
 
-            for (i = 0 ; i < e ; ++i)
-            {
-                ps->inbuf[i] = ps->inbuf[i+o];
-            }
 
-            insize = e;
-            posbits = 0;
-        }
 
-        if (insize < IBUFSIZ_ALL - IBUFSIZ)
-        {
-            if ((rsize = (ctxt->reader)(ps->inbuf + insize, IBUFSIZ, ctxt->rwCtxt)) < 0)
-            {
-                return NCMP_READ_ERROR;
-            }
+static void
+lowerCounts(Trainer* tr, size_t msg)
+{
+    const Byte* p = tr->msgs[msg];
+    size_t      i;
+
+    ++tr->marker;
+
+    for (i = 0; i + GRAMLEN <= tr->msgLens[msg]; ++i)
+    {
+        uint32_t    h = gramHash(p + i);
 
-            insize += rsize;
+        if (tr->mark[h] != tr->marker)
+        {
+            tr->mark[h]   = tr->marker;
+            tr->count[h] -= tr->count[h] / 4;
         }
+    }
+}
 
-        inbits = ((rsize > 0) ? (insize - insize%n_bits)<<3 :
-                                (insize<<3)-(n_bits-1));
 
-        while (inbits > posbits)
+
+static void
+heapPush(Trainer* tr, TrainItem item)
+{
+    size_t  i = tr->heapLen++;
+
+    while (i > 0 && tr->heap[(i - 1) / 2].score < item.score)
+    {
+        tr->heap[i] = tr->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    tr->heap[i] = item;
+}
+
+
+
+static TrainItem
+heapPop(Trainer* tr)
+{
+    TrainItem   top = tr->heap[0];
+    TrainItem   last = tr->heap[--tr->heapLen];
+    size_t      i = 0;
+
+    for (;;)
+    {
+        size_t  c = 2 * i + 1;
+
+        if (c >= tr->heapLen)
         {
-            if (free_ent > maxcode)
-            {
-                posbits = ((posbits-1) + ((n_bits<<3) -
-                                 (posbits-1+(n_bits<<3))%(n_bits<<3)));
+            break;
+        }
 
-                ++n_bits;
-                if (n_bits == ps->maxbits)
-                    maxcode = maxmaxcode;
-                else
-                    maxcode = MAXCODE(n_bits)-1;
+        if (c + 1 < tr->heapLen && tr->heap[c + 1].score > tr->heap[c].score)
+        {
+            ++c;
+        }
 
-                bitmask = (1<<n_bits)-1;
-                goto resetbuf;
-            }
+        if (tr->heap[c].score <= last.score)
+        {
+            break;
+        }
 
-            input(ps->inbuf, posbits, code, n_bits, bitmask);
+        tr->heap[i] = tr->heap[c];
+        i = c;
+    }
 
-            if (oldcode == -1)
-            {
-                if (code >= 256) {
-#if 0
-                    fprintf(stderr, "oldcode:-1 code:%i\n", (int)(code));
-                    fprintf(stderr, "uncompress: corrupt input\n");
-#endif
-                    return NCMP_DATA_ERROR;
-                }
-                ps->outbuf[outpos++] = (Byte)(finchar = (int)(oldcode = code));
-                continue;
-            }
+    if (tr->heapLen > 0)
+    {
+        tr->heap[i] = last;
+    }
 
-            if (code == CLEAR && ps->block_mode)
-            {
-                clear_tab_prefixof(ps);
-                free_ent = FIRST - 1;
-                posbits = ((posbits-1) + ((n_bits<<3) -
-                            (posbits-1+(n_bits<<3))%(n_bits<<3)));
-                maxcode = MAXCODE(n_bits = INIT_BITS)-1;
-                bitmask = (1<<n_bits)-1;
-                goto resetbuf;
-            }
+    return top;
+}
 
-            incode = code;
-            stackp = de_stack(ps);
 
-            if (code >= free_ent)   /* Special case for KwKwK string.   */
-            {
-                if (code > free_ent)
-                {
-#if 0
-                    Byte *p;
 
-                    posbits -= n_bits;
-                    p = &ps->inbuf[posbits>>3];
+NCompressError
+nTrainPreset(const Byte* const* msgs, const size_t* msgLens, size_t numMsgs,
+             Byte* sample, size_t sampleCap, size_t* sampleLen)
+{
+    Trainer     tr;
+    size_t      round = 0;
+    size_t      i;
 
-                    fprintf(stderr, "insize:%d posbits:%d inbuf:%02X %02X %02X %02X %02X (%d)\n", insize, posbits,
-                            p[-1],p[0],p[1],p[2],p[3], (posbits&07));
-                    fprintf(stderr, "uncompress: corrupt input\n");
-#endif
-                    return NCMP_DATA_ERROR;
-                }
+    *sampleLen = 0;
 
-                *--stackp = (Byte)finchar;
-                code = oldcode;
-            }
+    memset(&tr, 0, sizeof(tr));
+    tr.msgs    = msgs;
+    tr.msgLens = msgLens;
+    tr.count   = (uint32_t*)calloc(1 << GRAMBITS, sizeof(uint32_t));
+    tr.mark    = (uint32_t*)calloc(1 << GRAMBITS, sizeof(uint32_t));
+    tr.heap    = (TrainItem*)malloc((numMsgs + 1) * sizeof(TrainItem));
 
-            while ((cmp_code_int)code >= (cmp_code_int)256)
-            {
-                // Generate output characters in reverse order
-                *--stackp = tab_suffixof(ps, code);
-                code = tab_prefixof(ps, code);
-            }
+    if (!tr.count || !tr.mark || !tr.heap)
+    {
+        free(tr.count);
+        free(tr.mark);
+        free(tr.heap);
+        return NCMP_OTHER_ERROR;
+    }
 
-            *--stackp = (Byte)(finchar = tab_suffixof(ps, code));
+    for (i = 0; i < numMsgs; ++i)
+    {
+        scoreMessage(&tr, i, 1);
+    }
 
-            // And put them out in forward order
-            {
-                int    i;
+    for (i = 0; i < numMsgs; ++i)
+    {
+        TrainItem   item = { scoreMessage(&tr, i, 0), i, 0 };
 
-                if (outpos + (i = (de_stack(ps) - stackp)) >= OBUFSIZ)
-                {
-                    do
-                    {
-                        if (i > OBUFSIZ - outpos)
-                        {
-                            i = OBUFSIZ-outpos;
-                        }
+        if (item.score > 0 && msgLens[i] <= sampleCap)
+        {
+            heapPush(&tr, item);
+        }
+    }
 
-                        if (i > 0)
-                        {
-                            memcpy(ps->outbuf + outpos, stackp, i);
-                            outpos += i;
-                        }
+    while (tr.heapLen > 0)
+    {
+        TrainItem   item = heapPop(&tr);
+        size_t      len = msgLens[item.msg];
 
-                        if (outpos >= OBUFSIZ)
-                        {
-                            if ((ctxt->writer)(ps->outbuf, outpos, ctxt->rwCtxt) != outpos)
-                            {
-                                return NCMP_WRITE_ERROR;
-                            }
+        if (len > sampleCap - *sampleLen)
+        {
+            continue;
+        }
 
-                            outpos = 0;
-                        }
-                        stackp+= i;
-                    }
-                    while ((i = (de_stack(ps) - stackp)) > 0);
-                }
-                else
-                {
-                    memcpy(ps->outbuf + outpos, stackp, i);
-                    outpos += i;
-                }
-            }
+        if (item.round != round)
+        {
+            // Put it back unless it is still the best.
+            item.score = scoreMessage(&tr, item.msg, 0);
+            item.round = round;
 
-            if ((code = free_ent) < maxmaxcode) /* Generate the new entry. */
+            if (tr.heapLen > 0 && item.score < tr.heap[0].score)
             {
-                tab_prefixof(ps, code) = (unsigned short)oldcode;
-                tab_suffixof(ps, code) = (Byte)finchar;
-                free_ent = code+1;
+                heapPush(&tr, item);
+                continue;
             }
+        }
 
-            oldcode = incode;   /* Remember previous code.  */
+        if (item.score < 2)
+        {
+            break;
         }
 
-        ps->bytes_in += rsize;
-    }
-    while (rsize > 0);
+        memcpy(sample + *sampleLen, msgs[item.msg], len);
+        *sampleLen += len;
 
-    if (outpos > 0 && (ctxt->writer)(ps->outbuf, outpos, ctxt->rwCtxt) != outpos)
-    {
-        return NCMP_WRITE_ERROR;
+        lowerCounts(&tr, item.msg);
+        ++round;
     }
 
+    free(tr.count);
+    free(tr.mark);
+    free(tr.heap);
     return NCMP_OK;
 }
@@ -30,6 +30,9 @@
         Anthony L. Shipman
 */
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -57,6 +60,14 @@ typedef int (*NCmpStreamReader)(Byte* bytes, size_t numBytes, void* rwCtxt);
 typedef int (*NCmpStreamWriter)(const Byte* bytes, size_t numBytes, void* rwCtxt);
 
 
+/*  As NCmpStreamReader and NCmpStreamWriter but returning ssize_t, so
+    that a callback isn't limited to 2 GB at a time.  See nSetStreams64().
+*/
+typedef ssize_t (*NCmpStreamReader64)(Byte* bytes, size_t numBytes, void* rwCtxt);
+
+typedef ssize_t (*NCmpStreamWriter64)(const Byte* bytes, size_t numBytes, void* rwCtxt);
+
+
 typedef struct NCompressCtxt
 {
     NCmpStreamReader    reader;
@@ -79,6 +90,9 @@ typedef enum NCompressError
     NCMP_DATA_ERROR,     // invalid compressed data format
     NCMP_BITS_ERROR,     // compressed with too large a bits parameter
     NCMP_OTHER_ERROR,    // some other internal error
+    NCMP_PRESET_ERROR,   // needs the preset table it was compressed with
+    NCMP_LIMIT_ERROR,    // passed a limit from nSetDecompressLimits()
+    NCMP_NOT_FOUND,      // no object with the key in a container
 
 } NCompressError;
 
@@ -90,10 +104,90 @@ typedef enum NCompressError
 
     The bits parameter is only used when compressing. It sets the maximum
     size of a code word. The value must be in the range 9 to 16 or else
-    zero to select the default of 16.
+    zero to select the default of 16.  With 9 bits the table is cleared
+    each time it fills, since decompressors can't keep using a full
+    9 bit table.
 */
 void    nInitCompress(NCompressCtxt* ctxt, int bits);
 
+/*  The dictionary used by the compressor to find (prefix, char) pairs.
+
+    NCMP_DICT_CLASSIC is the double hashing of the original compress.
+    NCMP_DICT_TAGGED is a bucketed table which compares 8 tags at once
+    so that most lookups touch a single cache line.
+
+    Both produce identical output.  The default is NCMP_DICT_CLASSIC
+    unless the library was built with NCMP_DEFAULT_DICT set otherwise.
+*/
+typedef enum NCompressDict
+{
+    NCMP_DICT_CLASSIC = 0,
+    NCMP_DICT_TAGGED,
+
+} NCompressDict;
+
+
+/*  Select the dictionary for compression.
+    Call this after nInitCompress().
+*/
+void    nSetCompressDict(NCompressCtxt* ctxt, NCompressDict dict);
+
+/*  Codes of more than 16 bits, for large inputs whose table would
+    otherwise fill after 65536 strings.
+
+    For a compressor call this after nInitCompress() with bits from 17
+    to NCMP_EXTENDED_BITS.  It replaces the bits given there, and 0 goes
+    back to 16.  For a decompressor bits is the widest code it accepts,
+    and 0, the default, rejects these streams with NCMP_BITS_ERROR as
+    other decompressors do.  Other values return NCMP_BITS_ERROR.
+
+    The tables take 16 bytes per code when compressing and 6 when
+    decompressing, which at 24 bits is 256 MB and 96 MB.  A compressor
+    allocates them here and returns NCMP_OTHER_ERROR if it can't.  A
+    decompressor allocates them for the first stream which needs them.
+
+    These streams don't use a preset table.  They can't be searched,
+    spliced, appended to or saved with nSaveState(), and those calls
+    return NCMP_BITS_ERROR.
+    The statistics don't count their lookups and probes.
+*/
+#define NCMP_EXTENDED_BITS  24
+
+NCompressError nSetExtendedBits(NCompressCtxt* ctxt, int bits);
+
+/*  Run nCompress() and nDecompress() as a pipeline.
+
+    The reader runs on one thread, the compression or decompression on
+    the calling thread and the writer on a third thread, so that slow
+    I/O overlaps with the work.  The stages pass blocks of 256 KB with
+    numBlocks of them, rounded up to a power of two, between each pair
+    of stages.  A numBlocks of 0 turns this off, which is the default.
+
+    The reader is passed 256 KB at a time and the writer is given up to
+    256 KB at a time.  They must not rely on running on the caller's
+    thread.  The statistics count the blocks passed to the kernel
+    rather than the calls to the reader and writer.  If the threads
+    can't be started the call runs without them.
+
+    Call this after nInitCompress() or nInitDecompress().
+*/
+void    nSetPipeline(NCompressCtxt* ctxt, int numBlocks);
+
+/*  Use these callbacks in place of the reader and writer in the
+    context.  They are passed its rwCtxt.  Either may be NULL to go back
+    to the one in the context.  Call this after nInitCompress() or
+    nInitDecompress().
+
+    The library passes the callbacks at most the size of its buffers,
+    which are from 8 KB to 1 MB, and keeps 64 bit counts of the bytes
+    in and out.  nGetTotals() returns them for the current or last
+    stream.  The counts and offsets in the statistics, events, limits
+    and search results are 64 bits too.
+*/
+void    nSetStreams64(NCompressCtxt* ctxt, NCmpStreamReader64 reader, NCmpStreamWriter64 writer);
+
+void    nGetTotals(NCompressCtxt* ctxt, uint64_t* bytesIn, uint64_t* bytesOut);
+
 /*  Initialise for decompression.
 
     Set the reader, writer and read-write context in
@@ -103,10 +197,525 @@ void    nInitDecompress(NCompressCtxt* ctxt);
 
 void    nFreeCompress(NCompressCtxt* ctxt);
 
+/*  Drop any stream in progress so that the next call starts a new one
+    with the same context and settings.  A compressor starts a new
+    stream after nCompressEnd() anyway, and nCompress() and nDecompress()
+    always start one.  This is needed to decompress another stream with
+    nDecompressRead() or to abandon a stream part way through.
+*/
+void    nResetCompress(NCompressCtxt* ctxt);
+
 NCompressError nCompress(NCompressCtxt* ctxt);
 
+/*  Compress by pushing the input instead of pulling it from the reader.
+
+    Call nCompressWrite() as data becomes available and nCompressEnd()
+    once at the end of the stream.  Only the writer is used.  The output
+    is identical to that of nCompress() on the same input.
+
+    nCompressFlush() outputs the code for the pending input and passes
+    every complete byte to the writer at once instead of waiting for the
+    output buffer to fill.  The bits of a trailing partial byte are kept
+    and written with the next code, so the stream stays valid for any
+    decompressor.  A decoder can then recover all input up to the flush
+    except for a code which ends in that partial byte.  Note that other
+    decompressors reading from a pipe may also hold back an incomplete
+    group of eight codes until more data arrives.  nDecompressPush()
+    doesn't.
+
+    Each flush ends the current string match, which costs a little
+    compression.  The three calls return NCMP_WRITE_ERROR if the writer
+    fails.
+*/
+NCompressError nCompressWrite(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes);
+
+NCompressError nCompressFlush(NCompressCtxt* ctxt);
+
+NCompressError nCompressEnd(NCompressCtxt* ctxt);
+
 NCompressError nDecompress(NCompressCtxt* ctxt);
 
+/*  Decompress by pulling the output instead of pushing it to the writer.
+
+    Set the reader and read-write context in the CompressCtxt struct.
+    Then call nDecompressOpen() and nDecompressRead() as often as needed.
+    Free with nFreeCompress().
+
+    nDecompressOpen() is nInitDecompress() under another name and takes
+    its place.  Call it once on a new context, before any nSet...()
+    call.  On a context which is already initialised it leaks the old
+    state and drops its settings.  Use nResetCompress() to start another
+    stream with the same context.
+
+    nDecompressRead() expands the codes straight into bytes and sets
+    numRead to the number of bytes stored there.  This is less than
+    numBytes only at the end of the stream or on an error, so a numRead
+    of zero with NCMP_OK means the end.  A string which doesn't fit is
+    kept and returned first by the next call.  An error is returned again
+    by any later call.
+*/
+void    nDecompressOpen(NCompressCtxt* ctxt);
+
+NCompressError nDecompressRead(NCompressCtxt* ctxt, Byte* bytes, size_t numBytes, size_t* numRead);
+
+/*  Decompress without callbacks, for callers which can't block in a
+    reader, such as coroutines and event loops.  This works like zlib's
+    inflate().
+
+    Initialise with nInitDecompress() and pass the input as it arrives
+    in bytes.  Each call decompresses into out until it is full or the
+    input is used up.  It sets numUsed to the input bytes taken and
+    numOut to the bytes stored in out.  Call again with the rest of the
+    input while numOut is outSize.  Every code which has arrived whole
+    is decoded, so the output of nCompressFlush() comes out as soon as
+    it is pushed.  The bits of a partial code are kept until more
+    arrives, so the bytes may be reused once they have been taken.  Pass
+    bytes as NULL at the end of the input and call until numOut is less
+    than outSize.
+
+    Call nResetCompress() before another stream.  Don't mix this with
+    nDecompressRead() in one stream.
+*/
+NCompressError nDecompressPush(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes, size_t* numUsed,
+                               Byte* out, size_t outSize, size_t* numOut);
+
+/*  Decompress the whole stream in bytes into out, straight from one
+    buffer to the other.  Each call starts a new stream, so the context
+    may be used for one stream after another.  numOut is set to the
+    bytes stored in out.  If the stream doesn't fit this fills out and
+    returns NCMP_LIMIT_ERROR.  The limits and the CRC work as for the
+    other calls.
+*/
+NCompressError nDecompressBuffer(NCompressCtxt* ctxt, const Byte* bytes, size_t numBytes,
+                                 Byte* out, size_t outSize, size_t* numOut);
+
+/*  Limits for decompressing untrusted input, where a small stream can
+    expand to a huge output.
+
+    maxOutput is the most bytes a stream may decompress to.  maxRatio is
+    the most bytes of output for each byte of input read so far, which
+    counts the header and any input read ahead.  maxWork is the most
+    bytes that one call of nDecompress(), nDecompressRead() or
+    nDecompressPush() may decompress, which bounds the time it takes.
+    A limit of 0 is no limit.
+
+    The output stops at the limit, and that call and any later call for
+    the stream return NCMP_LIMIT_ERROR.  Call this after
+    nInitDecompress().  The limits stay for later streams until this is
+    called with NULL.  nSearch() doesn't use them since it works a code
+    at a time, so its time goes with the size of its input.
+*/
+typedef struct NCompressLimits
+{
+    int64_t maxOutput;
+    int64_t maxRatio;
+    int64_t maxWork;
+
+} NCompressLimits;
+
+void    nSetDecompressLimits(NCompressCtxt* ctxt, const NCompressLimits* limits);
+
+/*  CRC32C of the uncompressed data, the Castagnoli polynomial as used by
+    iSCSI and ext4.
+
+    nSetCrc32c() turns it on or off for the context and starts it again.
+    It is taken as the bytes are compressed or decompressed, a piece at a
+    time while they are still in the cache, and with the SSE4.2
+    instruction where there is one.  nGetCrc32c() returns it for the
+    current or last stream.  Each stream starts at 0.  It is kept in a
+    snapshot.
+
+    A .Z stream has no room for it, so nWriteCrc32c() passes 16 bytes to
+    the writer to be kept beside the stream: "nCmC", the CRC in 4 bytes
+    and the length of the uncompressed data in 8 bytes, least
+    significant first.  After decompressing, nCheckCrc32c() reads them
+    and returns NCMP_DATA_ERROR if they don't match.  Both return
+    NCMP_OTHER_ERROR if the CRC is off.  Call these after
+    nInitCompress() or nInitDecompress().
+*/
+void    nSetCrc32c(NCompressCtxt* ctxt, int on);
+
+uint32_t nGetCrc32c(NCompressCtxt* ctxt);
+
+NCompressError nWriteCrc32c(NCompressCtxt* ctxt, NCmpStreamWriter writer, void* wCtxt);
+
+NCompressError nCheckCrc32c(NCompressCtxt* ctxt, NCmpStreamReader reader, void* rCtxt);
+
+/*  Compress or decompress between file descriptors without callbacks.
+
+    A regular input file is mapped into memory and compressed straight
+    from the mapping.  Other inputs, such as pipes, are read 1 MB at a
+    time.  The output is written 1 MB at a time from a page aligned
+    buffer.  If fdOut was opened with O_DIRECT at an aligned offset the
+    last block is padded and the file truncated to the right length.
+
+    The output starts at the current offset of fdOut.  Neither
+    descriptor is closed.  The bits parameter is as for nInitCompress().
+    On NCMP_READ_ERROR or NCMP_WRITE_ERROR errno is that of the failed
+    call.
+*/
+NCompressError nCompressFile(int fdIn, int fdOut, int bits);
+
+NCompressError nDecompressFile(int fdIn, int fdOut);
+
+/*  As nDecompressFile() but runs of zeros in the output are skipped
+    with lseek() instead of written, so a mostly empty image becomes a
+    sparse file.  Only runs of whole 4 KB blocks are skipped, and short
+    runs are written unless they end the stream.  Zeros over data
+    already in the file are punched out or else written.  The file is
+    extended to cover a run at the end.  An output which isn't a regular
+    file, or was opened with O_APPEND, is written as usual.
+*/
+NCompressError nDecompressFileSparse(int fdIn, int fdOut);
+
+//======================================================================
+
+/*  Join compressed streams without decompressing them.
+
+    nSplice() writes the stream from the reader followed by the one from
+    reader2 as a single stream which decompresses to both.  The first is
+    ended with a CLEAR and the body of the second is copied after it, so
+    only the codes of the first are looked at and none are recoded.
+    Initialise ctxt with nInitDecompress() and set the reader, writer
+    and read-write context.  The second stream is read from reader2 with
+    rwCtxt2.
+
+    nCompressAppend() continues the compressed file open on fd, which
+    must be readable and writable and not opened with O_APPEND.  Call it
+    after nInitCompress(), whose bits are replaced by those of the file.
+    It leaves fd where the new output goes, so a writer which writes to
+    fd at its offset extends the file with nCompressWrite() and
+    nCompressEnd().  The file stays valid until the first write.
+
+    Both streams must have been compressed with the same bits and, unless
+    the first holds no codes, in block mode, which is the default.  For
+    a stream of several members these are the bits of its last member.
+    Otherwise these return NCMP_BITS_ERROR.
+*/
+NCompressError nSplice(NCompressCtxt* ctxt, NCmpStreamReader reader2, void* rwCtxt2);
+
+NCompressError nCompressAppend(NCompressCtxt* ctxt, int fd);
+
+//======================================================================
+
+/*  Streams of several members.
+
+    nSetMemberSize() makes the compressor end a member after each
+    memberSize bytes of input with a CLEAR padded to the end of its
+    group, and go on with a new table.  The last member ends so too.
+    The output is one valid .Z stream for any decompressor, and can be
+    decoded from the end of any of those CLEARs.  Members have no preset
+    table, so any preset is ignored.  A memberSize of 0 turns this off,
+    which is the default.  Call it after nInitCompress().
+
+    The decompressors also go on through whole streams one after the
+    other, each with its own header and bits, where each but the last
+    ends with a padded CLEAR or holds no codes, such as the outputs of
+    nSetMemberSize() joined with cat.  Since .Z has no end marker, that
+    is the only place the next header can be told from codes.  Other
+    decompressors stop at the second header with an error.
+
+    Plain .Z files joined with cat are not supported.  Their first
+    stream ends part way through a group, so the header after it is
+    read as codes, which gives NCMP_DATA_ERROR or wrong output.
+    Decompress such files one at a time.
+
+    nDecompressFileParallel() is nDecompressFile() with a regular input
+    file decompressed on numThreads threads, or one per CPU for 0.  The
+    codes are scanned first and split into parts at the padded CLEARs
+    and headers, which any stream with CLEARs has, not only one with
+    members.  The output of each part is held in memory until those
+    before it are written, for at most two parts for each thread.  Other
+    inputs, and streams without CLEARs or with a preset or extended
+    codes, are decompressed on one thread.
+*/
+void    nSetMemberSize(NCompressCtxt* ctxt, int64_t memberSize);
+
+NCompressError nDecompressFileParallel(int fdIn, int fdOut, int numThreads);
+
+//======================================================================
+
+/*  Containers of many small objects, each compressed by itself.
+
+    The objects are standard .Z streams one after the other in an
+    append-only data file, so each can be cut out and decompressed by
+    any tool.  A sorted index beside it holds the key of each object,
+    its offset, its compressed and decompressed lengths and the CRC32C
+    of its bytes.  Both files are mapped, so a lookup is a binary search
+    of the index and an object is decompressed straight from the data.
+
+    The index is the file at path and the data is path.N for the
+    generation N kept in the index.  nOpenContainer() opens them for
+    reading, and for writing too with NCMP_CONT_WRITE.  With
+    NCMP_CONT_CREATE as well an empty container is made if there is
+    none.  The bits are as for nInitCompress().  Only one writer may
+    have a container open at a time.  It holds an flock() on path.lock,
+    and another writer or a compaction which tries to take it gets
+    NCMP_WRITE_ERROR with errno EWOULDBLOCK.
+
+    nContainerPut() compresses bytes of less than 4 GB and appends them
+    under a key, in place of any object with the same key.
+    nContainerRemove() drops the object of a key.  Lookups don't see
+    either until nContainerCommit(), which syncs the data and then puts
+    a new index in place with a rename, so after a crash the container
+    is as it was at the last commit.  nCloseContainer() commits any
+    changes and frees the container.
+
+    nContainerFind() fills obj for the object of a key, or returns
+    NCMP_NOT_FOUND.  Its bytes are in the mapping, which stays valid
+    until the next commit, and can be decompressed with
+    nDecompressBuffer().  Finds on several threads at once are safe
+    while nothing else is called on the container.  nContainerGet()
+    decompresses the object into out with the container's own context
+    and sets numOut to its length.  It returns NCMP_LIMIT_ERROR without
+    decompressing if out is too small, and NCMP_DATA_ERROR if the length
+    or CRC don't match the index.
+
+    Replaced and removed objects stay in the data file until
+    nCompactContainer() copies the live ones, without recompressing
+    them, to a data file of the next generation and commits an index for
+    it.  The old data file is then deleted, and readers which have it
+    open keep their mapping.  It takes the lock of a writer, so it fails
+    while the container is open for writing.
+
+    On NCMP_READ_ERROR or NCMP_WRITE_ERROR errno is that of the failed
+    call.  A damaged index gives NCMP_DATA_ERROR.
+*/
+#define NCMP_CONT_WRITE     1
+#define NCMP_CONT_CREATE    2
+
+typedef struct NCompressContainer
+{
+    void*   priv;
+
+} NCompressContainer;
+
+
+typedef struct NCompressObject
+{
+    const Byte* bytes;          // the compressed stream, in the mapping
+    uint64_t    offset;         // of bytes in the data file
+    uint32_t    compressedLen;
+    uint32_t    length;         // decompressed
+    uint32_t    crc;            // CRC32C of the decompressed bytes
+
+} NCompressObject;
+
+
+NCompressError nOpenContainer(NCompressContainer* cont, const char* path, int flags, int bits);
+
+NCompressError nContainerPut(NCompressContainer* cont, const void* key, size_t keyLen,
+                             const Byte* bytes, size_t numBytes);
+
+NCompressError nContainerRemove(NCompressContainer* cont, const void* key, size_t keyLen);
+
+NCompressError nContainerCommit(NCompressContainer* cont);
+
+NCompressError nContainerFind(NCompressContainer* cont, const void* key, size_t keyLen, NCompressObject* obj);
+
+NCompressError nContainerGet(NCompressContainer* cont, const void* key, size_t keyLen,
+                             Byte* out, size_t outSize, size_t* numOut);
+
+NCompressError nCloseContainer(NCompressContainer* cont);
+
+NCompressError nCompactContainer(const char* path);
+
+//======================================================================
+
+/*  Save the state of a stream so that another process can go on with it.
+
+    nSaveState() passes a snapshot of the compressor or decompressor to
+    the writer.  It holds the position in the stream, the codes in use
+    and any input read but not yet decoded, and is at most about 200 KB.
+    Call it between nCompressWrite(), nDecompressRead() or
+    nDecompressPush() calls, not from inside nCompress() or
+    nDecompress().  A compressor first passes its complete bytes to its
+    own writer, so the output then holds bytesOut bytes.
+
+    nLoadState() reads a snapshot into a context initialised for the
+    same direction, replacing its stream.  Then go on from bytesOut in
+    the output and, when decompressing, from bytesIn in the input, as
+    given by nGetStats().  The other statistics start again.  It returns
+    NCMP_DATA_ERROR for a snapshot which is not valid, or is for the
+    other direction or another version, and the context is then left
+    with no stream.  The reader is never asked for more than the snapshot.
+*/
+NCompressError nSaveState(NCompressCtxt* ctxt, NCmpStreamWriter writer, void* wCtxt);
+
+NCompressError nLoadState(NCompressCtxt* ctxt, NCmpStreamReader reader, void* rCtxt);
+
+//======================================================================
+
+/*  Preset tables for small messages.
+
+    A stream starts with an empty table, so a message of a few hundred
+    bytes barely compresses.  nSetPreset() runs a sample of typical data
+    through LZW once to make a preset table.  Each stream then starts
+    with the strings of the sample already in the table and goes back
+    to them at a CLEAR.  These streams have the 0x40 bit set in the
+    third byte of the header, which is not part of the .Z format, so
+    other decompressors can't read them.
+
+    Call it after nInitCompress() or nInitDecompress(), with the same
+    sample for both.  It drops any stream in progress.  The stream
+    doesn't say which sample it needs, and a decompressor with another
+    one gives garbage or NCMP_DATA_ERROR.  One without a preset returns
+    NCMP_PRESET_ERROR.  The preset takes at most three quarters of the
+    codes, which is 49152 at 16 bits, and the rest of the sample is
+    ignored.  A sampleLen of 0 removes the preset.  This returns
+    NCMP_OTHER_ERROR if it runs out of memory.
+
+    Making the table costs about as much as compressing the sample.
+    After that a new stream only empties the entries which the last one
+    added, so keep one context for many small messages.  nSplice() and
+    nCompressAppend() return NCMP_BITS_ERROR for these streams.
+
+    nTrainPreset() makes a sample of at most sampleCap bytes from
+    numMsgs example messages.  It picks whole messages, preferring those
+    made of strings which many of the others share.  ncompress -T runs
+    it over files.
+*/
+NCompressError nSetPreset(NCompressCtxt* ctxt, const Byte* sample, size_t sampleLen);
+
+NCompressError nTrainPreset(const Byte* const* msgs, const size_t* msgLens, size_t numMsgs,
+                            Byte* sample, size_t sampleCap, size_t* sampleLen);
+
+//======================================================================
+
+/*  Search a compressed stream without decompressing it.
+
+    Initialise with nInitDecompress() and set the reader.  nSearch()
+    reads the whole stream, or up to the match wanted, and calls the
+    handler for each match.  The handler may be NULL.  If it returns
+    non-zero the search stops.  numFound is set to the matches or lines
+    reported.
+
+    NCMP_SEARCH_ALL reports every match, including overlapping ones,
+    with the uncompressed offset of its first byte.
+    NCMP_SEARCH_FIRST reports just the first.  NCMP_SEARCH_LINES
+    reports each line holding a match once, with the offset of the
+    start of the line and its number from 1, like grep -n.  Its pattern
+    can't hold a newline.
+
+    The pattern is from 1 to NCMP_SEARCH_MAX bytes, else this returns
+    NCMP_OTHER_ERROR.  The strings of the codes are matched as a whole
+    instead of byte by byte, which is much faster than decompressing and
+    scanning when the data compresses well.
+*/
+#define NCMP_SEARCH_MAX     255
+
+typedef enum NCompressSearchMode
+{
+    NCMP_SEARCH_ALL = 0,
+    NCMP_SEARCH_FIRST,
+    NCMP_SEARCH_LINES,
+
+} NCompressSearchMode;
+
+
+typedef struct NCompressMatch
+{
+    int64_t offset;     // of the match, or of its line
+    int64_t line;       // for NCMP_SEARCH_LINES, from 1
+
+} NCompressMatch;
+
+
+typedef int (*NCmpMatchHandler)(const NCompressMatch* match, void* matchCtxt);
+
+
+NCompressError nSearch(NCompressCtxt* ctxt, const Byte* pattern, size_t patternLen, NCompressSearchMode mode,
+                       NCmpMatchHandler handler, void* matchCtxt, int64_t* numFound);
+
+//======================================================================
+
+/*  Statistics for the current or last stream.  They are reset when a
+    stream starts.
+
+    Offsets are positions in the uncompressed data, for compression and
+    decompression alike.  They are where the codes before the event end,
+    so both sides give the same offset for a clear or a widening.  The
+    exceptions are one at a flush or the end of a member, which the
+    compressor gives after the string of the last code, and the table
+    filling, which the decompressor sees one code later.  Only the
+    offsets of the last NCMP_STATS_CLEARS clears are kept, oldest first.
+    The event handler sees them all.
+
+    The dictionary lookups are those of the main compression loop.  The
+    probes are the slots examined by the classic dictionary or the
+    buckets examined by the tagged one.  They are only counted with
+    NCMP_STATS_PROBES.  The times are only measured with
+    NCMP_STATS_TIMES.  The kernel time is the time spent in the library
+    calls less the time in the callbacks.
+*/
+#define NCMP_STATS_CLEARS   16
+
+typedef struct NCompressStats
+{
+    int64_t bytesIn;            // bytes read or passed in
+    int64_t bytesOut;           // bytes written or passed out
+    int64_t codes;              // codes output or input, including CLEARs
+    int64_t clears;             // CLEAR codes
+    int64_t clearOffsets[NCMP_STATS_CLEARS];
+    int64_t widenings;          // increases in the code width
+    int64_t fullBytes;          // uncompressed bytes handled with a full table
+
+    int64_t lookups;            // dictionary lookups
+    int64_t probes;             // slots or buckets examined by the lookups
+    int64_t maxProbes;          // the most for a single lookup
+
+    int64_t readerCalls;
+    int64_t writerCalls;
+    double  callbackSeconds;    // in the reader, writer and event handler
+    double  kernelSeconds;      // in the library itself
+
+} NCompressStats;
+
+
+//  Flags for nSetStatsFlags().
+#define NCMP_STATS_PROBES   0x01    // count dictionary probes
+#define NCMP_STATS_TIMES    0x02    // time the callbacks and the kernel
+
+
+/*  Select the optional statistics.  Counting probes costs a little
+    speed and timing costs two clock reads per callback and per call.
+    Call this after nInitCompress() or nInitDecompress().
+*/
+void    nSetStatsFlags(NCompressCtxt* ctxt, int flags);
+
+void    nGetStats(NCompressCtxt* ctxt, NCompressStats* stats);
+
+
+typedef enum NCompressEventType
+{
+    NCMP_EVENT_PROGRESS = 0,    // after each call to the reader or writer
+    NCMP_EVENT_WIDEN,           // the codes became one bit wider
+    NCMP_EVENT_FULL,            // the code table filled
+    NCMP_EVENT_CLEAR,           // the code table was cleared
+
+} NCompressEventType;
+
+
+typedef struct NCompressEvent
+{
+    NCompressEventType  type;
+    int                 bits;       // the code width after the event
+    int64_t             offset;     // the uncompressed offset
+    int64_t             bytesIn;
+    int64_t             bytesOut;
+
+} NCompressEvent;
+
+
+typedef void (*NCmpEventHandler)(const NCompressEvent* event, void* eventCtxt);
+
+
+/*  Set a function to be called for each event, or NULL for none.  It
+    is called from inside the library calls and must not call them.
+    Call this after nInitCompress() or nInitDecompress().
+*/
+void    nSetEventHandler(NCompressCtxt* ctxt, NCmpEventHandler handler, void* eventCtxt);
+
 //======================================================================
 
 #ifdef __cplusplus
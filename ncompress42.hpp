@@ -0,0 +1,911 @@
+#ifndef NCOMPRESS42_HPP
+#define NCOMPRESS42_HPP
+
+/*  This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <http://unlicense.org/>
+*/
+
+/*  A C++ layer over ncompress42.h.  It needs C++20 for std::span.
+
+    Compressor and Decompressor own a context, which is allocated once
+    and used again for each stream.  They are move-only.  The reader and
+    writer are passed to each call as callables instead of being kept in
+    the context, so a moved context never points at a stale object:
+
+        source(std::span<Byte> room) -> size_t     bytes read, 0 at the end
+        sink(std::span<const Byte> bytes)
+
+    An exception from a source or sink is caught at the C boundary and
+    rethrown once the library call returns.  Errors from the library are
+    thrown as ncompress::Error.
+
+    ocompressbuf and idecompressbuf are stream buffers over another
+    stream buffer.  ocompressbuf compresses its put area in place and
+    idecompressbuf decompresses straight into its get area.  Large
+    writes and reads bypass the buffer and use the caller's memory.
+*/
+
+#if __cplusplus < 202002L
+#error "ncompress42.hpp needs C++20"
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ncompress42.h"
+
+namespace ncompress
+{
+
+//======================================================================
+
+class Error : public std::runtime_error
+{
+public:
+    explicit Error(NCompressError code)
+      : std::runtime_error(describe(code)),
+        code_(code)
+    {
+    }
+
+    NCompressError code() const noexcept
+    {
+        return code_;
+    }
+
+    static const char* describe(NCompressError code) noexcept
+    {
+        switch (code)
+        {
+        case NCMP_OK:           return "no error";
+        case NCMP_READ_ERROR:   return "read error";
+        case NCMP_WRITE_ERROR:  return "write error";
+        case NCMP_DATA_ERROR:   return "invalid compressed data";
+        case NCMP_BITS_ERROR:   return "compressed with too many bits";
+        case NCMP_PRESET_ERROR: return "needs a preset table";
+        case NCMP_LIMIT_ERROR:  return "passed a decompression limit";
+        case NCMP_NOT_FOUND:    return "no object with the key";
+        default:                return "internal error";
+        }
+    }
+
+private:
+    NCompressError  code_;
+};
+
+
+namespace detail
+{
+
+struct None
+{
+};
+
+
+/*  Connects the C callbacks to a source and a sink for one call.  The
+    reader and the writer keep their own exceptions since with a
+    pipeline they run on different threads.
+*/
+template <class Source, class Sink>
+struct Binding
+{
+    Source*             source;
+    Sink*               sink;
+    std::exception_ptr  readFailure;
+    std::exception_ptr  writeFailure;
+
+    static ssize_t read(Byte* bytes, size_t numBytes, void* rwCtxt)
+    {
+        Binding* b = static_cast<Binding*>(rwCtxt);
+
+        try
+        {
+            return static_cast<ssize_t>((*b->source)(std::span<Byte>(bytes, numBytes)));
+        }
+        catch (...)
+        {
+            b->readFailure = std::current_exception();
+            return -1;
+        }
+    }
+
+    static ssize_t write(const Byte* bytes, size_t numBytes, void* rwCtxt)
+    {
+        Binding* b = static_cast<Binding*>(rwCtxt);
+
+        try
+        {
+            (*b->sink)(std::span<const Byte>(bytes, numBytes));
+            return static_cast<ssize_t>(numBytes);
+        }
+        catch (...)
+        {
+            b->writeFailure = std::current_exception();
+            return -1;
+        }
+    }
+
+    void bind(NCompressCtxt& ctxt)
+    {
+        NCmpStreamReader64  reader = nullptr;
+        NCmpStreamWriter64  writer = nullptr;
+
+        if constexpr (!std::is_same_v<Source, None>)
+            reader = read;
+
+        if constexpr (!std::is_same_v<Sink, None>)
+            writer = write;
+
+        ctxt.reader = nullptr;
+        ctxt.writer = nullptr;
+        ctxt.rwCtxt = this;
+        nSetStreams64(&ctxt, reader, writer);
+    }
+
+    // An exception from a callback explains the error it caused.
+    void check(NCompressError err)
+    {
+        if (readFailure)
+        {
+            std::rethrow_exception(readFailure);
+        }
+
+        if (writeFailure)
+        {
+            std::rethrow_exception(writeFailure);
+        }
+
+        if (err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+    }
+};
+
+} // namespace detail
+
+//======================================================================
+
+/*  The context shared by Compressor and Decompressor.
+*/
+class Context
+{
+public:
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    Context(Context&& other) noexcept
+      : ctxt_(other.ctxt_)
+    {
+        other.ctxt_.priv = nullptr;
+    }
+
+    Context& operator=(Context&& other) noexcept
+    {
+        if (this != &other)
+        {
+            nFreeCompress(&ctxt_);
+            ctxt_ = other.ctxt_;
+            other.ctxt_.priv = nullptr;
+        }
+
+        return *this;
+    }
+
+    ~Context()
+    {
+        nFreeCompress(&ctxt_);
+    }
+
+    // False once moved from.
+    explicit operator bool() const noexcept
+    {
+        return ctxt_.priv != nullptr;
+    }
+
+    // Drop any stream in progress.
+    void reset() noexcept
+    {
+        nResetCompress(&ctxt_);
+    }
+
+    void setStatsFlags(int flags) noexcept
+    {
+        nSetStatsFlags(&ctxt_, flags);
+    }
+
+    void setEventHandler(NCmpEventHandler handler, void* eventCtxt) noexcept
+    {
+        nSetEventHandler(&ctxt_, handler, eventCtxt);
+    }
+
+    /*  The source and sink then run on their own threads during
+        compress() and decompress().
+    */
+    void setPipeline(int numBlocks) noexcept
+    {
+        nSetPipeline(&ctxt_, numBlocks);
+    }
+
+    // Compressor and decompressor need the same sample.  See nSetPreset().
+    void setPreset(std::span<const Byte> sample)
+    {
+        checkOpen();
+
+        if (NCompressError err = nSetPreset(&ctxt_, sample.data(), sample.size()); err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+    }
+
+    // Codes of up to bits bits, from 17 to 24.  See nSetExtendedBits().
+    void setExtendedBits(int bits)
+    {
+        checkOpen();
+
+        if (NCompressError err = nSetExtendedBits(&ctxt_, bits); err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+    }
+
+    // The CRC32C of the uncompressed data.  See nSetCrc32c().
+    void setCrc32c(bool on) noexcept
+    {
+        nSetCrc32c(&ctxt_, on);
+    }
+
+    uint32_t crc32c() noexcept
+    {
+        return nGetCrc32c(&ctxt_);
+    }
+
+    NCompressStats stats() noexcept
+    {
+        NCompressStats s;
+
+        nGetStats(&ctxt_, &s);
+        return s;
+    }
+
+    NCompressCtxt* get() noexcept
+    {
+        return &ctxt_;
+    }
+
+protected:
+    Context()
+    {
+    }
+
+    void checkAlloc()
+    {
+        if (!ctxt_.priv)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    void checkOpen()
+    {
+        if (!ctxt_.priv)
+        {
+            throw Error(NCMP_OTHER_ERROR);
+        }
+    }
+
+    template <class Source, class Sink, class Call>
+    void run(Source* source, Sink* sink, Call call)
+    {
+        detail::Binding<Source, Sink> b{source, sink, nullptr, nullptr};
+
+        checkOpen();
+        b.bind(ctxt_);
+        b.check(call());
+    }
+
+    NCompressCtxt   ctxt_ = {};
+};
+
+//======================================================================
+
+class Compressor : public Context
+{
+public:
+    // The bits are as for nInitCompress().
+    explicit Compressor(int bits = 0)
+    {
+        nInitCompress(&ctxt_, bits);
+        checkAlloc();
+    }
+
+    Compressor(int bits, NCompressDict dict)
+      : Compressor(bits)
+    {
+        setDict(dict);
+    }
+
+    void setDict(NCompressDict dict) noexcept
+    {
+        nSetCompressDict(&ctxt_, dict);
+    }
+
+    // Members of memberSize bytes of input.  See nSetMemberSize().
+    void setMemberSize(int64_t memberSize) noexcept
+    {
+        nSetMemberSize(&ctxt_, memberSize);
+    }
+
+    // Compress everything from the source into a new stream.
+    template <class Source, class Sink>
+    void compress(Source&& source, Sink&& sink)
+    {
+        run(&source, &sink, [this] { return nCompress(&ctxt_); });
+    }
+
+    /*  Push input into the current stream, or a new one after end().
+        These are nCompressWrite(), nCompressFlush() and nCompressEnd().
+    */
+    template <class Sink>
+    void write(std::span<const Byte> bytes, Sink&& sink)
+    {
+        run(static_cast<detail::None*>(nullptr), &sink, [&] { return nCompressWrite(&ctxt_, bytes.data(), bytes.size()); });
+    }
+
+    template <class Sink>
+    void flush(Sink&& sink)
+    {
+        run(static_cast<detail::None*>(nullptr), &sink, [this] { return nCompressFlush(&ctxt_); });
+    }
+
+    template <class Sink>
+    void end(Sink&& sink)
+    {
+        run(static_cast<detail::None*>(nullptr), &sink, [this] { return nCompressEnd(&ctxt_); });
+    }
+
+    std::vector<Byte> compress(std::span<const Byte> bytes)
+    {
+        std::vector<Byte>   out;
+        auto                sink = [&out](std::span<const Byte> b) { out.insert(out.end(), b.begin(), b.end()); };
+
+        reset();
+        write(bytes, sink);
+        end(sink);
+        return out;
+    }
+};
+
+
+
+class Decompressor : public Context
+{
+public:
+    Decompressor()
+    {
+        nInitDecompress(&ctxt_);
+        checkAlloc();
+    }
+
+    // See nSetDecompressLimits().
+    void setLimits(const NCompressLimits& limits) noexcept
+    {
+        nSetDecompressLimits(&ctxt_, &limits);
+    }
+
+    // Decompress a whole stream from the source.
+    template <class Source, class Sink>
+    void decompress(Source&& source, Sink&& sink)
+    {
+        run(&source, &sink, [this] { return nDecompress(&ctxt_); });
+    }
+
+    /*  Pull up to bytes.size() bytes of the current stream, as with
+        nDecompressRead().  Pass the same source each time.  This returns
+        fewer bytes only at the end of the stream.  Call reset() before
+        another stream.
+    */
+    template <class Source>
+    size_t read(std::span<Byte> bytes, Source&& source)
+    {
+        size_t got = 0;
+
+        run(&source, static_cast<detail::None*>(nullptr), [&] { return nDecompressRead(&ctxt_, bytes.data(), bytes.size(), &got); });
+        return got;
+    }
+
+    /*  Decompress input which is pushed instead of read, with
+        nDecompressPush().  This takes what it uses from the front of
+        input and returns the bytes stored in out.  That is less than
+        out.size() once all of the input is used.  finish() ends the
+        input in the same way.  Call reset() before another stream.
+    */
+    size_t push(std::span<const Byte>& input, std::span<Byte> out)
+    {
+        static const Byte   none = 0;
+
+        // A NULL pointer would end the input.
+        return pushBytes(input.empty() ? &none : input.data(), input, out);
+    }
+
+    size_t finish(std::span<Byte> out)
+    {
+        std::span<const Byte> input;
+
+        return pushBytes(nullptr, input, out);
+    }
+
+    /*  Decompress the stream in bytes straight into out, with
+        nDecompressBuffer(), and return the length.
+    */
+    size_t decompressInto(std::span<const Byte> bytes, std::span<Byte> out)
+    {
+        size_t got = 0;
+
+        checkOpen();
+
+        if (NCompressError err = nDecompressBuffer(&ctxt_, bytes.data(), bytes.size(), out.data(), out.size(), &got);
+            err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+
+        return got;
+    }
+
+    std::vector<Byte> decompress(std::span<const Byte> bytes)
+    {
+        std::vector<Byte>   out;
+        size_t              pos = 0;
+
+        auto source = [&](std::span<Byte> room)
+        {
+            size_t n = std::min(room.size(), bytes.size() - pos);
+
+            std::memcpy(room.data(), bytes.data() + pos, n);
+            pos += n;
+            return n;
+        };
+
+        decompress(source, [&out](std::span<const Byte> b) { out.insert(out.end(), b.begin(), b.end()); });
+        return out;
+    }
+
+private:
+    size_t pushBytes(const Byte* bytes, std::span<const Byte>& input, std::span<Byte> out)
+    {
+        size_t          used = 0;
+        size_t          got  = 0;
+        NCompressError  err;
+
+        checkOpen();
+        err   = nDecompressPush(&ctxt_, bytes, input.size(), &used, out.data(), out.size(), &got);
+        input = input.subspan(used);
+
+        if (err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+
+        return got;
+    }
+};
+
+//======================================================================
+
+/*  An output stream buffer which compresses into another one.
+
+    The put area is compressed in place when it fills.  sync(), as from
+    std::flush or std::endl, also calls nCompressFlush() so that all of
+    the output so far can be decompressed, which costs a little
+    compression each time.  finish() ends the stream and is called by
+    the destructor.  After that compressor() can be moved into a new
+    ocompressbuf to reuse the context.
+
+    An error is thrown from the stream buffer, so the stream becomes
+    bad, and is kept for error().
+*/
+class ocompressbuf : public std::streambuf
+{
+public:
+    explicit ocompressbuf(std::streambuf* dest, int bits = 0, size_t bufSize = 1 << 16)
+      : ocompressbuf(dest, Compressor(bits), bufSize)
+    {
+    }
+
+    ocompressbuf(std::streambuf* dest, Compressor&& comp, size_t bufSize = 1 << 16)
+      : comp_(std::move(comp)),
+        dest_(dest),
+        buf_(std::max<size_t>(bufSize, 1))
+    {
+        comp_.reset();
+        setp(buf_.data(), buf_.data() + buf_.size());
+    }
+
+    ~ocompressbuf() override
+    {
+        try
+        {
+            finish();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void finish()
+    {
+        if (!finished_)
+        {
+            finished_ = true;
+            guard([this]
+            {
+                drain();
+                comp_.end(sink());
+            });
+        }
+    }
+
+    Compressor& compressor() noexcept
+    {
+        return comp_;
+    }
+
+    NCompressError error() const noexcept
+    {
+        return error_;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (finished_)
+        {
+            return traits_type::eof();
+        }
+
+        guard([this] { drain(); });
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(ch);
+    }
+
+    // A large write is compressed straight from the caller's buffer.
+    std::streamsize xsputn(const char_type* s, std::streamsize n) override
+    {
+        if (finished_ || static_cast<size_t>(n) < buf_.size())
+        {
+            return std::streambuf::xsputn(s, n);
+        }
+
+        guard([&]
+        {
+            drain();
+            comp_.write(std::span<const Byte>(reinterpret_cast<const Byte*>(s), n), sink());
+        });
+
+        return n;
+    }
+
+    int sync() override
+    {
+        if (finished_)
+        {
+            return 0;
+        }
+
+        guard([this]
+        {
+            drain();
+            comp_.flush(sink());
+        });
+
+        return dest_->pubsync();
+    }
+
+private:
+    struct Sink
+    {
+        std::streambuf* dest;
+
+        void operator()(std::span<const Byte> b) const
+        {
+            auto n = static_cast<std::streamsize>(b.size());
+
+            if (dest->sputn(reinterpret_cast<const char*>(b.data()), n) != n)
+            {
+                throw Error(NCMP_WRITE_ERROR);
+            }
+        }
+    };
+
+    Sink sink() const noexcept
+    {
+        return Sink{dest_};
+    }
+
+    void drain()
+    {
+        size_t n = pptr() - pbase();
+
+        if (n > 0)
+        {
+            comp_.write(std::span<const Byte>(reinterpret_cast<const Byte*>(pbase()), n), sink());
+            setp(buf_.data(), buf_.data() + buf_.size());
+        }
+    }
+
+    template <class F>
+    void guard(F f)
+    {
+        try
+        {
+            f();
+        }
+        catch (const Error& e)
+        {
+            error_ = e.code();
+            throw;
+        }
+    }
+
+    Compressor          comp_;
+    std::streambuf*     dest_;
+    std::vector<char>   buf_;
+    bool                finished_ = false;
+    NCompressError      error_    = NCMP_OK;
+};
+
+
+
+/*  An input stream buffer which decompresses from another one.
+
+    The input is decompressed straight into the get area, or into the
+    caller's buffer for a large read.  The stream ends at the end of the
+    compressed stream.  An error is thrown from the stream buffer, so
+    the stream becomes bad, and is kept for error().  decompressor() can
+    be moved into a new idecompressbuf to reuse the context.
+*/
+class idecompressbuf : public std::streambuf
+{
+public:
+    explicit idecompressbuf(std::streambuf* src, size_t bufSize = 1 << 16)
+      : idecompressbuf(src, Decompressor(), bufSize)
+    {
+    }
+
+    idecompressbuf(std::streambuf* src, Decompressor&& decomp, size_t bufSize = 1 << 16)
+      : decomp_(std::move(decomp)),
+        src_(src),
+        buf_(std::max<size_t>(bufSize, 1))
+    {
+        decomp_.reset();
+        setg(buf_.data(), buf_.data(), buf_.data());
+    }
+
+    Decompressor& decompressor() noexcept
+    {
+        return decomp_;
+    }
+
+    NCompressError error() const noexcept
+    {
+        return error_;
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() == egptr())
+        {
+            size_t got = fill(buf_.data(), buf_.size());
+
+            setg(buf_.data(), buf_.data(), buf_.data() + got);
+
+            if (got == 0)
+            {
+                return traits_type::eof();
+            }
+        }
+
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char_type* s, std::streamsize n) override
+    {
+        std::streamsize done = std::min(n, static_cast<std::streamsize>(egptr() - gptr()));
+
+        std::memcpy(s, gptr(), done);
+        gbump(static_cast<int>(done));
+
+        if (static_cast<size_t>(n - done) >= buf_.size())
+        {
+            done += fill(s + done, n - done);
+        }
+        else
+        if (done < n)
+        {
+            done += std::streambuf::xsgetn(s + done, n - done);
+        }
+
+        return done;
+    }
+
+private:
+    size_t fill(char* bytes, size_t numBytes)
+    {
+        auto source = [this](std::span<Byte> room) -> size_t
+        {
+            return src_->sgetn(reinterpret_cast<char*>(room.data()), static_cast<std::streamsize>(room.size()));
+        };
+
+        if (ended_)
+        {
+            return 0;
+        }
+
+        try
+        {
+            size_t got = decomp_.read(std::span<Byte>(reinterpret_cast<Byte*>(bytes), numBytes), source);
+
+            ended_ = got < numBytes;
+            return got;
+        }
+        catch (const Error& e)
+        {
+            error_ = e.code();
+            ended_ = true;
+            throw;
+        }
+    }
+
+    Decompressor        decomp_;
+    std::streambuf*     src_;
+    std::vector<char>   buf_;
+    bool                ended_ = false;
+    NCompressError      error_ = NCMP_OK;
+};
+
+//======================================================================
+
+/*  A container of small objects, with nOpenContainer().  The destructor
+    commits any changes but can't report an error, so call close() first
+    to see one.
+*/
+class Container
+{
+public:
+    explicit Container(const char* path, int flags = 0, int bits = 0)
+    {
+        check(nOpenContainer(&cont_, path, flags, bits));
+    }
+
+    Container(const Container&) = delete;
+    Container& operator=(const Container&) = delete;
+
+    Container(Container&& other) noexcept
+      : cont_(std::exchange(other.cont_, {}))
+    {
+    }
+
+    Container& operator=(Container&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (cont_.priv)
+            {
+                nCloseContainer(&cont_);
+            }
+
+            cont_ = std::exchange(other.cont_, {});
+        }
+
+        return *this;
+    }
+
+    ~Container()
+    {
+        if (cont_.priv)
+        {
+            nCloseContainer(&cont_);
+        }
+    }
+
+    void put(std::span<const Byte> key, std::span<const Byte> bytes)
+    {
+        check(nContainerPut(&cont_, key.data(), key.size(), bytes.data(), bytes.size()));
+    }
+
+    void remove(std::span<const Byte> key)
+    {
+        check(nContainerRemove(&cont_, key.data(), key.size()));
+    }
+
+    void commit()
+    {
+        check(nContainerCommit(&cont_));
+    }
+
+    // False if there is no object with the key.
+    bool find(std::span<const Byte> key, NCompressObject& obj)
+    {
+        NCompressError err = nContainerFind(&cont_, key.data(), key.size(), &obj);
+
+        if (err == NCMP_NOT_FOUND)
+        {
+            return false;
+        }
+
+        check(err);
+        return true;
+    }
+
+    // The object of a key, which must be there.
+    std::vector<Byte> get(std::span<const Byte> key)
+    {
+        NCompressObject     obj;
+        std::vector<Byte>   out;
+        size_t              got = 0;
+
+        check(nContainerFind(&cont_, key.data(), key.size(), &obj));
+        out.resize(obj.length);
+        check(nContainerGet(&cont_, key.data(), key.size(), out.data(), out.size(), &got));
+        return out;
+    }
+
+    void close()
+    {
+        if (cont_.priv)
+        {
+            check(nCloseContainer(&cont_));
+        }
+    }
+
+    NCompressContainer* get() noexcept
+    {
+        return &cont_;
+    }
+
+private:
+    static void check(NCompressError err)
+    {
+        if (err != NCMP_OK)
+        {
+            throw Error(err);
+        }
+    }
+
+    NCompressContainer  cont_ = {};
+};
+
+//======================================================================
+
+inline std::vector<Byte> compress(std::span<const Byte> bytes, int bits = 0)
+{
+    return Compressor(bits).compress(bytes);
+}
+
+
+
+inline std::vector<Byte> decompress(std::span<const Byte> bytes)
+{
+    return Decompressor().decompress(bytes);
+}
+
+} // namespace ncompress
+
+#endif // NCOMPRESS42_HPP
@@ -0,0 +1,488 @@
+#ifndef NCOMPRESS42CORO_HPP
+#define NCOMPRESS42CORO_HPP
+
+/*  This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <http://unlicense.org/>
+*/
+
+/*  C++20 coroutines over ncompress42.hpp, for services which handle
+    many streams without a thread for each.  It is kept apart since
+    older compilers need a flag such as -fcoroutines for it.
+
+    Nothing here blocks or waits.  The decompression is built on
+    nDecompressPush(), which keeps its state in the context between
+    pieces of input, so a coroutine awaits its input however it likes
+    and passes each piece on as it arrives:
+
+        AsyncDecompressor   dec;
+
+        while ((n = co_await in.read(buf)) > 0)
+            for (std::span<const Byte> chunk : dec.chunks({buf, n}))
+                co_await out.write(chunk);
+
+        for (std::span<const Byte> chunk : dec.finish())
+            co_await out.write(chunk);
+
+    For compression CompressSink gives write(), flush() and end()
+    tasks which pass the compressed bytes to an asynchronous writer.
+
+    Task and Generator are the smallest types needed for this.  A Task
+    starts when it is awaited, or from start() for a task which nothing
+    awaits, such as one run by an executor.  Either works with any
+    executor since they only resume whoever awaits them.
+*/
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <utility>
+
+#include "ncompress42.hpp"
+
+namespace ncompress
+{
+
+//======================================================================
+
+class Task
+{
+public:
+    struct promise_type;
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type
+    {
+        std::coroutine_handle<>     continuation;
+        std::exception_ptr          failure;
+
+        Task get_return_object() noexcept
+        {
+            return Task(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        // Resume the awaiter, if any, when the task ends.
+        struct Final
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(Handle h) noexcept
+            {
+                std::coroutine_handle<> next = h.promise().continuation;
+
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        Final final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            failure = std::current_exception();
+        }
+    };
+
+    Task(Task&& other) noexcept
+      : h_(std::exchange(other.h_, {}))
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+            {
+                h_.destroy();
+            }
+
+            h_ = std::exchange(other.h_, {});
+        }
+
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (h_)
+        {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+
+    void await_resume()
+    {
+        result();
+    }
+
+    // Run a task which nothing awaits up to its first suspension.
+    void start()
+    {
+        h_.resume();
+    }
+
+    bool done() const noexcept
+    {
+        return !h_ || h_.done();
+    }
+
+    // Rethrow the exception which ended the task, if any.
+    void result()
+    {
+        if (h_ && h_.promise().failure)
+        {
+            std::rethrow_exception(h_.promise().failure);
+        }
+    }
+
+private:
+    explicit Task(Handle h) noexcept
+      : h_(h)
+    {
+    }
+
+    Handle  h_;
+};
+
+
+
+/*  A synchronous generator.  It can't await, so it is used from inside
+    a coroutine between the awaits.
+*/
+template <class T>
+class Generator
+{
+public:
+    struct promise_type;
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type
+    {
+        T                   value;
+        std::exception_ptr  failure;
+
+        Generator get_return_object() noexcept
+        {
+            return Generator(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always yield_value(T v) noexcept
+        {
+            value = std::move(v);
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            failure = std::current_exception();
+        }
+
+        template <class U>
+        void await_transform(U&&) = delete;
+    };
+
+    class iterator
+    {
+    public:
+        using value_type      = T;
+        using difference_type = std::ptrdiff_t;
+
+        explicit iterator(Handle h = {}) noexcept
+          : h_(h)
+        {
+        }
+
+        iterator& operator++()
+        {
+            resume(h_);
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            ++*this;
+        }
+
+        const T& operator*() const noexcept
+        {
+            return h_.promise().value;
+        }
+
+        bool operator==(std::default_sentinel_t) const noexcept
+        {
+            return h_.done();
+        }
+
+    private:
+        Handle  h_;
+    };
+
+    Generator(Generator&& other) noexcept
+      : h_(std::exchange(other.h_, {}))
+    {
+    }
+
+    Generator& operator=(Generator&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+            {
+                h_.destroy();
+            }
+
+            h_ = std::exchange(other.h_, {});
+        }
+
+        return *this;
+    }
+
+    ~Generator()
+    {
+        if (h_)
+        {
+            h_.destroy();
+        }
+    }
+
+    iterator begin()
+    {
+        resume(h_);
+        return iterator(h_);
+    }
+
+    std::default_sentinel_t end() const noexcept
+    {
+        return {};
+    }
+
+private:
+    explicit Generator(Handle h) noexcept
+      : h_(h)
+    {
+    }
+
+    static void resume(Handle h)
+    {
+        h.resume();
+
+        if (h.promise().failure)
+        {
+            std::rethrow_exception(std::exchange(h.promise().failure, nullptr));
+        }
+    }
+
+    Handle  h_;
+};
+
+//======================================================================
+
+/*  Decompresses input pushed a piece at a time.
+
+    chunks() yields the bytes decompressed from one piece of input as
+    spans into a buffer of chunkSize bytes.  Each span is valid until
+    the generator goes on, and the input until it ends.  Every whole
+    code is decoded, and the bits of a partial one are kept for the next
+    piece, so a flushed stream decodes up to its flush.
+    finish() yields the rest at the end of the input.  Errors are thrown
+    as ncompress::Error from the generator.
+
+    Use decompressor().reset() before another stream.
+*/
+class AsyncDecompressor
+{
+public:
+    explicit AsyncDecompressor(size_t chunkSize = 1 << 16)
+      : AsyncDecompressor(Decompressor(), chunkSize)
+    {
+    }
+
+    AsyncDecompressor(Decompressor&& decomp, size_t chunkSize = 1 << 16)
+      : decomp_(std::move(decomp)),
+        buf_(std::max<size_t>(chunkSize, 1))
+    {
+    }
+
+    Generator<std::span<const Byte>> chunks(std::span<const Byte> input)
+    {
+        size_t got;
+
+        do
+        {
+            got = decomp_.push(input, buf_);
+
+            if (got > 0)
+            {
+                co_yield std::span<const Byte>(buf_.data(), got);
+            }
+        }
+        while (got == buf_.size());
+    }
+
+    Generator<std::span<const Byte>> finish()
+    {
+        size_t got;
+
+        do
+        {
+            got = decomp_.finish(buf_);
+
+            if (got > 0)
+            {
+                co_yield std::span<const Byte>(buf_.data(), got);
+            }
+        }
+        while (got == buf_.size());
+    }
+
+    Decompressor& decompressor() noexcept
+    {
+        return decomp_;
+    }
+
+private:
+    Decompressor        decomp_;
+    std::vector<Byte>   buf_;
+};
+
+
+
+/*  Compresses into an asynchronous writer, which must have
+
+        co_await writer.write(std::span<const Byte> bytes)
+
+    and be done with the bytes when it resumes the sink.  The output is
+    collected and passed on once there are chunkSize bytes, and at each
+    flush() and end().  The bytes passed to write() must stay valid
+    until it ends.  After end() the next write() starts a new stream.
+*/
+template <class Writer>
+class CompressSink
+{
+public:
+    explicit CompressSink(Writer& writer, int bits = 0, size_t chunkSize = 1 << 16)
+      : CompressSink(writer, Compressor(bits), chunkSize)
+    {
+    }
+
+    CompressSink(Writer& writer, Compressor&& comp, size_t chunkSize = 1 << 16)
+      : writer_(writer),
+        comp_(std::move(comp)),
+        chunkSize_(std::max<size_t>(chunkSize, 1))
+    {
+        comp_.reset();
+    }
+
+    Task write(std::span<const Byte> bytes)
+    {
+        while (!bytes.empty())
+        {
+            std::span<const Byte> piece = bytes.first(std::min(bytes.size(), chunkSize_));
+
+            comp_.write(piece, collect());
+            bytes = bytes.subspan(piece.size());
+
+            if (pending_.size() >= chunkSize_)
+            {
+                co_await drain();
+            }
+        }
+    }
+
+    Task flush()
+    {
+        comp_.flush(collect());
+        co_await drain();
+    }
+
+    Task end()
+    {
+        comp_.end(collect());
+        co_await drain();
+    }
+
+    Compressor& compressor() noexcept
+    {
+        return comp_;
+    }
+
+private:
+    struct Collect
+    {
+        std::vector<Byte>*  pending;
+
+        void operator()(std::span<const Byte> b) const
+        {
+            pending->insert(pending->end(), b.begin(), b.end());
+        }
+    };
+
+    Collect collect() noexcept
+    {
+        return Collect{&pending_};
+    }
+
+    Task drain()
+    {
+        if (!pending_.empty())
+        {
+            co_await writer_.write(std::span<const Byte>(pending_));
+            pending_.clear();
+        }
+    }
+
+    Writer&             writer_;
+    Compressor          comp_;
+    size_t              chunkSize_;
+    std::vector<Byte>   pending_;
+};
+
+} // namespace ncompress
+
+#endif // NCOMPRESS42CORO_HPP
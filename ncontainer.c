@@ -0,0 +1,1080 @@
+/*  ncontainer.c - Containers of many small objects, each compressed by
+    itself.  See ncompress42.h.  This uses only the API of ncompress42.h
+    and is built into the same library.
+
+    This is free and unencumbered software released into the public domain.
+
+    For more information, please refer to <http://unlicense.org/>
+*/
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+#include    <sys/file.h>
+#include    <sys/mman.h>
+#include    <sys/stat.h>
+#include    <sys/types.h>
+
+#include    "ncompress42.h"
+
+//  The index is a header, the entries sorted by key and then the keys.
+//  The header is CONTMAGIC, CONTVERSION in 4 bytes, and the generation,
+//  the number of entries, the length of the data and the length of the
+//  keys in 8 bytes each.  An entry is the offset of the object in 8
+//  bytes, its compressed length, length, CRC and key length in 4 bytes
+//  each, and the offset of its key among the keys in 8 bytes.  Numbers
+//  are least significant first, as in a snapshot from nSaveState().
+//
+//  Changes are kept in memory until a commit, when they are sorted and
+//  merged with the old index into a new one.  Since the keys of both are
+//  already in order this is a single pass.
+//
+//  A writer and a compaction hold an flock() on path.lock.  The index
+//  can't be locked itself since each commit replaces it.
+
+#define CONTMAGIC       "nCmI"
+#define CONTVERSION     1
+#define CONTHEADER      40
+#define CONTENTRY       32
+#define CONTBUFSIZ      (1 << 20)   // of the data written at once
+
+
+/*  A put or remove since the last commit.
+*/
+typedef struct contChange
+{
+    const Byte* key;            // set for the sort
+    size_t      keyOff;         // in ContState.keys
+    uint32_t    keyLen;
+    int         removed;
+    long        seq;
+    uint64_t    offset;
+    uint32_t    compLen;
+    uint32_t    length;
+    uint32_t    crc;
+} ContChange;
+
+
+typedef struct contState
+{
+    char*           path;
+    int             writable;
+    int             fdLock;         // holds the lock of a writer
+    int             fdData;
+    uint64_t        gen;
+    const Byte*     index;          // the mapped index
+    size_t          indexSize;
+    long            count;
+    const Byte*     keyBase;        // the keys in the index
+    uint64_t        keysLen;
+    const Byte*     data;           // the mapped data, or NULL if empty
+    uint64_t        dataLen;
+
+    ContChange*     changes;
+    long            numChanges;
+    long            capChanges;
+    Byte*           keys;           // of the changes
+    size_t          keysUsed;
+    size_t          keysCap;
+
+    Byte*           buf;            // data not yet written
+    size_t          bufLen;
+    uint64_t        bufAt;          // the offset of buf in the data file
+    uint64_t        end;            // where the next object goes
+    int             failed;
+
+    NCompressCtxt   comp;
+    NCompressCtxt   decomp;
+} ContState;
+
+
+
+static uint64_t
+getLE(const Byte* p, int n)
+{
+    uint64_t    v = 0;
+
+    while (n-- > 0)
+    {
+        v = (v << 8) | p[n];
+    }
+
+    return v;
+}
+
+
+
+static void
+putLE(Byte* p, uint64_t v, int n)
+{
+    int     i;
+
+    for (i = 0; i < n; ++i)
+    {
+        p[i] = (Byte)(v >> (i * 8));
+    }
+}
+
+
+
+static int
+pwriteAll(int fd, const Byte* bytes, size_t numBytes, uint64_t at)
+{
+    while (numBytes > 0)
+    {
+        ssize_t n = pwrite(fd, bytes, numBytes, (off_t)at);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        bytes    += n;
+        numBytes -= n;
+        at       += n;
+    }
+
+    return 0;
+}
+
+
+
+//  The name of the data file of a generation, which the caller frees.
+static char*
+dataPath(const char* path, uint64_t gen)
+{
+    size_t  len = strlen(path) + 24;
+    char*   p = (char*)malloc(len);
+
+    if (p)
+    {
+        snprintf(p, len, "%s.%llu", path, (unsigned long long)gen);
+    }
+
+    return p;
+}
+
+
+
+/*  Take the lock of a writer or compaction on the container at path.
+    This returns the descriptor which holds it, or -1 with errno set to
+    EWOULDBLOCK if another has it.
+*/
+static int
+lockContainer(const char* path)
+{
+    size_t  len = strlen(path) + 6;
+    char*   p = (char*)malloc(len);
+    int     fd;
+    int     e;
+
+    if (!p)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    snprintf(p, len, "%s.lock", path);
+    fd = open(p, O_RDWR | O_CREAT, 0644);
+    e  = errno;
+    free(p);
+
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        e = errno;
+        close(fd);
+        fd = -1;
+    }
+
+    errno = e;
+    return fd;
+}
+
+
+
+/*  Compare a key with that of the entry at e.  Sets *bad for a key which
+    isn't within the keys.
+*/
+static int
+compareEntry(const ContState* cs, const Byte* e, const Byte* key, size_t keyLen, int* bad)
+{
+    uint64_t    off = getLE(e + 24, 8);
+    uint32_t    len = (uint32_t)getLE(e + 20, 4);
+    int         c;
+
+    if (off > cs->keysLen || len > cs->keysLen - off)
+    {
+        *bad = 1;
+        return 0;
+    }
+
+    c = memcmp(key, cs->keyBase + off, (keyLen < len) ? keyLen : len);
+
+    if (c == 0)
+    {
+        c = (keyLen < len) ? -1 : (keyLen > len);
+    }
+
+    return c;
+}
+
+
+
+static int
+compareChanges(const void* a, const void* b)
+{
+    const ContChange*   x = (const ContChange*)a;
+    const ContChange*   y = (const ContChange*)b;
+    int                 c = memcmp(x->key, y->key, (x->keyLen < y->keyLen) ? x->keyLen : y->keyLen);
+
+    if (c == 0)
+    {
+        c = (x->keyLen > y->keyLen) - (x->keyLen < y->keyLen);
+    }
+
+    if (c == 0)
+    {
+        // The last change to a key wins.
+        c = (x->seq > y->seq) - (x->seq < y->seq);
+    }
+
+    return c;
+}
+
+
+
+static void
+unmapContainer(ContState* cs)
+{
+    if (cs->index)
+    {
+        munmap((void*)cs->index, cs->indexSize);
+        cs->index = NULL;
+    }
+
+    if (cs->data)
+    {
+        munmap((void*)cs->data, cs->dataLen);
+        cs->data = NULL;
+    }
+}
+
+
+
+/*  Map the index at cs->path and the first dataLen bytes of the data,
+    after checking the header.  A data file open on cs->fdData is kept.
+*/
+static NCompressError
+mapContainer(ContState* cs)
+{
+    struct stat st;
+    const Byte* h;
+    void*       p = MAP_FAILED;
+    int         fd;
+
+    unmapContainer(cs);
+
+    if ((fd = open(cs->path, O_RDONLY)) < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if (fstat(fd, &st) < 0 || (st.st_size >= CONTHEADER &&
+        (p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        int e = errno;
+
+        close(fd);
+        errno = e;
+        return NCMP_READ_ERROR;
+    }
+
+    close(fd);
+
+    if (st.st_size < CONTHEADER)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    h = (const Byte*)p;
+    cs->index     = h;
+    cs->indexSize = st.st_size;
+    cs->gen       = getLE(h + 8, 8);
+    cs->count     = (long)getLE(h + 16, 8);
+    cs->dataLen   = getLE(h + 24, 8);
+    cs->keysLen   = getLE(h + 32, 8);
+    cs->keyBase   = h + CONTHEADER + (size_t)cs->count * CONTENTRY;
+
+    if (memcmp(h, CONTMAGIC, 4) != 0 || getLE(h + 4, 4) != CONTVERSION || cs->count < 0 ||
+        (uint64_t)cs->count > ((uint64_t)st.st_size - CONTHEADER) / CONTENTRY ||
+        cs->keysLen != (uint64_t)st.st_size - CONTHEADER - (uint64_t)cs->count * CONTENTRY)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (cs->fdData < 0)
+    {
+        char* dp = dataPath(cs->path, cs->gen);
+
+        if (!dp)
+        {
+            return NCMP_OTHER_ERROR;
+        }
+
+        cs->fdData = open(dp, cs->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        free(dp);
+
+        if (cs->fdData < 0)
+        {
+            return NCMP_READ_ERROR;
+        }
+    }
+
+    if (fstat(cs->fdData, &st) < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if ((uint64_t)st.st_size < cs->dataLen)
+    {
+        return NCMP_DATA_ERROR;
+    }
+
+    if (cs->dataLen > 0)
+    {
+        if ((p = mmap(NULL, cs->dataLen, PROT_READ, MAP_SHARED, cs->fdData, 0)) == MAP_FAILED)
+        {
+            return NCMP_READ_ERROR;
+        }
+
+        cs->data = (const Byte*)p;
+    }
+
+    return NCMP_OK;
+}
+
+
+
+/*  Write an index for gen to path.tmp and rename it to path.  The entries
+    and keys are in the form they have in the file.
+*/
+static NCompressError
+writeIndex(const char* path, uint64_t gen, long count, uint64_t dataLen,
+           const Byte* entries, const Byte* keys, uint64_t keysLen)
+{
+    Byte        h[CONTHEADER];
+    size_t      len = strlen(path) + 5;
+    char*       tmp = (char*)malloc(len);
+    int         fd;
+    int         ok;
+
+    if (!tmp)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    snprintf(tmp, len, "%s.tmp", path);
+
+    memcpy(h, CONTMAGIC, 4);
+    putLE(h + 4, CONTVERSION, 4);
+    putLE(h + 8, gen, 8);
+    putLE(h + 16, (uint64_t)count, 8);
+    putLE(h + 24, dataLen, 8);
+    putLE(h + 32, keysLen, 8);
+
+    ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0;
+    ok = ok && pwriteAll(fd, h, CONTHEADER, 0) == 0;
+    ok = ok && pwriteAll(fd, entries, (size_t)count * CONTENTRY, CONTHEADER) == 0;
+    ok = ok && pwriteAll(fd, keys, keysLen, CONTHEADER + (uint64_t)count * CONTENTRY) == 0;
+    ok = ok && fsync(fd) == 0;
+
+    if (fd >= 0 && close(fd) < 0)
+    {
+        ok = 0;
+    }
+
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok)
+    {
+        int e = errno;
+
+        unlink(tmp);
+        errno = e;
+    }
+
+    free(tmp);
+    return ok ? NCMP_OK : NCMP_WRITE_ERROR;
+}
+
+
+
+static int
+flushContainer(ContState* cs)
+{
+    if (cs->bufLen > 0 && pwriteAll(cs->fdData, cs->buf, cs->bufLen, cs->bufAt) < 0)
+    {
+        cs->failed = 1;
+        return -1;
+    }
+
+    cs->bufAt += cs->bufLen;
+    cs->bufLen = 0;
+    return 0;
+}
+
+
+
+//  The writer of the compressor, which appends to the data.
+static ssize_t
+containerWriter(const Byte* bytes, size_t numBytes, void* rwCtxt)
+{
+    ContState*  cs = (ContState*)rwCtxt;
+
+    if (cs->bufLen + numBytes > CONTBUFSIZ && flushContainer(cs) < 0)
+    {
+        return -1;
+    }
+
+    if (numBytes > CONTBUFSIZ)
+    {
+        if (pwriteAll(cs->fdData, bytes, numBytes, cs->bufAt) < 0)
+        {
+            cs->failed = 1;
+            return -1;
+        }
+
+        cs->bufAt += numBytes;
+    }
+    else
+    {
+        memcpy(cs->buf + cs->bufLen, bytes, numBytes);
+        cs->bufLen += numBytes;
+    }
+
+    cs->end += numBytes;
+    return (ssize_t)numBytes;
+}
+
+
+
+//  Drop the data after at, which is rewritten by the next put.
+static void
+rewindContainer(ContState* cs, uint64_t at)
+{
+    if (at >= cs->bufAt)
+    {
+        cs->bufLen = at - cs->bufAt;
+    }
+    else
+    {
+        cs->bufAt  = at;
+        cs->bufLen = 0;
+    }
+
+    cs->end = at;
+}
+
+
+
+/*  Add a change, with room for its key.
+*/
+static ContChange*
+addChange(ContState* cs, const void* key, size_t keyLen)
+{
+    ContChange* ch;
+
+    if (cs->numChanges == cs->capChanges)
+    {
+        long    cap = cs->capChanges ? 2 * cs->capChanges : 1024;
+
+        if (!(ch = (ContChange*)realloc(cs->changes, cap * sizeof(ContChange))))
+        {
+            return NULL;
+        }
+
+        cs->changes    = ch;
+        cs->capChanges = cap;
+    }
+
+    if (cs->keysUsed + keyLen > cs->keysCap)
+    {
+        size_t  cap = 2 * (cs->keysUsed + keyLen) + 4096;
+        Byte*   k = (Byte*)realloc(cs->keys, cap);
+
+        if (!k)
+        {
+            return NULL;
+        }
+
+        cs->keys    = k;
+        cs->keysCap = cap;
+    }
+
+    ch = &cs->changes[cs->numChanges];
+    memset(ch, 0, sizeof(*ch));
+    memcpy(cs->keys + cs->keysUsed, key, keyLen);
+
+    ch->keyOff = cs->keysUsed;
+    ch->keyLen = (uint32_t)keyLen;
+    ch->seq    = cs->numChanges;
+
+    cs->keysUsed += keyLen;
+    return ch;
+}
+
+
+
+static void
+freeContainer(ContState* cs)
+{
+    unmapContainer(cs);
+
+    if (cs->fdData >= 0)
+    {
+        close(cs->fdData);
+    }
+
+    if (cs->fdLock >= 0)
+    {
+        close(cs->fdLock);
+    }
+
+    nFreeCompress(&cs->comp);
+    nFreeCompress(&cs->decomp);
+    free(cs->changes);
+    free(cs->keys);
+    free(cs->buf);
+    free(cs->path);
+    free(cs);
+}
+
+
+
+NCompressError
+nOpenContainer(NCompressContainer* cont, const char* path, int flags, int bits)
+{
+    ContState*      cs = (ContState*)calloc(1, sizeof(ContState));
+    NCompressError  err;
+
+    cont->priv = NULL;
+
+    if (!cs)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    cs->fdData   = -1;
+    cs->fdLock   = -1;
+    cs->writable = (flags & NCMP_CONT_WRITE) != 0;
+    cs->path     = strdup(path);
+
+    nInitDecompress(&cs->decomp);
+
+    if (cs->writable)
+    {
+        cs->comp.writer = NULL;
+        cs->comp.rwCtxt = cs;
+        nInitCompress(&cs->comp, bits);
+        cs->buf = (Byte*)malloc(CONTBUFSIZ);
+    }
+
+    if (!cs->path || !cs->decomp.priv || (cs->writable && (!cs->comp.priv || !cs->buf)))
+    {
+        freeContainer(cs);
+        return NCMP_OTHER_ERROR;
+    }
+
+    nSetCrc32c(&cs->decomp, 1);
+
+    if (cs->writable)
+    {
+        nSetCrc32c(&cs->comp, 1);
+        nSetStreams64(&cs->comp, NULL, containerWriter);
+    }
+
+    if ((flags & NCMP_CONT_CREATE) && cs->writable && access(path, F_OK) < 0 && errno == ENOENT)
+    {
+        // An empty index for the first generation.
+        err = writeIndex(path, 1, 0, 0, NULL, NULL, 0);
+
+        if (err != NCMP_OK)
+        {
+            freeContainer(cs);
+            return err;
+        }
+    }
+
+    // Lock before the index is read, so that a compaction can't replace it.
+    if (cs->writable && (access(path, F_OK) < 0 || (cs->fdLock = lockContainer(path)) < 0))
+    {
+        int e = errno;
+
+        freeContainer(cs);
+        errno = e;
+        return (e == ENOENT) ? NCMP_READ_ERROR : NCMP_WRITE_ERROR;
+    }
+
+    if ((err = mapContainer(cs)) != NCMP_OK)
+    {
+        int e = errno;
+
+        freeContainer(cs);
+        errno = e;
+        return err;
+    }
+
+    cs->end = cs->bufAt = cs->dataLen;
+    cont->priv = cs;
+    return NCMP_OK;
+}
+
+
+
+NCompressError
+nContainerPut(NCompressContainer* cont, const void* key, size_t keyLen, const Byte* bytes, size_t numBytes)
+{
+    ContState*      cs = (ContState*)cont->priv;
+    ContChange*     ch;
+    uint64_t        start;
+    NCompressError  err;
+
+    if (!cs || !cs->writable || keyLen > UINT32_MAX || numBytes > UINT32_MAX)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (!(ch = addChange(cs, key, keyLen)))
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    start = cs->end;
+
+    // A stream may be left by a failed put.
+    nResetCompress(&cs->comp);
+
+    err = nCompressWrite(&cs->comp, bytes, numBytes);
+
+    if (err == NCMP_OK)
+    {
+        err = nCompressEnd(&cs->comp);
+    }
+
+    if (err == NCMP_OK && cs->end - start > UINT32_MAX)
+    {
+        err = NCMP_OTHER_ERROR;
+    }
+
+    if (err != NCMP_OK)
+    {
+        cs->keysUsed -= keyLen;
+        rewindContainer(cs, start);
+        return err;
+    }
+
+    ch->offset  = start;
+    ch->compLen = (uint32_t)(cs->end - start);
+    ch->length  = (uint32_t)numBytes;
+    ch->crc     = nGetCrc32c(&cs->comp);
+
+    ++cs->numChanges;
+    return NCMP_OK;
+}
+
+
+
+NCompressError
+nContainerRemove(NCompressContainer* cont, const void* key, size_t keyLen)
+{
+    ContState*  cs = (ContState*)cont->priv;
+    ContChange* ch;
+
+    if (!cs || !cs->writable || keyLen > UINT32_MAX || !(ch = addChange(cs, key, keyLen)))
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    ch->removed = 1;
+    ++cs->numChanges;
+    return NCMP_OK;
+}
+
+
+
+/*  Put the entry of a change in its form in the file, with its key.
+*/
+static void
+putEntry(Byte* e, uint64_t offset, uint32_t compLen, uint32_t length, uint32_t crc,
+         uint32_t keyLen, uint64_t keyOff)
+{
+    putLE(e, offset, 8);
+    putLE(e + 8, compLen, 4);
+    putLE(e + 12, length, 4);
+    putLE(e + 16, crc, 4);
+    putLE(e + 20, keyLen, 4);
+    putLE(e + 24, keyOff, 8);
+}
+
+
+
+NCompressError
+nContainerCommit(NCompressContainer* cont)
+{
+    ContState*      cs = (ContState*)cont->priv;
+    Byte*           entries;
+    Byte*           keys;
+    uint64_t        keysLen = 0;
+    long            count = 0;
+    long            i = 0;
+    long            j = 0;
+    int             bad = 0;
+    NCompressError  err;
+
+    if (!cs || !cs->writable)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (cs->numChanges == 0)
+    {
+        return NCMP_OK;
+    }
+
+    if (flushContainer(cs) < 0 || ftruncate(cs->fdData, (off_t)cs->end) < 0 || fdatasync(cs->fdData) < 0)
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    for (j = 0; j < cs->numChanges; ++j)
+    {
+        cs->changes[j].key = cs->keys + cs->changes[j].keyOff;
+    }
+
+    qsort(cs->changes, cs->numChanges, sizeof(ContChange), compareChanges);
+
+    entries = (Byte*)malloc(((size_t)cs->count + cs->numChanges) * CONTENTRY);
+    keys    = (Byte*)malloc(cs->keysLen + cs->keysUsed + 1);
+
+    if (!entries || !keys)
+    {
+        free(entries);
+        free(keys);
+        return NCMP_OTHER_ERROR;
+    }
+
+    j = 0;
+
+    while (i < cs->count || j < cs->numChanges)
+    {
+        const Byte*         e = cs->index + CONTHEADER + (size_t)i * CONTENTRY;
+        const ContChange*   ch = NULL;
+        int                 c = -1;
+
+        if (j < cs->numChanges)
+        {
+            // Only the last change to a key counts.
+            while (j + 1 < cs->numChanges && cs->changes[j+1].keyLen == cs->changes[j].keyLen &&
+                   memcmp(cs->changes[j+1].key, cs->changes[j].key, cs->changes[j].keyLen) == 0)
+            {
+                ++j;
+            }
+
+            ch = &cs->changes[j];
+            c  = (i < cs->count) ? compareEntry(cs, e, ch->key, ch->keyLen, &bad) : -1;
+        }
+
+        if (bad)
+        {
+            break;
+        }
+
+        if (c > 0 || !ch)
+        {
+            // The old entry stays, with its key moved.
+            uint64_t    off = getLE(e + 24, 8);
+            uint32_t    len = (uint32_t)getLE(e + 20, 4);
+
+            if (off > cs->keysLen || len > cs->keysLen - off)
+            {
+                bad = 1;
+                break;
+            }
+
+            memcpy(entries + (size_t)count * CONTENTRY, e, 24);
+            putLE(entries + (size_t)count * CONTENTRY + 24, keysLen, 8);
+            memcpy(keys + keysLen, cs->keyBase + off, len);
+            keysLen += len;
+            ++count;
+            ++i;
+            continue;
+        }
+
+        if (!ch->removed)
+        {
+            putEntry(entries + (size_t)count * CONTENTRY, ch->offset, ch->compLen, ch->length, ch->crc,
+                     ch->keyLen, keysLen);
+            memcpy(keys + keysLen, ch->key, ch->keyLen);
+            keysLen += ch->keyLen;
+            ++count;
+        }
+
+        if (c == 0)
+        {
+            ++i;
+        }
+
+        ++j;
+    }
+
+    err = bad ? NCMP_DATA_ERROR : writeIndex(cs->path, cs->gen, count, cs->end, entries, keys, keysLen);
+
+    free(entries);
+    free(keys);
+
+    if (err == NCMP_OK)
+    {
+        cs->numChanges = 0;
+        cs->keysUsed   = 0;
+        err = mapContainer(cs);
+    }
+
+    return err;
+}
+
+
+
+NCompressError
+nContainerFind(NCompressContainer* cont, const void* key, size_t keyLen, NCompressObject* obj)
+{
+    ContState*  cs = (ContState*)cont->priv;
+    long        lo = 0;
+    long        hi;
+    int         bad = 0;
+
+    if (!cs)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    hi = cs->count;
+
+    while (lo < hi)
+    {
+        long        mid = lo + (hi - lo) / 2;
+        const Byte* e = cs->index + CONTHEADER + (size_t)mid * CONTENTRY;
+        int         c = compareEntry(cs, e, (const Byte*)key, keyLen, &bad);
+
+        if (bad)
+        {
+            return NCMP_DATA_ERROR;
+        }
+
+        if (c < 0)
+        {
+            hi = mid;
+        }
+        else
+        if (c > 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            obj->offset        = getLE(e, 8);
+            obj->compressedLen = (uint32_t)getLE(e + 8, 4);
+            obj->length        = (uint32_t)getLE(e + 12, 4);
+            obj->crc           = (uint32_t)getLE(e + 16, 4);
+
+            if (obj->offset > cs->dataLen || obj->compressedLen > cs->dataLen - obj->offset)
+            {
+                return NCMP_DATA_ERROR;
+            }
+
+            obj->bytes = cs->data + obj->offset;
+            return NCMP_OK;
+        }
+    }
+
+    return NCMP_NOT_FOUND;
+}
+
+
+
+NCompressError
+nContainerGet(NCompressContainer* cont, const void* key, size_t keyLen, Byte* out, size_t outSize, size_t* numOut)
+{
+    ContState*      cs = (ContState*)cont->priv;
+    NCompressObject obj;
+    NCompressError  err;
+
+    *numOut = 0;
+
+    if ((err = nContainerFind(cont, key, keyLen, &obj)) != NCMP_OK)
+    {
+        return err;
+    }
+
+    *numOut = obj.length;
+
+    if (obj.length > outSize)
+    {
+        return NCMP_LIMIT_ERROR;
+    }
+
+    err = nDecompressBuffer(&cs->decomp, obj.bytes, obj.compressedLen, out, obj.length, numOut);
+
+    if (err == NCMP_OK && (*numOut != obj.length || nGetCrc32c(&cs->decomp) != obj.crc))
+    {
+        err = NCMP_DATA_ERROR;
+    }
+
+    // More output than the index has is damage too.
+    return (err == NCMP_LIMIT_ERROR) ? NCMP_DATA_ERROR : err;
+}
+
+
+
+NCompressError
+nCloseContainer(NCompressContainer* cont)
+{
+    ContState*      cs = (ContState*)cont->priv;
+    NCompressError  err = NCMP_OK;
+
+    if (!cs)
+    {
+        return NCMP_OTHER_ERROR;
+    }
+
+    if (cs->writable)
+    {
+        err = nContainerCommit(cont);
+    }
+
+    freeContainer(cs);
+    cont->priv = NULL;
+    return err;
+}
+
+
+
+NCompressError
+nCompactContainer(const char* path)
+{
+    NCompressContainer  cont;
+    ContState*          cs;
+    Byte*               entries = NULL;
+    char*               newPath = NULL;
+    char*               oldPath = NULL;
+    uint64_t            at = 0;
+    int                 fd = -1;
+    int                 fdLock;
+    long                i;
+    NCompressError      err;
+
+    if (access(path, F_OK) < 0)
+    {
+        return NCMP_READ_ERROR;
+    }
+
+    if ((fdLock = lockContainer(path)) < 0)
+    {
+        return NCMP_WRITE_ERROR;
+    }
+
+    if ((err = nOpenContainer(&cont, path, 0, 0)) != NCMP_OK)
+    {
+        int e = errno;
+
+        close(fdLock);
+        errno = e;
+        return err;
+    }
+
+    // Held until the container is closed.
+    ((ContState*)cont.priv)->fdLock = fdLock;
+
+    cs      = (ContState*)cont.priv;
+    entries = (Byte*)malloc((size_t)cs->count * CONTENTRY + 1);
+    newPath = dataPath(path, cs->gen + 1);
+    oldPath = dataPath(path, cs->gen);
+
+    if (!entries || !newPath || !oldPath)
+    {
+        err = NCMP_OTHER_ERROR;
+        goto done;
+    }
+
+    memcpy(entries, cs->index + CONTHEADER, (size_t)cs->count * CONTENTRY);
+
+    if ((fd = open(newPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        err = NCMP_WRITE_ERROR;
+        goto done;
+    }
+
+    // The live objects in key order, which keeps the keys as they were.
+    for (i = 0; i < cs->count; ++i)
+    {
+        Byte*       e = entries + (size_t)i * CONTENTRY;
+        uint64_t    off = getLE(e, 8);
+        uint32_t    len = (uint32_t)getLE(e + 8, 4);
+
+        if (off > cs->dataLen || len > cs->dataLen - off)
+        {
+            err = NCMP_DATA_ERROR;
+            goto done;
+        }
+
+        if (pwriteAll(fd, cs->data + off, len, at) < 0)
+        {
+            err = NCMP_WRITE_ERROR;
+            goto done;
+        }
+
+        putLE(e, at, 8);
+        at += len;
+    }
+
+    if (fdatasync(fd) < 0)
+    {
+        err = NCMP_WRITE_ERROR;
+        goto done;
+    }
+
+    err = writeIndex(path, cs->gen + 1, cs->count, at, entries, cs->keyBase, cs->keysLen);
+
+    if (err == NCMP_OK)
+    {
+        unlink(oldPath);
+    }
+
+done:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (err != NCMP_OK && newPath)
+    {
+        int e = errno;
+
+        unlink(newPath);
+        errno = e;
+    }
+
+    free(entries);
+    free(newPath);
+    free(oldPath);
+    nCloseContainer(&cont);
+    return err;
+}
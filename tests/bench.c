@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include <ncompress42.h>
+
+#include "corpus.h"
+
+/*  Throughput benchmark for nCompress() and nDecompress().
+
+    The corpus is generated from fixed seeds so that every run measures
+    the same bytes.  For each kind of data, size and bits the data is
+    compressed and decompressed from memory, the round trip is checked,
+    and one JSON record is printed per operation.  Progress goes to
+    stderr so stdout can be saved and compared between releases.
+
+    usage: bench [-m maxsize] [-n minsize] [-k kind] [-b bits] [-t seconds]
+
+    Sizes go up by powers of ten from 100 bytes.  The default largest
+    size is 10M; -m 1G runs the full corpus, which needs about 4 GB of
+    memory.
+*/
+
+//======================================================================
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+
+static uint64_t
+cycles()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+//======================================================================
+//  Peak RSS.  On Linux writing 5 to clear_refs resets the high water
+//  mark so it can be read per operation.  Elsewhere it is the peak of
+//  the whole process.
+
+static void
+resetPeakRss()
+{
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+
+    if (f)
+    {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+
+
+static long
+peakRssKb()
+{
+    FILE*           f = fopen("/proc/self/status", "r");
+    char            line[256];
+    long            kb = -1;
+    struct rusage   ru;
+
+    if (f)
+    {
+        while (fgets(line, sizeof line, f))
+        {
+            if (strncmp(line, "VmHWM:", 6) == 0)
+            {
+                kb = atol(line + 6);
+                break;
+            }
+        }
+
+        fclose(f);
+    }
+
+    if (kb < 0 && getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        kb = ru.ru_maxrss;
+    }
+
+    return kb;
+}
+
+
+//======================================================================
+
+typedef struct result
+{
+    double      seconds;
+    uint64_t    cycles;
+    long        runs;
+    long        rssKb;
+    int         ok;
+} Result;
+
+
+static double   minSeconds = 0.2;
+static int      firstRecord = 1;
+
+
+/*  Run one operation often enough to take minSeconds.
+*/
+static void
+timeOp(int decompress, const Byte* in, size_t size, int bits, MemStream* ms, Result* res)
+{
+    double      start;
+    uint64_t    c0;
+
+    res->runs = 0;
+    res->ok   = 1;
+
+    resetPeakRss();
+
+    start = now();
+    c0    = cycles();
+
+    do
+    {
+        NCompressError err = decompress ? runDecompress(in, size, ms) :
+                                          runCompress(in, size, bits, ms);
+
+        if (err != NCMP_OK)
+        {
+            res->ok = 0;
+        }
+
+        ++res->runs;
+    }
+    while (now() - start < minSeconds);
+
+    res->cycles  = cycles() - c0;
+    res->seconds = now() - start;
+    res->rssKb   = peakRssKb();
+}
+
+
+
+static void
+printRecord(const char* kind, size_t size, int bits, const char* op,
+            size_t outSize, const Result* res)
+{
+    double  bytes = (double)size * res->runs;
+
+    printf("%s\n    {\"corpus\": \"%s\", \"size\": %zu, \"bits\": %d, \"op\": \"%s\", "
+           "\"runs\": %ld, \"mb_per_s\": %.2f, ",
+           firstRecord ? "" : ",", kind, size, bits, op,
+           res->runs, bytes / res->seconds / 1e6);
+
+    if (res->cycles)
+    {
+        printf("\"cycles_per_byte\": %.2f, ", res->cycles / bytes);
+    }
+    else
+    {
+        printf("\"cycles_per_byte\": null, ");
+    }
+
+    printf("\"ratio\": %.4f, \"peak_rss_kb\": %ld, \"ok\": %s}",
+           size ? (double)outSize / size : 0.0, res->rssKb, res->ok ? "true" : "false");
+
+    fflush(stdout);
+    firstRecord = 0;
+}
+
+
+
+static size_t
+parseSize(const char* s)
+{
+    char*   end;
+    double  v = strtod(s, &end);
+
+    switch (*end)
+    {
+    case 'k': case 'K': v *= 1e3; break;
+    case 'm': case 'M': v *= 1e6; break;
+    case 'g': case 'G': v *= 1e9; break;
+    }
+
+    return (size_t)v;
+}
+
+
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: bench [-m maxsize] [-n minsize] [-k kind] [-b bits] [-t seconds]\n");
+    exit(2);
+}
+
+
+//======================================================================
+
+int
+main(int argc, char** argv)
+{
+    size_t      minSize = 100;
+    size_t      maxSize = 10000000;
+    const char* onlyKind = NULL;
+    int         onlyBits = 0;
+    int         opt;
+    Byte*       corpus;
+    MemStream   cms = { 0 };
+    MemStream   dms = { 0 };
+    char        cpu[256] = "unknown";
+    FILE*       f;
+
+    while ((opt = getopt(argc, argv, "m:n:k:b:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm': maxSize = parseSize(optarg);   break;
+        case 'n': minSize = parseSize(optarg);   break;
+        case 'k': onlyKind = optarg;             break;
+        case 'b': onlyBits = atoi(optarg);       break;
+        case 't': minSeconds = atof(optarg);     break;
+        default:  usage();
+        }
+    }
+
+    if ((corpus = malloc(maxSize + 1)) == NULL)
+    {
+        fprintf(stderr, "bench: cannot allocate %zu bytes\n", maxSize);
+        return 1;
+    }
+
+    if ((f = fopen("/proc/cpuinfo", "r")) != NULL)
+    {
+        char line[512];
+
+        while (fgets(line, sizeof line, f))
+        {
+            char* p = strchr(line, ':');
+
+            if (strncmp(line, "model name", 10) == 0 && p)
+            {
+                snprintf(cpu, sizeof cpu, "%s", p + 2);
+                cpu[strcspn(cpu, "\n\"\\")] = '\0';
+                break;
+            }
+        }
+
+        fclose(f);
+    }
+
+    printf("{\n  \"library\": \"ncompress42\",\n  \"cpu\": \"%s\",\n"
+           "  \"timestamp\": %ld,\n  \"min_seconds\": %.3f,\n  \"results\": [",
+           cpu, (long)time(NULL), minSeconds);
+
+    for (int k = 0; k < corpusNumKinds; ++k)
+    {
+        if (onlyKind && strcmp(onlyKind, corpusKinds[k].name) != 0)
+        {
+            continue;
+        }
+
+        // Generate the largest size once; smaller sizes are its prefixes.
+        seedRandom(k + 1);
+
+        corpusKinds[k].fill(corpus, maxSize);
+
+        for (size_t size = minSize; size <= maxSize; size *= 10)
+        {
+            for (int bits = 9; bits <= 16; ++bits)
+            {
+                Result  res;
+                size_t  compSize;
+                int     ok;
+
+                if (onlyBits && bits != onlyBits)
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "%-10s %10zu bits %2d\n", corpusKinds[k].name, size, bits);
+
+                timeOp(0, corpus, size, bits, &cms, &res);
+                compSize = cms.outSize;
+                printRecord(corpusKinds[k].name, size, bits, "compress", compSize, &res);
+
+                timeOp(1, cms.out, compSize, bits, &dms, &res);
+
+                ok = res.ok && dms.outSize == size && memcmp(dms.out, corpus, size) == 0;
+                res.ok = ok;
+                printRecord(corpusKinds[k].name, size, bits, "decompress", compSize, &res);
+
+                if (!ok)
+                {
+                    fprintf(stderr, "bench: round trip failed for %s %zu bits %d\n",
+                            corpusKinds[k].name, size, bits);
+                }
+            }
+        }
+    }
+
+    printf("\n  ]\n}\n");
+
+    free(cms.out);
+    free(dms.out);
+    free(corpus);
+    return 0;
+}
@@ -0,0 +1,291 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <ncompress42coro.hpp>
+
+/*  Round trips of the coroutines in ncompress42coro.hpp.  The writer
+    and the input resume their coroutines from a queue, as an event
+    loop on one thread would.
+*/
+
+using ncompress::AsyncDecompressor;
+using ncompress::CompressSink;
+using ncompress::Task;
+
+//======================================================================
+
+static int  numFailed = 0;
+
+
+static void
+reportAssert(bool b, int line, const char* msg)
+{
+    if (!b)
+    {
+        std::fprintf(stderr, "Assertion failure: line %d %s\n", line, msg);
+        ++numFailed;
+    }
+}
+
+
+#define ASSERT(test)          reportAssert(test, __LINE__, "")
+#define ASSERT_MSG(test, msg) reportAssert(test, __LINE__, msg)
+
+//======================================================================
+
+//  The coroutines waiting to be resumed.
+static std::deque<std::coroutine_handle<>>  ready;
+
+
+//  Run the queue until every coroutine waits for nothing.
+static void
+runLoop()
+{
+    while (!ready.empty())
+    {
+        std::coroutine_handle<> h = ready.front();
+
+        ready.pop_front();
+        h.resume();
+    }
+}
+
+
+//  Suspend until the loop gets to the awaiter.
+struct Later
+{
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        ready.push_back(h);
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+};
+
+
+/*  A writer which takes the bytes once the loop gets to it, as a
+    socket would.
+*/
+struct QueuedWriter
+{
+    std::vector<Byte>   bytes;
+    long                numWrites = 0;
+
+    Task write(std::span<const Byte> b)
+    {
+        co_await Later{};
+        bytes.insert(bytes.end(), b.begin(), b.end());
+        ++numWrites;
+    }
+};
+
+
+
+static std::vector<Byte>
+makeText(size_t num, unsigned seed)
+{
+    static const char* words[] =
+    {
+        "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ",
+        "dog ", "and ", "then ", "some ", "more ", "words ", "follow\n",
+    };
+    std::vector<Byte>   text;
+
+    srandom(seed);
+
+    while (text.size() < num)
+    {
+        for (const char* w = words[random() % (sizeof(words) / sizeof(words[0]))]; *w && text.size() < num; ++w)
+        {
+            text.push_back((random() % 97 == 0) ? static_cast<Byte>(random()) : static_cast<Byte>(*w));
+        }
+    }
+
+    return text;
+}
+
+//======================================================================
+
+/*  A flush made part way into the stream.
+*/
+struct Flush
+{
+    size_t  compLen;        // of the output up to it
+    size_t  textLen;        // of the input up to it
+};
+
+
+
+/*  Compress text in pieces of random sizes, flushing now and then.
+*/
+static Task
+produce(CompressSink<QueuedWriter>& sink, QueuedWriter& writer, std::span<const Byte> text,
+        std::vector<Flush>& flushes)
+{
+    size_t pos = 0;
+
+    while (pos < text.size())
+    {
+        size_t n = std::min<size_t>(1 + random() % 20000, text.size() - pos);
+
+        co_await sink.write(text.subspan(pos, n));
+        pos += n;
+
+        if (random() % 4 == 0)
+        {
+            co_await sink.flush();
+            flushes.push_back(Flush{writer.bytes.size(), pos});
+        }
+    }
+
+    co_await sink.end();
+}
+
+
+
+/*  Decompress comp as it arrives in pieces of random sizes, up to each
+    flush in turn.  Everything up to the flush decodes by then, less at
+    most the string of the last code.
+*/
+static Task
+consume(AsyncDecompressor& dec, std::span<const Byte> comp, const std::vector<Flush>& flushes,
+        std::vector<Byte>& out)
+{
+    size_t pos = 0;
+
+    for (size_t f = 0; f <= flushes.size(); ++f)
+    {
+        size_t end = (f < flushes.size()) ? flushes[f].compLen : comp.size();
+
+        while (pos < end)
+        {
+            size_t n = std::min<size_t>(1 + random() % 3000, end - pos);
+
+            co_await Later{};
+
+            for (std::span<const Byte> chunk : dec.chunks(comp.subspan(pos, n)))
+            {
+                out.insert(out.end(), chunk.begin(), chunk.end());
+            }
+
+            pos += n;
+        }
+
+        if (f < flushes.size())
+        {
+            ASSERT_MSG(out.size() <= flushes[f].textLen && out.size() + 100 > flushes[f].textLen,
+                       "decoded up to the flush");
+        }
+    }
+
+    for (std::span<const Byte> chunk : dec.finish())
+    {
+        out.insert(out.end(), chunk.begin(), chunk.end());
+    }
+}
+
+
+
+static void
+testRoundTrip()
+{
+    std::vector<Byte>   text = makeText(600000, 1);
+
+    for (int bits : {9, 16})
+    {
+        QueuedWriter                writer;
+        CompressSink<QueuedWriter>  sink(writer, bits, 4096);
+        AsyncDecompressor           dec(1000);
+        std::vector<Flush>          flushes;
+        std::vector<Byte>           out;
+
+        srandom(bits);
+
+        Task producer = produce(sink, writer, text, flushes);
+
+        producer.start();
+        runLoop();
+
+        ASSERT(producer.done());
+        producer.result();
+        ASSERT(!flushes.empty() && writer.numWrites > static_cast<long>(flushes.size()));
+
+        Task consumer = consume(dec, writer.bytes, flushes, out);
+
+        consumer.start();
+        runLoop();
+
+        ASSERT(consumer.done());
+        consumer.result();
+        ASSERT(out.size() == text.size() && std::memcmp(out.data(), text.data(), text.size()) == 0);
+
+        // The same contexts for another stream.
+        writer.bytes.clear();
+        flushes.clear();
+        out.clear();
+        dec.decompressor().reset();
+
+        producer = produce(sink, writer, std::span<const Byte>(text).first(50000), flushes);
+        producer.start();
+        runLoop();
+
+        consumer = consume(dec, writer.bytes, flushes, out);
+        consumer.start();
+        runLoop();
+
+        ASSERT(out.size() == 50000 && std::memcmp(out.data(), text.data(), 50000) == 0);
+    }
+}
+
+
+
+/*  Bad input is thrown from the generator and out of the task.
+*/
+static void
+testError()
+{
+    std::vector<Byte>   text = makeText(100000, 2);
+    std::vector<Byte>   comp = ncompress::compress(text);
+    AsyncDecompressor   dec;
+    std::vector<Flush>  flushes;
+    std::vector<Byte>   out;
+
+    comp[1] ^= 0xff;
+
+    Task consumer = consume(dec, comp, flushes, out);
+
+    consumer.start();
+    runLoop();
+
+    try
+    {
+        consumer.result();
+        ASSERT_MSG(false, "no exception");
+    }
+    catch (const ncompress::Error& e)
+    {
+        ASSERT(e.code() == NCMP_DATA_ERROR);
+    }
+}
+
+//======================================================================
+
+int
+main()
+{
+    testRoundTrip();
+    testError();
+
+    std::printf("%s\n", numFailed ? "Failed" : "Passed");
+    return numFailed != 0;
+}
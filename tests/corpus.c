@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <ncompress42.h>
+
+#include "corpus.h"
+
+/*  The generated test data and memory streams shared by the benchmarks.
+*/
+
+//======================================================================
+
+static uint64_t rngState;
+
+
+void
+seedRandom(uint64_t seed)
+{
+    rngState = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+
+
+uint32_t
+nextRandom()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (uint32_t)(rngState >> 16);
+}
+
+
+
+//======================================================================
+
+static const char* words[] =
+{
+    "the", "of", "and", "to", "a", "in", "is", "it", "that", "was",
+    "for", "on", "are", "with", "as", "his", "they", "be", "at", "one",
+    "have", "this", "from", "or", "had", "by", "word", "but", "what",
+    "some", "we", "can", "out", "other", "were", "all", "there", "when",
+    "up", "use", "your", "how", "said", "an", "each", "she", "which",
+    "compression", "table", "string", "dictionary", "prefix", "output",
+    "algorithm", "between", "something", "remember", "throughput",
+};
+
+#define NWORDS  (sizeof(words) / sizeof(words[0]))
+
+
+static void
+fillRandom(Byte* buffer, size_t num)
+{
+    for (size_t i = 0; i < num; ++i)
+    {
+        buffer[i] = nextRandom() & 0xff;
+    }
+}
+
+
+
+static void
+fillUniform(Byte* buffer, size_t num)
+{
+    memset(buffer, 'a', num);
+}
+
+
+
+/*  Words drawn with a skewed distribution, so the common ones are much
+    more frequent, in sentences and paragraphs.
+*/
+static void
+fillText(Byte* buffer, size_t num)
+{
+    size_t  i = 0;
+    int     start = 1;
+
+    while (i < num)
+    {
+        uint32_t    r = nextRandom();
+        const char* w = words[((r & 0xffff) * (r & 0xffff) >> 16) * NWORDS >> 16];
+
+        if (start && i < num)
+        {
+            buffer[i++] = (Byte)(*w++ - 'a' + 'A');
+            start = 0;
+        }
+
+        while (*w && i < num)
+        {
+            buffer[i++] = (Byte)*w++;
+        }
+
+        r >>= 16;
+
+        if (r % 97 == 0)
+        {
+            if (i < num) buffer[i++] = '.';
+            if (i < num) buffer[i++] = '\n';
+            if (i < num) buffer[i++] = '\n';
+            start = 1;
+        }
+        else
+        if (r % 11 == 0)
+        {
+            if (i < num) buffer[i++] = '.';
+            if (i < num) buffer[i++] = ' ';
+            start = 1;
+        }
+        else
+        if (r % 7 == 0)
+        {
+            if (i < num) buffer[i++] = ',';
+            if (i < num) buffer[i++] = ' ';
+        }
+        else
+        if (i < num)
+        {
+            buffer[i++] = ' ';
+        }
+    }
+}
+
+
+
+static void
+fillLog(Byte* buffer, size_t num)
+{
+    static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char* paths[]  = { "/api/v1/users", "/api/v1/orders", "/health",
+                                    "/api/v2/search", "/static/app.js" };
+    size_t  i = 0;
+    long    t = 1700000000000L;
+    char    line[256];
+
+    while (i < num)
+    {
+        uint32_t    r = nextRandom();
+        int         len;
+
+        t += r % 50;
+
+        len = snprintf(line, sizeof line,
+                       "%ld.%03ld %s [worker-%u] GET %s status=%d bytes=%u latency=%ums id=%08x\n",
+                       t / 1000, t % 1000, levels[r % 6], (r >> 3) % 16, paths[(r >> 7) % 5],
+                       (r >> 10) % 20 ? 200 : 404, nextRandom() % 100000,
+                       nextRandom() % 500, nextRandom());
+
+        if ((size_t)len > num - i)
+        {
+            len = (int)(num - i);
+        }
+
+        memcpy(buffer + i, line, len);
+        i += len;
+    }
+}
+
+
+
+/*  Mostly zero with scattered small records, like a sparse binary file.
+*/
+static void
+fillSparse(Byte* buffer, size_t num)
+{
+    size_t  i = 0;
+
+    memset(buffer, 0, num);
+
+    while (i < num)
+    {
+        uint32_t r = nextRandom();
+
+        i += r % 512;
+
+        for (int k = 0; k < (int)((r >> 9) % 16) && i < num; ++k)
+        {
+            buffer[i++] = nextRandom() & 0xff;
+        }
+    }
+}
+
+
+
+/*  Already compressed data is the compressed text corpus, repeated as
+    often as needed.  LZW can't see repeats that far apart.
+*/
+static void
+fillCompressed(Byte* buffer, size_t num)
+{
+    size_t      textSize = 16000000;
+    Byte*       text = malloc(textSize);
+    MemStream   ms = { 0 };
+    size_t      i;
+
+    seedRandom(3);
+    fillText(text, textSize);
+    runCompress(text, textSize, 16, &ms);
+
+    for (i = 0; i < num; i += ms.outSize)
+    {
+        memcpy(buffer + i, ms.out, (num - i < ms.outSize) ? num - i : ms.outSize);
+    }
+
+    free(ms.out);
+    free(text);
+}
+
+
+
+const Kind corpusKinds[] =
+{
+    { "random",     fillRandom     },
+    { "uniform",    fillUniform    },
+    { "text",       fillText       },
+    { "log",        fillLog        },
+    { "sparse",     fillSparse     },
+    { "compressed", fillCompressed },
+};
+
+const int corpusNumKinds = (int)(sizeof(corpusKinds) / sizeof(corpusKinds[0]));
+
+
+//======================================================================
+//  Memory streams
+
+static int
+memReader(Byte* bytes, size_t numBytes, void* ctxt)
+{
+    MemStream*  ms = (MemStream*)ctxt;
+    size_t      num = ms->inSize - ms->inOff;
+
+    if (num > numBytes)
+    {
+        num = numBytes;
+    }
+
+    memcpy(bytes, ms->in + ms->inOff, num);
+    ms->inOff += num;
+    return (int)num;
+}
+
+
+
+static int
+memWriter(const Byte* bytes, size_t numBytes, void* ctxt)
+{
+    MemStream*  ms = (MemStream*)ctxt;
+
+    if (ms->outSize + numBytes > ms->outCap)
+    {
+        size_t  cap = ms->outCap ? ms->outCap : 65536;
+        Byte*   out;
+
+        while (ms->outSize + numBytes > cap)
+        {
+            cap *= 2;
+        }
+
+        if ((out = realloc(ms->out, cap)) == NULL)
+        {
+            return -1;
+        }
+
+        ms->out    = out;
+        ms->outCap = cap;
+    }
+
+    memcpy(ms->out + ms->outSize, bytes, numBytes);
+    ms->outSize += numBytes;
+    return (int)numBytes;
+}
+
+
+
+NCompressError
+runCompress(const Byte* in, size_t size, int bits, MemStream* ms)
+{
+    NCompressCtxt   ctxt;
+    NCompressError  err;
+
+    ms->in      = in;
+    ms->inSize  = size;
+    ms->inOff   = 0;
+    ms->outSize = 0;
+
+    ctxt.reader = memReader;
+    ctxt.writer = memWriter;
+    ctxt.rwCtxt = ms;
+
+    nInitCompress(&ctxt, bits);
+    err = nCompress(&ctxt);
+    nFreeCompress(&ctxt);
+
+    return err;
+}
+
+
+
+NCompressError
+runDecompress(const Byte* in, size_t size, MemStream* ms)
+{
+    NCompressCtxt   ctxt;
+    NCompressError  err;
+
+    ms->in      = in;
+    ms->inSize  = size;
+    ms->inOff   = 0;
+    ms->outSize = 0;
+
+    ctxt.reader = memReader;
+    ctxt.writer = memWriter;
+    ctxt.rwCtxt = ms;
+
+    nInitDecompress(&ctxt);
+    err = nDecompress(&ctxt);
+    nFreeCompress(&ctxt);
+
+    return err;
+}
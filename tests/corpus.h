@@ -0,0 +1,43 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ncompress42.h>
+
+/*  Deterministic test data for the benchmarks.  The same seed always
+    gives the same bytes.
+*/
+
+void        seedRandom(uint64_t seed);
+uint32_t    nextRandom();
+
+typedef struct kind
+{
+    const char* name;
+    void        (*fill)(Byte* buffer, size_t num);
+} Kind;
+
+extern const Kind   corpusKinds[];
+extern const int    corpusNumKinds;
+
+
+/*  A stream from one buffer in memory to another which grows as needed.
+*/
+typedef struct memStream
+{
+    const Byte* in;
+    size_t      inSize;
+    size_t      inOff;
+
+    Byte*       out;
+    size_t      outSize;
+    size_t      outCap;
+} MemStream;
+
+
+NCompressError  runCompress(const Byte* in, size_t size, int bits, MemStream* ms);
+NCompressError  runDecompress(const Byte* in, size_t size, MemStream* ms);
+
+#endif // CORPUS_H
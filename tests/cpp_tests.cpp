@@ -0,0 +1,388 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ncompress42.hpp>
+
+/*  Round trips of the C++ layer in ncompress42.hpp.  Each test works in
+    memory and checks the result against the input.
+*/
+
+using ncompress::Compressor;
+using ncompress::Decompressor;
+
+//======================================================================
+
+static int  numFailed = 0;
+
+
+static void
+reportAssert(bool b, int line, const char* msg)
+{
+    if (!b)
+    {
+        std::fprintf(stderr, "Assertion failure: line %d %s\n", line, msg);
+        ++numFailed;
+    }
+}
+
+
+#define ASSERT(test)          reportAssert(test, __LINE__, "")
+#define ASSERT_MSG(test, msg) reportAssert(test, __LINE__, msg)
+
+//======================================================================
+
+static std::vector<Byte>
+makeText(size_t num, unsigned seed)
+{
+    static const char* words[] =
+    {
+        "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ",
+        "dog ", "and ", "then ", "some ", "more ", "words ", "follow\n",
+    };
+    std::vector<Byte>   text;
+
+    srandom(seed);
+
+    while (text.size() < num)
+    {
+        for (const char* w = words[random() % (sizeof(words) / sizeof(words[0]))]; *w && text.size() < num; ++w)
+        {
+            text.push_back((random() % 97 == 0) ? static_cast<Byte>(random()) : static_cast<Byte>(*w));
+        }
+    }
+
+    return text;
+}
+
+
+
+static bool
+sameBytes(const std::vector<Byte>& a, const std::vector<Byte>& b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+
+
+static std::vector<Byte>
+toBytes(const std::string& s)
+{
+    return std::vector<Byte>(s.begin(), s.end());
+}
+
+//======================================================================
+
+/*  Compressor and Decompressor with vectors, a source and a sink, and
+    the functions of the namespace.
+*/
+static void
+testRoundTrip()
+{
+    std::vector<Byte>   text = makeText(300000, 1);
+    std::vector<Byte>   comp = ncompress::compress(text);
+    std::vector<Byte>   plain;
+    size_t              pos = 0;
+    Compressor          c(12);
+    Decompressor        d;
+
+    ASSERT(sameBytes(ncompress::decompress(comp), text));
+
+    // The context is used again for each stream.
+    for (int i = 0; i < 2; ++i)
+    {
+        comp = c.compress(text);
+        ASSERT(comp.size() > 3 && (comp[2] & 0x1f) == 12);
+        ASSERT(sameBytes(d.decompress(comp), text));
+    }
+
+    // Pieces written to a sink, read back from a source in pieces.
+    comp.clear();
+    auto sink = [&comp](std::span<const Byte> b) { comp.insert(comp.end(), b.begin(), b.end()); };
+
+    c.write(std::span<const Byte>(text).first(1000), sink);
+    c.write(std::span<const Byte>(text).subspan(1000), sink);
+    c.end(sink);
+
+    auto source = [&](std::span<Byte> room)
+    {
+        size_t n = std::min<size_t>({room.size(), comp.size() - pos, 777});
+
+        std::memcpy(room.data(), comp.data() + pos, n);
+        pos += n;
+        return n;
+    };
+
+    d.decompress(source, [&plain](std::span<const Byte> b) { plain.insert(plain.end(), b.begin(), b.end()); });
+    ASSERT(sameBytes(plain, text));
+
+    // Bad input is thrown as an Error.
+    comp[0] ^= 0xff;
+
+    try
+    {
+        d.decompress(comp);
+        ASSERT_MSG(false, "no exception");
+    }
+    catch (const ncompress::Error& e)
+    {
+        ASSERT(e.code() == NCMP_DATA_ERROR);
+    }
+}
+
+
+
+/*  A moved context goes on with its stream and the old one is empty.
+*/
+static void
+testMoves()
+{
+    std::vector<Byte>   text = makeText(100000, 2);
+    std::vector<Byte>   comp;
+    auto                sink = [&comp](std::span<const Byte> b) { comp.insert(comp.end(), b.begin(), b.end()); };
+    Compressor          c;
+
+    c.write(std::span<const Byte>(text).first(50000), sink);
+
+    Compressor          moved(std::move(c));
+
+    ASSERT(!c && moved);
+    moved.write(std::span<const Byte>(text).subspan(50000), sink);
+    moved.end(sink);
+
+    // Using the empty one throws instead of crashing.
+    try
+    {
+        c.end(sink);
+        ASSERT_MSG(false, "no exception");
+    }
+    catch (const ncompress::Error& e)
+    {
+        ASSERT(e.code() == NCMP_OTHER_ERROR);
+    }
+
+    Decompressor        d;
+    Decompressor        other;
+
+    other = std::move(d);
+    ASSERT(!d && other);
+    ASSERT(sameBytes(other.decompress(comp), text));
+
+    // Assigning a moved context back.
+    d = std::move(other);
+    ASSERT(d && !other);
+    ASSERT(sameBytes(d.decompress(comp), text));
+}
+
+
+
+/*  std::flush on an ostream over ocompressbuf makes all of the output
+    so far decompress, less at most the string of the last code.
+*/
+static void
+testOcompressbuf()
+{
+    std::vector<Byte>   text = makeText(200000, 3);
+    std::stringbuf      dest;
+    size_t              half = text.size() / 2;
+
+    {
+        ncompress::ocompressbuf buf(&dest, 0, 4096);
+        std::ostream            out(&buf);
+
+        // Small writes go through the put area, large ones straight in.
+        for (size_t i = 0; i < half; i += 100)
+        {
+            out.write(reinterpret_cast<const char*>(text.data() + i), std::min<size_t>(100, half - i));
+        }
+
+        out << std::flush;
+        ASSERT(out.good());
+
+        // The bytes are those of nCompressFlush(), whatever the writes.
+        Compressor          c;
+        std::vector<Byte>   flushed;
+        auto                sink = [&flushed](std::span<const Byte> b) { flushed.insert(flushed.end(), b.begin(), b.end()); };
+
+        c.write(std::span<const Byte>(text).first(half), sink);
+        c.flush(sink);
+        ASSERT(sameBytes(toBytes(dest.str()), flushed));
+
+        Decompressor        d;
+        std::vector<Byte>   part(half);
+        std::span<const Byte> input(flushed);
+        size_t              got = d.push(input, part);
+
+        ASSERT(input.empty() && got <= half && got + 100 > half);
+        ASSERT(std::memcmp(part.data(), text.data(), got) == 0);
+
+        out.write(reinterpret_cast<const char*>(text.data() + half), text.size() - half);
+        buf.finish();
+        ASSERT(out.good() && buf.error() == NCMP_OK);
+    }
+
+    ASSERT(sameBytes(ncompress::decompress(toBytes(dest.str())), text));
+}
+
+
+
+/*  An istream over idecompressbuf, read in small pieces, a byte at a
+    time and in reads larger than its buffer.
+*/
+static void
+testIdecompressbuf()
+{
+    std::vector<Byte>   text = makeText(300000, 4);
+    std::vector<Byte>   comp = ncompress::compress(text);
+    std::string         compStr(comp.begin(), comp.end());
+
+    {
+        std::stringbuf              src(compStr);
+        ncompress::idecompressbuf   buf(&src, 4096);
+        std::istream                in(&buf);
+        std::vector<Byte>           plain;
+        char                        piece[7];
+        int                         ch;
+
+        for (int i = 0; i < 1000 && (ch = in.get()) != EOF; ++i)
+        {
+            plain.push_back(static_cast<Byte>(ch));
+        }
+
+        while (in.read(piece, 1 + plain.size() % sizeof(piece)) || in.gcount() > 0)
+        {
+            plain.insert(plain.end(), piece, piece + in.gcount());
+        }
+
+        ASSERT(sameBytes(plain, text));
+        ASSERT(buf.error() == NCMP_OK);
+    }
+
+    {
+        std::stringbuf              src(compStr);
+        ncompress::idecompressbuf   buf(&src, 4096);
+        std::istream                in(&buf);
+        std::vector<Byte>           plain(text.size() + 1);
+        size_t                      num = 0;
+
+        // The first read is served partly from the get area.
+        in.read(reinterpret_cast<char*>(plain.data()), 10);
+        num += in.gcount();
+
+        while (in.read(reinterpret_cast<char*>(plain.data() + num), std::min<size_t>(100000, plain.size() - num)) ||
+               in.gcount() > 0)
+        {
+            num += in.gcount();
+        }
+
+        plain.resize(num);
+        ASSERT(sameBytes(plain, text));
+    }
+
+    {
+        // A bad header leaves the istream bad and the error kept.
+        compStr[1] ^= 0x55;
+
+        std::stringbuf              src(compStr);
+        ncompress::idecompressbuf   buf(&src, 4096);
+        std::istream                in(&buf);
+        char                        piece[100];
+
+        in.read(piece, sizeof(piece));
+        ASSERT(in.bad() && in.gcount() == 0);
+        ASSERT(buf.error() == NCMP_DATA_ERROR);
+    }
+}
+
+
+
+/*  The calls which take spans: push() and finish(), read() from a
+    source and decompressInto().
+*/
+static void
+testSpans()
+{
+    std::vector<Byte>   text = makeText(250000, 5);
+    std::vector<Byte>   comp = ncompress::compress(text);
+    std::vector<Byte>   out(text.size());
+    std::vector<Byte>   plain;
+    Byte                chunk[3000];
+    Decompressor        d;
+
+    // Pushed in pieces, with the unused input left in the span.
+    for (size_t pos = 0; pos < comp.size(); pos += 1111)
+    {
+        std::span<const Byte> input = std::span<const Byte>(comp).subspan(pos, std::min<size_t>(1111, comp.size() - pos));
+
+        while (!input.empty())
+        {
+            size_t got = d.push(input, chunk);
+
+            plain.insert(plain.end(), chunk, chunk + got);
+        }
+    }
+
+    for (size_t got = sizeof(chunk); got == sizeof(chunk); )
+    {
+        got = d.finish(chunk);
+        plain.insert(plain.end(), chunk, chunk + got);
+    }
+
+    ASSERT(sameBytes(plain, text));
+
+    // Pulled from a source.
+    size_t  pos = 0;
+    size_t  num = 0;
+    auto    source = [&](std::span<Byte> room)
+    {
+        size_t n = std::min(room.size(), comp.size() - pos);
+
+        std::memcpy(room.data(), comp.data() + pos, n);
+        pos += n;
+        return n;
+    };
+
+    d.reset();
+
+    for (size_t got = 1; got > 0; num += got)
+    {
+        got = d.read(std::span<Byte>(out).subspan(num, std::min<size_t>(5000, out.size() - num)), source);
+    }
+
+    ASSERT(num == text.size() && std::memcmp(out.data(), text.data(), num) == 0);
+
+    // Straight from one span to another, and into too little room.
+    std::fill(out.begin(), out.end(), 0);
+    ASSERT(d.decompressInto(comp, out) == text.size());
+    ASSERT(sameBytes(out, text));
+
+    try
+    {
+        d.decompressInto(comp, std::span<Byte>(out).first(text.size() - 1));
+        ASSERT_MSG(false, "no exception");
+    }
+    catch (const ncompress::Error& e)
+    {
+        ASSERT(e.code() == NCMP_LIMIT_ERROR);
+    }
+}
+
+//======================================================================
+
+int
+main()
+{
+    testRoundTrip();
+    testMoves();
+    testOcompressbuf();
+    testIdecompressbuf();
+    testSpans();
+
+    std::printf("%s\n", numFailed ? "Failed" : "Passed");
+    return numFailed != 0;
+}
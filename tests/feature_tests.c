@@ -0,0 +1,1795 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <ncompress42.h>
+
+/*  Round trip and regression tests of the features added to the
+    library.  Each test compresses and decompresses in memory, or in
+    files under a temporary directory, and checks the result against
+    the input.
+*/
+
+//======================================================================
+
+static int  numFailed = 0;
+
+
+static void
+reportAssert(int b, int line, const char* msg)
+{
+    if (!msg)
+    {
+        msg = "";
+    }
+
+    if (!b)
+    {
+        fprintf(stderr, "Assertion failure: line %d %s\n", line, msg);
+        ++numFailed;
+    }
+}
+
+
+#define ASSERT(test)          reportAssert(test, __LINE__, "")
+#define ASSERT_MSG(test, msg) reportAssert(test, __LINE__, msg)
+
+
+static char tmpDir[] = "/tmp/ncmp_testsXXXXXX";
+
+//======================================================================
+
+/*  A growable buffer.
+*/
+typedef struct Buf
+{
+    Byte*   bytes;
+    size_t  len;
+    size_t  cap;
+    size_t  pos;        // of the next byte to read
+} Buf;
+
+
+/*  The input and output of a context, for its reader and writer.
+*/
+typedef struct Streams
+{
+    Buf     in;
+    Buf     out;
+} Streams;
+
+
+
+static void
+putBuf(Buf* b, const Byte* bytes, size_t num)
+{
+    if (num == 0)
+    {
+        return;
+    }
+
+    if (b->len + num > b->cap)
+    {
+        b->cap   = 2 * (b->len + num) + 1024;
+        b->bytes = (Byte*)realloc(b->bytes, b->cap);
+    }
+
+    memcpy(b->bytes + b->len, bytes, num);
+    b->len += num;
+}
+
+
+
+static void
+freeBuf(Buf* b)
+{
+    free(b->bytes);
+    memset(b, 0, sizeof(*b));
+}
+
+
+
+static void
+freeStreams(Streams* s)
+{
+    freeBuf(&s->in);
+    freeBuf(&s->out);
+}
+
+
+
+static int
+bufRead(Byte* bytes, size_t numBytes, void* ctxt)
+{
+    Buf*    b = (Buf*)ctxt;
+    size_t  num = b->len - b->pos;
+
+    if (num > numBytes)
+    {
+        num = numBytes;
+    }
+
+    memcpy(bytes, b->bytes + b->pos, num);
+    b->pos += num;
+    return (int)num;
+}
+
+
+
+static int
+bufWrite(const Byte* bytes, size_t numBytes, void* ctxt)
+{
+    putBuf((Buf*)ctxt, bytes, numBytes);
+    return (int)numBytes;
+}
+
+
+
+static int
+streamRead(Byte* bytes, size_t numBytes, void* ctxt)
+{
+    return bufRead(bytes, numBytes, &((Streams*)ctxt)->in);
+}
+
+
+
+static int
+streamWrite(const Byte* bytes, size_t numBytes, void* ctxt)
+{
+    return bufWrite(bytes, numBytes, &((Streams*)ctxt)->out);
+}
+
+
+
+static void
+setStreams(NCompressCtxt* ctxt, Streams* s)
+{
+    ctxt->reader = streamRead;
+    ctxt->writer = streamWrite;
+    ctxt->rwCtxt = s;
+}
+
+
+
+//  Text made of words from a small vocabulary, which compresses well.
+static void
+fillText(Byte* buffer, size_t num, unsigned seed)
+{
+    static const char* words[] =
+    {
+        "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ",
+        "dog ", "and ", "then ", "some ", "more ", "words ", "follow\n",
+    };
+    size_t  i = 0;
+
+    srandom(seed);
+
+    while (i < num)
+    {
+        const char* w = words[random() % (sizeof(words) / sizeof(words[0]))];
+
+        for (; *w && i < num; ++w)
+        {
+            buffer[i++] = (random() % 97 == 0) ? (Byte)random() : (Byte)*w;
+        }
+    }
+}
+
+
+
+static void
+fillRandom(Byte* buffer, size_t num, unsigned seed)
+{
+    srandom(seed);
+
+    for (size_t i = 0; i < num; ++i)
+    {
+        buffer[i] = random() & 0xff;
+    }
+}
+
+
+
+//  Compress bytes into out with a context set up by the caller.
+static NCompressError
+compressWith(NCompressCtxt* ctxt, const Byte* bytes, size_t num, Buf* out)
+{
+    NCompressError err;
+
+    ctxt->writer = bufWrite;
+    ctxt->rwCtxt = out;
+
+    err = nCompressWrite(ctxt, bytes, num);
+
+    if (err == NCMP_OK)
+    {
+        err = nCompressEnd(ctxt);
+    }
+
+    return err;
+}
+
+
+
+static void
+compressBuf(const Byte* bytes, size_t num, int bits, Buf* out)
+{
+    NCompressCtxt   ctxt;
+
+    nInitCompress(&ctxt, bits);
+    ASSERT(compressWith(&ctxt, bytes, num, out) == NCMP_OK);
+    nFreeCompress(&ctxt);
+}
+
+
+
+//  Decompress in with nDecompress() and a context set up by the caller.
+static NCompressError
+decompressWith(NCompressCtxt* ctxt, const Buf* in, Buf* out)
+{
+    Streams         s = {0};
+    NCompressError  err;
+
+    s.in.bytes = in->bytes;
+    s.in.len   = in->len;
+
+    setStreams(ctxt, &s);
+    err = nDecompress(ctxt);
+
+    *out = s.out;
+    return err;
+}
+
+
+
+static NCompressError
+decompressBuf(const Buf* in, Buf* out)
+{
+    NCompressCtxt   ctxt;
+    NCompressError  err;
+
+    nInitDecompress(&ctxt);
+    err = decompressWith(&ctxt, in, out);
+    nFreeCompress(&ctxt);
+
+    return err;
+}
+
+
+
+static int
+sameBytes(const Buf* b, const Byte* bytes, size_t num)
+{
+    return b->len == num && memcmp(b->bytes, bytes, num) == 0;
+}
+
+
+
+static void
+writeFile(const char* path, const Byte* bytes, size_t num)
+{
+    FILE* fp = fopen(path, "w");
+
+    ASSERT(fp && fwrite(bytes, 1, num, fp) == num);
+
+    if (fp)
+    {
+        fclose(fp);
+    }
+}
+
+
+
+static void
+readFile(const char* path, Buf* b)
+{
+    Byte    chunk[8192];
+    size_t  n;
+    FILE*   fp = fopen(path, "r");
+
+    ASSERT(fp != NULL);
+
+    while (fp && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        putBuf(b, chunk, n);
+    }
+
+    if (fp)
+    {
+        fclose(fp);
+    }
+}
+
+
+
+static void
+tmpPath(char* path, const char* name)
+{
+    snprintf(path, 256, "%s/%s", tmpDir, name);
+}
+
+
+
+static int
+fdWrite(const Byte* bytes, size_t numBytes, void* ctxt)
+{
+    return (int)write(*(int*)ctxt, bytes, numBytes);
+}
+
+
+
+//======================================================================
+
+/*  NCMP_DICT_TAGGED gives the output of NCMP_DICT_CLASSIC at each width,
+    through table fills and the CLEARs after a change of input.
+*/
+static void
+testDicts()
+{
+    size_t          num = 1200000;
+    Byte*           input = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    Buf             classic = {0};
+    Buf             tagged = {0};
+    Buf             plain = {0};
+
+    fillText(input, 600000, 22);
+    fillRandom(input + 600000, 200000, 23);
+    fillText(input + 800000, num - 800000, 24);
+
+    for (int bits = 9; bits <= 16; ++bits)
+    {
+        nInitCompress(&ctxt, bits);
+        nSetCompressDict(&ctxt, NCMP_DICT_CLASSIC);
+        ASSERT(compressWith(&ctxt, input, num, &classic) == NCMP_OK);
+        nFreeCompress(&ctxt);
+
+        nInitCompress(&ctxt, bits);
+        nSetCompressDict(&ctxt, NCMP_DICT_TAGGED);
+        ASSERT(compressWith(&ctxt, input, num, &tagged) == NCMP_OK);
+        nFreeCompress(&ctxt);
+
+        ASSERT_MSG(sameBytes(&tagged, classic.bytes, classic.len), "the dictionaries differ");
+        ASSERT(decompressBuf(&tagged, &plain) == NCMP_OK);
+        ASSERT(sameBytes(&plain, input, num));
+
+        freeBuf(&classic);
+        freeBuf(&tagged);
+        freeBuf(&plain);
+    }
+
+    free(input);
+}
+
+
+
+/*  A 9 bit table is cleared when it fills, so its codes never need a
+    tenth bit.  It used to get code 512, which decompressors read
+    with 10 bits.
+*/
+static void
+testNineBits()
+{
+    size_t          num = 200000;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    NCompressStats  stats;
+    Buf             comp = {0};
+    Buf             plain = {0};
+
+    fillText(text, num, 15);
+    compressBuf(text, num, 9, &comp);
+
+    ASSERT(comp.len > 3 && (comp.bytes[2] & 0x1f) == 9);
+
+    nInitDecompress(&ctxt);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+
+    nGetStats(&ctxt, &stats);
+    ASSERT(stats.clears > 0 && stats.widenings == 0);
+    nFreeCompress(&ctxt);
+
+    freeBuf(&comp);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  The length of the string of the last code that LZW gives for bytes,
+    while the table is still filling.  Every code is a string in the
+    table plus one byte, as in the compressor without CLEARs.
+*/
+static size_t
+lastCodeLen(const Byte* bytes, size_t num)
+{
+    size_t      size = 1 << 20;
+    uint32_t*   keys = (uint32_t*)calloc(size, sizeof(uint32_t));
+    uint32_t*   codes = (uint32_t*)malloc(size * sizeof(uint32_t));
+    uint32_t    freeEnt = 257;
+    uint32_t    ent = bytes[0];
+    size_t      len = 1;
+
+    for (size_t i = 1; i < num; ++i)
+    {
+        uint32_t    key = (ent << 8 | bytes[i]) + 1;
+        size_t      h = (key * 2654435761u) & (size - 1);
+
+        while (keys[h] != 0 && keys[h] != key)
+        {
+            h = (h + 1) & (size - 1);
+        }
+
+        if (keys[h] == key)
+        {
+            ent = codes[h];
+            ++len;
+        }
+        else
+        {
+            keys[h]  = key;
+            codes[h] = freeEnt++;
+            ent = bytes[i];
+            len = 1;
+        }
+    }
+
+    ASSERT(freeEnt < 65536);
+
+    free(keys);
+    free(codes);
+    return len;
+}
+
+
+
+/*  nCompressFlush() passes the complete bytes on at once.  They decode
+    to the input up to the flush, less at most the string of the last
+    code, and the stream then goes on as before.
+*/
+static void
+testFlush()
+{
+    size_t          num = 200000;
+    size_t          half = num / 2;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    Buf             comp = {0};
+    Buf             part = {0};
+    Buf             plain = {0};
+
+    fillText(text, num, 1);
+
+    nInitCompress(&ctxt, 0);
+    ctxt.writer = bufWrite;
+    ctxt.rwCtxt = &comp;
+
+    ASSERT(nCompressWrite(&ctxt, text, half) == NCMP_OK);
+    ASSERT(nCompressFlush(&ctxt) == NCMP_OK);
+
+    putBuf(&part, comp.bytes, comp.len);
+    ASSERT(decompressBuf(&part, &plain) == NCMP_OK);
+    ASSERT(plain.len <= half && half - plain.len <= lastCodeLen(text, half));
+    ASSERT(memcmp(plain.bytes, text, plain.len) == 0);
+    freeBuf(&plain);
+
+    ASSERT(nCompressWrite(&ctxt, text + half, num - half) == NCMP_OK);
+    ASSERT(nCompressEnd(&ctxt) == NCMP_OK);
+
+    ASSERT(decompressBuf(&comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+
+    nFreeCompress(&ctxt);
+    freeBuf(&comp);
+    freeBuf(&part);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  nDecompressRead() in pieces of many sizes gives what nDecompress()
+    does.
+*/
+static void
+testPull()
+{
+    size_t          num = 300000;
+    Byte*           text = (Byte*)malloc(num);
+    Byte            piece[5000];
+    NCompressCtxt   ctxt;
+    Streams         s = {0};
+    Buf             plain = {0};
+    NCompressError  err;
+    size_t          numRead;
+    size_t          want = 1;
+
+    fillText(text, num, 2);
+    compressBuf(text, num, 0, &s.in);
+
+    nDecompressOpen(&ctxt);
+    setStreams(&ctxt, &s);
+
+    do
+    {
+        err = nDecompressRead(&ctxt, piece, want, &numRead);
+        putBuf(&plain, piece, numRead);
+        want = (want * 7 + 3) % sizeof(piece) + 1;
+    }
+    while (err == NCMP_OK && numRead > 0);
+
+    ASSERT(err == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+    freeBuf(&plain);
+
+    // Another stream with the same context.
+    nResetCompress(&ctxt);
+    s.in.pos = 0;
+
+    do
+    {
+        err = nDecompressRead(&ctxt, piece, sizeof(piece), &numRead);
+        putBuf(&plain, piece, numRead);
+    }
+    while (err == NCMP_OK && numRead > 0);
+
+    ASSERT(err == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+
+    nFreeCompress(&ctxt);
+    freeStreams(&s);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  A pipe which a child process fills with bytes and then closes.  The
+    read end is returned.
+*/
+static int
+pipeFrom(const Byte* bytes, size_t num, pid_t* child)
+{
+    int     fds[2];
+
+    ASSERT(pipe(fds) == 0);
+
+    if ((*child = fork()) == 0)
+    {
+        close(fds[0]);
+
+        while (num > 0)
+        {
+            ssize_t n = write(fds[1], bytes, num);
+
+            if (n <= 0)
+            {
+                _exit(1);
+            }
+
+            bytes += n;
+            num   -= n;
+        }
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+    return fds[0];
+}
+
+
+
+/*  Run nCompressFile() or nDecompressFile() from inFd into path.  The
+    output starts after skip bytes of a header already in the file, and
+    what follows them is checked against want.
+*/
+static void
+fileInto(int compress, int fdIn, const char* path, size_t skip, const Buf* want)
+{
+    static const Byte   head[] = "a header which the output must leave alone\n";
+    Buf                 out = {0};
+    Byte*               before = (Byte*)malloc(skip + 1);
+    int                 fdOut = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    for (size_t i = 0; i < skip; ++i)
+    {
+        before[i] = head[i % (sizeof(head) - 1)];
+    }
+
+    ASSERT(fdIn >= 0 && fdOut >= 0);
+    ASSERT(write(fdOut, before, skip) == (ssize_t)skip);
+
+    if (compress)
+    {
+        ASSERT(nCompressFile(fdIn, fdOut, 0) == NCMP_OK);
+    }
+    else
+    {
+        ASSERT(nDecompressFile(fdIn, fdOut) == NCMP_OK);
+    }
+
+    ASSERT(lseek(fdOut, 0, SEEK_CUR) == (off_t)(skip + want->len));
+    close(fdOut);
+
+    readFile(path, &out);
+    ASSERT(out.len == skip + want->len);
+    ASSERT(out.len >= skip && memcmp(out.bytes, before, skip) == 0);
+    ASSERT(sameBytes(want, out.bytes + skip, out.len - skip));
+
+    freeBuf(&out);
+    free(before);
+}
+
+
+
+/*  nCompressFile() and nDecompressFile() give the bytes of the callback
+    API from a regular file, which is mapped, and from a pipe, which is
+    read, and write at the offset of the output.
+*/
+static void
+testFiles()
+{
+    size_t  num = 3000000;
+    Buf     text = {0};
+    Buf     comp = {0};
+    char    textPath[256];
+    char    compPath[256];
+    char    outPath[256];
+    pid_t   child;
+    int     status;
+    int     fd;
+
+    text.bytes = (Byte*)malloc(num);
+    text.len   = num;
+    fillText(text.bytes, num, 25);
+    compressBuf(text.bytes, num, 0, &comp);
+
+    tmpPath(textPath, "files");
+    tmpPath(compPath, "files.Z");
+    tmpPath(outPath, "files.out");
+    writeFile(textPath, text.bytes, num);
+    writeFile(compPath, comp.bytes, comp.len);
+
+    for (size_t skip = 0; skip <= 5000; skip += 5000)
+    {
+        // From regular files.
+        fd = open(textPath, O_RDONLY);
+        fileInto(1, fd, outPath, skip, &comp);
+        close(fd);
+
+        fd = open(compPath, O_RDONLY);
+        fileInto(0, fd, outPath, skip, &text);
+        close(fd);
+
+        // From pipes.
+        fd = pipeFrom(text.bytes, num, &child);
+        fileInto(1, fd, outPath, skip, &comp);
+        close(fd);
+        ASSERT(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        fd = pipeFrom(comp.bytes, comp.len, &child);
+        fileInto(0, fd, outPath, skip, &text);
+        close(fd);
+        ASSERT(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    unlink(textPath);
+    unlink(compPath);
+    unlink(outPath);
+    freeBuf(&comp);
+    freeBuf(&text);
+}
+
+
+
+/*  Streams whose reader fails once it has read readLimit bytes and
+    whose writer fails once it has written writeLimit.  The writer
+    notes the most threads it has seen.
+*/
+typedef struct FailStreams
+{
+    Streams s;
+    size_t  readLimit;
+    size_t  writeLimit;
+    int     maxThreads;
+} FailStreams;
+
+
+
+//  The threads of the process, as listed in /proc.
+static int
+numThreads()
+{
+    DIR*            dir = opendir("/proc/self/task");
+    struct dirent*  ent;
+    int             num = 0;
+
+    while (dir && (ent = readdir(dir)) != NULL)
+    {
+        num += (ent->d_name[0] != '.');
+    }
+
+    if (dir)
+    {
+        closedir(dir);
+    }
+
+    return num;
+}
+
+
+
+static int
+failRead(Byte* bytes, size_t numBytes, void* ctxt)
+{
+    FailStreams*    fs = (FailStreams*)ctxt;
+
+    return (fs->s.in.pos >= fs->readLimit) ? -1 : streamRead(bytes, numBytes, &fs->s);
+}
+
+
+
+static int
+failWrite(const Byte* bytes, size_t numBytes, void* ctxt)
+{
+    FailStreams*    fs = (FailStreams*)ctxt;
+    int             num = numThreads();
+
+    if (num > fs->maxThreads)
+    {
+        fs->maxThreads = num;
+    }
+
+    return (fs->s.out.len >= fs->writeLimit) ? -1 : streamWrite(bytes, numBytes, &fs->s);
+}
+
+
+
+/*  Compress or decompress in with nCompress() or nDecompress() and a
+    pipeline of numBlocks, 0 for none.  The limits are as for
+    FailStreams, and the output is left in fs.
+*/
+static NCompressError
+runFailStreams(int compress, int numBlocks, const Buf* in, size_t readLimit, size_t writeLimit,
+               FailStreams* fs)
+{
+    NCompressCtxt   ctxt;
+    NCompressError  err;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->s.in.bytes  = in->bytes;
+    fs->s.in.len    = in->len;
+    fs->readLimit   = readLimit;
+    fs->writeLimit  = writeLimit;
+
+    if (compress)
+    {
+        nInitCompress(&ctxt, 0);
+    }
+    else
+    {
+        nInitDecompress(&ctxt);
+    }
+
+    nSetPipeline(&ctxt, numBlocks);
+    ctxt.reader = failRead;
+    ctxt.writer = failWrite;
+    ctxt.rwCtxt = fs;
+
+    err = compress ? nCompress(&ctxt) : nDecompress(&ctxt);
+
+    // The caller's functions are back in the context.
+    ASSERT(ctxt.reader == failRead && ctxt.writer == failWrite && ctxt.rwCtxt == fs);
+
+    nFreeCompress(&ctxt);
+    return err;
+}
+
+
+
+/*  A pipeline gives the bytes of a serial run, and on an error of its
+    reader or writer returns what a serial run does with its threads
+    ended.
+*/
+static void
+testPipeline()
+{
+    size_t          num = 3000000;
+    Buf             text = {0};
+    Buf             comp = {0};
+    FailStreams     serial;
+    FailStreams     piped;
+    int             threads = numThreads();
+
+    text.bytes = (Byte*)malloc(num);
+    text.len   = num;
+    fillText(text.bytes, num, 16);
+
+    // Compress, then decompress the result.
+    ASSERT(runFailStreams(1, 0, &text, SIZE_MAX, SIZE_MAX, &serial) == NCMP_OK);
+    ASSERT(runFailStreams(1, 4, &text, SIZE_MAX, SIZE_MAX, &piped) == NCMP_OK);
+    ASSERT(piped.maxThreads > threads);
+    ASSERT(sameBytes(&piped.s.out, serial.s.out.bytes, serial.s.out.len));
+    comp = serial.s.out;
+    freeBuf(&piped.s.out);
+
+    ASSERT(runFailStreams(0, 0, &comp, SIZE_MAX, SIZE_MAX, &serial) == NCMP_OK);
+    ASSERT(runFailStreams(0, 3, &comp, SIZE_MAX, SIZE_MAX, &piped) == NCMP_OK);
+    ASSERT(piped.maxThreads > threads);
+    ASSERT(sameBytes(&serial.s.out, text.bytes, num));
+    ASSERT(sameBytes(&piped.s.out, text.bytes, num));
+    freeBuf(&serial.s.out);
+    freeBuf(&piped.s.out);
+
+    // The reader fails part way, then the writer.
+    for (int compress = 0; compress < 2; ++compress)
+    {
+        Buf*    in = compress ? &text : &comp;
+
+        for (int fail = 0; fail < 2; ++fail)
+        {
+            size_t          readLimit = fail ? SIZE_MAX : in->len / 2;
+            size_t          writeLimit = fail ? 100000 : SIZE_MAX;
+            NCompressError  err = runFailStreams(compress, 0, in, readLimit, writeLimit, &serial);
+
+            ASSERT(err != NCMP_OK);
+            ASSERT(runFailStreams(compress, 2, in, readLimit, writeLimit, &piped) == err);
+            ASSERT(numThreads() == threads);
+            freeBuf(&serial.s.out);
+            freeBuf(&piped.s.out);
+        }
+    }
+
+    freeBuf(&comp);
+    freeBuf(&text);
+}
+
+
+
+/*  Decompress the stream in inPath into outPath with
+    nDecompressFileSparse(), keeping what outPath holds, and check the
+    result against image.
+*/
+static void
+sparseFile(const char* inPath, const char* outPath, const Byte* image, size_t num, struct stat* st)
+{
+    Buf     plain = {0};
+    int     fdIn  = open(inPath, O_RDONLY);
+    int     fdOut = open(outPath, O_WRONLY | O_CREAT, 0600);
+
+    ASSERT(fdIn >= 0 && fdOut >= 0);
+    ASSERT(nDecompressFileSparse(fdIn, fdOut) == NCMP_OK);
+    ASSERT(fstat(fdOut, st) == 0);
+    close(fdIn);
+    close(fdOut);
+
+    readFile(outPath, &plain);
+    ASSERT(sameBytes(&plain, image, num));
+    freeBuf(&plain);
+}
+
+
+
+/*  A mostly empty image becomes a sparse file.  It has data between
+    runs of zeros, one of them too short to skip, and ends in zeros
+    which the file is extended to cover.  Zeros over an output which
+    already holds data are zeros too.
+*/
+static void
+testSparse()
+{
+    size_t          num = 8 << 20;
+    Byte*           image = (Byte*)calloc(num, 1);
+    Byte*           old;
+    Buf             comp = {0};
+    char            inPath[256];
+    char            outPath[256];
+    struct stat     st;
+
+    fillText(image, 65536, 17);
+    fillText(image + (3 << 20) + 123, 100, 18);
+    fillText(image + (5 << 20), 65536, 19);
+    fillText(image + (5 << 20) + 65536 + 8192, 4096, 20);
+
+    compressBuf(image, num, 0, &comp);
+    tmpPath(inPath, "image.Z");
+    tmpPath(outPath, "image");
+    writeFile(inPath, comp.bytes, comp.len);
+
+    unlink(outPath);
+    sparseFile(inPath, outPath, image, num, &st);
+    ASSERT(st.st_size == (off_t)num);
+    ASSERT_MSG((size_t)st.st_blocks * 512 < num / 8, "the zeros take up space");
+
+    // Over a file of the same size full of other bytes.
+    old = (Byte*)malloc(num);
+    fillRandom(old, num, 21);
+    writeFile(outPath, old, num);
+    free(old);
+
+    sparseFile(inPath, outPath, image, num, &st);
+
+    unlink(inPath);
+    unlink(outPath);
+    freeBuf(&comp);
+    free(image);
+}
+
+
+
+/*  nDecompressPush() with the input and output in small pieces.
+*/
+static void
+testPush()
+{
+    size_t          num = 300000;
+    Byte*           text = (Byte*)malloc(num);
+    Byte            out[1000];
+    NCompressCtxt   ctxt;
+    Buf             comp = {0};
+    Buf             plain = {0};
+    NCompressError  err = NCMP_OK;
+    size_t          pos = 0;
+    size_t          numUsed;
+    size_t          numOut;
+
+    fillText(text, num, 3);
+    compressBuf(text, num, 0, &comp);
+
+    nInitDecompress(&ctxt);
+
+    while (err == NCMP_OK && pos < comp.len)
+    {
+        size_t  n = (pos * 13 + 1) % 777 + 1;
+
+        if (n > comp.len - pos)
+        {
+            n = comp.len - pos;
+        }
+
+        err = nDecompressPush(&ctxt, comp.bytes + pos, n, &numUsed, out, sizeof(out), &numOut);
+        putBuf(&plain, out, numOut);
+        pos += numUsed;
+    }
+
+    do
+    {
+        err = nDecompressPush(&ctxt, NULL, 0, &numUsed, out, sizeof(out), &numOut);
+        putBuf(&plain, out, numOut);
+    }
+    while (err == NCMP_OK && numOut == sizeof(out));
+
+    ASSERT(err == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+
+    nFreeCompress(&ctxt);
+    freeBuf(&comp);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  A stream pushed to nDecompressPush() at each nCompressFlush()
+    decodes at once, less at most the string of the last code.  That is
+    in the piece flushed last, and the first piece is a short message.
+    Whole codes decode even when their group hasn't all been pushed.
+*/
+static void
+testFlushPush()
+{
+    static const int bits[] = { 9, 16, 20 };
+    size_t          num = 200000;
+    Byte*           text = (Byte*)malloc(num);
+    Byte*           out = (Byte*)malloc(num);
+
+    fillText(text, num, 16);
+
+    for (int b = 0; b < 3; ++b)
+    {
+        NCompressCtxt   ctxt;
+        NCompressCtxt   dctxt;
+        Buf             comp = {0};
+        size_t          pos = 0;
+        size_t          pushed = 0;
+        size_t          numOut = 0;
+        size_t          numUsed;
+        size_t          got;
+
+        nInitCompress(&ctxt, (bits[b] > 16) ? 0 : bits[b]);
+        ctxt.writer = bufWrite;
+        ctxt.rwCtxt = &comp;
+
+        if (bits[b] > 16)
+        {
+            ASSERT(nSetExtendedBits(&ctxt, bits[b]) == NCMP_OK);
+        }
+
+        nInitDecompress(&dctxt);
+        ASSERT(nSetExtendedBits(&dctxt, NCMP_EXTENDED_BITS) == NCMP_OK);
+
+        for (int n = 0; pos < num; ++n)
+        {
+            size_t  len = (n == 0) ? 37 : (size_t)(n * 97) % 1500 + 1;
+
+            if (len > num - pos)
+            {
+                len = num - pos;
+            }
+
+            ASSERT(nCompressWrite(&ctxt, text + pos, len) == NCMP_OK);
+            ASSERT(nCompressFlush(&ctxt) == NCMP_OK);
+
+            ASSERT(nDecompressPush(&dctxt, comp.bytes + pushed, comp.len - pushed, &numUsed,
+                                   out + numOut, num - numOut, &got) == NCMP_OK);
+            ASSERT(numUsed == comp.len - pushed);
+            pushed  += numUsed;
+            numOut  += got;
+
+            if (n == 0)
+            {
+                ASSERT(numOut > 0 && numOut + lastCodeLen(text, len) >= len);
+
+                // Nothing more comes without more input.
+                ASSERT(nDecompressPush(&dctxt, comp.bytes, 0, &numUsed, out + numOut,
+                                       num - numOut, &got) == NCMP_OK);
+                ASSERT(numUsed == 0 && got == 0);
+            }
+
+            ASSERT_MSG(numOut >= pos && numOut <= pos + len, "the pieces before the last flush decode");
+            ASSERT(memcmp(out, text, numOut) == 0);
+            pos += len;
+        }
+
+        ASSERT(nCompressEnd(&ctxt) == NCMP_OK);
+        ASSERT(nDecompressPush(&dctxt, comp.bytes + pushed, comp.len - pushed, &numUsed,
+                               out + numOut, num - numOut, &got) == NCMP_OK);
+        numOut += got;
+        ASSERT(nDecompressPush(&dctxt, NULL, 0, &numUsed, out + numOut, num - numOut, &got) == NCMP_OK);
+        numOut += got;
+
+        ASSERT(numOut == num && memcmp(out, text, num) == 0);
+
+        nFreeCompress(&dctxt);
+        nFreeCompress(&ctxt);
+        freeBuf(&comp);
+    }
+
+    /*  The CLEARs of random bytes at 12 bits fall part way into a group.
+        One is read again once the rest of its group is pushed.
+    */
+    {
+        size_t          half = num / 2;
+        NCompressCtxt   dctxt;
+        Buf             comp = {0};
+        size_t          numOut = 0;
+        size_t          numUsed;
+        size_t          got;
+
+        fillRandom(text, half, 17);
+        compressBuf(text, half, 12, &comp);
+
+        nInitDecompress(&dctxt);
+
+        for (size_t pos = 0; pos < comp.len; ++pos)
+        {
+            ASSERT(nDecompressPush(&dctxt, comp.bytes + pos, 1, &numUsed, out + numOut,
+                                   num - numOut, &got) == NCMP_OK && numUsed == 1);
+            numOut += got;
+        }
+
+        ASSERT(nDecompressPush(&dctxt, NULL, 0, &numUsed, out + numOut, num - numOut, &got) == NCMP_OK);
+        numOut += got;
+
+        ASSERT(numOut == half && memcmp(out, text, half) == 0);
+
+        nFreeCompress(&dctxt);
+        freeBuf(&comp);
+    }
+
+    free(out);
+    free(text);
+}
+
+
+
+/*  nSplice() joins two streams and nCompressAppend() continues a file.
+*/
+static void
+testSplice()
+{
+    size_t          num = 150000;
+    Byte*           text = (Byte*)malloc(2 * num);
+    NCompressCtxt   ctxt;
+    Streams         s = {0};
+    Buf             second = {0};
+    Buf             plain = {0};
+    Buf             file = {0};
+    char            path[256];
+    int             fd;
+
+    fillText(text, num, 4);
+    fillText(text + num, num, 5);
+    compressBuf(text, num, 0, &s.in);
+    compressBuf(text + num, num, 0, &second);
+
+    nInitDecompress(&ctxt);
+    setStreams(&ctxt, &s);
+    ASSERT(nSplice(&ctxt, bufRead, &second) == NCMP_OK);
+    nFreeCompress(&ctxt);
+
+    ASSERT(decompressBuf(&s.out, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, 2 * num));
+    freeBuf(&plain);
+
+    // Append the second half to a file holding the first.
+    tmpPath(path, "append.Z");
+    writeFile(path, s.in.bytes, s.in.len);
+    fd = open(path, O_RDWR);
+    ASSERT(fd >= 0);
+
+    nInitCompress(&ctxt, 0);
+    ASSERT(nCompressAppend(&ctxt, fd) == NCMP_OK);
+    ctxt.writer = fdWrite;
+    ctxt.rwCtxt = &fd;
+    ASSERT(nCompressWrite(&ctxt, text + num, num) == NCMP_OK);
+    ASSERT(nCompressEnd(&ctxt) == NCMP_OK);
+    nFreeCompress(&ctxt);
+    close(fd);
+
+    readFile(path, &file);
+    ASSERT(decompressBuf(&file, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, 2 * num));
+    unlink(path);
+
+    freeStreams(&s);
+    freeBuf(&second);
+    freeBuf(&plain);
+    freeBuf(&file);
+    free(text);
+}
+
+
+
+/*  Push cut bytes of comp, save the decompressor in snap and finish the
+    stream in another context loaded from it.
+*/
+static NCompressError
+resumeDecompress(const Buf* comp, size_t cut, Buf* snap, Buf* plain)
+{
+    Byte            out[4096];
+    NCompressCtxt   ctxt;
+    NCompressStats  stats;
+    NCompressError  err = NCMP_OK;
+    size_t          pos;
+    size_t          numUsed;
+    size_t          numOut;
+
+    nInitDecompress(&ctxt);
+
+    for (pos = 0; err == NCMP_OK && pos < cut; pos += numUsed)
+    {
+        err = nDecompressPush(&ctxt, comp->bytes + pos, cut - pos, &numUsed, out, sizeof(out), &numOut);
+        putBuf(plain, out, numOut);
+    }
+
+    if (err == NCMP_OK)
+    {
+        err = nSaveState(&ctxt, bufWrite, snap);
+    }
+
+    nGetStats(&ctxt, &stats);
+    nFreeCompress(&ctxt);
+
+    if (err != NCMP_OK)
+    {
+        return err;
+    }
+
+    ASSERT((size_t)stats.bytesOut == plain->len);
+
+    nInitDecompress(&ctxt);
+
+    if ((err = nLoadState(&ctxt, bufRead, snap)) != NCMP_OK)
+    {
+        nFreeCompress(&ctxt);
+        return err;
+    }
+
+    for (pos = stats.bytesIn; err == NCMP_OK && pos < comp->len; pos += numUsed)
+    {
+        err = nDecompressPush(&ctxt, comp->bytes + pos, comp->len - pos, &numUsed, out, sizeof(out), &numOut);
+        putBuf(plain, out, numOut);
+    }
+
+    do
+    {
+        err = nDecompressPush(&ctxt, NULL, 0, &numUsed, out, sizeof(out), &numOut);
+        putBuf(plain, out, numOut);
+    }
+    while (err == NCMP_OK && numOut == sizeof(out));
+
+    nFreeCompress(&ctxt);
+    return err;
+}
+
+
+
+/*  Save a stream part way through and go on with it in another context.
+*/
+static void
+testSnapshots()
+{
+    size_t          num = 300000;
+    size_t          half = num / 3;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    NCompressCtxt   ctxt2;
+    NCompressStats  stats;
+    Buf             comp = {0};
+    Buf             snap = {0};
+    Buf             plain = {0};
+
+    fillText(text, num, 6);
+
+    // The compressor.
+    nInitCompress(&ctxt, 0);
+    ctxt.writer = bufWrite;
+    ctxt.rwCtxt = &comp;
+    ASSERT(nCompressWrite(&ctxt, text, half) == NCMP_OK);
+    ASSERT(nSaveState(&ctxt, bufWrite, &snap) == NCMP_OK);
+    nGetStats(&ctxt, &stats);
+    nFreeCompress(&ctxt);
+
+    ASSERT((size_t)stats.bytesOut == comp.len);
+
+    nInitCompress(&ctxt2, 0);
+    ASSERT(nLoadState(&ctxt2, bufRead, &snap) == NCMP_OK);
+    ASSERT(compressWith(&ctxt2, text + half, num - half, &comp) == NCMP_OK);
+    nFreeCompress(&ctxt2);
+
+    ASSERT(decompressBuf(&comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+    freeBuf(&plain);
+    freeBuf(&snap);
+
+    // The decompressor, saved after each of these bytes of the stream.
+    {
+        size_t  cuts[] = { 0, 1, 2, 3, 4, 100, comp.len / 2, comp.len };
+
+        for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); ++i)
+        {
+            freeBuf(&snap);
+            ASSERT(resumeDecompress(&comp, cuts[i], &snap, &plain) == NCMP_OK);
+            ASSERT_MSG(sameBytes(&plain, text, num), "resumed decompression");
+            freeBuf(&plain);
+        }
+    }
+
+    // A snapshot of the wrong direction is refused.
+    snap.pos = 0;
+    nInitCompress(&ctxt, 0);
+    ASSERT(nLoadState(&ctxt, bufRead, &snap) == NCMP_DATA_ERROR);
+    nFreeCompress(&ctxt);
+
+    freeBuf(&comp);
+    freeBuf(&snap);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  A small message with a preset table.
+*/
+static void
+testPreset()
+{
+    Byte            sample[8000];
+    Byte            msg[400];
+    NCompressCtxt   ctxt;
+    Buf             comp = {0};
+    Buf             plainComp = {0};
+    Buf             plain = {0};
+
+    fillText(sample, sizeof(sample), 7);
+    fillText(msg, sizeof(msg), 8);
+
+    nInitCompress(&ctxt, 0);
+    ASSERT(nSetPreset(&ctxt, sample, sizeof(sample)) == NCMP_OK);
+    ASSERT(compressWith(&ctxt, msg, sizeof(msg), &comp) == NCMP_OK);
+    nFreeCompress(&ctxt);
+
+    compressBuf(msg, sizeof(msg), 0, &plainComp);
+    ASSERT(comp.len < plainComp.len);
+
+    nInitDecompress(&ctxt);
+    ASSERT(nSetPreset(&ctxt, sample, sizeof(sample)) == NCMP_OK);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, msg, sizeof(msg)));
+    nFreeCompress(&ctxt);
+    freeBuf(&plain);
+
+    ASSERT(decompressBuf(&comp, &plain) == NCMP_PRESET_ERROR);
+
+    freeBuf(&comp);
+    freeBuf(&plainComp);
+    freeBuf(&plain);
+}
+
+
+
+/*  Codes of more than 16 bits are only read by a decompressor which
+    allows them.
+*/
+static void
+testExtendedBits()
+{
+    size_t          num = 3 << 20;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    Buf             comp = {0};
+    Buf             plain = {0};
+
+    fillText(text, num, 9);
+
+    nInitCompress(&ctxt, 0);
+    ASSERT(nSetExtendedBits(&ctxt, 20) == NCMP_OK);
+    ASSERT(compressWith(&ctxt, text, num, &comp) == NCMP_OK);
+    nFreeCompress(&ctxt);
+
+    ASSERT(comp.len > 3 && (comp.bytes[2] & 0x1f) == 20);
+
+    ASSERT(decompressBuf(&comp, &plain) == NCMP_BITS_ERROR);
+    freeBuf(&plain);
+
+    nInitDecompress(&ctxt);
+    ASSERT(nSetExtendedBits(&ctxt, NCMP_EXTENDED_BITS) == NCMP_OK);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+    nFreeCompress(&ctxt);
+
+    freeBuf(&comp);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+/*  The output and ratio limits stop a stream with NCMP_LIMIT_ERROR.
+*/
+static void
+testLimits()
+{
+    size_t          num = 1 << 20;
+    Byte*           zeros = (Byte*)calloc(num, 1);
+    NCompressCtxt   ctxt;
+    NCompressLimits limits = {0};
+    Buf             comp = {0};
+    Buf             plain = {0};
+
+    compressBuf(zeros, num, 0, &comp);
+
+    nInitDecompress(&ctxt);
+    limits.maxOutput = num / 2;
+    nSetDecompressLimits(&ctxt, &limits);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_LIMIT_ERROR);
+    ASSERT(plain.len <= num / 2);
+    freeBuf(&plain);
+
+    limits.maxOutput = 0;
+    limits.maxRatio  = 100;
+    nSetDecompressLimits(&ctxt, &limits);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_LIMIT_ERROR);
+    freeBuf(&plain);
+
+    nSetDecompressLimits(&ctxt, NULL);
+    ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, zeros, num));
+    nFreeCompress(&ctxt);
+
+    freeBuf(&comp);
+    freeBuf(&plain);
+    free(zeros);
+}
+
+
+
+//  Keep the type and offset of each clear and widening.
+static void
+keepEvent(const NCompressEvent* event, void* ctxt)
+{
+    if (event->type == NCMP_EVENT_CLEAR || event->type == NCMP_EVENT_WIDEN)
+    {
+        int64_t rec[2] = { event->type, event->offset };
+
+        putBuf((Buf*)ctxt, (const Byte*)rec, sizeof(rec));
+    }
+}
+
+
+
+/*  The compressor and decompressor report each clear and widening at
+    the same offset.  The compressor used to count the byte it held as
+    the next prefix.
+*/
+static void
+testEventOffsets()
+{
+    static const int    bits[] = { 9, 12, 16, 20 };
+    size_t              num = 300000;
+    Byte*               text = (Byte*)malloc(num);
+
+    for (int kind = 0; kind < 2; ++kind)
+    {
+        if (kind == 0)
+        {
+            fillText(text, num, 21);
+        }
+        else
+        {
+            fillRandom(text, num, 21);
+        }
+
+        for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); ++i)
+        {
+            NCompressCtxt   ctxt;
+            Buf             cevents = {0};
+            Buf             devents = {0};
+            Buf             comp = {0};
+            Buf             plain = {0};
+
+            nInitCompress(&ctxt, bits[i]);
+            nSetEventHandler(&ctxt, keepEvent, &cevents);
+            ASSERT(compressWith(&ctxt, text, num, &comp) == NCMP_OK);
+            nFreeCompress(&ctxt);
+
+            nInitDecompress(&ctxt);
+            nSetEventHandler(&ctxt, keepEvent, &devents);
+            ASSERT(decompressWith(&ctxt, &comp, &plain) == NCMP_OK);
+            ASSERT(sameBytes(&plain, text, num));
+            nFreeCompress(&ctxt);
+
+            ASSERT(cevents.len > 0);
+            ASSERT(sameBytes(&devents, cevents.bytes, cevents.len));
+
+            freeBuf(&cevents);
+            freeBuf(&devents);
+            freeBuf(&comp);
+            freeBuf(&plain);
+        }
+    }
+
+    free(text);
+}
+
+
+
+/*  The CRC32C is the same on both sides and its sidecar is checked.
+*/
+static void
+testCrc()
+{
+    size_t          num = 200000;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    NCompressCtxt   dctxt;
+    Buf             comp = {0};
+    Buf             side = {0};
+    Buf             plain = {0};
+
+    // The check value of CRC32C.
+    nInitCompress(&ctxt, 0);
+    nSetCrc32c(&ctxt, 1);
+    ASSERT(compressWith(&ctxt, (const Byte*)"123456789", 9, &comp) == NCMP_OK);
+    ASSERT(nGetCrc32c(&ctxt) == 0xE3069283);
+    nFreeCompress(&ctxt);
+    freeBuf(&comp);
+
+    fillText(text, num, 10);
+
+    nInitCompress(&ctxt, 0);
+    nSetCrc32c(&ctxt, 1);
+    ASSERT(compressWith(&ctxt, text, num, &comp) == NCMP_OK);
+    ASSERT(nWriteCrc32c(&ctxt, bufWrite, &side) == NCMP_OK);
+    ASSERT(side.len == 16);
+
+    nInitDecompress(&dctxt);
+    nSetCrc32c(&dctxt, 1);
+    ASSERT(decompressWith(&dctxt, &comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+    ASSERT(nGetCrc32c(&dctxt) == nGetCrc32c(&ctxt));
+    ASSERT(nCheckCrc32c(&dctxt, bufRead, &side) == NCMP_OK);
+
+    side.pos = 0;
+    side.bytes[5] ^= 1;
+    ASSERT(nCheckCrc32c(&dctxt, bufRead, &side) == NCMP_DATA_ERROR);
+
+    nFreeCompress(&dctxt);
+    nFreeCompress(&ctxt);
+    freeBuf(&comp);
+    freeBuf(&side);
+    freeBuf(&plain);
+    free(text);
+}
+
+
+
+//  Decompress comp from a file with nDecompressFileParallel().
+static void
+parallelFile(const Buf* comp, const Byte* text, size_t num)
+{
+    Buf     plain = {0};
+    char    inPath[256];
+    char    outPath[256];
+    int     fdIn;
+    int     fdOut;
+
+    tmpPath(inPath, "members.Z");
+    tmpPath(outPath, "members");
+    writeFile(inPath, comp->bytes, comp->len);
+
+    fdIn  = open(inPath, O_RDONLY);
+    fdOut = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ASSERT(fdIn >= 0 && fdOut >= 0);
+    ASSERT(nDecompressFileParallel(fdIn, fdOut, 4) == NCMP_OK);
+    close(fdIn);
+    close(fdOut);
+
+    readFile(outPath, &plain);
+    ASSERT(sameBytes(&plain, text, num));
+    unlink(inPath);
+    unlink(outPath);
+    freeBuf(&plain);
+}
+
+
+
+/*  Members end with a padded CLEAR and have no header of their own, so
+    the stream stays one for other decompressors.  Streams of members
+    joined with cat are followed too, and both, as well as a stream with
+    CLEARs of its own, are decoded on several threads.
+*/
+static void
+testMembers()
+{
+    size_t          num = 400000;
+    Byte*           text = (Byte*)malloc(num);
+    NCompressCtxt   ctxt;
+    Buf             comp = {0};
+    Buf             plain = {0};
+    size_t          numHeaders = 0;
+
+    fillText(text, num, 11);
+
+    nInitCompress(&ctxt, 0);
+    nSetMemberSize(&ctxt, 30000);
+    ASSERT(compressWith(&ctxt, text, num / 2, &comp) == NCMP_OK);
+
+    for (size_t i = 0; i + 3 <= comp.len; ++i)
+    {
+        numHeaders += (memcmp(comp.bytes + i, comp.bytes, 3) == 0);
+    }
+
+    ASSERT(numHeaders == 1);
+    parallelFile(&comp, text, num / 2);
+
+    // Another stream of members after it.
+    ASSERT(compressWith(&ctxt, text + num / 2, num - num / 2, &comp) == NCMP_OK);
+    nFreeCompress(&ctxt);
+
+    ASSERT(decompressBuf(&comp, &plain) == NCMP_OK);
+    ASSERT(sameBytes(&plain, text, num));
+    freeBuf(&plain);
+
+    parallelFile(&comp, text, num);
+    freeBuf(&comp);
+
+    // A full 9 bit table is cleared, without members.
+    compressBuf(text, num, 9, &comp);
+    parallelFile(&comp, text, num);
+
+    freeBuf(&comp);
+    free(text);
+}
+
+
+
+/*  Put, replace, remove and compact objects in a container.
+*/
+static void
+testContainers()
+{
+    int                 numObjs = 200;
+    Byte*               objs = (Byte*)malloc(numObjs * 1000);
+    Byte                other[500];
+    Byte                out[1000];
+    size_t              numOut;
+    char                path[256];
+    char                key[32];
+    NCompressContainer  cont;
+    NCompressObject     obj;
+    int                 i;
+
+    fillText(objs, numObjs * 1000, 12);
+    fillRandom(other, sizeof(other), 13);
+    tmpPath(path, "cont");
+
+    ASSERT(nOpenContainer(&cont, path, NCMP_CONT_WRITE | NCMP_CONT_CREATE, 0) == NCMP_OK);
+
+    for (i = 0; i < numObjs; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        ASSERT(nContainerPut(&cont, key, strlen(key), objs + i * 1000, 1 + i * 997 % 1000) == NCMP_OK);
+    }
+
+    ASSERT(nContainerFind(&cont, "key1", 4, &obj) == NCMP_NOT_FOUND);
+    ASSERT(nContainerCommit(&cont) == NCMP_OK);
+
+    ASSERT(nContainerFind(&cont, "key5", 4, &obj) == NCMP_OK);
+    ASSERT(obj.length == 1 + 5 * 997 % 1000);
+    ASSERT(nContainerGet(&cont, "key5", 4, out, sizeof(out), &numOut) == NCMP_OK);
+    ASSERT(numOut == obj.length && memcmp(out, objs + 5000, numOut) == 0);
+    ASSERT(nContainerGet(&cont, "key5", 4, out, 1, &numOut) == NCMP_LIMIT_ERROR);
+
+    // Only one writer or compaction at a time.
+    {
+        NCompressContainer  cont2;
+
+        ASSERT(nCompactContainer(path) == NCMP_WRITE_ERROR);
+        ASSERT(nOpenContainer(&cont2, path, NCMP_CONT_WRITE, 0) == NCMP_WRITE_ERROR);
+        ASSERT(nOpenContainer(&cont2, path, 0, 0) == NCMP_OK);
+        ASSERT(nCloseContainer(&cont2) == NCMP_OK);
+    }
+
+    ASSERT(nContainerPut(&cont, "key3", 4, other, sizeof(other)) == NCMP_OK);
+    ASSERT(nContainerRemove(&cont, "key7", 4) == NCMP_OK);
+    ASSERT(nCloseContainer(&cont) == NCMP_OK);
+
+    ASSERT(nCompactContainer(path) == NCMP_OK);
+
+    ASSERT(nOpenContainer(&cont, path, 0, 0) == NCMP_OK);
+    ASSERT(nContainerFind(&cont, "key7", 4, &obj) == NCMP_NOT_FOUND);
+    ASSERT(nContainerGet(&cont, "key3", 4, out, sizeof(out), &numOut) == NCMP_OK);
+    ASSERT(numOut == sizeof(other) && memcmp(out, other, numOut) == 0);
+
+    for (i = 0; i < numObjs; ++i)
+    {
+        if (i == 3 || i == 7)
+        {
+            continue;
+        }
+
+        snprintf(key, sizeof(key), "key%d", i);
+        ASSERT(nContainerGet(&cont, key, strlen(key), out, sizeof(out), &numOut) == NCMP_OK);
+        ASSERT(numOut == (size_t)(1 + i * 997 % 1000) && memcmp(out, objs + i * 1000, numOut) == 0);
+    }
+
+    ASSERT(nCloseContainer(&cont) == NCMP_OK);
+
+    free(objs);
+}
+
+
+
+static int
+countMatch(const NCompressMatch* match, void* ctxt)
+{
+    (void)match;
+    ++*(int64_t*)ctxt;
+    return 0;
+}
+
+
+
+/*  nSearch() finds what a scan of the text does.
+*/
+static void
+testSearch()
+{
+    size_t          num = 300000;
+    Byte*           text = (Byte*)malloc(num);
+    const char*     pat = "fox jumps";
+    size_t          patLen = strlen(pat);
+    int64_t         expect = 0;
+    int64_t         seen = 0;
+    int64_t         numFound = 0;
+    NCompressCtxt   ctxt;
+    Streams         s = {0};
+
+    fillText(text, num, 14);
+    compressBuf(text, num, 0, &s.in);
+
+    for (size_t i = 0; i + patLen <= num; ++i)
+    {
+        expect += (memcmp(text + i, pat, patLen) == 0);
+    }
+
+    nInitDecompress(&ctxt);
+    setStreams(&ctxt, &s);
+    ASSERT(nSearch(&ctxt, (const Byte*)pat, patLen, NCMP_SEARCH_ALL, countMatch, &seen, &numFound) == NCMP_OK);
+    ASSERT(expect > 0 && numFound == expect && seen == expect);
+    nFreeCompress(&ctxt);
+
+    // A header of fewer than 9 bits is refused, with a preset or not.
+    for (int i = 0; i < 2; ++i)
+    {
+        Buf     plain = {0};
+
+        s.in.bytes[2] = (i == 0) ? 0x80 : 0xa0;
+        s.in.pos = 0;
+
+        nInitDecompress(&ctxt);
+        ASSERT(nSetPreset(&ctxt, text, 1000) == NCMP_OK);
+        setStreams(&ctxt, &s);
+        ASSERT(nSearch(&ctxt, (const Byte*)pat, patLen, NCMP_SEARCH_ALL, NULL, NULL, &numFound) == NCMP_DATA_ERROR);
+        nFreeCompress(&ctxt);
+
+        ASSERT(decompressBuf(&s.in, &plain) == NCMP_DATA_ERROR);
+        freeBuf(&plain);
+    }
+
+    freeStreams(&s);
+    free(text);
+}
+
+
+
+//======================================================================
+
+int
+main(int argc, char** argv)
+{
+    char    path[256];
+
+    if (!mkdtemp(tmpDir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    testDicts();
+    testNineBits();
+    testFlush();
+    testPull();
+    testFiles();
+    testPipeline();
+    testSparse();
+    testPush();
+    testFlushPush();
+    testSplice();
+    testSnapshots();
+    testPreset();
+    testExtendedBits();
+    testLimits();
+    testEventOffsets();
+    testCrc();
+    testMembers();
+    testContainers();
+    testSearch();
+
+    // The container's files.
+    tmpPath(path, "cont");
+    unlink(path);
+    tmpPath(path, "cont.lock");
+    unlink(path);
+
+    for (int gen = 0; gen < 4; ++gen)
+    {
+        snprintf(path, sizeof(path), "%s/cont.%d", tmpDir, gen);
+        unlink(path);
+    }
+
+    rmdir(tmpDir);
+
+    printf("%s\n", numFailed ? "Failed" : "Passed");
+    return numFailed != 0;
+}
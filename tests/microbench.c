@@ -0,0 +1,710 @@
+/*  Microbenchmarks for the kernels inside nCompress() and nDecompress().
+
+    This includes ncompress42.c itself so that it can time the static
+    kernels one at a time:
+
+        probe       dictionary lookups, the classic double hashing at
+                    lookup: and the tagged buckets, on a full table
+        build       lookups with inserts, as compress() fills the table
+        output      bit packing of codes with output()
+        unpack      unpacking of codes by the decompressor
+        chain       walking tab_prefixof to expand strings
+        resetbuf    shifting the unread input down and refilling inbuf
+
+    With -p it also reads instruction, cache miss and branch miss counts
+    from perf_event_open(), where the kernel allows it.  The results are
+    JSON records on stdout.
+
+    usage: microbench [-s size] [-k kind] [-t seconds] [-p]
+*/
+
+#include "../ncompress42.c"
+
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "corpus.h"
+
+//======================================================================
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//======================================================================
+//  Hardware counters
+
+enum
+{
+    CNT_CYCLES,
+    CNT_INSTRUCTIONS,
+    CNT_CACHE_MISSES,
+    CNT_BRANCH_MISSES,
+    NUM_COUNTERS
+};
+
+static const char* counterNames[NUM_COUNTERS] =
+{
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+static int  counterFds[NUM_COUNTERS] = { -1, -1, -1, -1 };
+
+
+
+static void
+openCounters()
+{
+#ifdef __linux__
+    static const unsigned long configs[NUM_COUNTERS] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+    {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof attr);
+        attr.size           = sizeof attr;
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = configs[i];
+        attr.disabled       = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        counterFds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    if (counterFds[CNT_INSTRUCTIONS] < 0)
+    {
+        fprintf(stderr, "microbench: perf_event_open is not available, counters are null\n");
+    }
+#endif
+}
+
+
+
+static void
+startCounters()
+{
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+    {
+        if (counterFds[i] >= 0)
+        {
+            ioctl(counterFds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counterFds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+
+
+static void
+stopCounters(long long* counts)
+{
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+    {
+        counts[i] = -1;
+
+#ifdef __linux__
+        if (counterFds[i] >= 0)
+        {
+            ioctl(counterFds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(counterFds[i], &counts[i], sizeof counts[i]) != sizeof counts[i])
+            {
+                counts[i] = -1;
+            }
+        }
+#endif
+    }
+}
+
+
+//======================================================================
+//  Timing and reporting
+
+typedef void (*Kernel)(void* arg);
+
+static double   minSeconds = 0.2;
+static int      firstRecord = 1;
+
+
+/*  Run a kernel often enough to take minSeconds and print its record.
+    ops is the number of operations in one run, for the per op figures.
+*/
+static void
+timeKernel(const char* name, int bits, Kernel kernel, void* arg, double ops,
+           const char* extra)
+{
+    long        runs = 0;
+    long long   counts[NUM_COUNTERS];
+    double      start;
+    double      secs;
+
+    kernel(arg);        // warm up
+
+    startCounters();
+    start = now();
+
+    do
+    {
+        kernel(arg);
+        ++runs;
+    }
+    while (now() - start < minSeconds);
+
+    secs = now() - start;
+    stopCounters(counts);
+
+    printf("%s\n    {\"kernel\": \"%s\", \"bits\": %d, \"runs\": %ld, \"ops\": %.0f, "
+           "\"ns_per_op\": %.3f",
+           firstRecord ? "" : ",", name, bits, runs, ops, secs * 1e9 / (ops * runs));
+
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+    {
+        if (counts[i] >= 0)
+            printf(", \"%s_per_op\": %.3f", counterNames[i], counts[i] / (ops * runs));
+        else
+            printf(", \"%s_per_op\": null", counterNames[i]);
+    }
+
+    printf("%s%s}", extra ? ", " : "", extra ? extra : "");
+    fflush(stdout);
+    firstRecord = 0;
+}
+
+
+//======================================================================
+//  The dictionary.  A plain LZW pass over the corpus records every
+//  lookup and fills the table as compress() would, without CLEARs.
+
+typedef struct dictArgs
+{
+    PrivState*  ps;
+    int         tagged;
+    const Byte* in;
+    size_t      size;
+    FCode*      keys;       // each (prefix, char) looked up
+    size_t      numKeys;
+    uint16_t*   codes;      // each code output
+    size_t      numCodes;
+    uint16_t*   prefix;     // the entries made by the trace
+    Byte*       suffix;
+    code_int    free_ent;
+} DictArgs;
+
+
+
+static void
+buildKernel(void* arg)
+{
+    DictArgs*   a = (DictArgs*)arg;
+    PrivState*  ps = a->ps;
+    const int   tagged = a->tagged;
+    FCode       f;
+    code_int    free_ent = FIRST;
+    size_t      i;
+
+    clear_dict(ps, tagged);
+
+    f.code  = 0;
+    f.e.ent = a->in[0];
+
+    for (i = 1; i < a->size; ++i)
+    {
+        long    slot;
+        long    code;
+
+        f.e.c = a->in[i];
+
+        if ((code = dictFind(ps, tagged, f, &slot)) >= 0)
+        {
+            f.e.ent = (unsigned short)code;
+            continue;
+        }
+
+        if (free_ent < MAXCODE(BITS))
+        {
+            dictInsert(ps, tagged, slot, f, free_ent++);
+        }
+
+        f.e.ent = f.e.c;
+    }
+
+    a->free_ent = free_ent;
+}
+
+
+
+static void
+probeKernel(void* arg)
+{
+    DictArgs*   a = (DictArgs*)arg;
+    long        sum = 0;
+    size_t      i;
+
+    for (i = 0; i < a->numKeys; ++i)
+    {
+        long slot;
+
+        sum += dictFind(a->ps, a->tagged, a->keys[i], &slot);
+    }
+
+    __asm__ volatile("" : : "r"(sum));
+}
+
+
+
+/*  The trace pass.  It counts the probes of each lookup in the classic
+    table as classicFind() makes them.
+*/
+static void
+traceDict(DictArgs* a, double* hitProbes, double* missProbes, long* maxProbes)
+{
+    PrivState*  ps = a->ps;
+    FCode       f;
+    code_int    free_ent = FIRST;
+    long        hits = 0;
+    long        misses = 0;
+    long        hitSum = 0;
+    long        missSum = 0;
+    size_t      i;
+
+    clear_dict(ps, 0);
+
+    *maxProbes = 0;
+    a->numKeys = 0;
+    a->numCodes = 0;
+
+    f.code  = 0;
+    f.e.ent = a->in[0];
+
+    for (i = 1; i < a->size; ++i)
+    {
+        long    hp;
+        long    n = 1;
+        long    v;
+
+        f.e.c = a->in[i];
+        a->keys[a->numKeys++] = f;
+
+        hp = ((((long)(f.e.c)) << (HBITS-8)) ^ (long)(f.e.ent));
+
+        if ((v = htabof(ps, hp)) != f.code && v != -1)
+        {
+            long p = primetab[f.e.c];
+
+            do
+            {
+                hp = (hp+p)&HMASK;
+                ++n;
+            }
+            while ((v = htabof(ps, hp)) != f.code && v != -1);
+        }
+
+        if (n > *maxProbes)
+        {
+            *maxProbes = n;
+        }
+
+        if (v == f.code)
+        {
+            ++hits;
+            hitSum += n;
+            f.e.ent = codetabof(ps, hp);
+            continue;
+        }
+
+        ++misses;
+        missSum += n;
+        a->codes[a->numCodes++] = f.e.ent;
+
+        if (free_ent < MAXCODE(BITS))
+        {
+            a->prefix[free_ent] = f.e.ent;
+            a->suffix[free_ent] = f.e.c;
+            dictInsert(ps, 0, hp, f, free_ent++);
+        }
+
+        f.e.ent = f.e.c;
+    }
+
+    a->codes[a->numCodes++] = f.e.ent;
+    a->free_ent = free_ent;
+
+    *hitProbes  = hits ? (double)hitSum / hits : 0;
+    *missProbes = misses ? (double)missSum / misses : 0;
+}
+
+
+//======================================================================
+//  Bit packing with output(), including the buffer turnover of the
+//  compress loop.
+
+typedef struct outputArgs
+{
+    PrivState*      ps;
+    const uint16_t* codes;
+    size_t          numCodes;
+    int             n_bits;
+} OutputArgs;
+
+
+
+static void
+outputKernel(void* arg)
+{
+    OutputArgs* a = (OutputArgs*)arg;
+    PrivState*  ps = a->ps;
+    int         n_bits = a->n_bits;
+    code_int    mask = MAXCODE(n_bits)-1;
+    int         outbits = 0;
+    size_t      k;
+
+    memset(ps->outbuf, 0, OBUFSIZ_ALL);
+
+    for (k = 0; k < a->numCodes; ++k)
+    {
+        code_int code = a->codes[k] & mask;     // output() has its own i
+
+        output(ps->outbuf, outbits, code, n_bits);
+
+        if (outbits >= (OBUFSIZ<<3))
+        {
+            outbits -= (OBUFSIZ<<3);
+            memcpy(ps->outbuf, ps->outbuf+OBUFSIZ, (outbits>>3)+1);
+            memset(ps->outbuf+(outbits>>3)+1, '\0', OBUFSIZ);
+        }
+    }
+}
+
+
+//======================================================================
+//  Unpacking a buffer of codes, with the unpacker chosen at run time
+//  and with the scalar one.
+
+typedef struct unpackArgs
+{
+    const Byte*     inbuf;
+    int             n_bits;
+    int             num;
+    uint16_t*       codes;
+    CodeUnpacker    unpack;
+} UnpackArgs;
+
+
+
+static void
+unpackKernel(void* arg)
+{
+    UnpackArgs* a = (UnpackArgs*)arg;
+    int         posbits;
+    int         k;
+
+    for (posbits = 0, k = 0; k < a->num; k += CODEBATCH)
+    {
+        int num = (a->num - k < CODEBATCH) ? a->num - k : CODEBATCH;
+
+        a->unpack(a->inbuf, posbits, a->n_bits, num, a->codes);
+        posbits += num * a->n_bits;
+    }
+}
+
+
+//======================================================================
+//  Expanding strings by walking tab_prefixof, as in decompressBlock().
+//  The decoder's table is built from the trace of the compressor.
+
+typedef struct chainArgs
+{
+    PrivState*      ps;
+    const uint16_t* codes;
+    size_t          numCodes;
+    Byte*           out;
+} ChainArgs;
+
+
+
+static void
+buildDecodeTable(PrivState* ps, const DictArgs* d)
+{
+    code_int    code;
+
+    for (code = 255 ; code >= 0 ; --code)
+    {
+        tab_suffixof(ps, code) = (Byte)code;
+        tab_lenof(ps, code) = 1;
+    }
+
+    for (code = FIRST; code < d->free_ent; ++code)
+    {
+        tab_prefixof(ps, code) = d->prefix[code];
+        tab_suffixof(ps, code) = d->suffix[code];
+        tab_lenof(ps, code) = (unsigned short)(tab_lenof(ps, d->prefix[code]) + 1);
+    }
+}
+
+
+
+static void
+chainKernel(void* arg)
+{
+    ChainArgs*  a = (ChainArgs*)arg;
+    PrivState*  ps = a->ps;
+    Byte*       out = a->out;
+    size_t      i;
+
+    for (i = 0; i < a->numCodes; ++i)
+    {
+        code_int    code = a->codes[i];
+        Byte*       stackp = out + tab_lenof(ps, code);
+
+        out = stackp;
+
+        while (code >= 256)
+        {
+            *--stackp = tab_suffixof(ps, code);
+            code = tab_prefixof(ps, code);
+        }
+
+        *--stackp = tab_suffixof(ps, code);
+    }
+}
+
+
+//======================================================================
+//  The resetbuf shuffle: the unread part of inbuf moves to the front
+//  and the reader fills the rest.
+
+typedef struct resetArgs
+{
+    PrivState*  ps;
+    const Byte* src;
+    size_t      srcSize;
+    int         n_bits;
+} ResetArgs;
+
+
+
+static void
+resetKernel(void* arg)
+{
+    ResetArgs*  a = (ResetArgs*)arg;
+    PrivState*  ps = a->ps;
+    int         n_bits = a->n_bits;
+    int         insize = 0;
+    int         posbits = 0;
+    size_t      off = 0;
+
+    while (off + IBUFSIZ <= a->srcSize)
+    {
+        int    i;
+        int    e;
+        int    o;
+
+        o = posbits >> 3;
+        e = (o <= insize) ? insize - o : 0;
+
+        for (i = 0 ; i < e ; ++i)
+        {
+            ps->inbuf[i] = ps->inbuf[i+o];
+        }
+
+        insize = e;
+
+        memcpy(ps->inbuf + insize, a->src + off, IBUFSIZ);
+        insize += IBUFSIZ;
+        off    += IBUFSIZ;
+
+        // All the whole groups are consumed, as by the decode loop.
+        posbits = (insize - insize%n_bits)<<3;
+    }
+}
+
+
+//======================================================================
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: microbench [-s size] [-k kind] [-t seconds] [-p]\n");
+    exit(2);
+}
+
+
+
+int
+main(int argc, char** argv)
+{
+    size_t          size = 4000000;
+    const char*     kindName = "text";
+    int             counters = 0;
+    int             opt;
+    int             k;
+    Byte*           corpus;
+    NCompressCtxt   cctxt;
+    NCompressCtxt   dctxt;
+    DictArgs        dict;
+    double          hitProbes;
+    double          missProbes;
+    long            maxProbes;
+    char            extra[256];
+
+    while ((opt = getopt(argc, argv, "s:k:t:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': size = (size_t)atof(optarg);   break;
+        case 'k': kindName = optarg;             break;
+        case 't': minSeconds = atof(optarg);     break;
+        case 'p': counters = 1;                  break;
+        default:  usage();
+        }
+    }
+
+    for (k = 0; k < corpusNumKinds && strcmp(corpusKinds[k].name, kindName) != 0; ++k)
+        ;
+
+    if (k == corpusNumKinds || size < 2)
+    {
+        usage();
+    }
+
+    if (counters)
+    {
+        openCounters();
+    }
+
+    corpus = malloc(size);
+    seedRandom(k + 1);
+    corpusKinds[k].fill(corpus, size);
+
+    nInitCompress(&cctxt, 0);
+    nInitDecompress(&dctxt);
+
+    if (!cctxt.priv || !dctxt.priv)
+    {
+        fprintf(stderr, "microbench: cannot allocate the state\n");
+        return 1;
+    }
+
+    dict.ps       = (PrivState*)cctxt.priv;
+    dict.in       = corpus;
+    dict.size     = size;
+    dict.keys     = malloc(size * sizeof(FCode));
+    dict.codes    = malloc(size * sizeof(uint16_t));
+    dict.prefix   = malloc(MAXCODE(BITS) * sizeof(uint16_t));
+    dict.suffix   = malloc(MAXCODE(BITS));
+
+    traceDict(&dict, &hitProbes, &missProbes, &maxProbes);
+
+    printf("{\n  \"corpus\": \"%s\",\n  \"size\": %zu,\n"
+           "  \"lookups\": %zu,\n  \"codes\": %zu,\n"
+           "  \"classic_hit_probes\": %.3f,\n  \"classic_miss_probes\": %.3f,\n"
+           "  \"classic_max_probes\": %ld,\n  \"results\": [",
+           kindName, size, dict.numKeys, dict.numCodes, hitProbes, missProbes, maxProbes);
+
+    snprintf(extra, sizeof extra, "\"avg_probe_len\": %.3f",
+             (hitProbes * (dict.numKeys - dict.numCodes) + missProbes * dict.numCodes) /
+             dict.numKeys);
+
+    // The full table from the trace is probed with every lookup.
+    dict.tagged = 0;
+    timeKernel("probe_classic", BITS, probeKernel, &dict, dict.numKeys, extra);
+    dict.tagged = 1;
+    buildKernel(&dict);
+    timeKernel("probe_tagged", BITS, probeKernel, &dict, dict.numKeys, NULL);
+
+    dict.tagged = 0;
+    timeKernel("build_classic", BITS, buildKernel, &dict, dict.numKeys, NULL);
+    dict.tagged = 1;
+    timeKernel("build_tagged", BITS, buildKernel, &dict, dict.numKeys, NULL);
+
+    for (int n_bits = INIT_BITS; n_bits <= BITS; ++n_bits)
+    {
+        OutputArgs  oa = { (PrivState*)cctxt.priv, dict.codes, dict.numCodes, n_bits };
+
+        timeKernel("output", n_bits, outputKernel, &oa, dict.numCodes, NULL);
+    }
+
+    for (int n_bits = INIT_BITS; n_bits <= BITS; ++n_bits)
+    {
+        PrivState*  ps = (PrivState*)dctxt.priv;
+        uint16_t    codes[CODEBATCH];
+        int         num = ((IBUFSIZ_ALL - 16) * 8 / n_bits) & ~7;
+        UnpackArgs  ua = { ps->inbuf, n_bits, num, codes, unpackCodes };
+
+        memcpy(ps->inbuf, corpus, (size < IBUFSIZ_ALL) ? size : IBUFSIZ_ALL);
+
+        timeKernel("unpack", n_bits, unpackKernel, &ua, num, NULL);
+
+        ua.unpack = unpackCodesScalar;
+        timeKernel("unpack_scalar", n_bits, unpackKernel, &ua, num, NULL);
+    }
+
+    {
+        PrivState*  ps = (PrivState*)dctxt.priv;
+        ChainArgs   ca;
+        double      bytes = 0;
+        size_t      i;
+
+        buildDecodeTable(ps, &dict);
+
+        for (i = 0; i < dict.numCodes; ++i)
+        {
+            bytes += tab_lenof(ps, dict.codes[i]);
+        }
+
+        ca.ps       = ps;
+        ca.codes    = dict.codes;
+        ca.numCodes = dict.numCodes;
+        ca.out      = malloc((size_t)bytes + 1);
+
+        snprintf(extra, sizeof extra, "\"avg_chain_len\": %.3f", bytes / dict.numCodes);
+        timeKernel("chain", BITS, chainKernel, &ca, dict.numCodes, extra);
+
+        if (memcmp(ca.out, corpus, (size_t)bytes) != 0)
+        {
+            fprintf(stderr, "microbench: the chain kernel didn't reproduce the corpus\n");
+        }
+
+        free(ca.out);
+    }
+
+    for (int n_bits = INIT_BITS; n_bits <= BITS; ++n_bits)
+    {
+        ResetArgs   ra = { (PrivState*)dctxt.priv, corpus, size, n_bits };
+
+        timeKernel("resetbuf", n_bits, resetKernel, &ra, (double)(size / IBUFSIZ), NULL);
+    }
+
+    printf("\n  ]\n}\n");
+
+    nFreeCompress(&cctxt);
+    nFreeCompress(&dctxt);
+    free(dict.keys);
+    free(dict.codes);
+    free(dict.prefix);
+    free(dict.suffix);
+    free(corpus);
+    return 0;
+}